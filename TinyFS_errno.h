@@ -16,5 +16,13 @@
 #define TFS_ERR_INSUFFICIENT_SPACE (-(EOVERFLOW))
 #define TFS_ERR_FILE_NAME_TOO_LONG (-(ENAMETOOLONG))
 #define TFS_ERR_INVALID (-(EINVAL))
+#define TFS_ERR_NO_ENTRY (-(ENOENT))
+#define TFS_ERR_EXISTS (-(EEXIST))
+#define TFS_ERR_NOT_DIR (-(ENOTDIR))
+#define TFS_ERR_IS_DIR (-(EISDIR))
+#define TFS_ERR_NOT_EMPTY (-(ENOTEMPTY))
+#define TFS_ERR_NO_MEMORY (-(ENOMEM))
+#define TFS_ERR_BUSY (-(EBUSY))
+#define TFS_ERR_IO (-(EIO))
 
 #endif
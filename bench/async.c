@@ -0,0 +1,156 @@
+/* Async API benchmark
+ *
+ * An event loop writes and reads back small files, once calling tfs_*
+ * directly and once through tfs_write_async / tfs_read_async with up to
+ * BENCH_IN_FLIGHT calls outstanding, waiting on the completion eventfd
+ * with poll. Reports calls/s and how long the loop thread spent inside
+ * tfs_* calls, in total and the longest single call - the time it couldn't
+ * serve anything else.
+ *
+ *   bench_async [image]
+ *
+ * The image is /tmp/bench_async.tfs by default; name it direct:<file> to
+ * have every read reach the device.
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+#include "../libDisk.h"
+
+#define BENCH_DISK "/tmp/bench_async.tfs"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 16384)
+#define BENCH_FILES 256
+#define BENCH_ROUNDS 4
+#define BENCH_FILE_SIZE 300
+#define BENCH_IN_FLIGHT 64
+
+static char *image = BENCH_DISK;
+static char data[BENCH_FILE_SIZE];
+static char back[BENCH_FILES][BENCH_FILE_SIZE];
+static fileDescriptor fds[BENCH_FILES];
+
+/* time the loop thread spent in tfs_* calls */
+static double busy, busy_max;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void account(double start) {
+    double s = now() - start;
+    busy += s;
+    if (s > busy_max)
+        busy_max = s;
+}
+
+static int setup(void) {
+    if (tfs_mkfs(image, BENCH_DISK_SIZE) < 0 || tfs_mount(image) < 0) {
+        fprintf(stderr, "%s: can't make the image\n", image);
+        return -1;
+    }
+    int i;
+    for (i = 0; i < BENCH_FILES; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", i);
+        if ((fds[i] = tfs_openFile(name)) < 0)
+            return -1;
+    }
+    busy = busy_max = 0;
+    return 0;
+}
+
+/* one write and one read of every file each round */
+static int run_sync(void) {
+    int round, i;
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        for (i = 0; i < BENCH_FILES; i++) {
+            double start = now();
+            int err = tfs_writeFile(fds[i], data, BENCH_FILE_SIZE);
+            int j;
+            for (j = 0; err >= 0 && j < BENCH_FILE_SIZE; j++)
+                err = tfs_readByte(fds[i], &back[i][j]);
+            account(start);
+            if (err < 0)
+                return err;
+        }
+    }
+    return 0;
+}
+
+static int run_async(void) {
+    int efd = tfs_async_start();
+    if (efd < 0)
+        return efd;
+    struct tfs_completion done[BENCH_IN_FLIGHT];
+    int total = BENCH_ROUNDS * BENCH_FILES * 2;
+    int submitted = 0, completed = 0;
+    while (completed < total) {
+        // keep the queue topped up, a write and the read after it at a time
+        while (submitted < total && submitted - completed + 2 <= BENCH_IN_FLIGHT) {
+            int i = (submitted / 2) % BENCH_FILES;
+            double start = now();
+            int err = tfs_write_async(fds[i], data, BENCH_FILE_SIZE, NULL);
+            if (err >= 0)
+                err = tfs_read_async(fds[i], back[i], BENCH_FILE_SIZE, NULL);
+            account(start);
+            if (err < 0)
+                return err;
+            submitted += 2;
+        }
+        struct pollfd p = { efd, POLLIN, 0 };
+        if (poll(&p, 1, -1) < 0)
+            return -1;
+        double start = now();
+        int n = tfs_async_poll(done, BENCH_IN_FLIGHT);
+        account(start);
+        int k;
+        for (k = 0; k < n; k++) {
+            if (done[k].ret < 0)
+                return done[k].ret;
+        }
+        completed += n;
+    }
+    return tfs_async_stop();
+}
+
+static int run(const char *label, int async) {
+    if (setup() < 0)
+        return -1;
+    double start = now();
+    int err = async ? run_async() : run_sync();
+    double s = now() - start;
+    tfs_unmount();
+    if (err < 0 || memcmp(back[0], data, BENCH_FILE_SIZE) != 0) {
+        fprintf(stderr, "%s: failed (%d)\n", label, err);
+        return -1;
+    }
+    int calls = BENCH_ROUNDS * BENCH_FILES * 2;
+    printf("%-6s %8.0f writes+reads/s  loop thread in tfs_* %6.1f%% of the time, longest call %8.1f us\n",
+           label, calls / s, busy / s * 100, busy_max * 1e6);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [image]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2)
+        image = argv[1];
+    int i;
+    for (i = 0; i < BENCH_FILE_SIZE; i++)
+        data[i] = rand();
+    if (run("sync", 0) < 0 || run("async", 1) < 0)
+        return 1;
+    remove(image + (strncmp(image, DIRECT_DISK_PREFIX, strlen(DIRECT_DISK_PREFIX)) == 0 ? strlen(DIRECT_DISK_PREFIX) : 0));
+    return 0;
+}
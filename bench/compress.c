@@ -0,0 +1,106 @@
+/* Compression benchmark
+ *
+ * Writes and reads back the same corpus with and without TFS_FLAG_COMPRESS
+ * and reports throughput and how many blocks each mode used.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+
+#define BENCH_DISK "/tmp/bench_compress.tfs"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 65535)
+#define BENCH_FILES 16
+#define BENCH_FILE_SIZE 60000
+
+int tfs_free_block_count();
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* log-like lines: a handful of templates with changing numbers */
+static void fill_text(char *buf, int size, unsigned seed) {
+    static const char *lines[] = {
+        "INFO  request served tenant=%04u shard=%02u latency_us=%u\n",
+        "WARN  retrying upstream tenant=%04u attempt=%u\n",
+        "DEBUG cache lookup key=user:%u hit=true\n",
+    };
+    int pos = 0;
+    while (pos < size) {
+        char line[128];
+        int n = snprintf(line, sizeof line, lines[seed % 3], seed % 9973, seed % 17, seed % 1000);
+        if (n > size - pos)
+            n = size - pos;
+        memcpy(&buf[pos], line, n);
+        pos += n;
+        seed = seed * 1103515245 + 12345;
+    }
+}
+
+static int run(const char *mode, int flags, char **contents) {
+    if (tfs_mkfs(BENCH_DISK, BENCH_DISK_SIZE) < 0 || tfs_mount(BENCH_DISK) < 0) {
+        fprintf(stderr, "failed to create %s\n", BENCH_DISK);
+        return -1;
+    }
+    int free_before = tfs_free_block_count();
+    int fds[BENCH_FILES];
+    int i;
+
+    double start = now();
+    for (i = 0; i < BENCH_FILES; i++) {
+        char name[16];
+        snprintf(name, sizeof name, "file%02d", i);
+        fds[i] = tfs_openFile(name);
+        tfs_setFlags(fds[i], flags);
+        if (tfs_writeFile(fds[i], contents[i], BENCH_FILE_SIZE) < 0) {
+            fprintf(stderr, "tfs_writeFile failed\n");
+            return -1;
+        }
+    }
+    double write_s = now() - start;
+    int blocks = free_before - tfs_free_block_count();
+
+    start = now();
+    for (i = 0; i < BENCH_FILES; i++) {
+        char c;
+        int n = 0;
+        tfs_seek(fds[i], 0);
+        while (n < BENCH_FILE_SIZE && tfs_readByte(fds[i], &c) == TFS_OK) {
+            if (c != contents[i][n]) {
+                fprintf(stderr, "mismatch in file %d at %d\n", i, n);
+                return -1;
+            }
+            n++;
+        }
+    }
+    double read_s = now() - start;
+
+    double mb = (double)BENCH_FILES * BENCH_FILE_SIZE / (1024 * 1024);
+    printf("%-10s write %7.2f MB/s  read %7.2f MB/s  blocks %5d  (%.1f%% of raw bytes)\n",
+           mode, mb / write_s, mb / read_s, blocks,
+           100.0 * blocks * BLOCKSIZE / ((double)BENCH_FILES * BENCH_FILE_SIZE));
+    tfs_unmount();
+    for (i = 0; i < BENCH_FILES; i++)
+        tfs_closeFile(fds[i]);
+    return 0;
+}
+
+int main() {
+    char *contents[BENCH_FILES];
+    int i;
+    for (i = 0; i < BENCH_FILES; i++) {
+        contents[i] = malloc(BENCH_FILE_SIZE);
+        fill_text(contents[i], BENCH_FILE_SIZE, i + 1);
+    }
+    if (run("raw", 0, contents) < 0 || run("compress", TFS_FLAG_COMPRESS, contents) < 0)
+        return 1;
+    remove(BENCH_DISK);
+    return 0;
+}
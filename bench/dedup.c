@@ -0,0 +1,106 @@
+/* Deduplication benchmark
+ *
+ * Writes the same corpus with and without TFS_FLAG_DEDUP and reports write
+ * throughput, blocks used and the dedup ratio. The "templated" corpus builds
+ * files out of a small pool of shared blocks, the "unique" one has nothing to
+ * share and shows the raw cost of hashing and index lookups on the write path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+
+#define BENCH_DISK "/tmp/bench_dedup.tfs"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 65535)
+#define BENCH_FILES 32
+#define BENCH_FILE_SIZE 30000
+#define BENCH_DATA_SIZE 252
+#define BENCH_TEMPLATES 8
+
+int tfs_free_block_count();
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* every block is either one of the shared templates or random */
+static void fill(char *buf, int size, int templated) {
+    static char templates[BENCH_TEMPLATES][BENCH_DATA_SIZE];
+    static int init = 0;
+    int i;
+    if (!init) {
+        for (i = 0; i < BENCH_TEMPLATES * BENCH_DATA_SIZE; i++)
+            templates[i / BENCH_DATA_SIZE][i % BENCH_DATA_SIZE] = rand();
+        init = 1;
+    }
+    int pos;
+    for (pos = 0; pos < size; pos += BENCH_DATA_SIZE) {
+        int n = size - pos < BENCH_DATA_SIZE ? size - pos : BENCH_DATA_SIZE;
+        if (templated && rand() % 4 != 0) {
+            memcpy(&buf[pos], templates[rand() % BENCH_TEMPLATES], n);
+        } else {
+            for (i = 0; i < n; i++)
+                buf[pos + i] = rand();
+        }
+    }
+}
+
+static int run(const char *corpus, const char *mode, int flags, char **contents) {
+    if (tfs_mkfs(BENCH_DISK, BENCH_DISK_SIZE) < 0 || tfs_mount(BENCH_DISK) < 0) {
+        fprintf(stderr, "failed to create %s\n", BENCH_DISK);
+        return -1;
+    }
+    int free_before = tfs_free_block_count();
+    int fds[BENCH_FILES];
+    int i;
+
+    double start = now();
+    for (i = 0; i < BENCH_FILES; i++) {
+        char name[16];
+        snprintf(name, sizeof name, "file%02d", i);
+        fds[i] = tfs_openFile(name);
+        tfs_setFlags(fds[i], flags);
+        if (tfs_writeFile(fds[i], contents[i], BENCH_FILE_SIZE) < 0) {
+            fprintf(stderr, "tfs_writeFile failed\n");
+            return -1;
+        }
+    }
+    double write_s = now() - start;
+    int blocks = free_before - tfs_free_block_count();
+
+    struct tfs_dedup_stats stats;
+    tfs_dedupStats(&stats);
+    double mb = (double)BENCH_FILES * BENCH_FILE_SIZE / (1024 * 1024);
+    printf("%-9s %-6s write %7.2f MB/s  blocks %5d", corpus, mode, mb / write_s, blocks);
+    if (stats.physical_blocks > 0)
+        printf("  ratio %.2f  hits %u/%u", (double)stats.logical_blocks / stats.physical_blocks,
+               stats.hits, stats.lookups);
+    printf("\n");
+    tfs_unmount();
+    for (i = 0; i < BENCH_FILES; i++)
+        tfs_closeFile(fds[i]);
+    return 0;
+}
+
+int main() {
+    char *templated[BENCH_FILES];
+    char *unique[BENCH_FILES];
+    int i;
+    for (i = 0; i < BENCH_FILES; i++) {
+        templated[i] = malloc(BENCH_FILE_SIZE);
+        unique[i] = malloc(BENCH_FILE_SIZE);
+        fill(templated[i], BENCH_FILE_SIZE, 1);
+        fill(unique[i], BENCH_FILE_SIZE, 0);
+    }
+    if (run("templated", "raw", 0, templated) < 0 || run("templated", "dedup", TFS_FLAG_DEDUP, templated) < 0
+            || run("unique", "raw", 0, unique) < 0 || run("unique", "dedup", TFS_FLAG_DEDUP, unique) < 0)
+        return 1;
+    remove(BENCH_DISK);
+    return 0;
+}
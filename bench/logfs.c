@@ -0,0 +1,121 @@
+/* Log-structured write benchmark
+ *
+ * Runs the same write-heavy workload - small files written, overwritten and
+ * deleted at random over a fixed set of names - against an image in place,
+ * in place with punched frees, and log-structured with and without
+ * tfs_clean between rounds. Reports calls/s, the host writes and syscalls
+ * each call cost, how long writing the image back to the device took, and
+ * how fragmented the free space ended up.
+ *
+ *   bench_logfs [image]
+ *
+ * The image is /tmp/bench_logfs.tfs by default.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+#include "../libDisk.h"
+
+#define BENCH_DISK "/tmp/bench_logfs.tfs"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 16384)
+#define BENCH_NAMES 600
+#define BENCH_ROUNDS 10
+#define BENCH_OPS 2000
+#define BENCH_SIZE_MAX 6000
+/* time tfs_clean gets after each round */
+#define BENCH_CLEAN_MS 5
+
+static char *image = BENCH_DISK;
+static char data[BENCH_SIZE_MAX];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* mostly small files, now and then a bigger one */
+static int size_of(void) {
+    return rand() % 4 == 0 ? rand() % BENCH_SIZE_MAX : rand() % 1000;
+}
+
+static int run(const char *label, int log, int punch, int clean) {
+    srand(1);
+    if (tfs_setLogStructured(log) < 0 || tfs_setPunchHoles(punch) < 0
+            || tfs_mkfs(image, BENCH_DISK_SIZE) < 0 || tfs_mount(image) < 0) {
+        fprintf(stderr, "%s: can't make the image\n", image);
+        return -1;
+    }
+    struct disk_stats before, after;
+    diskStats(&before);
+    double start = now();
+    long calls = 0;
+    int round;
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        int i;
+        for (i = 0; i < BENCH_OPS; i++) {
+            char name[16];
+            snprintf(name, sizeof(name), "f%d", rand() % BENCH_NAMES);
+            fileDescriptor fd = tfs_openFile(name);
+            if (fd < 0) {
+                fprintf(stderr, "%s: tfs_openFile failed (%d)\n", label, fd);
+                return -1;
+            }
+            int err = rand() % 8 == 0 ? tfs_deleteFile(fd) : tfs_writeFile(fd, data, size_of());
+            if (err < 0) {
+                fprintf(stderr, "%s: write failed (%d)\n", label, err);
+                return -1;
+            }
+            tfs_closeFile(fd);
+            calls += 3;
+        }
+        if (clean && tfs_clean(BENCH_CLEAN_MS) < 0) {
+            fprintf(stderr, "%s: tfs_clean failed\n", label);
+            return -1;
+        }
+    }
+    double s = now() - start;
+    diskStats(&after);
+    struct tfs_frag_stats frag;
+    tfs_fragStats(&frag);
+    tfs_unmount();
+
+    // what the device sees once the page cache is written back
+    int host = open(image, O_RDONLY);
+    start = now();
+    fdatasync(host);
+    double sync_s = now() - start;
+    posix_fadvise(host, 0, 0, POSIX_FADV_DONTNEED);
+    close(host);
+
+    printf("%-22s %10.0f calls/s %6.2f writes %6.2f blocks %6.2f syscalls per call  sync %7.1f ms  free runs %5u largest %5u\n",
+           label, calls / s, (double)(after.writes - before.writes) / calls,
+           (double)(after.blocks_written - before.blocks_written) / calls,
+           (double)(after.syscalls - before.syscalls) / calls, sync_s * 1000, frag.free_runs, frag.largest_free_run);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [image]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2)
+        image = argv[1];
+    int i;
+    for (i = 0; i < BENCH_SIZE_MAX; i++)
+        data[i] = rand();
+    if (run("in place", 0, 0, 0) < 0 || run("in place, punched", 0, 1, 0) < 0
+            || run("log-structured", 1, 0, 0) < 0 || run("log-structured, clean", 1, 0, 1) < 0)
+        return 1;
+    tfs_setLogStructured(0);
+    remove(image);
+    return 0;
+}
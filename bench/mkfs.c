@@ -0,0 +1,57 @@
+/* mkfs benchmark
+ *
+ * Formats and mounts images of a few sizes and reports the time each takes
+ * and how much of the image the host actually had to allocate.
+ */
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+
+#define BENCH_DISK "/tmp/bench_mkfs.tfs"
+#define BENCH_ROUNDS 20
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *label, int nBytes) {
+    double mkfs_s = 0;
+    double mount_s = 0;
+    int i;
+    for (i = 0; i < BENCH_ROUNDS; i++) {
+        double start = now();
+        if (tfs_mkfs(BENCH_DISK, nBytes) < 0) {
+            fprintf(stderr, "tfs_mkfs failed\n");
+            return -1;
+        }
+        mkfs_s += now() - start;
+
+        start = now();
+        if (tfs_mount(BENCH_DISK) < 0) {
+            fprintf(stderr, "tfs_mount failed\n");
+            return -1;
+        }
+        mount_s += now() - start;
+        tfs_unmount();
+    }
+    struct stat st;
+    stat(BENCH_DISK, &st);
+    printf("%-6s %9d bytes  mkfs %8.3f ms  mount %8.3f ms  host allocated %ld bytes\n",
+           label, nBytes, 1000 * mkfs_s / BENCH_ROUNDS, 1000 * mount_s / BENCH_ROUNDS,
+           (long)st.st_blocks * 512);
+    return 0;
+}
+
+int main() {
+    if (run("1MB", 1000 * 1000) < 0 || run("16MB", 16 * 1000 * 1000) < 0
+            || run("max", 65536 * BLOCKSIZE) < 0)
+        return 1;
+    remove(BENCH_DISK);
+    return 0;
+}
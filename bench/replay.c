@@ -0,0 +1,293 @@
+/* Trace replay
+ *
+ * Re-executes the tfs_* calls of a trace written by tfs_traceStart against a
+ * fresh image and reports throughput, per call and per phase (a run of the
+ * same call, e.g. the 1000 writes after 1000 opens), along with the block
+ * I/O the trace recorded against what the replay did. Running the same
+ * trace against two builds of the library is an A/B test on a real
+ * workload.
+ *
+ *   tfs_replay [-t] [-i image] trace
+ *
+ * Calls run back to back unless -t is given, which waits for each call's
+ * original start time. Every tfs_mkfs and tfs_mount goes to `image`
+ * (/tmp/tfs_replay.tfs by default) instead of the traced path. A trace
+ * started with an image already mounted, or that mounts one without making
+ * it, gets a fresh empty one.
+ * File contents aren't traced, writes replay a fixed pattern of the traced
+ * size, so compression and dedup see different data than they did.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+#include "../libDisk.h"
+
+#define REPLAY_DISK "/tmp/tfs_replay.tfs"
+/* image for traces that mount one they didn't make */
+#define REPLAY_DISK_SIZE (BLOCKSIZE * 16384)
+/* highest traced descriptor that can be mapped to a replayed one */
+#define REPLAY_FDS_MAX 4096
+#define REPLAY_PHASES_SHOWN 40
+
+struct phase {
+    int op;
+    long calls;
+    uint64_t ns;
+};
+
+static uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static char *image = REPLAY_DISK;
+static fileDescriptor fds[REPLAY_FDS_MAX];
+static char *data;
+static int data_size;
+static int null_fd;
+
+/* the replayed descriptor for a traced one, -1 for one that was never opened */
+static fileDescriptor fd_of(int traced) {
+    return traced >= 0 && traced < REPLAY_FDS_MAX ? fds[traced] : -1;
+}
+
+/* a pattern buffer of at least `size` bytes for writes */
+static char *pattern(int size) {
+    if (size <= data_size)
+        return data;
+    char *grown = realloc(data, size);
+    if (grown == NULL)
+        return NULL;
+    int i;
+    for (i = data_size; i < size; i++)
+        grown[i] = i % 251;
+    data = grown;
+    data_size = size;
+    return data;
+}
+
+static int replay_batch(struct tfs_trace_record *r, char *strings) {
+    int count = r->args[0];
+    struct tfs_batch_op *ops = calloc(count > 0 ? count : 1, sizeof(struct tfs_batch_op));
+    if (ops == NULL)
+        return TFS_ERR_NO_MEMORY;
+    char *p = strings;
+    int i;
+    for (i = 0; i < count && p < strings + r->len; i++) {
+        int32_t size;
+        ops[i].op = (uint8_t)*p;
+        memcpy(&size, p + 1, sizeof(size));
+        ops[i].size = size;
+        ops[i].path = p + 1 + sizeof(size);
+        ops[i].buffer = pattern(size);
+        p = ops[i].path + strlen(ops[i].path) + 1;
+    }
+    int ret = tfs_batch(ops, i);
+    free(ops);
+    return ret;
+}
+
+/* runs one traced call, returns what it returned */
+static int replay(struct tfs_trace_record *r, char *strings) {
+    char *str0 = strings;
+    char *str1 = r->len > 0 ? strings + strlen(strings) + 1 : strings;
+    int *a = r->args;
+    char c;
+    switch (r->op) {
+    case TFS_OP_MKFS: return tfs_mkfs(image, a[0]);
+    case TFS_OP_MOUNT:
+        // an image the trace didn't make starts out empty
+        if (access(image, F_OK) != 0 && tfs_mkfs(image, REPLAY_DISK_SIZE) < 0)
+            return TFS_ERR_NO_DISK;
+        return tfs_mount(image);
+    case TFS_OP_UNMOUNT: return tfs_unmount();
+    case TFS_OP_OPEN_FILE: {
+        fileDescriptor fd = tfs_openFile(str0);
+        if (r->ret >= 0 && r->ret < REPLAY_FDS_MAX)
+            fds[r->ret] = fd;
+        return fd;
+    }
+    case TFS_OP_CLOSE_FILE: return tfs_closeFile(fd_of(a[0]));
+    case TFS_OP_WRITE_FILE: return tfs_writeFile(fd_of(a[0]), pattern(a[1]), a[1]);
+    case TFS_OP_DELETE_FILE: return tfs_deleteFile(fd_of(a[0]));
+    case TFS_OP_READ_BYTE: return tfs_readByte(fd_of(a[0]), &c);
+    case TFS_OP_SEEK: return tfs_seek(fd_of(a[0]), a[1]);
+    case TFS_OP_READ_FILE_INFO: return tfs_readFileInfo(fd_of(a[0])).err;
+    case TFS_OP_SENDFILE: return tfs_sendfile(fd_of(a[0]), null_fd, a[1], a[2]);
+    case TFS_OP_SET_FLAGS: return tfs_setFlags(fd_of(a[0]), a[1]);
+    case TFS_OP_FALLOCATE: return tfs_fallocate(fd_of(a[0]), a[1]);
+    case TFS_OP_CHECK_CONSISTENCY: return tfs_checkConsistency();
+    case TFS_OP_MKDIR: return tfs_mkdir(str0);
+    case TFS_OP_RMDIR: return tfs_rmdir(str0);
+    case TFS_OP_RENAME: return tfs_rename(str0, str1);
+    case TFS_OP_LINK: return tfs_link(str0, str1);
+    case TFS_OP_CLONE: return tfs_clone(str0, str1);
+    case TFS_OP_SNAPSHOT: return tfs_snapshot(str0);
+    case TFS_OP_RESIZE: return tfs_resize(a[0]);
+    case TFS_OP_WRITE_BEGIN: return tfs_writeBegin(fd_of(a[0]));
+    case TFS_OP_WRITE_CHUNK: return tfs_writeChunk(fd_of(a[0]), pattern(a[1]), a[1]);
+    case TFS_OP_WRITE_COMMIT: return tfs_writeCommit(fd_of(a[0]));
+    case TFS_OP_WRITE_ABORT: return tfs_writeAbort(fd_of(a[0]));
+    case TFS_OP_BATCH: return replay_batch(r, strings);
+    case TFS_OP_DEFRAG: return tfs_defrag(a[0]);
+    case TFS_OP_CLEAN: return tfs_clean(a[0]);
+    case TFS_OP_READ_ASYNC: {
+        // the same bytes, read in the caller's thread
+        int got = 0;
+        while (got < a[1] && tfs_readByte(fd_of(a[0]), &c) >= 0)
+            got++;
+        return got;
+    }
+    }
+    return TFS_ERR_INVALID;
+}
+
+int main(int argc, char **argv) {
+    int timed = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "ti:")) != -1) {
+        if (opt == 't')
+            timed = 1;
+        else if (opt == 'i')
+            image = optarg;
+        else
+            break;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-t] [-i image] trace\n", argv[0]);
+        return 2;
+    }
+    FILE *in = fopen(argv[optind], "rb");
+    if (in == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    struct tfs_trace_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TFS_TRACE_MAGIC
+            || header.version != TFS_TRACE_VERSION) {
+        fprintf(stderr, "%s: not a TinyFS trace\n", argv[optind]);
+        return 1;
+    }
+    int i;
+    for (i = 0; i < REPLAY_FDS_MAX; i++)
+        fds[i] = -1;
+    null_fd = open("/dev/null", O_WRONLY);
+    pattern(65535);
+
+    // a trace that started with an image mounted picks up on a fresh one of
+    // the same size, any other makes or mounts its own
+    remove(image);
+    if (header.image_bytes != 0) {
+        if (tfs_mkfs(image, header.image_bytes) < 0 || tfs_mount(image) < 0) {
+            fprintf(stderr, "%s: can't make the image\n", image);
+            return 1;
+        }
+    }
+
+    static struct tfs_stats stats;
+    static struct phase phases[REPLAY_PHASES_SHOWN];
+    long phase_count = 0;
+    long calls = 0;
+    long diverged = 0;
+    long traced_reads = 0;
+    long traced_writes = 0;
+    uint64_t traced_ns = 0;
+    uint64_t replay_ns = 0;
+    char *strings = NULL;
+    uint32_t strings_cap = 0;
+    struct phase current = { -1, 0, 0 };
+    tfs_resetStats();
+    uint64_t replay_start = now();
+
+    struct tfs_trace_record r;
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        if (r.len + 1 > strings_cap) {
+            strings_cap = r.len + 1;
+            strings = realloc(strings, strings_cap);
+        }
+        if (fread(strings, 1, r.len, in) != r.len)
+            break;
+        strings[r.len] = '\0';
+        if (r.type == TFS_TRACE_IO) {
+            traced_reads += r.op == DISK_TRACE_READ || r.op == DISK_TRACE_READAHEAD || r.op == DISK_TRACE_SEND;
+            traced_writes += r.op == DISK_TRACE_WRITE;
+            continue;
+        }
+        if (r.type != TFS_TRACE_CALL || r.op >= TFS_OP_COUNT)
+            continue;
+        if (timed) {
+            uint64_t at = replay_start + r.start_ns;
+            uint64_t t = now();
+            if (at > t) {
+                struct timespec ts = { (at - t) / 1000000000, (at - t) % 1000000000 };
+                nanosleep(&ts, NULL);
+            }
+        }
+        uint64_t start = now();
+        int ret = replay(&r, strings);
+        uint64_t ns = now() - start;
+        calls++;
+        traced_ns += r.ns;
+        replay_ns += ns;
+        // descriptors may come out different, only success has to match
+        if ((ret < 0) != (r.ret < 0) || (r.op != TFS_OP_OPEN_FILE && ret != r.ret))
+            diverged++;
+
+        if (r.op != current.op && current.calls > 0) {
+            if (phase_count < REPLAY_PHASES_SHOWN)
+                phases[phase_count] = current;
+            phase_count++;
+            current.calls = 0;
+            current.ns = 0;
+        }
+        current.op = r.op;
+        current.calls++;
+        current.ns += ns;
+    }
+    if (current.calls > 0) {
+        if (phase_count < REPLAY_PHASES_SHOWN)
+            phases[phase_count] = current;
+        phase_count++;
+    }
+    uint64_t wall = now() - replay_start;
+    tfs_getStats(&stats);
+    tfs_unmount();
+
+    printf("%ld calls in %.3f ms (%.0f calls/s), %.3f ms inside the library (traced %.3f ms), %ld results differ\n",
+           calls, wall / 1e6, wall > 0 ? calls / (wall / 1e9) : 0, replay_ns / 1e6, traced_ns / 1e6, diverged);
+    printf("block reads %ld traced, %lu replayed; block writes %ld traced, %lu replayed\n",
+           traced_reads, (unsigned long)stats.block_reads, traced_writes, (unsigned long)stats.block_writes);
+    printf("\n%-24s %10s %12s %12s %10s\n", "call", "calls", "ms", "calls/s", "p50 <= us");
+    for (i = 0; i < TFS_OP_COUNT; i++) {
+        struct tfs_op_stats *op = &stats.ops[i];
+        if (op->calls == 0)
+            continue;
+        // upper end of the bucket holding the median call
+        uint64_t seen = 0;
+        int bucket = 0;
+        while (bucket < TFS_LATENCY_BUCKETS - 1 && (seen += op->latency[bucket]) * 2 < op->calls)
+            bucket++;
+        printf("%-24s %10lu %12.3f %12.0f %10.3f\n", tfs_opName(i), (unsigned long)op->calls,
+               op->total_ns / 1e6, op->total_ns > 0 ? op->calls / (op->total_ns / 1e9) : 0,
+               (double)((uint64_t)2 << bucket) / 1000);
+    }
+    printf("\n%-6s %-24s %10s %12s %12s\n", "phase", "call", "calls", "ms", "calls/s");
+    for (i = 0; i < phase_count && i < REPLAY_PHASES_SHOWN; i++)
+        printf("%-6d %-24s %10ld %12.3f %12.0f\n", i, tfs_opName(phases[i].op), phases[i].calls,
+               phases[i].ns / 1e6, phases[i].ns > 0 ? phases[i].calls / (phases[i].ns / 1e9) : 0);
+    if (phase_count > REPLAY_PHASES_SHOWN)
+        printf("... %ld more phases\n", phase_count - REPLAY_PHASES_SHOWN);
+    free(strings);
+    free(data);
+    fclose(in);
+    return 0;
+}
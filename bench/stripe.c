@@ -0,0 +1,174 @@
+/* Striping benchmark
+ *
+ * Fills a disk striped over 1, 2 and 4 host files with files and reads it
+ * sequentially in readahead runs as long as libDisk allows (each reaches
+ * every member), once with the members dropped from the host page cache and
+ * once cached, reporting MB/s. It then reads the files back with
+ * tfs_readByte, where the atime update every byte costs weighs far more than
+ * the backend does.
+ *
+ *   bench_stripe [-u unit] [dir ...]
+ *
+ * Members go round the given directories (/tmp by default); put them on
+ * different devices to see the parallel readahead pay off. On one device
+ * the cold numbers mostly show how well it takes concurrent reads.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+#include "../libDisk.h"
+
+#define BENCH_DISK_SIZE (BLOCKSIZE * 65535)
+#define BENCH_FILES 240
+/* files read back with tfs_readByte */
+#define BENCH_READ_FILES 16
+#define BENCH_FILE_SIZE 60000
+#define BENCH_UNIT 8
+#define BENCH_MEMBERS_MAX 4
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *dirs_default[] = { "/tmp" };
+static char **dirs = dirs_default;
+static int dir_count = 1;
+static char members[BENCH_MEMBERS_MAX][4096];
+
+/* the disk name for `count` members */
+static void spec(char *name, int size, int unit, int count) {
+    int len = snprintf(name, size, "%s%d:", STRIPE_DISK_PREFIX, unit);
+    int i;
+    for (i = 0; i < count; i++) {
+        snprintf(members[i], sizeof(members[i]), "%s/bench_stripe%d.img", dirs[i % dir_count], i);
+        len += snprintf(name + len, size - len, "%s%s", i > 0 ? "," : "", members[i]);
+    }
+}
+
+/* writes the members back and drops them from the page cache */
+static void evict(int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        int fd = open(members[i], O_RDONLY);
+        if (fd < 0)
+            continue;
+        fdatasync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+/* reads the whole disk in readahead runs, returns MB/s or a negative error */
+static double sweep(char *name) {
+    int disk = openDisk(name, 0);
+    if (disk < 0)
+        return -1;
+    double start = now();
+    long bytes = 0;
+    int bNum;
+    for (bNum = 0; bNum < BENCH_DISK_SIZE / BLOCKSIZE; bNum += READAHEAD_BLOCKS_MAX) {
+        int got = readaheadBlocks(disk, bNum, READAHEAD_BLOCKS_MAX);
+        if (got < 0) {
+            closeDisk(disk);
+            return -1;
+        }
+        bytes += (long)got * BLOCKSIZE;
+    }
+    double s = now() - start;
+    closeDisk(disk);
+    return bytes / s / 1e6;
+}
+
+/* reads the first files in order, returns MB/s or a negative error */
+static double read_files(char *name, long *ios) {
+    if (tfs_mount(name) < 0 || tfs_setReadahead(READAHEAD_BLOCKS_MAX) < 0)
+        return -1;
+    double start = now();
+    int i;
+    for (i = 0; i < BENCH_READ_FILES; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "f%d", i);
+        fileDescriptor fd = tfs_openFile(path);
+        char c;
+        int j;
+        for (j = 0; j < BENCH_FILE_SIZE; j++) {
+            if (tfs_readByte(fd, &c) < 0) {
+                tfs_unmount();
+                return -1;
+            }
+        }
+        tfs_closeFile(fd);
+    }
+    double s = now() - start;
+    struct tfs_readahead_stats stats;
+    tfs_readaheadStats(&stats);
+    *ios = stats.ios;
+    tfs_unmount();
+    return (double)BENCH_READ_FILES * BENCH_FILE_SIZE / s / 1e6;
+}
+
+static int run(int unit, int count) {
+    char name[sizeof(members) + 64];
+    spec(name, sizeof(name), unit, count);
+    if (tfs_mkfs(name, BENCH_DISK_SIZE) < 0 || tfs_mount(name) < 0) {
+        fprintf(stderr, "failed to create %s\n", name);
+        return -1;
+    }
+    static char data[BENCH_FILE_SIZE];
+    int i;
+    for (i = 0; i < BENCH_FILE_SIZE; i++)
+        data[i] = rand();
+    for (i = 0; i < BENCH_FILES; i++) {
+        char path[16];
+        snprintf(path, sizeof(path), "f%d", i);
+        fileDescriptor fd = tfs_openFile(path);
+        if (fd < 0 || tfs_writeFile(fd, data, BENCH_FILE_SIZE) < 0) {
+            fprintf(stderr, "failed to write %s\n", path);
+            return -1;
+        }
+    }
+    tfs_unmount();
+
+    long ios = 0;
+    evict(count);
+    double cold = sweep(name);
+    double cached = sweep(name);
+    double files = read_files(name, &ios);
+    if (cold < 0 || cached < 0 || files < 0) {
+        fprintf(stderr, "failed to read back %s\n", name);
+        return -1;
+    }
+    printf("%d member%s  unit %3d blocks  cold %8.2f MB/s  cached %8.2f MB/s  tfs_readByte %6.2f MB/s (%ld readahead runs)\n",
+           count, count > 1 ? "s" : " ", unit, cold, cached, files, ios);
+    for (i = 0; i < count; i++)
+        remove(members[i]);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int unit = BENCH_UNIT;
+    int opt;
+    while ((opt = getopt(argc, argv, "u:")) != -1) {
+        if (opt != 'u' || (unit = atoi(optarg)) <= 0) {
+            fprintf(stderr, "usage: %s [-u unit] [dir ...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind < argc) {
+        dirs = argv + optind;
+        dir_count = argc - optind;
+    }
+    if (run(unit, 1) < 0 || run(unit, 2) < 0 || run(unit, 4) < 0)
+        return 1;
+    return 0;
+}
@@ -0,0 +1,354 @@
+/* Benchmark suite
+ *
+ * Runs a fixed set of workloads against the library and prints one JSON
+ * object with, for every workload, the throughput (ops/s), the p50 and p99
+ * latency of a single op and the host block I/Os per op (from diskStats).
+ *
+ *   suite [-o out.json] [-c baseline.json] [-t percent] [-f name]
+ *
+ * -o writes the results to a file as well as stdout, -f only runs the
+ * workloads whose name starts with `name`. -c compares against a saved run:
+ * a workload is a regression when its ops/s drop by more than the threshold
+ * (-t, 25% by default), its p99 grows by more than twice that (tails are
+ * noisier), or it does any more block I/O per op than it used to. I/O counts don't depend on the machine, so
+ * they are the reliable signal; timings need the same host to compare. The
+ * exit status is 1 when something regressed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+#include "../libDisk.h"
+
+#define BENCH_DISK "/tmp/bench_suite.tfs"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 16384)
+/* largest tfs_writeFile */
+#define BENCH_FILE_SIZE_MAX 65535
+/* files on the image for the mount and open workloads */
+#define BENCH_FILES 500
+/* files the write workloads take turns rewriting */
+#define BENCH_WRITE_FILES 16
+#define BENCH_WORKLOADS_MAX 32
+#define BENCH_THRESHOLD 25.0
+
+struct workload {
+    const char *name;
+    /* runs op `i`, the only part that is timed */
+    int (*op)(int i, int param);
+    /* builds the image the ops run on and undoes anything between ops that
+     * mustn't be timed, either can be NULL */
+    int (*setup)(int param);
+    int (*between)(int i, int param);
+    int param;
+    int ops;
+};
+
+struct result {
+    char name[64];
+    int ops;
+    double ops_per_s;
+    double p50_us;
+    double p99_us;
+    double reads_per_op;
+    double writes_per_op;
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char data[BENCH_FILE_SIZE_MAX];
+static char names[BENCH_FILES][16];
+static fileDescriptor fds[BENCH_FILES];
+static fileDescriptor big;
+
+/* a fresh image with BENCH_FILES small files and one big one */
+static int setup_files(int param) {
+    int i;
+    if (tfs_mkfs(BENCH_DISK, BENCH_DISK_SIZE) < 0 || tfs_mount(BENCH_DISK) < 0)
+        return -1;
+    for (i = 0; i < BENCH_FILES; i++) {
+        fileDescriptor fd = tfs_openFile(names[i]);
+        if (fd < 0 || tfs_writeFile(fd, data, 100) < 0 || tfs_closeFile(fd) < 0)
+            return -1;
+    }
+    big = tfs_openFile("big");
+    if (big < 0 || tfs_writeFile(big, data, BENCH_FILE_SIZE_MAX) < 0)
+        return -1;
+    return 0;
+}
+
+static int setup_empty(int param) {
+    if (tfs_mkfs(BENCH_DISK, BENCH_DISK_SIZE) < 0 || tfs_mount(BENCH_DISK) < 0)
+        return -1;
+    return 0;
+}
+
+static int op_mkfs(int i, int param) {
+    return tfs_mkfs(BENCH_DISK, param);
+}
+
+static int op_mount(int i, int param) {
+    return tfs_mount(BENCH_DISK);
+}
+
+static int between_mount(int i, int param) {
+    return tfs_unmount();
+}
+
+static int setup_mount(int param) {
+    if (setup_files(param) < 0)
+        return -1;
+    return tfs_unmount();
+}
+
+static int op_open_hit(int i, int param) {
+    fds[0] = tfs_openFile(names[i % BENCH_FILES]);
+    return fds[0];
+}
+
+static int between_close(int i, int param) {
+    return tfs_closeFile(fds[0]);
+}
+
+/* opening a name that isn't there makes the file */
+static int op_open_miss(int i, int param) {
+    char name[16];
+    sprintf(name, "m%d", i);
+    fds[0] = tfs_openFile(name);
+    return fds[0];
+}
+
+static int between_delete(int i, int param) {
+    return tfs_deleteFile(fds[0]) < 0 ? -1 : tfs_closeFile(fds[0]);
+}
+
+static int setup_write(int param) {
+    int i;
+    if (setup_empty(param) < 0)
+        return -1;
+    for (i = 0; i < BENCH_WRITE_FILES; i++)
+        if ((fds[i] = tfs_openFile(names[i])) < 0)
+            return -1;
+    return 0;
+}
+
+static int op_write(int i, int param) {
+    return tfs_writeFile(fds[i % BENCH_WRITE_FILES], data, param);
+}
+
+static int op_read_seq(int i, int param) {
+    char c;
+    if (i % BENCH_FILE_SIZE_MAX == 0 && tfs_seek(big, 0) < 0)
+        return -1;
+    return tfs_readByte(big, &c);
+}
+
+static int op_seek_random(int i, int param) {
+    return tfs_seek(big, rand() % BENCH_FILE_SIZE_MAX);
+}
+
+/* a whole small file's life: made, written, deleted */
+static int op_churn(int i, int param) {
+    fileDescriptor fd = tfs_openFile(names[i % BENCH_FILES]);
+    if (fd < 0 || tfs_writeFile(fd, data, param) < 0 || tfs_deleteFile(fd) < 0)
+        return -1;
+    return tfs_closeFile(fd);
+}
+
+static const struct workload workloads[] = {
+    { "mkfs_1MB", op_mkfs, NULL, NULL, 1000 * 1000, 200 },
+    { "mkfs_16MB", op_mkfs, NULL, NULL, 16 * 1000 * 1000, 200 },
+    { "mkfs_max", op_mkfs, NULL, NULL, 65536 * BLOCKSIZE, 200 },
+    { "mount", op_mount, setup_mount, between_mount, 0, 50 },
+    { "open_hit", op_open_hit, setup_files, between_close, 0, 20000 },
+    { "open_miss", op_open_miss, setup_files, between_delete, 0, 2000 },
+    { "write_small", op_write, setup_write, NULL, 100, 5000 },
+    { "write_large", op_write, setup_write, NULL, BENCH_FILE_SIZE_MAX, 500 },
+    { "read_seq", op_read_seq, setup_files, NULL, 0, 4 * BENCH_FILE_SIZE_MAX },
+    { "seek_random", op_seek_random, setup_files, NULL, 0, 20000 },
+    { "delete_churn", op_churn, setup_empty, NULL, 500, 5000 },
+};
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int run(const struct workload *w, struct result *r) {
+    double *lat = malloc(w->ops * sizeof(double));
+    if (lat == NULL)
+        return -1;
+    int err = 0;
+    if (w->setup != NULL && (err = w->setup(w->param)) < 0)
+        goto out;
+
+    struct disk_stats before, after;
+    diskStats(&before);
+    long between_reads = 0;
+    long between_writes = 0;
+    double total = 0;
+    int i;
+    for (i = 0; i < w->ops; i++) {
+        double start = now();
+        if ((err = w->op(i, w->param)) < 0)
+            goto out;
+        lat[i] = now() - start;
+        total += lat[i];
+        if (w->between != NULL) {
+            struct disk_stats b0, b1;
+            diskStats(&b0);
+            if ((err = w->between(i, w->param)) < 0)
+                goto out;
+            diskStats(&b1);
+            between_reads += b1.reads - b0.reads;
+            between_writes += b1.writes - b0.writes;
+        }
+    }
+    diskStats(&after);
+    qsort(lat, w->ops, sizeof(double), cmp_double);
+
+    snprintf(r->name, sizeof r->name, "%s", w->name);
+    r->ops = w->ops;
+    r->ops_per_s = total > 0 ? w->ops / total : 0;
+    r->p50_us = 1e6 * lat[w->ops / 2];
+    r->p99_us = 1e6 * lat[(int)(w->ops * 0.99)];
+    r->reads_per_op = (double)(after.reads - before.reads - between_reads) / w->ops;
+    r->writes_per_op = (double)(after.writes - before.writes - between_writes) / w->ops;
+out:
+    if (err < 0)
+        fprintf(stderr, "%s: failed with %d\n", w->name, err);
+    tfs_unmount();
+    free(lat);
+    return err;
+}
+
+static void print_results(FILE *out, struct result *results, int count) {
+    int i;
+    fprintf(out, "{\n  \"workloads\": [\n");
+    for (i = 0; i < count; i++) {
+        struct result *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"ops\": %d, \"ops_per_s\": %.1f, \"p50_us\": %.3f, "
+                "\"p99_us\": %.3f, \"reads_per_op\": %.3f, \"writes_per_op\": %.3f}%s\n",
+                r->name, r->ops, r->ops_per_s, r->p50_us, r->p99_us, r->reads_per_op,
+                r->writes_per_op, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+/* reads back a file print_results wrote, one workload per line */
+static int load_results(const char *path, struct result *results) {
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+        return -1;
+    char line[512];
+    int count = 0;
+    while (count < BENCH_WORKLOADS_MAX && fgets(line, sizeof line, in) != NULL) {
+        struct result *r = &results[count];
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ops\": %d, \"ops_per_s\": %lf, \"p50_us\": %lf, "
+                   "\"p99_us\": %lf, \"reads_per_op\": %lf, \"writes_per_op\": %lf",
+                   r->name, &r->ops, &r->ops_per_s, &r->p50_us, &r->p99_us, &r->reads_per_op,
+                   &r->writes_per_op) == 7)
+            count++;
+    }
+    fclose(in);
+    return count;
+}
+
+/* prints one line per workload found in both runs, returns how many regressed */
+static int compare(struct result *base, int base_count, struct result *results, int count,
+                   double threshold) {
+    int regressions = 0;
+    int i, j;
+    for (i = 0; i < count; i++) {
+        struct result *r = &results[i];
+        for (j = 0; j < base_count && strcmp(base[j].name, r->name) != 0; j++)
+            ;
+        if (j == base_count)
+            continue;
+        struct result *b = &base[j];
+        double speed = b->ops_per_s > 0 ? 100 * (r->ops_per_s - b->ops_per_s) / b->ops_per_s : 0;
+        double p99 = b->p99_us > 0 ? 100 * (r->p99_us - b->p99_us) / b->p99_us : 0;
+        // a thousandth of an I/O per op is below what the JSON keeps
+        int more_io = r->reads_per_op > b->reads_per_op + 0.001
+                || r->writes_per_op > b->writes_per_op + 0.001;
+        int regressed = speed < -threshold || p99 > 2 * threshold || more_io;
+        regressions += regressed;
+        fprintf(stderr, "%-14s ops/s %+7.1f%%  p99 %+7.1f%%  reads/op %.3f -> %.3f  writes/op %.3f -> %.3f%s\n",
+                r->name, speed, p99, b->reads_per_op, r->reads_per_op, b->writes_per_op,
+                r->writes_per_op, regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    const char *out_path = NULL;
+    const char *base_path = NULL;
+    const char *filter = "";
+    double threshold = BENCH_THRESHOLD;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:c:t:f:")) != -1) {
+        if (opt == 'o')
+            out_path = optarg;
+        else if (opt == 'c')
+            base_path = optarg;
+        else if (opt == 't')
+            threshold = atof(optarg);
+        else if (opt == 'f')
+            filter = optarg;
+        else {
+            fprintf(stderr, "usage: %s [-o out.json] [-c baseline.json] [-t percent] [-f name]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    int i;
+    for (i = 0; i < (int)sizeof data; i++)
+        data[i] = i % 251;
+    for (i = 0; i < BENCH_FILES; i++)
+        sprintf(names[i], "f%d", i);
+    srand(1);
+
+    static struct result results[BENCH_WORKLOADS_MAX];
+    int count = 0;
+    for (i = 0; i < (int)(sizeof workloads / sizeof workloads[0]); i++) {
+        if (strncmp(workloads[i].name, filter, strlen(filter)) != 0)
+            continue;
+        if (run(&workloads[i], &results[count]) < 0)
+            return 1;
+        count++;
+    }
+    remove(BENCH_DISK);
+
+    print_results(stdout, results, count);
+    if (out_path != NULL) {
+        FILE *out = fopen(out_path, "w");
+        if (out == NULL) {
+            perror(out_path);
+            return 1;
+        }
+        print_results(out, results, count);
+        fclose(out);
+    }
+    if (base_path != NULL) {
+        static struct result base[BENCH_WORKLOADS_MAX];
+        int base_count = load_results(base_path, base);
+        if (base_count < 0) {
+            perror(base_path);
+            return 1;
+        }
+        int regressions = compare(base, base_count, results, count, threshold);
+        fprintf(stderr, "%d of %d workloads regressed\n", regressions, count);
+        if (regressions > 0)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/* Write-back benchmark
+ *
+ * Runs a write-heavy workload - small files written, overwritten and
+ * deleted at random over a fixed set of names - with writes going straight
+ * to the image and with tfs_setWriteBack, in place and log-structured.
+ * Reports calls/s, the slowest 1% of calls, the host writes each call cost
+ * and the blocks per host write, and how long tfs_sync then took.
+ *
+ *   bench_writeback [image]
+ *
+ * The image is /tmp/bench_writeback.tfs by default. Name it
+ * direct:<file> to take the host page cache out, which is where waiting on
+ * writes shows.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../TinyFS_errno.h"
+#include "../libTinyFS.h"
+#include "../libDisk.h"
+
+#define BENCH_DISK "/tmp/bench_writeback.tfs"
+#define BENCH_DISK_SIZE (BLOCKSIZE * 16384)
+#define BENCH_NAMES 600
+#define BENCH_OPS 20000
+#define BENCH_SIZE_MAX 6000
+/* write-back cache size and thresholds */
+#define BENCH_WB_BLOCKS 4096
+#define BENCH_WB_DIRTY_PCT 50
+#define BENCH_WB_AGE_MS 30
+
+static char *image = BENCH_DISK;
+static char data[BENCH_SIZE_MAX];
+static double lat[BENCH_OPS];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* mostly small files, now and then a bigger one */
+static int size_of(void) {
+    return rand() % 4 == 0 ? rand() % BENCH_SIZE_MAX : rand() % 1000;
+}
+
+static int run(const char *label, int log, int writeback) {
+    srand(1);
+    if (tfs_setLogStructured(log) < 0 || tfs_mkfs(image, BENCH_DISK_SIZE) < 0 || tfs_mount(image) < 0
+            || (writeback && tfs_setWriteBack(BENCH_WB_BLOCKS, BENCH_WB_DIRTY_PCT, BENCH_WB_AGE_MS) < 0)) {
+        fprintf(stderr, "%s: can't make the image\n", image);
+        return -1;
+    }
+    struct disk_stats before, after;
+    diskStats(&before);
+    double start = now();
+    int i;
+    for (i = 0; i < BENCH_OPS; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "f%d", rand() % BENCH_NAMES);
+        double call = now();
+        fileDescriptor fd = tfs_openFile(name);
+        if (fd < 0) {
+            fprintf(stderr, "%s: tfs_openFile failed (%d)\n", label, fd);
+            return -1;
+        }
+        int err = rand() % 8 == 0 ? tfs_deleteFile(fd) : tfs_writeFile(fd, data, size_of());
+        if (err < 0) {
+            fprintf(stderr, "%s: write failed (%d)\n", label, err);
+            return -1;
+        }
+        tfs_closeFile(fd);
+        lat[i] = now() - call;
+    }
+    double s = now() - start;
+    start = now();
+    if (tfs_sync() < 0) {
+        fprintf(stderr, "%s: tfs_sync failed\n", label);
+        return -1;
+    }
+    double sync_s = now() - start;
+    diskStats(&after);
+    tfs_unmount();
+
+    qsort(lat, BENCH_OPS, sizeof(double), compare);
+    long writes = after.writes - before.writes;
+    long blocks = after.blocks_written - before.blocks_written;
+    printf("%-26s %10.0f calls/s  p99 %7.1f us  %6.2f writes per call  %6.2f blocks per write  sync %7.1f ms\n",
+           label, 3.0 * BENCH_OPS / s, lat[BENCH_OPS * 99 / 100] * 1e6, (double)writes / (3.0 * BENCH_OPS),
+           writes > 0 ? (double)blocks / writes : 0.0, sync_s * 1000);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [image]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2)
+        image = argv[1];
+    int i;
+    for (i = 0; i < BENCH_SIZE_MAX; i++)
+        data[i] = rand();
+    if (run("write-through", 0, 0) < 0 || run("write-back", 0, 1) < 0
+            || run("log-structured", 1, 0) < 0 || run("log-structured, write-back", 1, 1) < 0)
+        return 1;
+    tfs_setLogStructured(0);
+    remove(image + (strncmp(image, DIRECT_DISK_PREFIX, strlen(DIRECT_DISK_PREFIX)) == 0 ? strlen(DIRECT_DISK_PREFIX) : 0));
+    return 0;
+}
@@ -1,11 +1,21 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "tinyFS.h"
 #include "TinyFS_errno.h"
+#include "libDisk.h"
 
 #ifndef DBG_MACRO
 #define DBG_MACRO
@@ -19,9 +29,82 @@
 #endif
 #endif
 
-bool fd_valid(int fd);
+/* most disks open at once */
+#define DISKS_MAX 64
+
+struct disk;
+
+/* What a backend provides. Block numbers are checked against the disk's
+ * size by the backend. readv is optional, without it readaheadBlocks()
+ * reads nothing, which suits backends where a read is only a copy. writev
+ * is too, without it writeBlocks() writes block by block */
+struct disk_ops {
+    int (*read)(struct disk *d, int bNum, void *block);
+    int (*write)(struct disk *d, int bNum, void *block);
+    /* writes all of iov starting at block bNum or fails */
+    int (*writev)(struct disk *d, int bNum, struct iovec *iov, int iovcnt);
+    /* bytes read into iov starting at block bNum */
+    int (*readv)(struct disk *d, int bNum, struct iovec *iov, int iovcnt);
+    int (*punch)(struct disk *d, int bNum, int count);
+    int (*resize)(struct disk *d, int nBytes);
+    /* whole blocks on the disk */
+    int (*size)(struct disk *d);
+    /* sends what it can of the range straight to outFd and returns how many
+     * bytes that was, sendBlock() reads and writes the rest */
+    int (*send)(struct disk *d, int bNum, int byte, int count, int outFd);
+    int (*close)(struct disk *d);
+};
+
+/* an open disk, the disk number is its index in disks */
+struct disk {
+    bool live;
+    const struct disk_ops *ops;
+    /* host file of the file backend */
+    int fd;
+    /* whatever else the backend keeps */
+    void *state;
+    /* write-back cache, NULL while writes go straight to the backend */
+    struct writeback *wb;
+};
+
+static struct disk disks[DISKS_MAX];
+
 int tlbntopbn(int lbn);
 int seek_inbounds(int fd, off_t offset);
+int send_fd(int fd, off_t offset, int count, int outFd);
+void readahead_drop(int disk, int bNum, int count);
+struct disk *disk_get(int disk);
+struct writeback;
+void *wb_find(struct writeback *wb, int bNum);
+bool wb_read(struct writeback *wb, int bNum, void *block);
+int wb_write(struct writeback *wb, int bNum, void *block);
+void wb_lock(struct writeback *wb);
+void wb_hold(struct writeback *wb, int bNum, int count);
+void wb_resize(struct writeback *wb, int size);
+void wb_release(struct writeback *wb);
+int wb_stop(struct disk *d);
+void io_lock(void);
+void io_unlock(void);
+int file_open(struct disk *d, char *filename, int nBytes);
+int ram_open(struct disk *d, char *name, int nBytes);
+int stripe_open(struct disk *d, char *name, int nBytes);
+int mirror_open(struct disk *d, char *name, int nBytes);
+int direct_open(struct disk *d, char *name, int nBytes);
+
+/* blocks read by readaheadBlocks(), direct mapped by block number so a run
+ * of up to READAHEAD_BLOCKS_MAX blocks never evicts itself */
+static struct {
+    bool live;
+    int disk;
+    int bNum;
+} ra_tags[READAHEAD_BLOCKS_MAX];
+static char ra_data[READAHEAD_BLOCKS_MAX][BLOCKSIZE];
+
+static struct disk_stats disk_stats;
+static void (*disk_trace)(int disk, int kind, int bNum, int count);
+
+/* serialises backend calls and disk_stats with the write-back flusher threads */
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /**
  * This functions opens a regular UNIX file and designates the first 
@@ -39,39 +122,53 @@ int openDisk(char *filename, int nBytes) {
     if (nBytes < BLOCKSIZE && nBytes != 0) {
         return -1;
     }
-    int flags = O_RDWR;
-    if (nBytes != 0) {
-        flags = flags | O_CREAT;
+    int disk;
+    for (disk = 0; disk < DISKS_MAX && disks[disk].live; disk++)
+        ;
+    if (disk == DISKS_MAX) {
+        return TFS_ERR_TOO_MANY_FILES;
     }
-    int fd = open(filename, flags, S_IRUSR | S_IWUSR);
-    if (fd < 0) {
-        return fd;
+    struct disk *d = &disks[disk];
+    memset(d, 0, sizeof(*d));
+    int err;
+    io_lock();
+    if (strncmp(filename, RAM_DISK_PREFIX, strlen(RAM_DISK_PREFIX)) == 0) {
+        err = ram_open(d, filename, nBytes);
+    } else if (strncmp(filename, STRIPE_DISK_PREFIX, strlen(STRIPE_DISK_PREFIX)) == 0) {
+        err = stripe_open(d, filename, nBytes);
+    } else if (strncmp(filename, MIRROR_DISK_PREFIX, strlen(MIRROR_DISK_PREFIX)) == 0) {
+        err = mirror_open(d, filename, nBytes);
+    } else if (strncmp(filename, DIRECT_DISK_PREFIX, strlen(DIRECT_DISK_PREFIX)) == 0) {
+        err = direct_open(d, filename, nBytes);
+    } else {
+        err = file_open(d, filename, nBytes);
     }
-
-    // int rem = nBytes % BLOCKSIZE;
-    // nBytes -= rem;
-
-    // set file len to nBytes
-    // note: before adjusting nBytes by block size
-    if (nBytes != 0 && ftruncate(fd, nBytes) < 0)
-        return -(errno);
-
-    // if (nBytes == 0) {
-    //     return fd;
-    // }
-    // TODO : overwrite file contents if nBytes > 0
-    return fd;
+    io_unlock();
+    if (err < 0) {
+        return err;
+    }
+    // a reused number must not see blocks read ahead from the disk it used to be
+    readahead_drop(disk, 0, -1);
+    d->live = true;
+    return disk;
 }
 
 /**
  * self explanatory
  */
 int closeDisk(int disk) {
-    if (!fd_valid(disk)) {
-        // file already closed
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        // already closed
         return -1;
     }
-    return close(disk);
+    int err = d->wb != NULL ? wb_stop(d) : 0;
+    readahead_drop(disk, 0, -1);
+    d->live = false;
+    io_lock();
+    int close_err = d->ops->close(d);
+    io_unlock();
+    return err < 0 ? err : close_err;
 }
 
 /**
@@ -87,13 +184,28 @@ int closeDisk(int disk) {
  * system.
  */
 int readBlock(int disk, int bNum, void *block) {
-    int pbn = tlbntopbn(bNum);
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        return -1;
+    }
+    if (d->wb != NULL && wb_read(d->wb, bNum, block)) {
+        return 0;
+    }
+    if (isReadAhead(disk, bNum)) {
+        memcpy(block, ra_data[bNum % READAHEAD_BLOCKS_MAX], BLOCKSIZE);
+        return 0;
+    }
     int err;
-    if ((err = seek_inbounds(disk, pbn)) < 0) {
+    io_lock();
+    if ((err = d->ops->read(d, bNum, block)) < 0) {
+        io_unlock();
         return err;
     }
-    if ((err = read(disk, block, BLOCKSIZE)) < 0) {
-        return err;
+    disk_stats.reads++;
+    disk_stats.blocks_read++;
+    io_unlock();
+    if (disk_trace != NULL) {
+        disk_trace(disk, DISK_TRACE_READ, bNum, 1);
     }
     return 0;
 } 
@@ -109,38 +221,2120 @@ int readBlock(int disk, int bNum, void *block) {
  * must define your own error code system.
  */
 int writeBlock(int disk, int bNum, void *block) {
-    int pbn = tlbntopbn(bNum);
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        return -1;
+    }
+    int err;
+    if (d->wb != NULL) {
+        // the flusher writes it later, and counts it then
+        if ((err = wb_write(d->wb, bNum, block)) < 0) {
+            return err;
+        }
+    } else {
+        io_lock();
+        if ((err = d->ops->write(d, bNum, block)) < 0) {
+            io_unlock();
+            return err;
+        }
+        disk_stats.writes++;
+        disk_stats.blocks_written++;
+        io_unlock();
+    }
+    if (disk_trace != NULL) {
+        disk_trace(disk, DISK_TRACE_WRITE, bNum, 1);
+    }
+    // keep a read ahead copy current
+    if (isReadAhead(disk, bNum)) {
+        memcpy(ra_data[bNum % READAHEAD_BLOCKS_MAX], block, BLOCKSIZE);
+    }
+    return 0;
+}
+
+/**
+ * writeBlocks() writes `count` blocks from `blocks` starting at `bNum` with
+ * a single write where the backend can, one writeBlock() each where it
+ * can't.
+ */
+int writeBlocks(int disk, int bNum, int count, void *blocks) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL || count < 0) {
+        return -1;
+    }
     int err;
-    if ((err = seek_inbounds(disk, pbn)) < 0) {
+    int i;
+    if (d->ops->writev == NULL || d->wb != NULL) {
+        for (i = 0; i < count; i++) {
+            if ((err = writeBlock(disk, bNum + i, (char *)blocks + tlbntopbn(i))) < 0) {
+                return err;
+            }
+        }
+        return 0;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    struct iovec iov = { blocks, tlbntopbn(count) };
+    io_lock();
+    if ((err = d->ops->writev(d, bNum, &iov, 1)) < 0) {
+        io_unlock();
         return err;
     }
-    if ((err = write(disk, block, BLOCKSIZE)) < 0) {
+    disk_stats.writes++;
+    disk_stats.blocks_written += count;
+    io_unlock();
+    if (disk_trace != NULL) {
+        disk_trace(disk, DISK_TRACE_WRITE, bNum, count);
+    }
+    for (i = 0; i < count; i++) {
+        if (isReadAhead(disk, bNum + i)) {
+            memcpy(ra_data[(bNum + i) % READAHEAD_BLOCKS_MAX], (char *)blocks + tlbntopbn(i), BLOCKSIZE);
+        }
+    }
+    return 0;
+}
+
+/**
+ * punchBlocks() releases `count` blocks starting at `bNum` back to the host
+ * file system. They read back as zeros afterwards and the disk keeps its
+ * size. Fails with the host's error (e.g. -EOPNOTSUPP) if it can't punch.
+ */
+int punchBlocks(int disk, int bNum, int count) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        return -1;
+    }
+    if (count <= 0)
+        return 0;
+    readahead_drop(disk, bNum, count);
+    int err;
+    // cached writes to the blocks are dropped rather than written after
+    if (d->wb != NULL) {
+        wb_hold(d->wb, bNum, count);
+    }
+    io_lock();
+    err = d->ops->punch(d, bNum, count);
+    io_unlock();
+    if (d->wb != NULL) {
+        wb_release(d->wb);
+    }
+    if (err < 0) {
         return err;
     }
+    if (disk_trace != NULL) {
+        disk_trace(disk, DISK_TRACE_PUNCH, bNum, count);
+    }
     return 0;
 }
 
-int seek_inbounds(int disk, off_t offset) {
+/**
+ * resizeDisk() grows or shrinks an open disk to nBytes. Blocks added at the
+ * end read as zeros, blocks cut off are lost.
+ */
+int resizeDisk(int disk, int nBytes) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL || nBytes < BLOCKSIZE) {
+        return -1;
+    }
+    readahead_drop(disk, nBytes / BLOCKSIZE, -1);
     int err;
-    off_t size;
-    if ((err = size = lseek(disk, 0, SEEK_END)) < 0) {
+    if (d->wb != NULL) {
+        wb_hold(d->wb, nBytes / BLOCKSIZE, -1);
+    }
+    io_lock();
+    err = d->ops->resize(d, nBytes);
+    io_unlock();
+    if (d->wb != NULL) {
+        if (err == 0) {
+            wb_resize(d->wb, nBytes / BLOCKSIZE);
+        }
+        wb_release(d->wb);
+    }
+    if (err < 0) {
         return err;
     }
-    size = size - (size % BLOCKSIZE);
-    if (offset > size) {
+    if (disk_trace != NULL) {
+        disk_trace(disk, DISK_TRACE_RESIZE, 0, nBytes / BLOCKSIZE);
+    }
+    return 0;
+}
+
+/**
+ * sendBlock() copies `count` bytes from byte `byte` of block `bNum` to the
+ * host file descriptor `outFd` without passing them through a user buffer
+ * where the backend can (sendfile for the file backend). Falls back to
+ * reading and writing whatever it couldn't send that way.
+ */
+int sendBlock(int disk, int bNum, int byte, int count, int outFd) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL || byte < 0 || count < 0 || byte + count > BLOCKSIZE) {
+        return -1;
+    }
+    int err;
+    int sent = 0;
+    // a block still in the write-back cache isn't on the host yet
+    char block[BLOCKSIZE];
+    bool cached = d->wb != NULL && wb_read(d->wb, bNum, block);
+    if (!cached && d->ops->send != NULL) {
+        io_lock();
+        sent = d->ops->send(d, bNum, byte, count, outFd);
+        if (sent >= 0 && sent == count) {
+            disk_stats.reads++;
+            disk_stats.blocks_read++;
+        }
+        io_unlock();
+        if (sent < 0) {
+            return sent;
+        }
+    }
+    count -= sent;
+    if (count == 0) {
+        if (disk_trace != NULL) {
+            disk_trace(disk, DISK_TRACE_SEND, bNum, 1);
+        }
+    } else {
+        if (!cached && (err = readBlock(disk, bNum, block)) < 0) {
+            return err;
+        }
+        char* data = block + byte + sent;
+        while (count > 0) {
+            io_lock();
+            disk_stats.syscalls++;
+            io_unlock();
+            ssize_t written = write(outFd, data, count);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written < 0) {
+                return -(errno);
+            }
+            data += written;
+            count -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * readaheadBlocks() reads `count` blocks starting at `bNum` with a single
+ * read into the readahead buffer. Blocks past the end of the disk are left
+ * out and count is capped at READAHEAD_BLOCKS_MAX.
+ */
+int readaheadBlocks(int disk, int bNum, int count) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        return -1;
+    }
+    if (d->ops->readv == NULL) {
+        return 0;
+    }
+    io_lock();
+    int size = d->ops->size(d);
+    io_unlock();
+    if (size < 0) {
+        return size;
+    }
+    if (count > READAHEAD_BLOCKS_MAX) {
+        count = READAHEAD_BLOCKS_MAX;
+    }
+    if (count > size - bNum) {
+        count = size - bNum;
+    }
+    if (bNum < 0 || count <= 0) {
+        return 0;
+    }
+    // the run wraps around the end of the buffer at most once
+    int first = bNum % READAHEAD_BLOCKS_MAX;
+    int head = count < READAHEAD_BLOCKS_MAX - first ? count : READAHEAD_BLOCKS_MAX - first;
+    struct iovec iov[2] = {
+        { ra_data[first], tlbntopbn(head) },
+        { ra_data[0], tlbntopbn(count - head) },
+    };
+    int i;
+    for (i = 0; i < count; i++) {
+        ra_tags[(bNum + i) % READAHEAD_BLOCKS_MAX].live = false;
+    }
+    // blocks the flusher hasn't written yet stay put until they're copied over
+    if (d->wb != NULL) {
+        wb_lock(d->wb);
+    }
+    io_lock();
+    int got = d->ops->readv(d, bNum, iov, count > head ? 2 : 1);
+    if (got >= 0) {
+        disk_stats.reads++;
+        disk_stats.blocks_read += got / BLOCKSIZE;
+    }
+    io_unlock();
+    if (got < 0) {
+        if (d->wb != NULL) {
+            wb_release(d->wb);
+        }
+        return got;
+    }
+    if (disk_trace != NULL) {
+        disk_trace(disk, DISK_TRACE_READAHEAD, bNum, got / BLOCKSIZE);
+    }
+    for (i = 0; i < got / BLOCKSIZE; i++) {
+        int slot = (bNum + i) % READAHEAD_BLOCKS_MAX;
+        ra_tags[slot].live = true;
+        ra_tags[slot].disk = disk;
+        ra_tags[slot].bNum = bNum + i;
+        // newer than what the host has
+        void *dirty;
+        if (d->wb != NULL && (dirty = wb_find(d->wb, bNum + i)) != NULL) {
+            memcpy(ra_data[slot], dirty, BLOCKSIZE);
+        }
+    }
+    if (d->wb != NULL) {
+        wb_release(d->wb);
+    }
+    return got / BLOCKSIZE;
+}
+
+void setDiskTrace(void (*trace)(int disk, int kind, int bNum, int count)) {
+    disk_trace = trace;
+}
+
+void diskStats(struct disk_stats *stats) {
+    io_lock();
+    *stats = disk_stats;
+    io_unlock();
+}
+
+int isReadAhead(int disk, int bNum) {
+    int slot = bNum % READAHEAD_BLOCKS_MAX;
+    return bNum >= 0 && ra_tags[slot].live && ra_tags[slot].disk == disk && ra_tags[slot].bNum == bNum;
+}
+
+/* forgets the read ahead blocks of `disk` from `bNum` on, `count` of them or all with -1 */
+void readahead_drop(int disk, int bNum, int count) {
+    int i;
+    for (i = 0; i < READAHEAD_BLOCKS_MAX; i++) {
+        if (ra_tags[i].live && ra_tags[i].disk == disk && ra_tags[i].bNum >= bNum
+                && (count < 0 || ra_tags[i].bNum < bNum + count)) {
+            ra_tags[i].live = false;
+        }
+    }
+}
+
+struct disk *disk_get(int disk) {
+    if (disk < 0 || disk >= DISKS_MAX || !disks[disk].live) {
+        return NULL;
+    }
+    return &disks[disk];
+}
+
+/******************************************************/
+/*************** Write-back functions *****************/
+/******************************************************/
+
+/* buckets of the dirty block table */
+#define WB_BUCKETS 1024
+/* longest run the flusher hands the backend in one write */
+#define WB_RUN_MAX 64
+
+/* a block of the sweep being written */
+struct wb_entry {
+    int bNum;
+    char *data;
+};
+
+/* Dirty blocks of a disk with write-back on. writeBlock() only copies into
+ * the table; the flusher thread takes everything in it at once once it's
+ * `ratio` percent full or its oldest block has waited `age_ms`, sorts it by
+ * block number and writes each run of adjacent blocks with one backend
+ * write. Writes to a full table wait for a sweep to make room */
+struct writeback {
+    struct disk *d;
+    int capacity;
+    int ratio;
+    int age_ms;
+    /* whole blocks on the disk, writes past it fail like the backend's would */
+    int size;
+    /* the table, chained through next from buckets, slot i holds bnum[i] */
+    int count;
+    int buckets[WB_BUCKETS];
+    int *next;
+    int *bnum;
+    char *data;
+    /* when the first block of the table went in */
+    struct timespec oldest;
+    /* the sweep being written, sorted by block number, and the buffer its
+     * blocks are in (the table's until the sweep took it) */
+    int flight_count;
+    struct wb_entry *flight;
+    char *flight_data;
+    /* a flushDisk() is waiting for everything */
+    bool flush_all;
+    bool stop;
+    /* first error of a background write, until flushDisk() reports it */
+    int err;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    /* table full or due, room made, sweep written */
+    pthread_cond_t work;
+    pthread_cond_t room;
+    pthread_cond_t done;
+};
+
+void io_lock(void) {
+    pthread_mutex_lock(&io_mutex);
+}
+
+void io_unlock(void) {
+    pthread_mutex_unlock(&io_mutex);
+}
+
+int wb_hash(int bNum) {
+    return (unsigned)bNum % WB_BUCKETS;
+}
+
+int wb_compare(const void *a, const void *b) {
+    const struct wb_entry *x = a, *y = b;
+    return (x->bNum > y->bNum) - (x->bNum < y->bNum);
+}
+
+/* the newest copy of bNum not on the host yet or NULL, wb->lock held */
+void *wb_find(struct writeback *wb, int bNum) {
+    int i;
+    for (i = wb->buckets[wb_hash(bNum)]; i >= 0; i = wb->next[i]) {
+        if (wb->bnum[i] == bNum) {
+            return wb->data + tlbntopbn(i);
+        }
+    }
+    struct wb_entry key = { bNum, NULL };
+    struct wb_entry *in_flight = bsearch(&key, wb->flight, wb->flight_count, sizeof(key), wb_compare);
+    return in_flight != NULL ? in_flight->data : NULL;
+}
+
+bool wb_read(struct writeback *wb, int bNum, void *block) {
+    pthread_mutex_lock(&wb->lock);
+    void *data = wb_find(wb, bNum);
+    if (data != NULL) {
+        memcpy(block, data, BLOCKSIZE);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return data != NULL;
+}
+
+bool wb_due(struct writeback *wb) {
+    if (wb->count * 100 >= wb->ratio * wb->capacity) {
+        return true;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long waited = (now.tv_sec - wb->oldest.tv_sec) * 1000 + (now.tv_nsec - wb->oldest.tv_nsec) / 1000000;
+    return waited >= wb->age_ms;
+}
+
+int wb_write(struct writeback *wb, int bNum, void *block) {
+    pthread_mutex_lock(&wb->lock);
+    if (bNum < 0 || bNum >= wb->size) {
+        pthread_mutex_unlock(&wb->lock);
         return TFS_ERR_OUT_OF_BOUNDS;
     }
-    if ((err = lseek(disk, offset, SEEK_SET)) < 0) {
+    int i;
+    for (i = wb->buckets[wb_hash(bNum)]; i >= 0 && wb->bnum[i] != bNum; i = wb->next[i])
+        ;
+    if (i < 0) {
+        while (wb->count == wb->capacity) {
+            pthread_cond_signal(&wb->work);
+            pthread_cond_wait(&wb->room, &wb->lock);
+        }
+        i = wb->count++;
+        wb->bnum[i] = bNum;
+        wb->next[i] = wb->buckets[wb_hash(bNum)];
+        wb->buckets[wb_hash(bNum)] = i;
+        if (i == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &wb->oldest);
+            pthread_cond_signal(&wb->work);
+        } else if (wb->count * 100 >= wb->ratio * wb->capacity) {
+            pthread_cond_signal(&wb->work);
+        }
+    }
+    memcpy(wb->data + tlbntopbn(i), block, BLOCKSIZE);
+    pthread_mutex_unlock(&wb->lock);
+    return 0;
+}
+
+/* keeps the table as it is until wb_release(), a sweep under way carries on */
+void wb_lock(struct writeback *wb) {
+    pthread_mutex_lock(&wb->lock);
+}
+
+/* whether bNum is among the blocks from `first` on, `count` of them or all with -1 */
+bool wb_in(int bNum, int first, int count) {
+    return bNum >= first && (count < 0 || bNum < first + count);
+}
+
+/* takes slot i out of the table, the last slot moves into its place */
+void wb_remove(struct writeback *wb, int i) {
+    int *link;
+    for (link = &wb->buckets[wb_hash(wb->bnum[i])]; *link != i; link = &wb->next[*link])
+        ;
+    *link = wb->next[i];
+    int last = --wb->count;
+    if (i == last) {
+        return;
+    }
+    for (link = &wb->buckets[wb_hash(wb->bnum[last])]; *link != last; link = &wb->next[*link])
+        ;
+    *link = i;
+    wb->next[i] = wb->next[last];
+    wb->bnum[i] = wb->bnum[last];
+    memcpy(wb->data + tlbntopbn(i), wb->data + tlbntopbn(last), BLOCKSIZE);
+}
+
+/* drops the blocks from bNum on, `count` of them or all with -1, once a
+ * sweep under way has written any of them, and keeps the table as it is
+ * until wb_release() */
+void wb_hold(struct writeback *wb, int bNum, int count) {
+    pthread_mutex_lock(&wb->lock);
+    while (wb->flight_count > 0) {
+        // the sweep is sorted, the first block at or after bNum tells
+        int lo = 0, hi = wb->flight_count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (wb->flight[mid].bNum < bNum) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == wb->flight_count || !wb_in(wb->flight[lo].bNum, bNum, count)) {
+            break;
+        }
+        pthread_cond_wait(&wb->done, &wb->lock);
+    }
+    int i;
+    if (count >= 0 && count < wb->count) {
+        int b;
+        for (b = bNum; b < bNum + count; b++) {
+            for (i = wb->buckets[wb_hash(b)]; i >= 0 && wb->bnum[i] != b; i = wb->next[i])
+                ;
+            if (i >= 0) {
+                wb_remove(wb, i);
+            }
+        }
+    } else {
+        for (i = wb->count - 1; i >= 0; i--) {
+            if (wb_in(wb->bnum[i], bNum, count)) {
+                wb_remove(wb, i);
+            }
+        }
+    }
+    pthread_cond_broadcast(&wb->room);
+}
+
+/* the disk is `size` blocks now, wb held */
+void wb_resize(struct writeback *wb, int size) {
+    wb->size = size;
+}
+
+void wb_release(struct writeback *wb) {
+    pthread_mutex_unlock(&wb->lock);
+}
+
+/* writes the sweep in wb->flight, wb->lock not held. Returns the first error */
+int wb_sweep(struct writeback *wb) {
+    struct disk *d = wb->d;
+    struct iovec iov[WB_RUN_MAX];
+    int err = 0;
+    int i = 0;
+    while (i < wb->flight_count) {
+        int run = 1;
+        while (i + run < wb->flight_count && run < WB_RUN_MAX
+                && wb->flight[i + run].bNum == wb->flight[i].bNum + run) {
+            run++;
+        }
+        int j;
+        int run_err = 0;
+        io_lock();
+        if (d->ops->writev != NULL) {
+            for (j = 0; j < run; j++) {
+                iov[j].iov_base = wb->flight[i + j].data;
+                iov[j].iov_len = BLOCKSIZE;
+            }
+            if ((run_err = d->ops->writev(d, wb->flight[i].bNum, iov, run)) == 0) {
+                disk_stats.writes++;
+                disk_stats.blocks_written += run;
+            }
+        } else {
+            for (j = 0; j < run && run_err == 0; j++) {
+                if ((run_err = d->ops->write(d, wb->flight[i + j].bNum, wb->flight[i + j].data)) == 0) {
+                    disk_stats.writes++;
+                    disk_stats.blocks_written++;
+                }
+            }
+        }
+        io_unlock();
+        if (run_err < 0 && err == 0) {
+            err = run_err;
+        }
+        i += run;
+    }
+    return err;
+}
+
+void *wb_flusher(void *arg) {
+    struct writeback *wb = arg;
+    pthread_mutex_lock(&wb->lock);
+    while (true) {
+        if (wb->count > 0 && (wb->flush_all || wb->stop || wb_due(wb))) {
+            // take the whole table, its buffer becomes the sweep's
+            int i;
+            for (i = 0; i < wb->count; i++) {
+                wb->flight[i].bNum = wb->bnum[i];
+                wb->flight[i].data = wb->data + tlbntopbn(i);
+            }
+            qsort(wb->flight, wb->count, sizeof(struct wb_entry), wb_compare);
+            char *data = wb->data;
+            wb->data = wb->flight_data;
+            wb->flight_data = data;
+            wb->flight_count = wb->count;
+            wb->count = 0;
+            memset(wb->buckets, -1, sizeof(wb->buckets));
+            pthread_cond_broadcast(&wb->room);
+            pthread_mutex_unlock(&wb->lock);
+            int err = wb_sweep(wb);
+            pthread_mutex_lock(&wb->lock);
+            wb->flight_count = 0;
+            if (err < 0 && wb->err == 0) {
+                wb->err = err;
+            }
+            pthread_cond_broadcast(&wb->done);
+            continue;
+        }
+        if (wb->stop) {
+            break;
+        }
+        if (wb->count == 0) {
+            pthread_cond_wait(&wb->work, &wb->lock);
+            continue;
+        }
+        struct timespec due = wb->oldest;
+        due.tv_sec += wb->age_ms / 1000;
+        due.tv_nsec += (long)(wb->age_ms % 1000) * 1000000;
+        if (due.tv_nsec >= 1000000000) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wb->work, &wb->lock, &due);
+    }
+    pthread_mutex_unlock(&wb->lock);
+    return NULL;
+}
+
+void wb_free(struct writeback *wb) {
+    pthread_mutex_destroy(&wb->lock);
+    pthread_cond_destroy(&wb->work);
+    pthread_cond_destroy(&wb->room);
+    pthread_cond_destroy(&wb->done);
+    free(wb->next);
+    free(wb->bnum);
+    free(wb->data);
+    free(wb->flight);
+    free(wb->flight_data);
+    free(wb);
+}
+
+/* writes out everything, stops the flusher and turns write-back off.
+ * Returns the first error of a background write */
+int wb_stop(struct disk *d) {
+    struct writeback *wb = d->wb;
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = true;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+    int err = wb->err;
+    d->wb = NULL;
+    wb_free(wb);
+    return err;
+}
+
+int diskWriteBack(int disk, int blocks, int dirtyPct, int ageMs) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL || blocks < 0 || dirtyPct <= 0 || dirtyPct > 100 || ageMs < 0) {
+        return TFS_ERR_INVALID;
+    }
+    int err = d->wb != NULL ? wb_stop(d) : 0;
+    if (err < 0 || blocks == 0) {
+        return err;
+    }
+    io_lock();
+    int size = d->ops->size(d);
+    io_unlock();
+    if (size < 0) {
+        return size;
+    }
+    struct writeback *wb = calloc(1, sizeof(struct writeback));
+    if (wb == NULL) {
+        return TFS_ERR_NO_MEMORY;
+    }
+    wb->d = d;
+    wb->capacity = blocks;
+    wb->ratio = dirtyPct;
+    wb->age_ms = ageMs;
+    wb->size = size;
+    memset(wb->buckets, -1, sizeof(wb->buckets));
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wb->work, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&wb->room, NULL);
+    pthread_cond_init(&wb->done, NULL);
+    wb->next = malloc(blocks * sizeof(int));
+    wb->bnum = malloc(blocks * sizeof(int));
+    wb->flight = malloc(blocks * sizeof(struct wb_entry));
+    wb->data = malloc((size_t)blocks * BLOCKSIZE);
+    wb->flight_data = malloc((size_t)blocks * BLOCKSIZE);
+    if (wb->next == NULL || wb->bnum == NULL || wb->flight == NULL || wb->data == NULL || wb->flight_data == NULL
+            || pthread_create(&wb->thread, NULL, wb_flusher, wb) != 0) {
+        wb_free(wb);
+        return TFS_ERR_NO_MEMORY;
+    }
+    d->wb = wb;
+    return 0;
+}
+
+int flushDisk(int disk) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        return -1;
+    }
+    struct writeback *wb = d->wb;
+    if (wb == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&wb->lock);
+    wb->flush_all = true;
+    pthread_cond_signal(&wb->work);
+    while (wb->count > 0 || wb->flight_count > 0) {
+        pthread_cond_wait(&wb->done, &wb->lock);
+    }
+    wb->flush_all = false;
+    int err = wb->err;
+    wb->err = 0;
+    pthread_mutex_unlock(&wb->lock);
+    return err;
+}
+
+/******************************************************/
+/**************** File backend functions **************/
+/******************************************************/
+
+int file_read(struct disk *d, int bNum, void *block) {
+    int pbn = tlbntopbn(bNum);
+    int err;
+    if ((err = seek_inbounds(d->fd, pbn)) < 0) {
+        return err;
+    }
+    disk_stats.syscalls++;
+    if ((err = read(d->fd, block, BLOCKSIZE)) < 0) {
+        return err;
+    }
+    // the block right at the end of the disk seeks fine but reads nothing
+    if (err < BLOCKSIZE) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    return 0;
+}
+
+int file_write(struct disk *d, int bNum, void *block) {
+    int pbn = tlbntopbn(bNum);
+    int err;
+    if ((err = seek_inbounds(d->fd, pbn)) < 0) {
+        return err;
+    }
+    disk_stats.syscalls++;
+    if ((err = write(d->fd, block, BLOCKSIZE)) < 0) {
+        return err;
+    }
+    return 0;
+}
+
+int file_writev(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    size_t bytes = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
+    }
+    int err;
+    // the end of the run has to be within the disk
+    if ((err = seek_inbounds(d->fd, tlbntopbn(bNum) + bytes)) < 0) {
+        return err;
+    }
+    disk_stats.syscalls++;
+    ssize_t written = pwritev(d->fd, iov, iovcnt, tlbntopbn(bNum));
+    if (written < 0) {
+        return -(errno);
+    }
+    return written == (ssize_t)bytes ? 0 : TFS_ERR_IO;
+}
+
+int file_readv(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    int err;
+    if ((err = seek_inbounds(d->fd, tlbntopbn(bNum))) < 0) {
+        return err;
+    }
+    disk_stats.syscalls++;
+    ssize_t got = readv(d->fd, iov, iovcnt);
+    if (got < 0) {
+        return -(errno);
+    }
+    return got;
+}
+
+int file_punch(struct disk *d, int bNum, int count) {
+    int err;
+    if ((err = seek_inbounds(d->fd, tlbntopbn(bNum + count) - BLOCKSIZE)) < 0) {
+        return err;
+    }
+    disk_stats.syscalls++;
+    if (fallocate(d->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, tlbntopbn(bNum), tlbntopbn(count)) < 0) {
+        return -(errno);
+    }
+    return 0;
+}
+
+int file_resize(struct disk *d, int nBytes) {
+    disk_stats.syscalls++;
+    if (ftruncate(d->fd, nBytes) < 0) {
+        return -(errno);
+    }
+    return 0;
+}
+
+int file_size(struct disk *d) {
+    disk_stats.syscalls++;
+    off_t size = lseek(d->fd, 0, SEEK_END);
+    if (size < 0) {
+        return -(errno);
+    }
+    return size / BLOCKSIZE;
+}
+
+int file_send(struct disk *d, int bNum, int byte, int count, int outFd) {
+    int err;
+    if ((err = seek_inbounds(d->fd, tlbntopbn(bNum + 1) - BLOCKSIZE)) < 0) {
+        return err;
+    }
+    return send_fd(d->fd, tlbntopbn(bNum) + byte, count, outFd);
+}
+
+/* sendfile from `offset` in host file `fd`, until done or the host says it
+ * can't do it for outFd. Returns the bytes sent */
+int send_fd(int fd, off_t offset, int count, int outFd) {
+    int sent = 0;
+    while (sent < count) {
+        disk_stats.syscalls++;
+        ssize_t n = sendfile(outFd, fd, &offset, count - sent);
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            break;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -(errno);
+        }
+        if (n == 0) {
+            return TFS_ERR_OUT_OF_BOUNDS;
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+int file_close(struct disk *d) {
+    return close(d->fd);
+}
+
+static const struct disk_ops file_ops = {
+    file_read, file_write, file_writev, file_readv, file_punch, file_resize, file_size, file_send, file_close,
+};
+
+int file_open(struct disk *d, char *filename, int nBytes) {
+    int flags = O_RDWR;
+    if (nBytes != 0) {
+        // drop old contents so the new disk starts out as one sparse hole
+        flags = flags | O_CREAT | O_TRUNC;
+    }
+    int fd = open(filename, flags, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return fd;
+    }
+
+    // set file len to nBytes
+    // note: before adjusting nBytes by block size
+    if (nBytes != 0 && ftruncate(fd, nBytes) < 0) {
+        int err = -(errno);
+        close(fd);
         return err;
     }
+    d->ops = &file_ops;
+    d->fd = fd;
     return 0;
 }
 
+/******************************************************/
+/**************** RAM backend functions ***************/
+/******************************************************/
+
+/* an in-memory disk, kept by name until ramDiskDrop() so that like a file
+ * it outlives closeDisk() and can be opened again with nBytes 0 */
+struct ram_disk {
+    char *name;
+    char *data;
+    /* in whole blocks */
+    int size;
+    /* where closing it saves the image, NULL for nowhere */
+    char *snapshot;
+    /* disks open on it */
+    int opens;
+    struct ram_disk *next;
+};
 
-bool fd_valid(int fd) {
-    return fcntl(fd, F_GETFD) != -1 || errno != EBADF;
+static struct ram_disk *ram_disks;
+
+struct ram_disk *ram_find(char *name) {
+    struct ram_disk *ram;
+    for (ram = ram_disks; ram != NULL && strcmp(ram->name, name) != 0; ram = ram->next)
+        ;
+    return ram;
 }
 
+int ram_read(struct disk *d, int bNum, void *block) {
+    struct ram_disk *ram = d->state;
+    if (bNum < 0 || bNum >= ram->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    memcpy(block, ram->data + tlbntopbn(bNum), BLOCKSIZE);
+    return 0;
+}
+
+int ram_write(struct disk *d, int bNum, void *block) {
+    struct ram_disk *ram = d->state;
+    if (bNum < 0 || bNum >= ram->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    memcpy(ram->data + tlbntopbn(bNum), block, BLOCKSIZE);
+    return 0;
+}
+
+int ram_writev(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    struct ram_disk *ram = d->state;
+    size_t bytes = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
+    }
+    if (bNum < 0 || tlbntopbn(bNum) + bytes > (size_t)tlbntopbn(ram->size)) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    char *at = ram->data + tlbntopbn(bNum);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(at, iov[i].iov_base, iov[i].iov_len);
+        at += iov[i].iov_len;
+    }
+    return 0;
+}
+
+int ram_punch(struct disk *d, int bNum, int count) {
+    struct ram_disk *ram = d->state;
+    if (bNum < 0 || bNum + count > ram->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    memset(ram->data + tlbntopbn(bNum), 0, tlbntopbn(count));
+    return 0;
+}
+
+int ram_resize(struct disk *d, int nBytes) {
+    struct ram_disk *ram = d->state;
+    int size = nBytes / BLOCKSIZE;
+    char *data = realloc(ram->data, tlbntopbn(size));
+    if (data == NULL) {
+        return TFS_ERR_NO_MEMORY;
+    }
+    if (size > ram->size) {
+        memset(data + tlbntopbn(ram->size), 0, tlbntopbn(size - ram->size));
+    }
+    ram->data = data;
+    ram->size = size;
+    return 0;
+}
+
+int ram_size(struct disk *d) {
+    struct ram_disk *ram = d->state;
+    return ram->size;
+}
+
+/* the block is already in memory, sending it is a plain write */
+int ram_send(struct disk *d, int bNum, int byte, int count, int outFd) {
+    struct ram_disk *ram = d->state;
+    if (bNum < 0 || bNum >= ram->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    char *data = ram->data + tlbntopbn(bNum) + byte;
+    int sent = 0;
+    while (sent < count) {
+        disk_stats.syscalls++;
+        ssize_t n = write(outFd, data + sent, count - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -(errno);
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+/* writes the image to `path` as a disk file, blocks of zeros become holes */
+int ram_save(struct ram_disk *ram, char *path) {
+    static const char zeros[BLOCKSIZE];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return -(errno);
+    }
+    int err = 0;
+    disk_stats.syscalls++;
+    if (ftruncate(fd, tlbntopbn(ram->size)) < 0) {
+        err = -(errno);
+    }
+    int i;
+    for (i = 0; err == 0 && i < ram->size; i++) {
+        char *block = ram->data + tlbntopbn(i);
+        if (memcmp(block, zeros, BLOCKSIZE) == 0) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        ssize_t written = pwrite(fd, block, BLOCKSIZE, tlbntopbn(i));
+        if (written < 0) {
+            err = -(errno);
+        } else if (written < BLOCKSIZE) {
+            err = TFS_ERR_NO_FREE_BLOCKS;
+        }
+    }
+    if (close(fd) < 0 && err == 0) {
+        err = -(errno);
+    }
+    return err;
+}
+
+int ram_close(struct disk *d) {
+    struct ram_disk *ram = d->state;
+    ram->opens--;
+    if (ram->snapshot != NULL) {
+        return ram_save(ram, ram->snapshot);
+    }
+    return 0;
+}
+
+static const struct disk_ops ram_ops = {
+    ram_read, ram_write, ram_writev, NULL, ram_punch, ram_resize, ram_size, ram_send, ram_close,
+};
+
+int ram_open(struct disk *d, char *name, int nBytes) {
+    struct ram_disk *ram = ram_find(name);
+    if (ram == NULL && nBytes == 0) {
+        return TFS_ERR_NO_DISK;
+    }
+    if (ram == NULL) {
+        ram = calloc(1, sizeof(struct ram_disk));
+        if (ram == NULL || (ram->name = strdup(name)) == NULL) {
+            free(ram);
+            return TFS_ERR_NO_MEMORY;
+        }
+        ram->next = ram_disks;
+        ram_disks = ram;
+    }
+    if (nBytes != 0) {
+        // a new disk reads as zeros, like a fresh sparse file
+        char *data = calloc(nBytes / BLOCKSIZE, BLOCKSIZE);
+        if (data == NULL) {
+            return TFS_ERR_NO_MEMORY;
+        }
+        free(ram->data);
+        ram->data = data;
+        ram->size = nBytes / BLOCKSIZE;
+    }
+    ram->opens++;
+    d->ops = &ram_ops;
+    d->state = ram;
+    return 0;
+}
+
+int ramDiskSnapshot(char *name, char *path) {
+    struct ram_disk *ram = ram_find(name);
+    if (ram == NULL) {
+        return TFS_ERR_NO_DISK;
+    }
+    char *snapshot = NULL;
+    if (path != NULL && (snapshot = strdup(path)) == NULL) {
+        return TFS_ERR_NO_MEMORY;
+    }
+    free(ram->snapshot);
+    ram->snapshot = snapshot;
+    return 0;
+}
+
+int ramDiskDrop(char *name) {
+    struct ram_disk **link;
+    for (link = &ram_disks; *link != NULL && strcmp((*link)->name, name) != 0; link = &(*link)->next)
+        ;
+    struct ram_disk *ram = *link;
+    if (ram == NULL) {
+        return TFS_ERR_NO_DISK;
+    }
+    if (ram->opens > 0) {
+        return TFS_ERR_BUSY;
+    }
+    *link = ram->next;
+    free(ram->name);
+    free(ram->data);
+    free(ram->snapshot);
+    free(ram);
+    return 0;
+}
+
+/******************************************************/
+/************** Stripe backend functions **************/
+/******************************************************/
+
+struct stripe;
+
+/* one host file of a striped disk and its share of a readahead run */
+struct stripe_member {
+    int fd;
+    struct stripe *stripe;
+    pthread_t thread;
+    /* the job its thread is given, todo until it's done */
+    bool todo;
+    struct iovec iov[READAHEAD_BLOCKS_MAX];
+    int iovcnt;
+    off_t offset;
+    int got;
+};
+
+/* a disk spread over `count` host files, `unit` blocks to each in turn */
+struct stripe {
+    int count;
+    int unit;
+    /* in whole blocks, kept so block I/O doesn't have to ask every member */
+    int size;
+    struct stripe_member members[STRIPE_MEMBERS_MAX];
+    /* member threads running, started by the first readahead that spans members */
+    int threads;
+    bool quit;
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+};
+
+/* the member holding logical block bNum, returns the block's number there */
+int stripe_map(struct stripe *stripe, int bNum, int *member) {
+    int unit = bNum / stripe->unit;
+    *member = unit % stripe->count;
+    return (unit / stripe->count) * stripe->unit + bNum % stripe->unit;
+}
+
+/* blocks of a `size` block disk that land on `member` */
+int stripe_share(struct stripe *stripe, int size, int member) {
+    int units = size / stripe->unit;
+    int blocks = (units / stripe->count + (member < units % stripe->count)) * stripe->unit;
+    if (member == units % stripe->count) {
+        blocks += size % stripe->unit;
+    }
+    return blocks;
+}
+
+/* the blocks `member` holds of the logical run bNum..bNum+count-1, which are
+ * contiguous on it. Returns how many and sets *first to the first of them */
+int stripe_span(struct stripe *stripe, int bNum, int count, int member, int *first) {
+    int blocks = 0;
+    int b = bNum;
+    while (b < bNum + count) {
+        int m;
+        int mbn = stripe_map(stripe, b, &m);
+        int run = stripe->unit - b % stripe->unit;
+        if (run > bNum + count - b) {
+            run = bNum + count - b;
+        }
+        if (m == member) {
+            if (blocks == 0) {
+                *first = mbn;
+            }
+            blocks += run;
+        }
+        b += run;
+    }
+    return blocks;
+}
+
+int stripe_preadv(struct stripe_member *member) {
+    ssize_t got = preadv(member->fd, member->iov, member->iovcnt, member->offset);
+    return got < 0 ? -(errno) : got;
+}
+
+void *stripe_worker(void *arg) {
+    struct stripe_member *member = arg;
+    struct stripe *stripe = member->stripe;
+    pthread_mutex_lock(&stripe->lock);
+    while (!stripe->quit) {
+        if (!member->todo) {
+            pthread_cond_wait(&stripe->work, &stripe->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&stripe->lock);
+        int got = stripe_preadv(member);
+        pthread_mutex_lock(&stripe->lock);
+        member->got = got;
+        member->todo = false;
+        if (--stripe->pending == 0) {
+            pthread_cond_signal(&stripe->done);
+        }
+    }
+    pthread_mutex_unlock(&stripe->lock);
+    return NULL;
+}
+
+int stripe_start(struct stripe *stripe) {
+    int i;
+    for (i = stripe->threads; i < stripe->count; i++) {
+        struct stripe_member *member = &stripe->members[i];
+        member->stripe = stripe;
+        if (pthread_create(&member->thread, NULL, stripe_worker, member) != 0) {
+            // the ones already running are stopped by stripe_close
+            return TFS_ERR_NO_MEMORY;
+        }
+        stripe->threads = i + 1;
+    }
+    return 0;
+}
+
+int stripe_read(struct disk *d, int bNum, void *block) {
+    struct stripe *stripe = d->state;
+    if (bNum < 0 || bNum >= stripe->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int member;
+    int mbn = stripe_map(stripe, bNum, &member);
+    disk_stats.syscalls++;
+    ssize_t got = pread(stripe->members[member].fd, block, BLOCKSIZE, (off_t)tlbntopbn(mbn));
+    if (got < 0) {
+        return -(errno);
+    }
+    if (got < BLOCKSIZE) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    return 0;
+}
+
+int stripe_write(struct disk *d, int bNum, void *block) {
+    struct stripe *stripe = d->state;
+    if (bNum < 0 || bNum >= stripe->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int member;
+    int mbn = stripe_map(stripe, bNum, &member);
+    disk_stats.syscalls++;
+    if (pwrite(stripe->members[member].fd, block, BLOCKSIZE, (off_t)tlbntopbn(mbn)) < 0) {
+        return -(errno);
+    }
+    return 0;
+}
+
+/* splits the run into one preadv per member and runs them at the same time,
+ * the caller doing the first itself. Returns the bytes of the leading blocks
+ * that were all read */
+int stripe_readv(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    struct stripe *stripe = d->state;
+    int count = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        count += iov[i].iov_len / BLOCKSIZE;
+    }
+    for (i = 0; i < stripe->count; i++) {
+        stripe->members[i].iovcnt = 0;
+        stripe->members[i].got = 0;
+    }
+    // consecutive blocks of a member are contiguous on it, the buffers of
+    // consecutive blocks of a unit are contiguous too
+    int first = -1;
+    int used = 0;
+    int b;
+    for (b = 0, i = 0; b < count; b++) {
+        int m;
+        int mbn = stripe_map(stripe, bNum + b, &m);
+        struct stripe_member *member = &stripe->members[m];
+        char *buffer = (char *)iov[i].iov_base + used;
+        struct iovec *last = member->iovcnt > 0 ? &member->iov[member->iovcnt - 1] : NULL;
+        if (last != NULL && (char *)last->iov_base + last->iov_len == buffer) {
+            last->iov_len += BLOCKSIZE;
+        } else {
+            if (member->iovcnt == 0) {
+                member->offset = tlbntopbn(mbn);
+            }
+            member->iov[member->iovcnt].iov_base = buffer;
+            member->iov[member->iovcnt].iov_len = BLOCKSIZE;
+            member->iovcnt++;
+        }
+        if (first < 0) {
+            first = m;
+        }
+        used += BLOCKSIZE;
+        if (used == (int)iov[i].iov_len) {
+            i++;
+            used = 0;
+        }
+    }
+    if (first < 0) {
+        return 0;
+    }
+
+    int err;
+    bool parallel = false;
+    for (i = 0; i < stripe->count; i++) {
+        if (i != first && stripe->members[i].iovcnt > 0) {
+            parallel = true;
+        }
+    }
+    if (parallel && stripe->threads < stripe->count && (err = stripe_start(stripe)) < 0) {
+        return err;
+    }
+    if (parallel) {
+        pthread_mutex_lock(&stripe->lock);
+        for (i = 0; i < stripe->count; i++) {
+            if (i != first && stripe->members[i].iovcnt > 0) {
+                disk_stats.syscalls++;
+                stripe->members[i].todo = true;
+                stripe->pending++;
+            }
+        }
+        pthread_cond_broadcast(&stripe->work);
+        pthread_mutex_unlock(&stripe->lock);
+    }
+    disk_stats.syscalls++;
+    stripe->members[first].got = stripe_preadv(&stripe->members[first]);
+    if (parallel) {
+        pthread_mutex_lock(&stripe->lock);
+        while (stripe->pending > 0) {
+            pthread_cond_wait(&stripe->done, &stripe->lock);
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+
+    // a short or failed member read cuts the run at its first missing block
+    int left[STRIPE_MEMBERS_MAX];
+    for (i = 0; i < stripe->count; i++) {
+        left[i] = stripe->members[i].got;
+    }
+    for (b = 0; b < count; b++) {
+        int m;
+        stripe_map(stripe, bNum + b, &m);
+        if (left[m] < BLOCKSIZE) {
+            break;
+        }
+        left[m] -= BLOCKSIZE;
+    }
+    if (b == 0 && stripe->members[first].got < 0) {
+        return stripe->members[first].got;
+    }
+    return tlbntopbn(b);
+}
+
+int stripe_punch(struct disk *d, int bNum, int count) {
+    struct stripe *stripe = d->state;
+    if (bNum < 0 || bNum + count > stripe->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int i;
+    for (i = 0; i < stripe->count; i++) {
+        int first;
+        int blocks = stripe_span(stripe, bNum, count, i, &first);
+        if (blocks == 0) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        if (fallocate(stripe->members[i].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      tlbntopbn(first), tlbntopbn(blocks)) < 0) {
+            return -(errno);
+        }
+    }
+    return 0;
+}
+
+int stripe_resize(struct disk *d, int nBytes) {
+    struct stripe *stripe = d->state;
+    int size = nBytes / BLOCKSIZE;
+    int i;
+    for (i = 0; i < stripe->count; i++) {
+        disk_stats.syscalls++;
+        if (ftruncate(stripe->members[i].fd, tlbntopbn(stripe_share(stripe, size, i))) < 0) {
+            return -(errno);
+        }
+    }
+    stripe->size = size;
+    return 0;
+}
+
+int stripe_size(struct disk *d) {
+    struct stripe *stripe = d->state;
+    return stripe->size;
+}
+
+int stripe_send(struct disk *d, int bNum, int byte, int count, int outFd) {
+    struct stripe *stripe = d->state;
+    if (bNum < 0 || bNum >= stripe->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int member;
+    int mbn = stripe_map(stripe, bNum, &member);
+    return send_fd(stripe->members[member].fd, tlbntopbn(mbn) + byte, count, outFd);
+}
+
+int stripe_close(struct disk *d) {
+    struct stripe *stripe = d->state;
+    int i;
+    pthread_mutex_lock(&stripe->lock);
+    stripe->quit = true;
+    pthread_cond_broadcast(&stripe->work);
+    pthread_mutex_unlock(&stripe->lock);
+    for (i = 0; i < stripe->threads; i++) {
+        pthread_join(stripe->members[i].thread, NULL);
+    }
+    int err = 0;
+    for (i = 0; i < stripe->count; i++) {
+        if (stripe->members[i].fd >= 0 && close(stripe->members[i].fd) < 0) {
+            err = -(errno);
+        }
+    }
+    pthread_mutex_destroy(&stripe->lock);
+    pthread_cond_destroy(&stripe->work);
+    pthread_cond_destroy(&stripe->done);
+    free(stripe);
+    return err;
+}
+
+static const struct disk_ops stripe_ops = {
+    stripe_read, stripe_write, NULL, stripe_readv, stripe_punch, stripe_resize, stripe_size, stripe_send, stripe_close,
+};
+
+/* name is "stripe:<unit>:<file>,<file>,..." */
+int stripe_open(struct disk *d, char *name, int nBytes) {
+    char *spec = name + strlen(STRIPE_DISK_PREFIX);
+    char *end;
+    long unit = strtol(spec, &end, 10);
+    if (end == spec || *end != ':' || unit <= 0 || unit > INT_MAX / BLOCKSIZE) {
+        return TFS_ERR_INVALID;
+    }
+    struct stripe *stripe = calloc(1, sizeof(struct stripe));
+    if (stripe == NULL) {
+        return TFS_ERR_NO_MEMORY;
+    }
+    stripe->unit = unit;
+    pthread_mutex_init(&stripe->lock, NULL);
+    pthread_cond_init(&stripe->work, NULL);
+    pthread_cond_init(&stripe->done, NULL);
+    d->ops = &stripe_ops;
+    d->state = stripe;
+
+    char path[PATH_MAX];
+    char *next = end + 1;
+    int err = 0;
+    while (err == 0 && *next != '\0') {
+        char *comma = strchr(next, ',');
+        int len = comma != NULL ? comma - next : (int)strlen(next);
+        if (stripe->count == STRIPE_MEMBERS_MAX || len == 0 || len >= PATH_MAX) {
+            err = TFS_ERR_INVALID;
+            break;
+        }
+        memcpy(path, next, len);
+        path[len] = '\0';
+        next += comma != NULL ? len + 1 : len;
+
+        struct stripe_member *member = &stripe->members[stripe->count++];
+        member->fd = open(path, nBytes != 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, S_IRUSR | S_IWUSR);
+        if (member->fd < 0) {
+            err = -(errno);
+        }
+    }
+    if (err == 0 && stripe->count == 0) {
+        err = TFS_ERR_INVALID;
+    }
+    int i;
+    if (err == 0 && nBytes != 0) {
+        err = stripe_resize(d, nBytes);
+    } else {
+        // an existing disk is as big as its members together
+        for (i = 0; err == 0 && i < stripe->count; i++) {
+            off_t size = lseek(stripe->members[i].fd, 0, SEEK_END);
+            if (size < 0) {
+                err = -(errno);
+            }
+            stripe->size += size / BLOCKSIZE;
+        }
+    }
+    if (err < 0) {
+        stripe_close(d);
+        return err;
+    }
+    return 0;
+}
+
+/******************************************************/
+/************** Mirror backend functions **************/
+/******************************************************/
+
+/* one host file holding a full copy of a mirrored disk */
+struct mirror_replica {
+    char *path;
+    /* -1 while it can't be used */
+    int fd;
+    /* missed writes, it is only read again once resynced */
+    bool stale;
+};
+
+/* a disk kept whole on every replica */
+struct mirror {
+    int count;
+    /* in whole blocks */
+    int size;
+    /* the replica the next read starts at, reads go round them all */
+    int next;
+    struct mirror_replica replicas[MIRROR_REPLICAS_MAX];
+};
+
+bool mirror_live(struct mirror *mirror, int replica) {
+    return mirror->replicas[replica].fd >= 0 && !mirror->replicas[replica].stale;
+}
+
+/* takes a replica that failed I/O out until mirrorResync() */
+void mirror_drop(struct mirror *mirror, int replica) {
+    struct mirror_replica *r = &mirror->replicas[replica];
+    dbg("mirror replica %s dropped: %s\n", r->path, strerror(errno));
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    r->fd = -1;
+    r->stale = true;
+}
+
+/* the live replica whose turn it is to be read, or -1 */
+int mirror_pick(struct mirror *mirror) {
+    int i;
+    for (i = 0; i < mirror->count; i++) {
+        int replica = (mirror->next + i) % mirror->count;
+        if (mirror_live(mirror, replica)) {
+            mirror->next = replica + 1;
+            return replica;
+        }
+    }
+    return -1;
+}
+
+/* copies the disk from live replica `from` to stale replica `to`, leaving
+ * blocks of zeros as holes */
+int mirror_copy(struct mirror *mirror, int from, int to) {
+    static const char zeros[BLOCKSIZE];
+    struct mirror_replica *r = &mirror->replicas[to];
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    r->fd = open(r->path, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (r->fd < 0) {
+        return -(errno);
+    }
+    disk_stats.syscalls++;
+    if (ftruncate(r->fd, tlbntopbn(mirror->size)) < 0) {
+        int err = -(errno);
+        mirror_drop(mirror, to);
+        return err;
+    }
+    char block[BLOCKSIZE];
+    int i;
+    for (i = 0; i < mirror->size; i++) {
+        disk_stats.syscalls++;
+        ssize_t got = pread(mirror->replicas[from].fd, block, BLOCKSIZE, tlbntopbn(i));
+        if (got < BLOCKSIZE) {
+            int err = got < 0 ? -(errno) : TFS_ERR_OUT_OF_BOUNDS;
+            mirror_drop(mirror, from);
+            return err;
+        }
+        if (memcmp(block, zeros, BLOCKSIZE) == 0) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        if (pwrite(r->fd, block, BLOCKSIZE, tlbntopbn(i)) < BLOCKSIZE) {
+            int err = errno != 0 ? -(errno) : TFS_ERR_IO;
+            mirror_drop(mirror, to);
+            return err;
+        }
+    }
+    r->stale = false;
+    return 0;
+}
+
+/* resyncs every stale replica from a live one. Returns how many came back,
+ * or the error of the first that couldn't be */
+int mirror_resync(struct mirror *mirror) {
+    int synced = 0;
+    int err = 0;
+    int i;
+    for (i = 0; i < mirror->count; i++) {
+        if (mirror_live(mirror, i)) {
+            continue;
+        }
+        int from = mirror_pick(mirror);
+        if (from < 0) {
+            return TFS_ERR_IO;
+        }
+        int copied = mirror_copy(mirror, from, i);
+        if (copied < 0 && err == 0) {
+            err = copied;
+        }
+        synced += copied == 0;
+    }
+    return err < 0 ? err : synced;
+}
+
+int mirror_read(struct disk *d, int bNum, void *block) {
+    struct mirror *mirror = d->state;
+    if (bNum < 0 || bNum >= mirror->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int replica;
+    while ((replica = mirror_pick(mirror)) >= 0) {
+        disk_stats.syscalls++;
+        ssize_t got = pread(mirror->replicas[replica].fd, block, BLOCKSIZE, tlbntopbn(bNum));
+        if (got == BLOCKSIZE) {
+            return 0;
+        }
+        // a short read is a replica cut short, the others may still have it
+        mirror_drop(mirror, replica);
+    }
+    return TFS_ERR_IO;
+}
+
+int mirror_write(struct disk *d, int bNum, void *block) {
+    struct mirror *mirror = d->state;
+    if (bNum < 0 || bNum >= mirror->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int written = 0;
+    int i;
+    for (i = 0; i < mirror->count; i++) {
+        if (!mirror_live(mirror, i)) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        if (pwrite(mirror->replicas[i].fd, block, BLOCKSIZE, tlbntopbn(bNum)) == BLOCKSIZE) {
+            written++;
+        } else {
+            mirror_drop(mirror, i);
+        }
+    }
+    return written > 0 ? 0 : TFS_ERR_IO;
+}
+
+int mirror_writev(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    struct mirror *mirror = d->state;
+    ssize_t bytes = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        bytes += iov[i].iov_len;
+    }
+    if (bNum < 0 || tlbntopbn(bNum) + bytes > tlbntopbn(mirror->size)) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int written = 0;
+    for (i = 0; i < mirror->count; i++) {
+        if (!mirror_live(mirror, i)) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        if (pwritev(mirror->replicas[i].fd, iov, iovcnt, tlbntopbn(bNum)) == bytes) {
+            written++;
+        } else {
+            mirror_drop(mirror, i);
+        }
+    }
+    return written > 0 ? 0 : TFS_ERR_IO;
+}
+
+int mirror_readv(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    struct mirror *mirror = d->state;
+    int replica;
+    while ((replica = mirror_pick(mirror)) >= 0) {
+        disk_stats.syscalls++;
+        ssize_t got = preadv(mirror->replicas[replica].fd, iov, iovcnt, tlbntopbn(bNum));
+        if (got >= 0) {
+            return got;
+        }
+        mirror_drop(mirror, replica);
+    }
+    return TFS_ERR_IO;
+}
+
+/* a replica that can't punch keeps its old data, the caller zeroes the
+ * blocks with writes when this fails */
+int mirror_punch(struct disk *d, int bNum, int count) {
+    struct mirror *mirror = d->state;
+    if (bNum < 0 || bNum + count > mirror->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int err = 0;
+    int i;
+    for (i = 0; i < mirror->count; i++) {
+        if (!mirror_live(mirror, i)) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        if (fallocate(mirror->replicas[i].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      tlbntopbn(bNum), tlbntopbn(count)) < 0 && err == 0) {
+            err = -(errno);
+        }
+    }
+    return err;
+}
+
+int mirror_resize(struct disk *d, int nBytes) {
+    struct mirror *mirror = d->state;
+    int resized = 0;
+    int i;
+    for (i = 0; i < mirror->count; i++) {
+        if (!mirror_live(mirror, i)) {
+            continue;
+        }
+        disk_stats.syscalls++;
+        if (ftruncate(mirror->replicas[i].fd, nBytes) == 0) {
+            resized++;
+        } else {
+            mirror_drop(mirror, i);
+        }
+    }
+    if (resized == 0) {
+        return TFS_ERR_IO;
+    }
+    mirror->size = nBytes / BLOCKSIZE;
+    return 0;
+}
+
+int mirror_size(struct disk *d) {
+    struct mirror *mirror = d->state;
+    return mirror->size;
+}
+
+int mirror_send(struct disk *d, int bNum, int byte, int count, int outFd) {
+    struct mirror *mirror = d->state;
+    if (bNum < 0 || bNum >= mirror->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    int replica = mirror_pick(mirror);
+    if (replica < 0) {
+        return TFS_ERR_IO;
+    }
+    return send_fd(mirror->replicas[replica].fd, tlbntopbn(bNum) + byte, count, outFd);
+}
+
+int mirror_close(struct disk *d) {
+    struct mirror *mirror = d->state;
+    int err = 0;
+    int i;
+    for (i = 0; i < mirror->count; i++) {
+        if (mirror->replicas[i].fd >= 0 && close(mirror->replicas[i].fd) < 0) {
+            err = -(errno);
+        }
+        free(mirror->replicas[i].path);
+    }
+    free(mirror);
+    return err;
+}
+
+static const struct disk_ops mirror_ops = {
+    mirror_read, mirror_write, mirror_writev, mirror_readv, mirror_punch, mirror_resize, mirror_size, mirror_send, mirror_close,
+};
+
+/* name is "mirror:<file>,<file>,..." */
+int mirror_open(struct disk *d, char *name, int nBytes) {
+    struct mirror *mirror = calloc(1, sizeof(struct mirror));
+    if (mirror == NULL) {
+        return TFS_ERR_NO_MEMORY;
+    }
+    d->ops = &mirror_ops;
+    d->state = mirror;
+
+    char *next = name + strlen(MIRROR_DISK_PREFIX);
+    int err = 0;
+    while (err == 0 && *next != '\0') {
+        char *comma = strchr(next, ',');
+        int len = comma != NULL ? comma - next : (int)strlen(next);
+        if (mirror->count == MIRROR_REPLICAS_MAX || len == 0) {
+            err = TFS_ERR_INVALID;
+            break;
+        }
+        struct mirror_replica *r = &mirror->replicas[mirror->count++];
+        r->fd = -1;
+        if ((r->path = strndup(next, len)) == NULL) {
+            err = TFS_ERR_NO_MEMORY;
+            break;
+        }
+        next += comma != NULL ? len + 1 : len;
+        // one that can't be opened is left out, the others carry the disk
+        r->fd = open(r->path, nBytes != 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, S_IRUSR | S_IWUSR);
+        if (r->fd < 0 || (nBytes != 0 && ftruncate(r->fd, nBytes) < 0)) {
+            mirror_drop(mirror, mirror->count - 1);
+        }
+    }
+    if (err == 0 && mirror->count == 0) {
+        err = TFS_ERR_INVALID;
+    }
+
+    // an existing disk is the size most replicas have, the rest missed
+    // writes (or a resize) and are copied over again
+    off_t sizes[MIRROR_REPLICAS_MAX];
+    int best = -1;
+    int votes = 0;
+    int i;
+    int j;
+    for (i = 0; err == 0 && i < mirror->count; i++) {
+        sizes[i] = -1;
+        if (mirror_live(mirror, i)) {
+            sizes[i] = nBytes != 0 ? nBytes : lseek(mirror->replicas[i].fd, 0, SEEK_END);
+        }
+    }
+    for (i = 0; err == 0 && i < mirror->count; i++) {
+        int same = 0;
+        for (j = 0; sizes[i] >= 0 && j < mirror->count; j++) {
+            same += sizes[j] == sizes[i];
+        }
+        if (same > votes) {
+            best = i;
+            votes = same;
+        }
+    }
+    if (err == 0 && best < 0) {
+        // not one replica can be opened
+        err = TFS_ERR_NO_DISK;
+    }
+    if (err == 0) {
+        mirror->size = sizes[best] / BLOCKSIZE;
+        for (i = 0; i < mirror->count; i++) {
+            if (sizes[i] != sizes[best]) {
+                mirror->replicas[i].stale = true;
+            }
+        }
+        // one that can't be resynced now stays out until mirrorResync()
+        mirror_resync(mirror);
+    }
+    if (err < 0) {
+        mirror_close(d);
+        return err;
+    }
+    return 0;
+}
+
+int mirrorResync(int disk) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL || d->ops != &mirror_ops) {
+        return TFS_ERR_INVALID;
+    }
+    // replicas are copied from what's on the disk, not what's cached
+    int err = d->wb != NULL ? flushDisk(disk) : 0;
+    if (err < 0) {
+        return err;
+    }
+    io_lock();
+    err = mirror_resync(d->state);
+    io_unlock();
+    return err;
+}
+
+int mirrorLive(int disk) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL || d->ops != &mirror_ops) {
+        return TFS_ERR_INVALID;
+    }
+    struct mirror *mirror = d->state;
+    int live = 0;
+    int i;
+    io_lock();
+    for (i = 0; i < mirror->count; i++) {
+        live += mirror_live(mirror, i);
+    }
+    io_unlock();
+    return live;
+}
+
+/******************************************************/
+/************** Direct backend functions **************/
+/******************************************************/
+
+/* strictest alignment direct I/O is assumed to need when the host doesn't say */
+#define DIRECT_ALIGN_MAX 4096
+/* the longest stretch one pooled buffer takes, longer requests are split */
+#define DIRECT_CHUNK (READAHEAD_BLOCKS_MAX * BLOCKSIZE)
+#define DIRECT_BUFFER_SIZE (DIRECT_CHUNK + 2 * DIRECT_ALIGN_MAX)
+/* idle buffers kept for reuse */
+#define DIRECT_POOL_MAX 8
+
+/* a disk on a host file opened with O_DIRECT */
+struct direct {
+    /* offsets and lengths of host I/O are multiples of this */
+    int align;
+    /* in whole blocks */
+    int size;
+    /* a read-modify-write of one sector must not interleave with another */
+    pthread_mutex_t lock;
+};
+
+/* aligned buffers shared by every direct disk */
+static struct {
+    pthread_mutex_t lock;
+    void *buffers[DIRECT_POOL_MAX];
+    int count;
+} direct_pool = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+
+void *direct_buffer_get(void) {
+    void *buffer = NULL;
+    pthread_mutex_lock(&direct_pool.lock);
+    if (direct_pool.count > 0) {
+        buffer = direct_pool.buffers[--direct_pool.count];
+    }
+    pthread_mutex_unlock(&direct_pool.lock);
+    if (buffer == NULL && posix_memalign(&buffer, DIRECT_ALIGN_MAX, DIRECT_BUFFER_SIZE) != 0) {
+        return NULL;
+    }
+    return buffer;
+}
+
+void direct_buffer_put(void *buffer) {
+    pthread_mutex_lock(&direct_pool.lock);
+    if (direct_pool.count < DIRECT_POOL_MAX) {
+        direct_pool.buffers[direct_pool.count++] = buffer;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&direct_pool.lock);
+    free(buffer);
+}
+
+/* Reads or writes `len` bytes at `offset` through a pooled buffer covering
+ * the aligned sectors around them. A write that doesn't cover whole
+ * sectors reads them first (read-modify-write) */
+int direct_chunk(struct disk *d, char *buffer, off_t offset, char *data, int len, bool write) {
+    struct direct *direct = d->state;
+    off_t start = offset - offset % direct->align;
+    off_t end = (offset + len + direct->align - 1) / direct->align * direct->align;
+    int span = end - start;
+    bool whole = start == offset && end == offset + len;
+    if (!write || !whole) {
+        disk_stats.syscalls++;
+        ssize_t got = pread(d->fd, buffer, span, start);
+        if (got < 0) {
+            return -(errno);
+        }
+        if (got < offset + len - start) {
+            return TFS_ERR_OUT_OF_BOUNDS;
+        }
+    }
+    if (!write) {
+        memcpy(data, buffer + (offset - start), len);
+        return 0;
+    }
+    memcpy(buffer + (offset - start), data, len);
+    disk_stats.syscalls++;
+    if (pwrite(d->fd, buffer, span, start) != span) {
+        return TFS_ERR_IO;
+    }
+    return 0;
+}
+
+/* moves `count` blocks between `data` and the disk from block bNum on */
+int direct_io(struct disk *d, int bNum, char *data, int count, bool write) {
+    struct direct *direct = d->state;
+    if (bNum < 0 || count < 0 || bNum + count > direct->size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    char *buffer = direct_buffer_get();
+    if (buffer == NULL) {
+        return TFS_ERR_NO_MEMORY;
+    }
+    pthread_mutex_lock(&direct->lock);
+    int err = 0;
+    int done;
+    for (done = 0; err == 0 && done < tlbntopbn(count); done += DIRECT_CHUNK) {
+        int len = tlbntopbn(count) - done < DIRECT_CHUNK ? tlbntopbn(count) - done : DIRECT_CHUNK;
+        err = direct_chunk(d, buffer, (off_t)tlbntopbn(bNum) + done, data + done, len, write);
+    }
+    pthread_mutex_unlock(&direct->lock);
+    direct_buffer_put(buffer);
+    return err;
+}
+
+int direct_read(struct disk *d, int bNum, void *block) {
+    return direct_io(d, bNum, block, 1, false);
+}
+
+int direct_write(struct disk *d, int bNum, void *block) {
+    return direct_io(d, bNum, block, 1, true);
+}
+
+/* iov comes from libDisk itself, in whole blocks */
+int direct_writev(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        int err = direct_io(d, bNum, iov[i].iov_base, iov[i].iov_len / BLOCKSIZE, true);
+        if (err < 0) {
+            return err;
+        }
+        bNum += iov[i].iov_len / BLOCKSIZE;
+    }
+    return 0;
+}
+
+/* readahead asks for blocks past the end too, which are left out */
+int direct_readv(struct disk *d, int bNum, struct iovec *iov, int iovcnt) {
+    struct direct *direct = d->state;
+    int got = 0;
+    int i;
+    for (i = 0; i < iovcnt && bNum < direct->size; i++) {
+        int count = iov[i].iov_len / BLOCKSIZE;
+        if (count > direct->size - bNum) {
+            count = direct->size - bNum;
+        }
+        int err = direct_io(d, bNum, iov[i].iov_base, count, false);
+        if (err < 0) {
+            return err;
+        }
+        got += tlbntopbn(count);
+        bNum += count;
+    }
+    return got;
+}
+
+/* the host file is kept a whole number of sectors long, so the last block
+ * can be written with aligned I/O */
+int direct_resize(struct disk *d, int nBytes) {
+    struct direct *direct = d->state;
+    off_t bytes = ((off_t)nBytes + direct->align - 1) / direct->align * direct->align;
+    disk_stats.syscalls++;
+    if (ftruncate(d->fd, bytes) < 0) {
+        return -(errno);
+    }
+    direct->size = nBytes / BLOCKSIZE;
+    return 0;
+}
+
+int direct_size(struct disk *d) {
+    struct direct *direct = d->state;
+    return direct->size;
+}
+
+int direct_close(struct disk *d) {
+    struct direct *direct = d->state;
+    pthread_mutex_destroy(&direct->lock);
+    free(direct);
+    return close(d->fd);
+}
+
+/* no sendfile, the page cache is what this backend keeps out of */
+static const struct disk_ops direct_ops = {
+    direct_read, direct_write, direct_writev, direct_readv, file_punch, direct_resize, direct_size, NULL,
+    direct_close,
+};
+
+/* name is "direct:<file>". Where the host file system can't do O_DIRECT the
+ * file is opened like any other */
+int direct_open(struct disk *d, char *name, int nBytes) {
+    char *path = name + strlen(DIRECT_DISK_PREFIX);
+    int flags = O_RDWR | O_DIRECT;
+    if (nBytes != 0) {
+        flags = flags | O_CREAT | O_TRUNC;
+    }
+    int fd = open(path, flags, S_IRUSR | S_IWUSR);
+    if (fd < 0 && errno == EINVAL) {
+        return file_open(d, path, nBytes);
+    }
+    if (fd < 0) {
+        return -(errno);
+    }
+    int align = DIRECT_ALIGN_MAX;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+        // no alignment means the file system can't do direct I/O on this file
+        // after all, one stricter than the pool's buffers isn't worth it
+        if (stx.stx_dio_offset_align == 0 || stx.stx_dio_offset_align > DIRECT_ALIGN_MAX
+                || stx.stx_dio_mem_align > DIRECT_ALIGN_MAX) {
+            close(fd);
+            return file_open(d, path, nBytes);
+        }
+        align = stx.stx_dio_offset_align;
+    }
+#endif
+    struct direct *direct = calloc(1, sizeof(struct direct));
+    if (direct == NULL) {
+        close(fd);
+        return TFS_ERR_NO_MEMORY;
+    }
+    direct->align = align;
+    pthread_mutex_init(&direct->lock, NULL);
+    d->ops = &direct_ops;
+    d->fd = fd;
+    d->state = direct;
+    int err = 0;
+    if (nBytes != 0) {
+        err = direct_resize(d, nBytes);
+    } else {
+        disk_stats.syscalls++;
+        off_t size = lseek(fd, 0, SEEK_END);
+        err = size < 0 ? -(errno) : 0;
+        direct->size = size / BLOCKSIZE;
+        // a file written without O_DIRECT may end part way into a sector
+        if (err == 0 && size % align != 0) {
+            err = direct_resize(d, tlbntopbn(direct->size));
+        }
+    }
+    if (err < 0) {
+        direct_close(d);
+        return err;
+    }
+    return 0;
+}
+
+int isDirect(int disk) {
+    struct disk *d = disk_get(disk);
+    if (d == NULL) {
+        return -1;
+    }
+    return d->ops == &direct_ops;
+}
+
+int seek_inbounds(int disk, off_t offset) {
+    int err;
+    off_t size;
+    disk_stats.syscalls++;
+    if ((err = size = lseek(disk, 0, SEEK_END)) < 0) {
+        return err;
+    }
+    size = size - (size % BLOCKSIZE);
+    if (offset > size) {
+        return TFS_ERR_OUT_OF_BOUNDS;
+    }
+    disk_stats.syscalls++;
+    if ((err = lseek(disk, offset, SEEK_SET)) < 0) {
+        return err;
+    }
+    return 0;
+}
+
+
 int tlbntopbn(int lbn) {
     return lbn * BLOCKSIZE;
 }
@@ -2,6 +2,9 @@
 #define LIBDISK_H
 
 #include "tinyFS.h"
+
+/* most blocks the readahead buffer holds */
+#define READAHEAD_BLOCKS_MAX 64
 /**
  * This functions opens a regular UNIX file and designates the first 
  * nBytes of it as space for the emulated disk. If nBytes is not exactly a 
@@ -16,11 +19,101 @@
  */
 int openDisk(char *filename, int nBytes);
 
+/* filenames starting with this open a RAM disk, e.g. "ram:scratch". A RAM
+ * disk lives in memory under its full name until ramDiskDrop(), so it can be
+ * closed and opened again with nBytes 0 like a file, and gets zeroed and
+ * resized by an open with nBytes > 0 */
+#define RAM_DISK_PREFIX "ram:"
+
+/**
+ * ramDiskSnapshot() has every closeDisk() of the RAM disk `name` save its
+ * image to the host file `path`, which then opens as a regular disk. Blocks
+ * of zeros are left as holes. NULL stops saving. Returns 0, or -ENOENT for
+ * a RAM disk that doesn't exist.
+ */
+int ramDiskSnapshot(char *name, char *path);
+
+/**
+ * ramDiskDrop() frees the RAM disk `name`. Returns 0, -ENOENT for a RAM
+ * disk that doesn't exist or -EBUSY while it is open.
+ */
+int ramDiskDrop(char *name);
+
+/* filenames starting with this open a disk striped over several host files,
+ * "stripe:<unit>:<file>,<file>,...". Block bNum is in stripe unit
+ * bNum / unit, which goes to file (bNum / unit) % files. Each file holds its
+ * share of nBytes, reopening with nBytes 0 needs the same unit and files in
+ * the same order. Readahead reads every file's part of a run at once, each
+ * on its own thread */
+#define STRIPE_DISK_PREFIX "stripe:"
+/* most files a disk can be striped over */
+#define STRIPE_MEMBERS_MAX 16
+
+/* filenames starting with this open a disk mirrored on several host files,
+ * "mirror:<file>,<file>,...". Writes go to every replica, reads take turns
+ * among them. A replica whose I/O fails is taken out and the disk carries on
+ * with the rest; openDisk() leaves out ones it can't open and copies the
+ * disk onto any that is missing or a different size than most */
+#define MIRROR_DISK_PREFIX "mirror:"
+/* most replicas of a mirrored disk */
+#define MIRROR_REPLICAS_MAX 8
+
+/**
+ * mirrorResync() copies the mirrored disk onto every replica that was taken
+ * out, recreating its file, and puts them back in. Returns how many came
+ * back or the error of the first that couldn't, -EINVAL if `disk` isn't
+ * mirrored.
+ */
+int mirrorResync(int disk);
+
+/**
+ * mirrorLive() returns how many replicas of the mirrored `disk` are in use,
+ * -EINVAL if it isn't mirrored.
+ */
+int mirrorLive(int disk);
+
+/* filenames starting with this open the host file after it with O_DIRECT,
+ * "direct:<file>", so its blocks aren't kept in the host page cache as well
+ * as by the caller. Host I/O goes through a pool of aligned buffers and
+ * covers whole sectors; writing a block that doesn't fill its sectors reads
+ * them first. The host file is kept a whole number of sectors long. Where
+ * the host file system can't do O_DIRECT the file is opened buffered, like
+ * one named without the prefix */
+#define DIRECT_DISK_PREFIX "direct:"
+
+/**
+ * isDirect() tells whether `disk` does direct I/O, 0 for one that was opened
+ * buffered, including a direct: disk the host couldn't open with O_DIRECT.
+ * -1 if the disk isn't open.
+ */
+int isDirect(int disk);
+
 /**
  * self explanatory
  */
 int closeDisk(int disk); 
 
+/**
+ * diskWriteBack() has writes to `disk` cached instead of written through:
+ * writeBlock() copies the block into a table of up to `blocks` dirty blocks
+ * and returns, and a thread of the disk's own writes them out once
+ * `dirtyPct` percent of the table is dirty or its oldest block has waited
+ * `ageMs` milliseconds. It writes the whole table at a time in block order,
+ * each run of adjacent blocks with one host write. A write to a full table
+ * waits for room. Reads see cached blocks, punchBlocks() and resizeDisk()
+ * drop the ones they cut off. `blocks` 0 writes everything out and turns
+ * caching off again; closeDisk() does too. Returns 0 or a negative error,
+ * the error of a background write that failed where there was one.
+ */
+int diskWriteBack(int disk, int blocks, int dirtyPct, int ageMs);
+
+/**
+ * flushDisk() waits until every cached write to `disk` is on the host.
+ * Returns 0, or the first error a background write ran into since the last
+ * flushDisk() (those blocks are lost).
+ */
+int flushDisk(int disk);
+
 /** readBlock() reads an entire block of BLOCKSIZE bytes from the open 
  * disk (identified by ‘disk’) and copies the result into a local buffer 
  * (must be at least of BLOCKSIZE bytes). The bNum is a logical block 
@@ -46,4 +139,87 @@ int readBlock(int disk, int bNum, void *block);
  */
 int writeBlock(int disk, int bNum, void *block); 
 
+/**
+ * writeBlocks() writes `count` consecutive blocks held back to back in
+ * `blocks`, starting at block `bNum`, with one host write where the backend
+ * allows it (a striped disk writes them one at a time). Counts as one write
+ * in diskStats(). Returns 0 or a negative error, on failure some of the
+ * blocks may have been written.
+ */
+int writeBlocks(int disk, int bNum, int count, void *blocks);
+
+/**
+ * punchBlocks() releases `count` blocks starting at block `bNum` to the host
+ * (fallocate PUNCH_HOLE). The blocks read back as zeros and the disk keeps
+ * its size. Returns 0 on success or a negative errno, -EOPNOTSUPP when the
+ * host file system can't punch holes.
+ */
+int punchBlocks(int disk, int bNum, int count);
+
+/**
+ * resizeDisk() grows or shrinks the open disk to nBytes. Blocks added at
+ * the end read as zeros, blocks cut off are lost. Returns 0 or a negative
+ * error.
+ */
+int resizeDisk(int disk, int nBytes);
+
+/**
+ * sendBlock() copies `count` bytes starting at byte `byte` of block `bNum`
+ * to the host file descriptor `outFd` (a file, pipe or socket) without
+ * copying them through user space where the host allows it. Returns 0 once
+ * all of them are written or a negative error.
+ */
+int sendBlock(int disk, int bNum, int byte, int count, int outFd);
+
+/**
+ * readaheadBlocks() reads `count` blocks starting at block `bNum` into a
+ * readahead buffer with one read, so the readBlock() calls that follow are
+ * served from memory. At most READAHEAD_BLOCKS_MAX blocks are kept; blocks
+ * past the end of the disk are skipped. writeBlock() updates buffered copies
+ * and punchBlocks(), resizeDisk() and closeDisk() drop them, so the buffer
+ * never returns stale data. Returns the number of blocks read or a negative
+ * error.
+ */
+int readaheadBlocks(int disk, int bNum, int count);
+
+/**
+ * isReadAhead() tells whether readBlock() would serve block `bNum` from the
+ * readahead buffer.
+ */
+int isReadAhead(int disk, int bNum);
+
+/* block I/O this library issued to the host since the program started,
+ * write-back flushes included */
+struct disk_stats {
+    /* host reads and writes, a readahead run counts as one read */
+    long reads;
+    long writes;
+    long blocks_read;
+    long blocks_written;
+    /* every call into the host kernel, seeks included */
+    long syscalls;
+};
+
+/**
+ * diskStats() copies the I/O counters into `stats`. Reads served from the
+ * readahead buffer aren't counted, they never reach the host.
+ */
+void diskStats(struct disk_stats *stats);
+
+/* what a disk trace callback is told about */
+#define DISK_TRACE_READ 1
+#define DISK_TRACE_WRITE 2
+#define DISK_TRACE_READAHEAD 3
+#define DISK_TRACE_PUNCH 4
+#define DISK_TRACE_RESIZE 5
+#define DISK_TRACE_SEND 6
+
+/**
+ * setDiskTrace() has `trace` called after every block I/O that reaches the
+ * host with the DISK_TRACE_* kind, the first block and the block count
+ * (the new size in blocks for a resize). NULL turns it off. Writes to a disk
+ * with write-back on are traced when they're made, not when they're flushed.
+ */
+void setDiskTrace(void (*trace)(int disk, int kind, int bNum, int count));
+
 #endif
@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "libLZ.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+/* like LZ4, the last bytes are always literals so matching never reads past the end */
+#define LZ_TAIL_LITERALS 5
+
+static uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* writes the 255-run extension of a length that overflowed its nibble */
+static int writeLength(char *dst, int pos, int dstCap, int len) {
+    while (len >= 255) {
+        if (pos >= dstCap)
+            return -1;
+        dst[pos++] = (char)255;
+        len -= 255;
+    }
+    if (pos >= dstCap)
+        return -1;
+    dst[pos++] = (char)len;
+    return pos;
+}
+
+static int writeSequence(char *dst, int pos, int dstCap, const char *lit, int litLen, int offset, int matchLen) {
+    if (pos >= dstCap)
+        return -1;
+    int token = pos++;
+    int litNibble = litLen < 15 ? litLen : 15;
+    int matchNibble = 0;
+    if (matchLen > 0)
+        matchNibble = matchLen - LZ_MIN_MATCH < 15 ? matchLen - LZ_MIN_MATCH : 15;
+    dst[token] = (char)((litNibble << 4) | matchNibble);
+    if (litLen >= 15 && (pos = writeLength(dst, pos, dstCap, litLen - 15)) < 0)
+        return -1;
+    if (pos + litLen > dstCap)
+        return -1;
+    memcpy(&dst[pos], lit, litLen);
+    pos += litLen;
+    if (matchLen == 0)
+        return pos;
+    if (pos + 2 > dstCap)
+        return -1;
+    dst[pos++] = (char)(offset & 0xff);
+    dst[pos++] = (char)(offset >> 8);
+    if (matchLen - LZ_MIN_MATCH >= 15 && (pos = writeLength(dst, pos, dstCap, matchLen - LZ_MIN_MATCH - 15)) < 0)
+        return -1;
+    return pos;
+}
+
+int lzCompress(const char *src, int srcLen, char *dst, int dstCap) {
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+
+    int pos = 0;
+    int anchor = 0;
+    int ip = 0;
+    int limit = srcLen - LZ_TAIL_LITERALS - LZ_MIN_MATCH;
+    while (ip < limit) {
+        uint32_t seq = read32(&src[ip]);
+        int h = hash32(seq);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || read32(&src[ref]) != seq) {
+            ip++;
+            continue;
+        }
+        int matchLen = LZ_MIN_MATCH;
+        while (ip + matchLen < srcLen - LZ_TAIL_LITERALS && src[ref + matchLen] == src[ip + matchLen])
+            matchLen++;
+        pos = writeSequence(dst, pos, dstCap, &src[anchor], ip - anchor, ip - ref, matchLen);
+        if (pos < 0)
+            return -1;
+        ip += matchLen;
+        anchor = ip;
+    }
+    return writeSequence(dst, pos, dstCap, &src[anchor], srcLen - anchor, 0, 0);
+}
+
+/* reads the 255-run extension of a length, -1 if src runs out */
+static int readLength(const char *src, int *pos, int srcLen) {
+    int len = 0;
+    uint8_t b;
+    do {
+        if (*pos >= srcLen)
+            return -1;
+        b = (uint8_t)src[(*pos)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+int lzDecompress(const char *src, int srcLen, char *dst, int dstCap) {
+    int pos = 0;
+    int op = 0;
+    while (pos < srcLen) {
+        uint8_t token = (uint8_t)src[pos++];
+        int litLen = token >> 4;
+        if (litLen == 15) {
+            int ext = readLength(src, &pos, srcLen);
+            if (ext < 0)
+                return -1;
+            litLen += ext;
+        }
+        if (pos + litLen > srcLen || op + litLen > dstCap)
+            return -1;
+        memcpy(&dst[op], &src[pos], litLen);
+        pos += litLen;
+        op += litLen;
+        if (pos == srcLen)
+            break;
+
+        if (pos + 2 > srcLen)
+            return -1;
+        int offset = (uint8_t)src[pos] | ((uint8_t)src[pos + 1] << 8);
+        pos += 2;
+        int matchLen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int ext = readLength(src, &pos, srcLen);
+            if (ext < 0)
+                return -1;
+            matchLen += ext;
+        }
+        if (offset == 0 || offset > op || op + matchLen > dstCap)
+            return -1;
+        // byte at a time since the match may overlap what it is copying
+        int i;
+        for (i = 0; i < matchLen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
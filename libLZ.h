@@ -0,0 +1,26 @@
+#ifndef LIBLZ_H
+#define LIBLZ_H
+
+/**
+ * A small LZ77 block compressor using the LZ4 block format: a sequence of
+ * (token, literals, offset, match) groups where the token's high nibble is the
+ * literal count and the low nibble the match length - 4, both extended with
+ * 255 bytes when they hit 15. Offsets are two bytes little endian. The last
+ * sequence carries literals only.
+ */
+
+/**
+ * lzCompress() compresses srcLen bytes of src into dst. Returns the
+ * compressed length, or -1 if it would not fit in dstCap bytes. Callers
+ * that only want a win should pass dstCap < srcLen.
+ */
+int lzCompress(const char *src, int srcLen, char *dst, int dstCap);
+
+/**
+ * lzDecompress() expands srcLen bytes of compressed src into dst, which
+ * must hold dstCap bytes. Returns the decompressed length or -1 if src is
+ * malformed or does not fit.
+ */
+int lzDecompress(const char *src, int srcLen, char *dst, int dstCap);
+
+#endif
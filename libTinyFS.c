@@ -5,8 +5,12 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "libDisk.h"
+#include "libLZ.h"
 #include "libTinyFS.h"
 #include "TinyFS_errno.h"
 
@@ -14,18 +18,23 @@
 
 #define TFS_OPEN_FILES_MAX 65535
 #define TFS_FILE_SIZE_MAX 65535
-#define TFS_FILE_NAME_LEN_MAX 8
+#define TFS_BLOCK_COUNT_MAX 65536
 
 #define TFS_BLOCK_TYPE_SUPER 1
 #define TFS_BLOCK_TYPE_INODE 2
 #define TFS_BLOCK_TYPE__DATA 3
 #define TFS_BLOCK_TYPE__FREE 4
+#define TFS_BLOCK_TYPE___DIR 5
+#define TFS_BLOCK_TYPE__DENT 6
+#define TFS_BLOCK_TYPE__REFS 7
+#define TFS_BLOCK_TYPE__INDX 8
 
 #define TFS_BLOCK_SUPER_INDEX 0
+/* the superblock doubles as the root directory */
+#define TFS_BLOCK__ROOT_INDEX TFS_BLOCK_SUPER_INDEX
 
 #define TFS_BLOCK__FILE_SIZE_DATA 252
 #define TFS_BLOCK_INODE_SIZE_SIZE 2
-#define TFS_BLOCK_INODE_SIZE_NAME 9
 #define TFS_BLOCK_INODE_SIZE_TIME 8
 
 #define TFS_BLOCK_EVERY_POS__TYPE 0
@@ -33,10 +42,81 @@
 #define TFS_BLOCK_EVERY_POS__ADDR 2
 #define TFS_BLOCK__FILE_POS__DATA 4
 #define TFS_BLOCK_INODE_POS__SIZE 4
-#define TFS_BLOCK_INODE_POS__NAME 6
-#define TFS_BLOCK_INODE_POS_MTIME (TFS_BLOCK_INODE_POS__NAME + TFS_BLOCK_INODE_SIZE_NAME)
+#define TFS_BLOCK_INODE_POS_MTIME (TFS_BLOCK_INODE_POS__SIZE + TFS_BLOCK_INODE_SIZE_SIZE)
 #define TFS_BLOCK_INODE_POS_ATIME (TFS_BLOCK_INODE_POS_MTIME + TFS_BLOCK_INODE_SIZE_TIME)
 #define TFS_BLOCK_INODE_POS_CTIME (TFS_BLOCK_INODE_POS_ATIME + TFS_BLOCK_INODE_SIZE_TIME)
+#define TFS_BLOCK_INODE_POS_LINKS (TFS_BLOCK_INODE_POS_CTIME + TFS_BLOCK_INODE_SIZE_TIME)
+#define TFS_BLOCK___DIR_POS_PARENT (TFS_BLOCK_INODE_POS_LINKS + TFS_BLOCK_INODE_SIZE_SIZE)
+#define TFS_BLOCK_INODE_POS_FLAGS (TFS_BLOCK___DIR_POS_PARENT + TFS_BLOCK_INODE_SIZE_SIZE)
+#define TFS_BLOCK_INODE_POS_PSIZE (TFS_BLOCK_INODE_POS_FLAGS + 1)
+/* blocks tfs_fallocate reserved - the chain is kept at least this long */
+#define TFS_BLOCK_INODE_POS_RESRV (TFS_BLOCK_INODE_POS_PSIZE + TFS_BLOCK_INODE_SIZE_SIZE)
+
+/* inode flag bits below 0x40 are the TFS_FLAG_* policy bits from libTinyFS.h,
+ * the ones above describe how the current content is laid out */
+#define TFS_INODE_FLAG_COMPRESSED 0x80
+#define TFS_INODE_FLAG_INDEXED 0x40
+#define TFS_INODE_FLAGS_LAYOUT (TFS_INODE_FLAG_COMPRESSED | TFS_INODE_FLAG_INDEXED)
+
+/* Compressed files store a stream of independently compressed frames of up to
+ * TFS_COMPRESS_FRAME logical bytes in the payload of their chain. The stream
+ * starts with the u16 end offset of every frame. A frame whose stored length
+ * equals its logical length was incompressible and is kept raw */
+#define TFS_COMPRESS_FRAME (16 * TFS_BLOCK__FILE_SIZE_DATA)
+#define TFS_COMPRESS_FRAMES_MAX ((TFS_FILE_SIZE_MAX + TFS_COMPRESS_FRAME - 1) / TFS_COMPRESS_FRAME)
+#define TFS_ZCACHE_ENTRIES 4
+
+#define TFS_READAHEAD_DEFAULT 8
+
+#define TFS_STREAM_BATCH 8
+
+/* tfs_clean works on segments of this many blocks, and moves the live
+ * blocks out of those where no more than TFS_LOG_CLEAN_LIVE_PCT percent
+ * are live */
+#define TFS_LOG_SEGMENT_BLOCKS 64
+#define TFS_LOG_CLEAN_LIVE_PCT 50
+
+/* Directory entries are 32 bytes: inode addr, inode block type, NUL padded name.
+ * Directory blocks (the superblock for root, or a __DIR inode) keep the first
+ * TFS_BLOCK___DIR_SLOTS entries inline and chain overflow _DENT blocks off of
+ * TFS_BLOCK___DIR_POS__NEXT. _DENT blocks chain through the usual addr field */
+#define TFS_DIRENT_SIZE 32
+#define TFS_DIRENT_POS_INODE 0
+#define TFS_DIRENT_POS__TYPE 2
+#define TFS_DIRENT_POS__NAME 3
+#define TFS_BLOCK___DIR_POS__NEXT 62
+#define TFS_BLOCK___DIR_POS__ENTS 64
+#define TFS_BLOCK___DIR_SLOTS 6
+#define TFS_BLOCK__DENT_POS__ENTS 4
+#define TFS_BLOCK__DENT_SLOTS 7
+
+/* Blocks referenced by more than one file (clones, snapshots) are listed in a
+ * chain of _REFS blocks as (block, extra references) pairs. Every other
+ * allocated block implicitly has a single reference. A reference to a data
+ * block covers the block and the rest of the chain after it */
+#define TFS_BLOCK_SUPER_POS__REFS 4
+#define TFS_BLOCK__REFS_POS__ENTS 4
+#define TFS_BLOCK__REFS_SIZE__ENT 4
+#define TFS_BLOCK__REFS_SLOTS 63
+
+/* Blocks at or past the superblock's high-water mark have never been written.
+ * tfs_mkfs only writes the superblock onto a sparse image, so those blocks
+ * read back as zeros and are handed out once the free list runs dry. Images
+ * without a block count predate this and have every block formatted */
+#define TFS_BLOCK_SUPER_POS___HWM 6
+#define TFS_BLOCK_SUPER_POS_COUNT 10
+
+/* Deduplicated (indexed) files don't chain their data blocks. The inode's addr
+ * points at a chain of _INDX blocks listing the data blocks in order, and every
+ * data block stands alone (next addr 0) so any number of index slots can share
+ * it through the refs table. A 0 entry is a hole that reads as zeros. Data blocks of indexed files are found by content
+ * through an in-memory hash index that is rebuilt at mount */
+#define TFS_BLOCK__INDX_POS__ENTS 4
+#define TFS_BLOCK__INDX_SLOTS 126
+#define TFS_FILE_BLOCKS_MAX ((TFS_FILE_SIZE_MAX + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA)
+#define TFS_DEDUP_BUCKETS 16384
+
+#define TFS_DCACHE_BUCKETS_MIN 256
 
 
 #ifndef FAIL_MACRO
@@ -99,54 +179,316 @@ void tfs_write_tstamp(char* block, enum tstamp tstamp, time_t t);
 void tfs_write_tstamp_now(char* block, enum tstamp tstamp);
 uint64_t tfs_read_tstamp(char* block, enum tstamp tstamp);
 void tfs_read_tstamp_into(char* block, enum tstamp tstamp, uint64_t* t);
+int tfs_block_alloc(addr_t* index, char* block);
+int tfs_block_free(addr_t index);
+int tfs_free_chain(addr_t first);
+int tfs_chain_collect(addr_t first, addr_t* out, int* count, bool* refs_changed);
+int tfs_blocks_free(addr_t* blocks, int count, char* block_super);
+void tfs_write_links(char* block, uint16_t links);
+uint16_t tfs_read_links(char* block);
+void tfs_write_hwm(char* block_super, uint32_t hwm);
+uint32_t tfs_read_hwm(char* block_super);
+void tfs_write_count(char* block_super, uint32_t count);
+uint32_t tfs_read_count(char* block_super);
+int tfs_formatted_limit(void);
+int tfs_holes_load(void);
+int tfs_blocks_release(addr_t* blocks, int count);
+void tfs_hole_push(addr_t index);
+void tfs_hole_remove(addr_t index);
+bool tfs_punching(void);
+int tfs_addr_cmp(const void* a, const void* b);
+int tfs_frag_scan(struct tfs_frag_stats *stats);
+
+/* in memory dentry, one per on-disk directory entry of every loaded directory */
+struct tfs_dentry {
+    struct tfs_dentry* next;
+    uint32_t hash;
+    addr_t parent;
+    addr_t inode;
+    uint8_t type;
+    /* where the entry lives on disk */
+    addr_t block;
+    uint8_t slot;
+    char name[TFS_FILE_NAME_LEN_MAX + 1];
+};
+
+struct tfs_dirent_loc {
+    addr_t block;
+    uint8_t slot;
+};
+
+/* a directory whose entries have all been read into the dentry cache */
+struct tfs_dir {
+    int entry_count;
+    int free_count;
+    int free_cap;
+    struct tfs_dirent_loc* free;
+};
 
 static struct {
     bool mounted;
     int disk;
+    /* dentry cache - hash of (parent, name) */
+    struct tfs_dentry** dcache;
+    int dcache_buckets;
+    int dcache_count;
+    /* loaded directories indexed by inode block */
+    struct tfs_dir** dirs;
+    /* extra references per block, mirrors the _REFS chain */
+    uint16_t* refs;
+    /* dedup content index - hash of a data block's payload, chained
+     * through dedup_next by block addr (0 ends a chain) */
+    addr_t* dedup_buckets;
+    addr_t* dedup_next;
+    uint64_t* dedup_hash;
+    struct tfs_dedup_stats dedup_stats;
+    /* blocks freed by punching them - all zeros, free but not on the free list */
+    addr_t* holes;
+    int hole_count;
+    /* where in holes each of them is */
+    int* hole_slot;
+    bool punch_holes;
+    /* log-structured mode - new blocks are all taken at log_head, which only
+     * moves forward until it runs out of room, and freed blocks are punched.
+     * log_head is 0 until the first block is taken after mounting */
+    bool log_mode;
+    addr_t log_head;
+    /* inode block tfs_defrag continues from, and the fewest blocks of a
+     * fragmented file it found no free run for on this pass */
+    int defrag_cursor;
+    int defrag_stuck;
+    /* what every block below space_end is (TFS_SPACE_*), with the free list
+     * linked both ways, for the allocator to search. Kept up to date by the
+     * single block paths, rebuilt from disk once space_valid is cleared */
+    uint8_t* space;
+    addr_t* free_next;
+    addr_t* free_prev;
+    int space_end;
+    bool space_valid;
+    /* blocks read ahead once a chained file is being read in order, 0 is off */
+    int readahead;
+    struct tfs_readahead_stats readahead_stats;
+    /* open files holding a block map, and writing through tfs_writeBegin */
+    int block_maps;
+    int streams;
 } tfs_meta;
 
 struct tfs_file_ptr {
     addr_t block_num;
     uint8_t byte_index;
 };
+/* a tfs_writeBegin in progress. Blocks are claimed a batch at a time and
+ * each one is written once the block after it is claimed, so only the block
+ * being filled is held in memory. None of it is reachable before commit */
+struct tfs_stream {
+    int size;
+    addr_t first;
+    /* where the next batch is looked for, right after the last one */
+    addr_t goal;
+    addr_t claimed[TFS_STREAM_BATCH];
+    int claimed_count;
+    int claimed_next;
+    /* the block being filled, 0 before the first byte */
+    addr_t block_index;
+    int fill;
+    char block[BLOCKSIZE];
+};
 struct tfs_openfile {
     bool live;
     uint16_t size;
     struct tfs_file_ptr ptr;
+    /* offset is the logical read position. Compressed and indexed files are
+     * read by it instead of ptr, indexed files keep the head of their index
+     * in ptr.block_num */
+    bool compressed;
+    bool indexed;
+    uint16_t offset;
+    /* readahead - the data block read last, and whether the file got to it
+     * by reading on from the block before it rather than by seeking */
+    addr_t ra_block;
+    bool ra_sequential;
+    /* addresses of a plain chain's data blocks in file order, read the first
+     * time the file seeks and dropped whenever the chain changes */
+    addr_t* block_map;
+    int block_map_count;
+    struct tfs_stream* stream;
     int inode_index;
+    /* directory the file is named in */
+    addr_t parent;
     char name[TFS_FILE_NAME_LEN_MAX + 1];
 };
 static struct tfs_openfile tfs_openfile_table[TFS_OPEN_FILES_MAX] = {0};
 
+/* counters for tfs_getStats, kept across mounts. libDisk's I/O counts are
+ * reported relative to tfs_stats_disk, taken at the last reset */
+static struct tfs_stats tfs_stats;
+static struct disk_stats tfs_stats_disk;
+
+/* trace file tfs_traceStart writes to, NULL when not tracing, and when it started */
+static struct {
+    FILE* file;
+    uint64_t start;
+} tfs_trace;
+
+/* held by every timed tfs_* call, so the async worker's calls and the
+ * caller's own take turns */
+static pthread_mutex_t tfs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* calls queued by tfs_*_async. Slots are used in turn: from head to run
+ * they're done and wait for tfs_async_poll, from run to tail for the
+ * worker, which runs them in that order */
+struct tfs_async_call {
+    int op;
+    fileDescriptor fd;
+    char *name;
+    char *buffer;
+    int size;
+    void *tag;
+    int ret;
+};
+static struct {
+    bool running;
+    bool stop;
+    /* readable while there are completions to poll */
+    int efd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    uint32_t head;
+    uint32_t run;
+    uint32_t tail;
+    struct tfs_async_call calls[TFS_ASYNC_QUEUE_MAX];
+} tfs_async = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER };
+
+/* decompressed frames of compressed files, least recently used is evicted */
+struct tfs_zframe {
+    bool live;
+    addr_t inode;
+    int frame;
+    int len;
+    uint32_t used;
+    char data[TFS_COMPRESS_FRAME];
+};
+static struct tfs_zframe tfs_zcache[TFS_ZCACHE_ENTRIES];
+static uint32_t tfs_zcache_tick;
+
+struct tfs_dentry* tfs_dcache_find(addr_t parent, const char* name);
+void tfs_dcache_drop(void);
+void tfs_dcache_clear(void);
+int tfs_dir_load(addr_t dir, struct tfs_dir** out);
+int tfs_dir_add(addr_t dir, const char* name, addr_t inode, uint8_t type);
+int tfs_dir_grow_at(addr_t dir, struct tfs_dir* dir_info, addr_t dent_index);
+int tfs_dir_remove(addr_t dir, struct tfs_dentry* dentry);
+int tfs_dirent_write(addr_t dir, struct tfs_dirent_loc loc, addr_t inode, uint8_t type, const char* name);
+int tfs_dirent_pos(addr_t block_index, addr_t dir, uint8_t slot);
+int tfs_dir_make(addr_t parent, const char* name, addr_t* out);
+int tfs_path_walk(const char* path, addr_t* dir, char* base);
+fileDescriptor tfs_open_in(addr_t dir, char* name);
+int tfs_inode_unlink(addr_t inode_index);
+int tfs_dir_free(addr_t dir_index);
+int tfs_refs_load(void);
+int tfs_refs_sync(void);
+int tfs_inode_clone(addr_t src, addr_t dir, const char* name, bool share);
+int tfs_compress_stream(char* buffer, int size, char* stream, int stream_cap);
+int tfs_zcache_get(addr_t inode_index, int frame, struct tfs_zframe** out);
+void tfs_zcache_drop(addr_t inode_index);
+int tfs_read_chain(addr_t first, int len, char* out);
+int tfs_read_data(char* block_inode, int len, char* out);
+int tfs_free_data(char* block_inode);
+void tfs_write_times(char* block_inode, uint64_t ctime);
+int tfs_dedup_load(void);
+int tfs_index_write(char* buffer, int size, int flags, addr_t* first_index, int* stored);
+int tfs_index_get(addr_t first_index, int block, addr_t* out);
+int tfs_shrink(uint32_t new_count, uint32_t hwm);
+int tfs_blocks_relocate(addr_t* from, addr_t* to, int count, int limit);
+
+/* what tfs_space_map found each block to be */
+#define TFS_SPACE_USED 0
+#define TFS_SPACE_FREE 1
+#define TFS_SPACE_HOLE 2
+#define TFS_SPACE_LAZY 3
+/* only while tfs_space_load walks the free list */
+#define TFS_SPACE_LISTED 4
+int tfs_space_map(uint8_t* map, int* end, addr_t* next);
+int tfs_space_find(uint8_t* map, int from, int end, int count);
+int tfs_space_take(addr_t goal, int count, addr_t* out, char* block_super);
+void tfs_space_used(addr_t index);
+void tfs_space_freed(addr_t index, addr_t prev, addr_t next);
+int tfs_chain_write(char* buffer, int size, int count, addr_t goal, addr_t* first);
+int tfs_chain_fill(char* buffer, int size, addr_t* blocks, int count);
+int tfs_readahead(struct tfs_openfile* file);
+int tfs_block_map_load(struct tfs_openfile* file);
+void tfs_block_map_free(struct tfs_openfile* file);
+void tfs_block_map_drop(addr_t inode_index);
+int tfs_stream_claim(struct tfs_stream* stream, addr_t* out);
+int tfs_stream_next(struct tfs_stream* stream);
+int tfs_stream_abort(struct tfs_openfile* file);
+int tfs_send_bytes(int out_fd, const char* data, int count);
+int tfs_index_free(addr_t first_index);
+struct tfs_batch_name;
+struct tfs_batch_dir;
+int tfs_batch_check(struct tfs_batch_op* ops, int count, struct tfs_batch_name* names, struct tfs_batch_dir* dirs, int* op_name, int* op_blocks);
+int tfs_batch_apply(struct tfs_batch_op* ops, int count, struct tfs_batch_name* names, int* op_name, int* op_blocks);
+int tfs_op_mkfs(char *filename, int nBytes);
+int tfs_op_mount(char *diskname);
+int tfs_op_unmount(void);
+fileDescriptor tfs_op_openFile(char *name);
+int tfs_op_closeFile(fileDescriptor FD);
+int tfs_op_writeFile(fileDescriptor FD, char *buffer, int size);
+int tfs_op_deleteFile(fileDescriptor FD);
+int tfs_op_readByte(fileDescriptor FD, char *buffer);
+int tfs_op_read(fileDescriptor FD, char *buffer, int size);
+int tfs_atime_update(struct tfs_openfile* file_meta);
+int tfs_op_seek(fileDescriptor FD, int offset);
+struct tfs_stat tfs_op_readFileInfo(fileDescriptor FD);
+int tfs_op_sendfile(fileDescriptor FD, int out_fd, int offset, int len);
+int tfs_op_setFlags(fileDescriptor FD, int flags);
+int tfs_op_fallocate(fileDescriptor FD, int bytes);
+int tfs_op_checkConsistency(void);
+int tfs_op_mkdir(char *path);
+int tfs_op_rmdir(char *path);
+int tfs_op_rename(char *old_path, char *new_path);
+int tfs_op_link(char *old_path, char *new_path);
+int tfs_op_clone(char *src_path, char *dst_path);
+int tfs_op_snapshot(char *path);
+int tfs_op_resize(int newBytes);
+int tfs_op_writeBegin(fileDescriptor FD);
+int tfs_op_writeChunk(fileDescriptor FD, char *buffer, int size);
+int tfs_op_writeCommit(fileDescriptor FD);
+int tfs_op_writeAbort(fileDescriptor FD);
+int tfs_op_batch(struct tfs_batch_op* ops, int count);
+int tfs_op_defrag(int budgetMs);
+int tfs_op_clean(int budgetMs);
+void tfs_lock(void);
+void tfs_unlock(void);
+uint64_t tfs_stats_now(void);
+uint64_t tfs_stats_op(int op, uint64_t start, int ret);
+int tfs_async_run(struct tfs_async_call *call);
+void *tfs_async_worker(void *arg);
+int tfs_async_submit(int op, fileDescriptor FD, char *name, char *buffer, int size, void *tag);
+int tfs_trace_start(char *path);
+int tfs_trace_stop(void);
+void tfs_trace_call(int op, uint64_t start, uint64_t ns, int ret, int arg0, int arg1, int arg2, const char* str0, const char* str1);
+void tfs_trace_batch(uint64_t start, uint64_t ns, int ret, struct tfs_batch_op* ops, int count);
+void tfs_trace_io(int disk, int kind, int bNum, int count);
+
 
 /* Makes a blank TinyFS file system of size nBytes on the unix file specified by ‘filename’. This function should use the emulated disk library to open the specified unix file, and upon success, format the file to be a mountable disk. This includes initializing all data to 0x00, setting magic numbers, initializing and writing the superblock and inodes, etc. Must return a specified success/error code. */
-int tfs_mkfs(char *filename, int nBytes) {
+int tfs_op_mkfs(char *filename, int nBytes) {
     int disk = openDisk(filename, nBytes);
     fail_if(disk);
 
     int block_count = (nBytes - (nBytes % BLOCKSIZE)) / BLOCKSIZE;
+    if (block_count > TFS_BLOCK_COUNT_MAX)
+        block_count = TFS_BLOCK_COUNT_MAX;
 
-    char block_default[BLOCKSIZE] = {0};
-    block_default[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
-    block_default[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
-
-    int block_index = 0;
-    for (block_index = 0; block_index < block_count; block_index++) {
-        addr_t next_block_index = 0;
-        if (block_index + 1 != block_count)
-            next_block_index = block_index + 1;
-        tfs_write_addr(block_default, next_block_index);
-        fail_if(writeBlock(disk, block_index, block_default));
-    }
-
+    // every other block stays a hole until the allocator reaches it
     char block_super[BLOCKSIZE] = {0};
     block_super[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE_SUPER;
     block_super[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
-
-    addr_t first_free_block_index = 0;
-    if (block_count > 1)
-        first_free_block_index = 1;
-    tfs_write_addr(block_super, first_free_block_index);
+    tfs_write_addr(block_super, 0);
+    tfs_write_hwm(block_super, TFS_BLOCK_SUPER_INDEX + 1);
+    tfs_write_count(block_super, block_count);
 
     fail_if(writeBlock(disk, TFS_BLOCK_SUPER_INDEX, block_super));
 
@@ -157,7 +499,7 @@ int tfs_mkfs(char *filename, int nBytes) {
 
  
 /* tfs_mount(char *diskname) "mounts" a TinyFS file system located within ‘diskname’.As part of the mount operation, tfs_mount should verify the file system is the correct type. In tinyFS, only one file system may be mounted at a time. Use tfs_unmount to cleanly unmount the currently mounted file system. Must return a specified success/error code. */
-int tfs_mount(char *diskname) {
+int tfs_op_mount(char *diskname) {
     if (tfs_meta.mounted == true)
         fail(TFS_ERR_ALREADY_MOUNTED);
     int disk = openDisk(diskname, 0);
@@ -168,32 +510,114 @@ int tfs_mount(char *diskname) {
         return TFS_ERR_NO_DISK;
     if (block_super[TFS_BLOCK_EVERY_POS_MAGIC] != TFS_BLOCK_MAGIC)
         return TFS_ERR_INVALID;
+    tfs_meta.dcache_buckets = TFS_DCACHE_BUCKETS_MIN;
+    tfs_meta.dcache_count = 0;
+    tfs_meta.dcache = calloc(tfs_meta.dcache_buckets, sizeof(struct tfs_dentry*));
+    tfs_meta.dirs = calloc(TFS_BLOCK_COUNT_MAX, sizeof(struct tfs_dir*));
+    tfs_meta.refs = calloc(TFS_BLOCK_COUNT_MAX, sizeof(uint16_t));
+    tfs_meta.dedup_buckets = calloc(TFS_DEDUP_BUCKETS, sizeof(addr_t));
+    tfs_meta.dedup_next = calloc(TFS_BLOCK_COUNT_MAX, sizeof(addr_t));
+    tfs_meta.dedup_hash = calloc(TFS_BLOCK_COUNT_MAX, sizeof(uint64_t));
+    tfs_meta.holes = calloc(TFS_BLOCK_COUNT_MAX, sizeof(addr_t));
+    tfs_meta.hole_slot = calloc(TFS_BLOCK_COUNT_MAX, sizeof(int));
+    tfs_meta.space = calloc(TFS_BLOCK_COUNT_MAX, sizeof(uint8_t));
+    tfs_meta.free_next = calloc(TFS_BLOCK_COUNT_MAX, sizeof(addr_t));
+    tfs_meta.free_prev = calloc(TFS_BLOCK_COUNT_MAX, sizeof(addr_t));
+    if (tfs_meta.dcache == NULL || tfs_meta.dirs == NULL || tfs_meta.refs == NULL
+            || tfs_meta.dedup_buckets == NULL || tfs_meta.dedup_next == NULL || tfs_meta.dedup_hash == NULL
+            || tfs_meta.holes == NULL || tfs_meta.hole_slot == NULL || tfs_meta.space == NULL
+            || tfs_meta.free_next == NULL || tfs_meta.free_prev == NULL) {
+        free(tfs_meta.dcache);
+        free(tfs_meta.dirs);
+        free(tfs_meta.refs);
+        free(tfs_meta.dedup_buckets);
+        free(tfs_meta.dedup_next);
+        free(tfs_meta.dedup_hash);
+        free(tfs_meta.holes);
+        free(tfs_meta.hole_slot);
+        free(tfs_meta.space);
+        free(tfs_meta.free_next);
+        free(tfs_meta.free_prev);
+        closeDisk(disk);
+        fail(TFS_ERR_NO_MEMORY);
+    }
     tfs_meta.mounted = true;
+    tfs_meta.defrag_cursor = 0;
+    tfs_meta.log_head = 0;
+    tfs_meta.space_valid = false;
+    tfs_meta.readahead = TFS_READAHEAD_DEFAULT;
+    memset(&tfs_meta.readahead_stats, 0, sizeof(tfs_meta.readahead_stats));
     tfs_meta.disk = disk;
-    fail_if(tfs_checkConsistency());
+    fail_if(tfs_op_checkConsistency());
+    fail_if(tfs_holes_load());
+    fail_if(tfs_refs_load());
+    fail_if(tfs_dedup_load());
     return TFS_OK;
 }
 
 /*  tfs_unmount(void) "unmounts" the currently mounted file system */
-int tfs_unmount(void) {
+int tfs_op_unmount(void) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
-    fail_if(closeDisk(tfs_meta.disk));
+    // unfinished streaming writes hand their blocks back
+    int fd;
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX && tfs_meta.streams > 0; fd++)
+        fail_if(tfs_stream_abort(&tfs_openfile_table[fd]));
+    // the disk is gone even when flushing write-back blocks failed, so the
+    // mount is torn down before that error is returned
+    int err = closeDisk(tfs_meta.disk);
+    tfs_dcache_drop();
+    free(tfs_meta.refs);
+    tfs_meta.refs = NULL;
+    free(tfs_meta.dedup_buckets);
+    free(tfs_meta.dedup_next);
+    free(tfs_meta.dedup_hash);
+    tfs_meta.dedup_buckets = NULL;
+    tfs_meta.dedup_next = NULL;
+    tfs_meta.dedup_hash = NULL;
+    free(tfs_meta.holes);
+    free(tfs_meta.hole_slot);
+    tfs_meta.holes = NULL;
+    tfs_meta.hole_slot = NULL;
+    tfs_meta.hole_count = 0;
+    free(tfs_meta.space);
+    free(tfs_meta.free_next);
+    free(tfs_meta.free_prev);
+    tfs_meta.space = NULL;
+    tfs_meta.free_next = NULL;
+    tfs_meta.free_prev = NULL;
+    tfs_meta.space_valid = false;
+    // descriptors outlive the mount, their block maps don't
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX && tfs_meta.block_maps > 0; fd++)
+        tfs_block_map_free(&tfs_openfile_table[fd]);
     tfs_meta.mounted = false;
+    fail_if(err);
     return TFS_OK;
 }
  
 /* Creates or Opens a file for reading and writing on the currently mounted file system. Creates a dynamic resource table entry for the file, and returns a file descriptor (integer) that can be used to reference this entry while the filesystem is mounted. */
-fileDescriptor tfs_openFile(char *name) {
+fileDescriptor tfs_op_openFile(char *name) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
 
     if (name == NULL)
         return TFS_ERR_INVALID;
-            
+
+    addr_t dir;
+    char base[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(name, &dir, base);
+    fail_if(err);
+
+    return tfs_open_in(dir, base);
+}
+
+/* opens (creating if needed) the file called `name` in directory `dir` */
+fileDescriptor tfs_open_in(addr_t dir, char* name) {
     int name_len = strlen(name);
-    if (name_len > TFS_FILE_NAME_LEN_MAX)
+    if (name_len == 0)
         return TFS_ERR_INVALID;
+    if (name_len > TFS_FILE_NAME_LEN_MAX)
+        return TFS_ERR_FILE_NAME_TOO_LONG;
 
     int i;
     bool found = false;
@@ -211,52 +635,37 @@ fileDescriptor tfs_openFile(char *name) {
     struct tfs_openfile* file_meta = &tfs_openfile_table[i];
 
     // find existing file
-    char block_tmp[BLOCKSIZE];
-    int block_index = 0;
-    for (block_index = 0; readBlock(tfs_meta.disk, block_index, block_tmp) >= 0; block_index++) {
-        if (block_tmp[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE_INODE) {
-            continue;
-        }
-        // printf("comparing existing %s to new %s\n", &block_tmp[TFS_BLOCK_INODE_POS__NAME], name);
-        if (memcmp(&block_tmp[TFS_BLOCK_INODE_POS__NAME], name, name_len) != 0) {
-            continue;
-        }
-        char* block_inode = block_tmp;
-        file_meta->inode_index = block_index;
+    struct tfs_dir* dir_info;
+    int err = tfs_dir_load(dir, &dir_info);
+    fail_if(err);
+    struct tfs_dentry* dentry = tfs_dcache_find(dir, name);
+    if (dentry != NULL) {
+        if (dentry->type == TFS_BLOCK_TYPE___DIR)
+            return TFS_ERR_IS_DIR;
+        char block_inode[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, dentry->inode, block_inode));
+        assert(block_inode[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE_INODE, "dentry %s does not point at an inode", name);
+        file_meta->inode_index = dentry->inode;
         file_meta->live = true;
         file_meta->size = tfs_read_size(block_inode);
         if (file_meta->size == 0) {
-            file_meta->ptr.block_num = block_index;
+            file_meta->ptr.block_num = dentry->inode;
         } else {
             file_meta->ptr.block_num = tfs_read_addr(block_inode);
         }
-        // printf("found file %s\n", name);
-        // printf("inode index = %d\n block index = %d\n", file_meta->inode_index, file_meta->ptr.block_num);
         file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
-        memcpy(file_meta->name, name, name_len);
+        file_meta->compressed = (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_COMPRESSED) != 0;
+        file_meta->indexed = (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_INDEXED) != 0;
+        file_meta->offset = 0;
+        file_meta->parent = dir;
+        memcpy(file_meta->name, name, name_len + 1);
         return FD;
     }
 
     // no file found - create file
-    // printf("creating file %s\n", name);
-    char block_super[BLOCKSIZE];
     char block_inode[BLOCKSIZE];
-
-    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
-
-    addr_t inode_index = tfs_read_addr(block_super);
-    if (inode_index == 0)
-        return TFS_ERR_NO_FREE_BLOCKS;
-
-    fail_if(readBlock(tfs_meta.disk, inode_index, block_inode));
-    // printf("inode index = %d\n", inode_index);
-    // hexdump_block(block_inode);
-    assert(block_inode[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__FREE, "block type is not free");
-
-    // update super next free block index
-    tfs_write_addr(block_super, tfs_read_addr(block_inode));
-    // printf("next free block index: %d inode=%d\n", tfs_read_addr(block_super), inode_index);
-    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    addr_t inode_index;
+    fail_if(tfs_block_alloc(&inode_index, block_inode));
 
     // format inode block
     tfs_write_size(block_inode, 0);
@@ -267,10 +676,14 @@ fileDescriptor tfs_openFile(char *name) {
         tfs_write_tstamp(block_inode, TSTAMP_ACCESS, t);
         tfs_write_tstamp(block_inode, TSTAMP_MODIFY, t);
     }
+    tfs_write_links(block_inode, 1);
     block_inode[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE_INODE;
-    memcpy(&block_inode[TFS_BLOCK_INODE_POS__NAME], name, name_len);
     fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode));
 
+    if ((err = tfs_dir_add(dir, name, inode_index, TFS_BLOCK_TYPE_INODE)) < 0) {
+        tfs_block_free(inode_index);
+        fail(err);
+    }
 
     // format file_meta
     file_meta->live = true;
@@ -278,31 +691,35 @@ fileDescriptor tfs_openFile(char *name) {
     file_meta->ptr.block_num = inode_index;
     file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
     file_meta->inode_index = inode_index;
-    memcpy(file_meta->name, name, name_len);
-
+    file_meta->parent = dir;
+    memcpy(file_meta->name, name, name_len + 1);
 
     return FD;
 }
 
 /* Closes the file, de-allocates all system resources, and removes table entry */ 
-int tfs_closeFile(fileDescriptor FD) {
+int tfs_op_closeFile(fileDescriptor FD) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
 
     if (!tfs_openfile_table[FD].live)
         return TFS_ERR_BAD_FD;
 
+    tfs_block_map_free(&tfs_openfile_table[FD]);
+    fail_if(tfs_stream_abort(&tfs_openfile_table[FD]));
     tfs_openfile_table[FD] = (struct tfs_openfile){0};
 
     return TFS_OK;
 }
  
 /* Writes buffer ‘buffer’ of size ‘size’, which represents an entire file’s content, to the file system. Previous content (if any) will be completely lost. Sets the file pointer to 0 (the start of file) when done. Returns success/error codes. */
-int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+int tfs_op_writeFile(fileDescriptor FD, char *buffer, int size) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
     if (!tfs_openfile_table[FD].live)
         return TFS_ERR_BAD_FD;
+    if (tfs_openfile_table[FD].stream != NULL)
+        return TFS_ERR_BUSY;
     // {
     //     char block_super_tmp[BLOCKSIZE];
     //     if (readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super_tmp) < 0)
@@ -312,6 +729,7 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
 
     char name[TFS_FILE_NAME_LEN_MAX + 1] = {0};
     strncpy(name, tfs_openfile_table[FD].name, TFS_FILE_NAME_LEN_MAX);
+    addr_t parent = tfs_openfile_table[FD].parent;
 
     uint64_t ctime = 0;
     /* save ctime */ {
@@ -326,131 +744,99 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
 
     struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
 
-    if (file_meta->inode_index != 0)
-        fail_if(tfs_deleteFile(FD));
-        // if ((err = tfs_deleteFile(FD)) < 0)
-        //     return err;
-    fail_if(tfs_closeFile(FD));
-    
-    fileDescriptor new_FD = tfs_openFile(name);
-    // {
-    //     char block_super_tmp[BLOCKSIZE];
-    //     if (readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super_tmp) < 0)
-    //         return TFS_ERR_TODO;
-    //     printf("block super -> %d\n", tfs_read_addr(block_super_tmp));
-    // }
-    
-    if (new_FD < 0)
-        return new_FD;
-    if (new_FD != FD) {
-        // copy new meta to old meta
-        memcpy(&tfs_openfile_table[FD], &tfs_openfile_table[new_FD], sizeof(struct tfs_openfile));
-        // close old fd
-        fail_if(tfs_closeFile(new_FD));
-        // if ((err = tfs_closeFile(new_FD)) < 0)
-        //     return err;
-    }
-
-
-    if (size == 0)
-        return TFS_OK;
+    if (file_meta->inode_index != 0) {
+        // rewrite in place so the inode, and every name linked to it, survives
+        char block_inode_old[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode_old));
+        fail_if(tfs_free_data(block_inode_old));
+        tfs_zcache_drop(file_meta->inode_index);
+        tfs_block_map_drop(file_meta->inode_index);
+        tfs_write_addr(block_inode_old, 0);
+        tfs_write_size(block_inode_old, 0);
+        block_inode_old[TFS_BLOCK_INODE_POS_FLAGS] &= ~TFS_INODE_FLAGS_LAYOUT;
+        memset(&block_inode_old[TFS_BLOCK_INODE_POS_PSIZE], 0, sizeof(uint16_t));
+        fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode_old));
+        file_meta->size = 0;
+        file_meta->compressed = false;
+        file_meta->indexed = false;
+        file_meta->offset = 0;
+        file_meta->ptr.block_num = file_meta->inode_index;
+        file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
+    } else {
+        // file was deleted while open - recreate it under the same name
+        fail_if(tfs_op_closeFile(FD));
 
-    int full_block_count = (size - (size % TFS_BLOCK__FILE_SIZE_DATA)) / TFS_BLOCK__FILE_SIZE_DATA;
-    int last_block_size = size % TFS_BLOCK__FILE_SIZE_DATA;
-    if (last_block_size == 0) {
-        last_block_size = TFS_BLOCK__FILE_SIZE_DATA;
-        full_block_count--;
+        fileDescriptor new_FD = tfs_open_in(parent, name);
+        if (new_FD < 0)
+            return new_FD;
+        if (new_FD != FD) {
+            // copy new meta to old meta
+            memcpy(&tfs_openfile_table[FD], &tfs_openfile_table[new_FD], sizeof(struct tfs_openfile));
+            // close old fd
+            fail_if(tfs_op_closeFile(new_FD));
+        }
     }
 
-    int total_block_count = full_block_count; /* full blocks */
-    if (last_block_size > 0)
-        total_block_count++; /* last (partially full) block */
-    assert(total_block_count >= 1, "no blocks");
-
     char block_inode[BLOCKSIZE];
     fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
-    // if (readBlock(tfs_meta.disk, file_meta->inode_index, block_inode) < 0)
-    //     return TFS_ERR_TODO;
-
-    char block_super[BLOCKSIZE];
-    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    uint16_t reserved;
+    memcpy(&reserved, &block_inode[TFS_BLOCK_INODE_POS_RESRV], sizeof(uint16_t));
+    if (size == 0 && reserved == 0)
+        return TFS_OK;
 
-    // printf("block super\n");
-    // hexdump_block(block_super);
+    /* compress if asked to and it saves space, the chain then holds the stream */
+    int logical_size = size;
+    if (size > 0 && (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_FLAG_COMPRESS)) {
+        static char stream[TFS_FILE_SIZE_MAX];
+        int stream_size = tfs_compress_stream(buffer, size, stream, size - 1);
+        if (stream_size > 0) {
+            buffer = stream;
+            size = stream_size;
+            block_inode[TFS_BLOCK_INODE_POS_FLAGS] |= TFS_INODE_FLAG_COMPRESSED;
+            file_meta->compressed = true;
+        }
+    }
+    uint16_t physical_size = size;
+    memcpy(&block_inode[TFS_BLOCK_INODE_POS_PSIZE], &physical_size, sizeof(uint16_t));
 
-    /* check if there is space */ {
-        int free_block_count = 0;
-        addr_t next_free_block_index = tfs_read_addr(block_super);
-        // printf("next_free_block_index: %d\n", next_free_block_index);
-        if (next_free_block_index == 0)
-            return TFS_ERR_NO_FREE_BLOCKS;
-        while (next_free_block_index != 0 && free_block_count < total_block_count) {
-            free_block_count++;
-            char block[BLOCKSIZE];
-            assert(readBlock(tfs_meta.disk, next_free_block_index, block) == 0, "failed to read block");
-            assert(block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__FREE, "block type is not free");
-            next_free_block_index = tfs_read_addr(block);
+    if (size > 0 && (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & (TFS_FLAG_DEDUP | TFS_FLAG_SPARSE))) {
+        addr_t first_index;
+        int stored;
+        int err = tfs_index_write(buffer, size, block_inode[TFS_BLOCK_INODE_POS_FLAGS], &first_index, &stored);
+        fail_if(err);
+        if (stored * TFS_BLOCK__FILE_SIZE_DATA < physical_size) {
+            // holes take no space
+            physical_size = stored * TFS_BLOCK__FILE_SIZE_DATA;
+            memcpy(&block_inode[TFS_BLOCK_INODE_POS_PSIZE], &physical_size, sizeof(uint16_t));
         }
-        if (free_block_count < total_block_count)
-            return TFS_ERR_INSUFFICIENT_SPACE;
+        block_inode[TFS_BLOCK_INODE_POS_FLAGS] |= TFS_INODE_FLAG_INDEXED;
+        tfs_write_addr(block_inode, first_index);
+        tfs_write_size(block_inode, logical_size);
+        file_meta->size = logical_size;
+        file_meta->indexed = true;
+        file_meta->offset = 0;
+        file_meta->ptr.block_num = first_index;
+        tfs_write_times(block_inode, ctime);
+        fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+        return TFS_OK;
     }
 
-    addr_t block_index = tfs_read_addr(block_super);
-    // printf("inode index = %d\nblock index = %d\n", file_meta->inode_index, block_index);
-    assert(block_index != 0, "next block not free");
-    assert(block_index != file_meta->ptr.block_num, "block_index != meta->ptr.block_num");
+    int total_block_count = (size + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    if (total_block_count < reserved)
+        total_block_count = reserved;
+    addr_t first;
+    int err = tfs_chain_write(buffer, size, total_block_count, file_meta->inode_index + 1, &first);
+    fail_if(err);
+
     // update inode block addr with first block addr
-    tfs_write_addr(block_inode, block_index);
-    tfs_write_size(block_inode, size);
-    file_meta->size = size;
+    tfs_write_addr(block_inode, first);
+    tfs_write_size(block_inode, logical_size);
+    file_meta->size = logical_size;
     // set file ptr to zero
-    // assert(file_meta->ptr.block_num == block_index, "file ptr is not zero is %d", file_meta->ptr.block_num);
-    file_meta->ptr.block_num = block_index;
+    file_meta->ptr.block_num = size > 0 ? first : file_meta->inode_index;
     file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
 
-    int written_blocks_count = 0;
-    while (written_blocks_count < full_block_count) {
-        char block[BLOCKSIZE];
-        fail_if(readBlock(tfs_meta.disk, block_index, block));
-        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__DATA;
-        char* block_data = &buffer[written_blocks_count * TFS_BLOCK__FILE_SIZE_DATA];
-        memcpy(&block[TFS_BLOCK__FILE_POS__DATA], block_data, TFS_BLOCK__FILE_SIZE_DATA);
-        fail_if(writeBlock(tfs_meta.disk, block_index, block));
-        // if (writeBlock(tfs_meta.disk, block_index, block) < 0)
-        //     return TFS_ERR_TODO;
-        block_index = tfs_read_addr(block);
-        written_blocks_count++;
-    }
-
-    int last_block_index = block_index;
-    char block_last[BLOCKSIZE];
-    fail_if(readBlock(tfs_meta.disk, last_block_index, block_last));
-    // if (readBlock(tfs_meta.disk, last_block_index, block_last) < 0)
-    //     return TFS_ERR_TODO;
-    addr_t next_free_block_index = tfs_read_addr(block_last);
-    tfs_write_addr(block_last, 0);
-    block_last[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__DATA;
-    char* block_data = &buffer[full_block_count * TFS_BLOCK__FILE_SIZE_DATA];
-    assert(last_block_size <= TFS_BLOCK__FILE_SIZE_DATA, "last block size is too big");
-    memcpy(&block_last[TFS_BLOCK__FILE_POS__DATA], block_data, last_block_size);
-    fail_if(writeBlock(tfs_meta.disk, last_block_index, block_last));
-    // if (writeBlock(tfs_meta.disk, last_block_index, block_last) < 0)
-    //     return TFS_ERR_TODO;
-
-    tfs_write_addr(block_super, next_free_block_index);
-    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
-    // if (writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super) < 0)
-    //     return TFS_ERR_TODO;
-
-    {
-        time_t t= time(NULL);
-        time_t new_ctime = t;
-        if (ctime != 0)
-            new_ctime = ctime;
-        tfs_write_tstamp(block_inode, TSTAMP_CREATE, new_ctime);
-        tfs_write_tstamp(block_inode, TSTAMP_ACCESS, t);
-        tfs_write_tstamp(block_inode, TSTAMP_MODIFY, t);
-    }
+    tfs_write_times(block_inode, ctime);
     // save updated inode
     fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
     // if (writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode) < 0)
@@ -460,7 +846,7 @@ int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
 }
  
 /* deletes a file and marks its blocks as free on disk. */
-int tfs_deleteFile(fileDescriptor FD) {
+int tfs_op_deleteFile(fileDescriptor FD) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
 
@@ -471,73 +857,29 @@ int tfs_deleteFile(fileDescriptor FD) {
     assert(file->inode_index != 0, "inode index is zero");
 
     int inode_index = file->inode_index;
-    /* zero out file meta - keeping name & live */ {
+
+    /* unlink from parent directory */ {
+        struct tfs_dentry* dentry = tfs_dcache_find(file->parent, file->name);
+        if (dentry != NULL && dentry->inode == inode_index)
+            fail_if(tfs_dir_remove(file->parent, dentry));
+    }
+
+    tfs_block_map_drop(inode_index);
+    fail_if(tfs_stream_abort(file));
+    /* zero out file meta - keeping name, parent & live */ {
         struct tfs_openfile new_file_meta = {0};
         new_file_meta.live = true;
-        memcpy(new_file_meta.name, file->name, TFS_FILE_NAME_LEN_MAX);
+        new_file_meta.parent = file->parent;
+        memcpy(new_file_meta.name, file->name, TFS_FILE_NAME_LEN_MAX + 1);
         memcpy(file, &new_file_meta, sizeof(struct tfs_openfile));
     }
 
-    // file->size = 0;
-    // file->ptr.block_num = 0;
-    // file->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
-    // file->inode_index = 0;
-
-    char block_inode[BLOCKSIZE];
-    fail_if(readBlock(tfs_meta.disk, inode_index, block_inode));
-    assert(block_inode[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE_INODE, "block type is not inode");
-    assert(block_inode[TFS_BLOCK_EVERY_POS_MAGIC] == TFS_BLOCK_MAGIC, "block magic is not correct");
-
-    char block_super[BLOCKSIZE];
-    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
-    assert(block_super[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE_SUPER, "block type is not super");
-    addr_t first_free_block_index = tfs_read_addr(block_super);
-
-    addr_t block_index = tfs_read_addr(block_inode);
-
-    while (block_index != 0) {
-        char block[BLOCKSIZE];
-        fail_if(readBlock(tfs_meta.disk, block_index, block));
-        // printf("before\n");
-        // hexdump_block(block);
-        assert(block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__DATA, "block type is not data");
-        assert(block[TFS_BLOCK_EVERY_POS_MAGIC] == TFS_BLOCK_MAGIC, "block magic is not correct");
-        addr_t next_block_index = tfs_read_addr(block);
-
-        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
-        char * block_data = &block[TFS_BLOCK__FILE_POS__DATA];
-        memset(block_data, 0, TFS_BLOCK__FILE_SIZE_DATA);
-        if (next_block_index == 0)
-            // connect freed block to previously first in free block chain
-            tfs_write_addr(block, first_free_block_index);
-
-        // printf("after\n");
-        // hexdump_block(block);
-        fail_if(writeBlock(tfs_meta.disk, block_index, block));
-        // if (writeBlock(tfs_meta.disk, block_index, block) < 0)
-        //     return TFS_ERR_TODO;
-        block_index = next_block_index;
-    }
-
-    if (block_index == 0)
-        block_index = first_free_block_index;
-
-    block_inode[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
-    char * block_inode_data = &block_inode[TFS_BLOCK__FILE_POS__DATA];
-    memset(block_inode_data, 0, TFS_BLOCK__FILE_SIZE_DATA);
-    // printf("changing inode block at %d ptr from %d -> %d\n", inode_index, tfs_read_addr(block_inode), block_index);
-    if (tfs_read_addr(block_inode) == 0)
-        tfs_write_addr(block_inode, block_index);
-    fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode));
-
-    assert(inode_index != 0, "inode index is zero");
-    tfs_write_addr(block_super, inode_index);
-    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
-    return TFS_OK;
+    // blocks are only freed once the last name is gone
+    return tfs_inode_unlink(inode_index);
 }
 
 /* reads one byte from the file and copies it to buffer, using the current file pointer location and incrementing it by one upon success. If the file pointer is already past the end of the file then tfs_readByte() should return an error and not increment the file pointer. */ 
-int tfs_readByte(fileDescriptor FD, char *buffer) {
+int tfs_op_readByte(fileDescriptor FD, char *buffer) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
 
@@ -545,18 +887,35 @@ int tfs_readByte(fileDescriptor FD, char *buffer) {
     if (!file_meta->live)
         return TFS_ERR_BAD_FD;
 
-    if (file_meta->ptr.block_num == file_meta->inode_index)
+    // chains can run past the size into reserved blocks
+    if (file_meta->offset >= file_meta->size)
+        return TFS_ERR_OUT_OF_BOUNDS;
+    if (!file_meta->compressed && !file_meta->indexed && file_meta->ptr.block_num == file_meta->inode_index)
         return TFS_ERR_OUT_OF_BOUNDS;
 
-    /* update atime */ {
-        int inode_index = file_meta->inode_index;
-        if (inode_index != 0) {
-            char block_inode_init[BLOCKSIZE];
-            fail_if(readBlock(tfs_meta.disk, inode_index, block_inode_init));
-
-            tfs_write_tstamp_now(block_inode_init, TSTAMP_ACCESS);
-            fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode_init));
-        }
+    fail_if(tfs_atime_update(file_meta));
+    if (file_meta->compressed) {
+        struct tfs_zframe* frame;
+        int err = tfs_zcache_get(file_meta->inode_index, file_meta->offset / TFS_COMPRESS_FRAME, &frame);
+        fail_if(err);
+        *buffer = frame->data[file_meta->offset % TFS_COMPRESS_FRAME];
+        file_meta->offset++;
+        return TFS_OK;
+    }
+    if (file_meta->indexed) {
+        addr_t block_index;
+        int err = tfs_index_get(file_meta->ptr.block_num, file_meta->offset / TFS_BLOCK__FILE_SIZE_DATA, &block_index);
+        fail_if(err);
+        char block[BLOCKSIZE] = {0};
+        if (block_index != 0)
+            fail_if(readBlock(tfs_meta.disk, block_index, block));
+        *buffer = block[TFS_BLOCK__FILE_POS__DATA + file_meta->offset % TFS_BLOCK__FILE_SIZE_DATA];
+        file_meta->offset++;
+        return TFS_OK;
+    }
+    if (file_meta->ptr.byte_index == TFS_BLOCK__FILE_POS__DATA || file_meta->ptr.block_num != file_meta->ra_block) {
+        file_meta->ra_block = file_meta->ptr.block_num;
+        fail_if(tfs_readahead(file_meta));
     }
     char block[BLOCKSIZE];
     fail_if(readBlock(tfs_meta.disk, file_meta->ptr.block_num, block));
@@ -570,15 +929,109 @@ int tfs_readByte(fileDescriptor FD, char *buffer) {
             next_addr = file_meta->inode_index;
         file_meta->ptr.block_num = next_addr;
         file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
+        file_meta->ra_sequential = true;
     } else {
         file_meta->ptr.byte_index++;
     }
+    file_meta->offset++;
 
     return TFS_OK;
 }
+
+/* stamps the file's inode with the time it was read */
+int tfs_atime_update(struct tfs_openfile* file_meta) {
+    int inode_index = file_meta->inode_index;
+    if (inode_index != 0) {
+        char block_inode_init[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, inode_index, block_inode_init));
+
+        tfs_write_tstamp_now(block_inode_init, TSTAMP_ACCESS);
+        fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode_init));
+    }
+    return TFS_OK;
+}
+
+/* Reads up to `size` bytes from the file pointer on, as that many
+ * tfs_op_readByte calls would, but updates atime once and copies a frame or
+ * block at a time. Returns how many were read, 0 at the end of the file */
+int tfs_op_read(fileDescriptor FD, char *buffer, int size) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live)
+        return TFS_ERR_BAD_FD;
+
+    int got = 0;
+    int err = TFS_OK;
+    while (got < size && file_meta->offset < file_meta->size) {
+        if (!file_meta->compressed && !file_meta->indexed && file_meta->ptr.block_num == file_meta->inode_index)
+            break;
+        if (got == 0 && (err = tfs_atime_update(file_meta)) < 0)
+            break;
+        // the rest of the frame or block, of the buffer or of the file, whichever is shortest
+        int n = size - got;
+        if (n > file_meta->size - file_meta->offset)
+            n = file_meta->size - file_meta->offset;
+
+        if (file_meta->compressed) {
+            struct tfs_zframe* frame;
+            if ((err = tfs_zcache_get(file_meta->inode_index, file_meta->offset / TFS_COMPRESS_FRAME, &frame)) < 0)
+                break;
+            if (n > TFS_COMPRESS_FRAME - file_meta->offset % TFS_COMPRESS_FRAME)
+                n = TFS_COMPRESS_FRAME - file_meta->offset % TFS_COMPRESS_FRAME;
+            memcpy(&buffer[got], &frame->data[file_meta->offset % TFS_COMPRESS_FRAME], n);
+            file_meta->offset += n;
+            got += n;
+            continue;
+        }
+        if (file_meta->indexed) {
+            addr_t block_index;
+            if ((err = tfs_index_get(file_meta->ptr.block_num, file_meta->offset / TFS_BLOCK__FILE_SIZE_DATA, &block_index)) < 0)
+                break;
+            char block[BLOCKSIZE] = {0};
+            if (block_index != 0 && (err = readBlock(tfs_meta.disk, block_index, block)) < 0)
+                break;
+            if (n > TFS_BLOCK__FILE_SIZE_DATA - file_meta->offset % TFS_BLOCK__FILE_SIZE_DATA)
+                n = TFS_BLOCK__FILE_SIZE_DATA - file_meta->offset % TFS_BLOCK__FILE_SIZE_DATA;
+            memcpy(&buffer[got], &block[TFS_BLOCK__FILE_POS__DATA + file_meta->offset % TFS_BLOCK__FILE_SIZE_DATA], n);
+            file_meta->offset += n;
+            got += n;
+            continue;
+        }
+
+        if (file_meta->ptr.byte_index == TFS_BLOCK__FILE_POS__DATA || file_meta->ptr.block_num != file_meta->ra_block) {
+            file_meta->ra_block = file_meta->ptr.block_num;
+            if ((err = tfs_readahead(file_meta)) < 0)
+                break;
+        }
+        char block[BLOCKSIZE];
+        if ((err = readBlock(tfs_meta.disk, file_meta->ptr.block_num, block)) < 0)
+            break;
+        if (n > BLOCKSIZE - file_meta->ptr.byte_index)
+            n = BLOCKSIZE - file_meta->ptr.byte_index;
+        memcpy(&buffer[got], &block[file_meta->ptr.byte_index], n);
+        if (file_meta->ptr.byte_index + n == BLOCKSIZE) {
+            addr_t next_addr = tfs_read_addr(block);
+            if (next_addr == 0)
+                next_addr = file_meta->inode_index;
+            file_meta->ptr.block_num = next_addr;
+            file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
+            file_meta->ra_sequential = true;
+        } else {
+            file_meta->ptr.byte_index += n;
+        }
+        file_meta->offset += n;
+        got += n;
+    }
+    // what was read before an error still counts
+    if (got == 0)
+        fail_if(err);
+    return got;
+}
  
 /* change the file pointer location to offset (absolute). Returns success/error codes.*/ 
-int tfs_seek(fileDescriptor FD, int offset) {
+int tfs_op_seek(fileDescriptor FD, int offset) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
     if (!tfs_openfile_table[FD].live)
@@ -588,25 +1041,30 @@ int tfs_seek(fileDescriptor FD, int offset) {
     int block = (offset - byte) / TFS_BLOCK__FILE_SIZE_DATA;
 
     struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    file_meta->offset = offset;
+    file_meta->ra_block = 0;
+    file_meta->ra_sequential = false;
 
-    char block_inode[BLOCKSIZE];
-    fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    if (file_meta->compressed || file_meta->indexed) {
+        // blocks are found by logical offset on the next read
+        return TFS_OK;
+    }
 
-    int block_index = tfs_read_addr(block_inode);
+    if (file_meta->block_map == NULL)
+        fail_if(tfs_block_map_load(file_meta));
 
-    while (block > 0) {
-        char block_tmp[BLOCKSIZE];
-        fail_if(readBlock(tfs_meta.disk, block_index, block_tmp));
-        block_index = tfs_read_addr(block_tmp);
-        block--;
+    if (block >= file_meta->block_map_count) {
+        // at or past the end, readByte stops on the size
+        file_meta->ptr.block_num = file_meta->inode_index;
+        file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
+        return TFS_OK;
     }
-
-    file_meta->ptr.block_num = block_index;
+    file_meta->ptr.block_num = file_meta->block_map[block];
     file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA + byte;
     return TFS_OK;
 }
 
-struct tfs_stat tfs_readFileInfo(fileDescriptor FD) {
+struct tfs_stat tfs_op_readFileInfo(fileDescriptor FD) {
     if (!tfs_meta.mounted)
         return (struct tfs_stat){.err = TFS_ERR_NOT_MOUNTED};
     if (!tfs_openfile_table[FD].live)
@@ -626,21 +1084,160 @@ struct tfs_stat tfs_readFileInfo(fileDescriptor FD) {
     tmp.ctime = tfs_read_tstamp(block_inode, TSTAMP_CREATE);
     tmp.atime = tfs_read_tstamp(block_inode, TSTAMP_ACCESS);
     tmp.mtime = tfs_read_tstamp(block_inode, TSTAMP_MODIFY);
+    tmp.links = tfs_read_links(block_inode);
+    tmp.flags = block_inode[TFS_BLOCK_INODE_POS_FLAGS] & ~TFS_INODE_FLAGS_LAYOUT;
+    tmp.physical_size = tmp.size;
+    if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAGS_LAYOUT)
+        memcpy(&tmp.physical_size, &block_inode[TFS_BLOCK_INODE_POS_PSIZE], sizeof(uint16_t));
 
-    memcpy(tmp.name, file_meta->name, TFS_FILE_NAME_LEN_MAX);
+    memcpy(tmp.name, file_meta->name, TFS_FILE_NAME_LEN_MAX + 1);
     return tmp;
 }
 
-int tfs_checkConsistency() {
+/* Copies `len` bytes of the file from `offset` to the host descriptor out_fd, data blocks straight from the image. Returns the bytes copied. */
+int tfs_op_sendfile(fileDescriptor FD, int out_fd, int offset, int len) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live || file_meta->inode_index == 0)
+        return TFS_ERR_BAD_FD;
+    if (offset < 0 || len < 0)
+        return TFS_ERR_INVALID;
+    if (offset > file_meta->size)
+        return TFS_ERR_OUT_OF_BOUNDS;
+    if (len > file_meta->size - offset)
+        len = file_meta->size - offset;
+
+    int sent = 0;
+    while (sent < len) {
+        int pos = offset + sent;
+        int n;
+        if (file_meta->compressed) {
+            // compressed frames have to be decoded, those bytes go from memory
+            struct tfs_zframe* frame;
+            int err = tfs_zcache_get(file_meta->inode_index, pos / TFS_COMPRESS_FRAME, &frame);
+            fail_if(err);
+            n = frame->len - pos % TFS_COMPRESS_FRAME;
+            if (n > len - sent)
+                n = len - sent;
+            fail_if(tfs_send_bytes(out_fd, &frame->data[pos % TFS_COMPRESS_FRAME], n));
+            sent += n;
+            continue;
+        }
+        int block = pos / TFS_BLOCK__FILE_SIZE_DATA;
+        int byte = pos % TFS_BLOCK__FILE_SIZE_DATA;
+        n = TFS_BLOCK__FILE_SIZE_DATA - byte;
+        if (n > len - sent)
+            n = len - sent;
+        addr_t block_index;
+        if (file_meta->indexed) {
+            fail_if(tfs_index_get(file_meta->ptr.block_num, block, &block_index));
+        } else {
+            if (file_meta->block_map == NULL)
+                fail_if(tfs_block_map_load(file_meta));
+            if (block >= file_meta->block_map_count)
+                fail(TFS_ERR_OUT_OF_BOUNDS);
+            block_index = file_meta->block_map[block];
+        }
+        if (block_index == 0) {
+            // a hole of a sparse file
+            static const char zeros[TFS_BLOCK__FILE_SIZE_DATA];
+            fail_if(tfs_send_bytes(out_fd, zeros, n));
+        } else {
+            fail_if(sendBlock(tfs_meta.disk, block_index, TFS_BLOCK__FILE_POS__DATA + byte, n, out_fd));
+        }
+        sent += n;
+    }
+
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    tfs_write_tstamp_now(block_inode, TSTAMP_ACCESS);
+    fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    return sent;
+}
+
+/* Sets the TFS_FLAG_* storage policy of a file. Policies apply from the next
+tfs_writeFile, content already written stays as it is. */
+int tfs_op_setFlags(fileDescriptor FD, int flags) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live || file_meta->inode_index == 0)
+        return TFS_ERR_BAD_FD;
+    if (flags & ~TFS_FLAG_ALL)
+        return TFS_ERR_INVALID;
+
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    block_inode[TFS_BLOCK_INODE_POS_FLAGS] = (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAGS_LAYOUT) | flags;
+    fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    return TFS_OK;
+}
+
+int tfs_op_fallocate(fileDescriptor FD, int bytes) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live || file_meta->inode_index == 0)
+        return TFS_ERR_BAD_FD;
+    if (bytes < 0 || bytes > TFS_FILE_SIZE_MAX)
+        return TFS_ERR_INVALID;
+
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & (TFS_FLAG_DEDUP | TFS_FLAG_SPARSE | TFS_INODE_FLAG_INDEXED))
+        return TFS_ERR_INVALID;
+    uint16_t reserved = (bytes + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    memcpy(&block_inode[TFS_BLOCK_INODE_POS_RESRV], &reserved, sizeof(uint16_t));
+
+    /* lay the stored bytes out again at the start of one run of the reserved length */
+    int stored = tfs_read_size(block_inode);
+    if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_COMPRESSED) {
+        uint16_t physical_size;
+        memcpy(&physical_size, &block_inode[TFS_BLOCK_INODE_POS_PSIZE], sizeof(uint16_t));
+        stored = physical_size;
+    }
+    int count = (stored + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    if (count < reserved)
+        count = reserved;
+    static char data[TFS_FILE_SIZE_MAX];
+    addr_t old = tfs_read_addr(block_inode);
+    fail_if(tfs_read_chain(old, stored, data));
+    // the old chain is only freed once the inode points at the new one, so
+    // running out of space leaves the file as it was
+    addr_t first = 0;
+    if (count > 0) {
+        int err = tfs_chain_write(data, stored, count, file_meta->inode_index + 1, &first);
+        fail_if(err);
+    }
+    tfs_write_addr(block_inode, first);
+    fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    fail_if(tfs_free_chain(old));
+    tfs_block_map_drop(file_meta->inode_index);
+
+    // plain chains are read through ptr, which pointed into the old one
+    int fd;
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX; fd++) {
+        struct tfs_openfile* other = &tfs_openfile_table[fd];
+        if (other->live && other->inode_index == file_meta->inode_index && !other->compressed && other->size > 0)
+            fail_if(tfs_op_seek(fd, other->offset));
+    }
+    return TFS_OK;
+}
+
+int tfs_op_checkConsistency(void) {
     if (!tfs_meta.mounted)
         return TFS_ERR_NOT_MOUNTED;
 
     int block_count = 0;
+    int limit = tfs_formatted_limit();
+    fail_if(limit);
     /* check magic */ {
         char block_tmp[BLOCKSIZE];
         int block_index = 0;
-        while (readBlock(tfs_meta.disk, block_index, block_tmp) >= 0) {
-            if (block_tmp[TFS_BLOCK_EVERY_POS_MAGIC] != TFS_BLOCK_MAGIC)
+        while (block_index < limit && readBlock(tfs_meta.disk, block_index, block_tmp) >= 0) {
+            bool hole = block_tmp[TFS_BLOCK_EVERY_POS__TYPE] == 0 && block_tmp[TFS_BLOCK_EVERY_POS_MAGIC] == 0;
+            if (block_tmp[TFS_BLOCK_EVERY_POS_MAGIC] != TFS_BLOCK_MAGIC && !hole)
                 return TFS_ERR_INVALID;
             block_index++;
             block_count++;
@@ -653,28 +1250,3771 @@ int tfs_checkConsistency() {
     /* check indode sizes */ {
         char block_inode[BLOCKSIZE];
         int block_index = 0;
-        while (readBlock(tfs_meta.disk, block_index, block_inode) >= 0) {
+        while (block_index < limit && readBlock(tfs_meta.disk, block_index, block_inode) >= 0) {
             block_index++;
             if (block_inode[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE_INODE)
                 continue;
-            if (tfs_read_size(block_inode) > TFS_BLOCK__FILE_SIZE_DATA)
+            uint16_t reserved;
+            memcpy(&reserved, &block_inode[TFS_BLOCK_INODE_POS_RESRV], sizeof(uint16_t));
+            if (tfs_read_size(block_inode) == 0 && tfs_read_addr(block_inode) != 0 && reserved == 0)
                 return TFS_ERR_INVALID;
 
         }
     }
+    /* check directory entries point at inodes of the recorded type */ {
+        char block_dir[BLOCKSIZE];
+        int block_index = 0;
+        while (block_index < limit && readBlock(tfs_meta.disk, block_index, block_dir) >= 0) {
+            int type = block_dir[TFS_BLOCK_EVERY_POS__TYPE];
+            int pos = TFS_BLOCK__DENT_POS__ENTS;
+            int slots = TFS_BLOCK__DENT_SLOTS;
+            if (type == TFS_BLOCK_TYPE_SUPER || type == TFS_BLOCK_TYPE___DIR) {
+                pos = TFS_BLOCK___DIR_POS__ENTS;
+                slots = TFS_BLOCK___DIR_SLOTS;
+            } else if (type != TFS_BLOCK_TYPE__DENT) {
+                block_index++;
+                continue;
+            }
+            block_index++;
+            int slot;
+            for (slot = 0; slot < slots; slot++) {
+                char* dirent = &block_dir[pos + slot * TFS_DIRENT_SIZE];
+                addr_t inode;
+                memcpy(&inode, &dirent[TFS_DIRENT_POS_INODE], sizeof(addr_t));
+                if (inode == 0)
+                    continue;
+                char block_inode[BLOCKSIZE];
+                if (readBlock(tfs_meta.disk, inode, block_inode) < 0)
+                    return TFS_ERR_INVALID;
+                if (block_inode[TFS_BLOCK_EVERY_POS__TYPE] != dirent[TFS_DIRENT_POS__TYPE])
+                    return TFS_ERR_INVALID;
+            }
+        }
+    }
 
     return TFS_OK;
 }
 
-/******************************************************/
-/****************** Helper functions ******************/
-/******************************************************/
+/* Creates an empty directory at `path`. The parent directory must exist and nothing may already be named `path`. */
+int tfs_op_mkdir(char *path) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (path == NULL)
+        return TFS_ERR_INVALID;
 
-void tfs_write_addr(char* block, uint16_t addr) {
-    union {
-        uint16_t addr;
-        char addr_bytes[2];
-    } addr_union;
+    addr_t parent;
+    char name[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(path, &parent, name);
+    fail_if(err);
+    if (name[0] == '\0')
+        return TFS_ERR_EXISTS;
+
+    addr_t dir_index;
+    return tfs_dir_make(parent, name, &dir_index);
+}
+
+/* Removes the empty directory at `path`. The root cannot be removed. */
+int tfs_op_rmdir(char *path) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (path == NULL)
+        return TFS_ERR_INVALID;
+
+    addr_t parent;
+    char name[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(path, &parent, name);
+    fail_if(err);
+    if (name[0] == '\0')
+        return TFS_ERR_INVALID;
+
+    struct tfs_dir* parent_info;
+    fail_if(tfs_dir_load(parent, &parent_info));
+    struct tfs_dentry* dentry = tfs_dcache_find(parent, name);
+    if (dentry == NULL)
+        return TFS_ERR_NO_ENTRY;
+    if (dentry->type != TFS_BLOCK_TYPE___DIR)
+        return TFS_ERR_NOT_DIR;
+
+    addr_t dir_index = dentry->inode;
+    struct tfs_dir* dir_info;
+    fail_if(tfs_dir_load(dir_index, &dir_info));
+    if (dir_info->entry_count != 0)
+        return TFS_ERR_NOT_EMPTY;
+
+    fail_if(tfs_dir_remove(parent, dentry));
+    return tfs_dir_free(dir_index);
+}
+
+/* Atomically renames `old_path` to `new_path`. If `new_path` exists its entry
+is rewritten in place to point at the renamed inode and the inode it named
+loses a link, so there is never a moment where `new_path` is missing. Only
+directory entries change, file data is never copied. Directories may be moved
+anywhere but into themselves and only replace empty directories. */
+int tfs_op_rename(char *old_path, char *new_path) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (old_path == NULL || new_path == NULL)
+        return TFS_ERR_INVALID;
+
+    addr_t old_parent, new_parent;
+    char old_name[TFS_FILE_NAME_LEN_MAX + 1];
+    char new_name[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(old_path, &old_parent, old_name);
+    fail_if(err);
+    err = tfs_path_walk(new_path, &new_parent, new_name);
+    fail_if(err);
+    if (old_name[0] == '\0' || new_name[0] == '\0')
+        return TFS_ERR_INVALID;
+
+    struct tfs_dir* dir_info;
+    fail_if(tfs_dir_load(old_parent, &dir_info));
+    fail_if(tfs_dir_load(new_parent, &dir_info));
+    struct tfs_dentry* old_dentry = tfs_dcache_find(old_parent, old_name);
+    if (old_dentry == NULL)
+        return TFS_ERR_NO_ENTRY;
+    struct tfs_dentry* new_dentry = tfs_dcache_find(new_parent, new_name);
+    if (new_dentry == old_dentry || (new_dentry != NULL && new_dentry->inode == old_dentry->inode))
+        return TFS_OK;
+
+    addr_t inode = old_dentry->inode;
+    uint8_t type = old_dentry->type;
+    if (type == TFS_BLOCK_TYPE___DIR) {
+        /* a directory can't be moved below itself */
+        addr_t ancestor = new_parent;
+        while (ancestor != TFS_BLOCK__ROOT_INDEX) {
+            if (ancestor == inode)
+                return TFS_ERR_INVALID;
+            char block_dir[BLOCKSIZE];
+            fail_if(readBlock(tfs_meta.disk, ancestor, block_dir));
+            memcpy(&ancestor, &block_dir[TFS_BLOCK___DIR_POS_PARENT], sizeof(addr_t));
+        }
+    }
+
+    if (new_dentry != NULL) {
+        addr_t victim = new_dentry->inode;
+        uint8_t victim_type = new_dentry->type;
+        if (victim_type == TFS_BLOCK_TYPE___DIR && type != TFS_BLOCK_TYPE___DIR)
+            return TFS_ERR_IS_DIR;
+        if (victim_type != TFS_BLOCK_TYPE___DIR && type == TFS_BLOCK_TYPE___DIR)
+            return TFS_ERR_NOT_DIR;
+        if (victim_type == TFS_BLOCK_TYPE___DIR) {
+            struct tfs_dir* victim_info;
+            fail_if(tfs_dir_load(victim, &victim_info));
+            if (victim_info->entry_count != 0)
+                return TFS_ERR_NOT_EMPTY;
+        }
+
+        // the swap itself - a single block write
+        struct tfs_dirent_loc loc = {.block = new_dentry->block, .slot = new_dentry->slot};
+        fail_if(tfs_dirent_write(new_parent, loc, inode, type, new_name));
+        new_dentry->inode = inode;
+        new_dentry->type = type;
+        fail_if(tfs_dir_remove(old_parent, old_dentry));
+
+        if (victim_type == TFS_BLOCK_TYPE___DIR) {
+            fail_if(tfs_dir_free(victim));
+        } else {
+            /* open descriptors of the replaced file see it as deleted */
+            tfs_block_map_drop(victim);
+            int i;
+            for (i = 0; i < TFS_OPEN_FILES_MAX; i++) {
+                struct tfs_openfile* file = &tfs_openfile_table[i];
+                if (!file->live || file->inode_index != victim)
+                    continue;
+                fail_if(tfs_stream_abort(file));
+                struct tfs_openfile new_file_meta = {0};
+                new_file_meta.live = true;
+                new_file_meta.parent = file->parent;
+                memcpy(new_file_meta.name, file->name, TFS_FILE_NAME_LEN_MAX + 1);
+                memcpy(file, &new_file_meta, sizeof(struct tfs_openfile));
+            }
+            fail_if(tfs_inode_unlink(victim));
+        }
+    } else {
+        // new name first so a crash leaves an extra name rather than none
+        fail_if(tfs_dir_add(new_parent, new_name, inode, type));
+        fail_if(tfs_dir_remove(old_parent, old_dentry));
+    }
+
+    if (type == TFS_BLOCK_TYPE___DIR && old_parent != new_parent) {
+        char block_dir[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, inode, block_dir));
+        memcpy(&block_dir[TFS_BLOCK___DIR_POS_PARENT], &new_parent, sizeof(addr_t));
+        fail_if(writeBlock(tfs_meta.disk, inode, block_dir));
+    }
+
+    /* open descriptors follow the file to its new name */ {
+        int i;
+        for (i = 0; i < TFS_OPEN_FILES_MAX; i++) {
+            struct tfs_openfile* file = &tfs_openfile_table[i];
+            if (!file->live || file->parent != old_parent || strcmp(file->name, old_name) != 0)
+                continue;
+            if (file->inode_index != 0 && file->inode_index != inode)
+                continue;
+            file->parent = new_parent;
+            memcpy(file->name, new_name, TFS_FILE_NAME_LEN_MAX + 1);
+        }
+    }
+    return TFS_OK;
+}
+
+/* Gives the file at `old_path` the additional name `new_path`. */
+int tfs_op_link(char *old_path, char *new_path) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (old_path == NULL || new_path == NULL)
+        return TFS_ERR_INVALID;
+
+    addr_t old_parent, new_parent;
+    char old_name[TFS_FILE_NAME_LEN_MAX + 1];
+    char new_name[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(old_path, &old_parent, old_name);
+    fail_if(err);
+    err = tfs_path_walk(new_path, &new_parent, new_name);
+    fail_if(err);
+    if (old_name[0] == '\0' || new_name[0] == '\0')
+        return TFS_ERR_INVALID;
+
+    struct tfs_dir* dir_info;
+    fail_if(tfs_dir_load(old_parent, &dir_info));
+    fail_if(tfs_dir_load(new_parent, &dir_info));
+    struct tfs_dentry* old_dentry = tfs_dcache_find(old_parent, old_name);
+    if (old_dentry == NULL)
+        return TFS_ERR_NO_ENTRY;
+    if (old_dentry->type == TFS_BLOCK_TYPE___DIR)
+        return TFS_ERR_IS_DIR;
+    if (tfs_dcache_find(new_parent, new_name) != NULL)
+        return TFS_ERR_EXISTS;
+
+    addr_t inode = old_dentry->inode;
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, inode, block_inode));
+    uint16_t links = tfs_read_links(block_inode);
+    if (links == UINT16_MAX)
+        return TFS_ERR_OUT_OF_BOUNDS;
+    tfs_write_links(block_inode, links + 1);
+    fail_if(writeBlock(tfs_meta.disk, inode, block_inode));
+
+    if ((err = tfs_dir_add(new_parent, new_name, inode, TFS_BLOCK_TYPE_INODE)) < 0) {
+        tfs_write_links(block_inode, links);
+        writeBlock(tfs_meta.disk, inode, block_inode);
+        fail(err);
+    }
+    return TFS_OK;
+}
+
+/* Creates `dst_path` as a copy of the file at `src_path` without copying any
+data. Both files share the source's blocks until either is rewritten, at
+which point the writer gets fresh blocks and the shared ones lose a reference. */
+int tfs_op_clone(char *src_path, char *dst_path) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (src_path == NULL || dst_path == NULL)
+        return TFS_ERR_INVALID;
+
+    addr_t src_parent, dst_parent;
+    char src_name[TFS_FILE_NAME_LEN_MAX + 1];
+    char dst_name[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(src_path, &src_parent, src_name);
+    fail_if(err);
+    err = tfs_path_walk(dst_path, &dst_parent, dst_name);
+    fail_if(err);
+    if (src_name[0] == '\0' || dst_name[0] == '\0')
+        return TFS_ERR_INVALID;
+
+    struct tfs_dir* dir_info;
+    fail_if(tfs_dir_load(src_parent, &dir_info));
+    fail_if(tfs_dir_load(dst_parent, &dir_info));
+    struct tfs_dentry* src_dentry = tfs_dcache_find(src_parent, src_name);
+    if (src_dentry == NULL)
+        return TFS_ERR_NO_ENTRY;
+    if (src_dentry->type == TFS_BLOCK_TYPE___DIR)
+        return TFS_ERR_IS_DIR;
+    if (tfs_dcache_find(dst_parent, dst_name) != NULL)
+        return TFS_ERR_EXISTS;
+
+    return tfs_inode_clone(src_dentry->inode, dst_parent, dst_name, true);
+}
+
+/* directory entries copied out of a directory so it can be walked while the tree changes */
+struct tfs_dirent_copy {
+    addr_t inode;
+    uint8_t type;
+    char name[TFS_FILE_NAME_LEN_MAX + 1];
+};
+
+int tfs_dir_list(addr_t dir, struct tfs_dirent_copy** out, int* count);
+
+/* Clones every file below `src` into `dst`, skipping the directory `skip`.
+ * With `share` false only the references are taken, nothing is created */
+int tfs_snapshot_dir(addr_t src, addr_t dst, addr_t skip, bool share) {
+    struct tfs_dirent_copy* entries;
+    int entry_count;
+    fail_if(tfs_dir_list(src, &entries, &entry_count));
+
+    int err = TFS_OK;
+    int i;
+    for (i = 0; i < entry_count && err >= 0; i++) {
+        struct tfs_dirent_copy* entry = &entries[i];
+        if (entry->inode == skip)
+            continue;
+        if (entry->type != TFS_BLOCK_TYPE___DIR) {
+            if (share) {
+                err = tfs_inode_clone(entry->inode, dst, entry->name, false);
+                continue;
+            }
+            char block_inode[BLOCKSIZE];
+            if ((err = readBlock(tfs_meta.disk, entry->inode, block_inode)) < 0)
+                break;
+            addr_t first = tfs_read_addr(block_inode);
+            if (first != 0)
+                tfs_meta.refs[first]++;
+            continue;
+        }
+        addr_t sub_dst = 0;
+        if (share) {
+            if ((err = tfs_dir_make(dst, entry->name, &sub_dst)) < 0)
+                break;
+        }
+        err = tfs_snapshot_dir(entry->inode, sub_dst, skip, share);
+    }
+    free(entries);
+    return err;
+}
+
+/* Freezes the current state of the whole image into a new directory at
+`path`. Only metadata is written: every file below the root gets a new inode
+sharing its data blocks, so the snapshot costs O(inodes + entries) no matter
+how much data there is. Later writes to either side copy on write. */
+int tfs_op_snapshot(char *path) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (path == NULL)
+        return TFS_ERR_INVALID;
+
+    addr_t parent;
+    char name[TFS_FILE_NAME_LEN_MAX + 1];
+    int err = tfs_path_walk(path, &parent, name);
+    fail_if(err);
+    if (name[0] == '\0')
+        return TFS_ERR_EXISTS;
+
+    addr_t snapshot;
+    if ((err = tfs_dir_make(parent, name, &snapshot)) < 0)
+        fail(err);
+
+    // take every reference up front so a crash part way through only leaks
+    if ((err = tfs_snapshot_dir(TFS_BLOCK__ROOT_INDEX, 0, snapshot, false)) < 0)
+        fail(err);
+    fail_if(tfs_refs_sync());
+    if ((err = tfs_snapshot_dir(TFS_BLOCK__ROOT_INDEX, snapshot, snapshot, true)) < 0)
+        fail(err);
+    return TFS_OK;
+}
+
+/* Grows or shrinks the mounted image to `newBytes`. New blocks start out
+ * past the high-water mark, so growing only has to extend the backing file.
+ * Shrinking first moves every live block out of the cut off tail */
+int tfs_op_resize(int newBytes) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (newBytes < BLOCKSIZE || newBytes / BLOCKSIZE > TFS_BLOCK_COUNT_MAX)
+        return TFS_ERR_INVALID;
+    // blocks claimed by streaming writes look free or punched on disk
+    if (tfs_meta.streams > 0)
+        return TFS_ERR_BUSY;
+    uint32_t new_count = newBytes / BLOCKSIZE;
+
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    uint32_t count = tfs_read_count(block_super);
+    uint32_t hwm = tfs_read_hwm(block_super);
+    if (count == 0) {
+        // formatted before the high-water mark existed, every block was written
+        char block[BLOCKSIZE];
+        while (readBlock(tfs_meta.disk, count, block) >= 0)
+            count++;
+        hwm = count;
+    }
+
+    if (new_count < count) {
+        int err = tfs_shrink(new_count, hwm);
+        fail_if(err);
+    } else {
+        fail_if(resizeDisk(tfs_meta.disk, new_count * BLOCKSIZE));
+        tfs_meta.space_valid = false;
+        tfs_write_hwm(block_super, hwm);
+        tfs_write_count(block_super, new_count);
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    }
+    return TFS_OK;
+}
+
+/* drops one link from a file inode, freeing it and its blocks with the last one */
+int tfs_inode_unlink(addr_t inode_index) {
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, inode_index, block_inode));
+    assert(block_inode[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE_INODE, "block type is not inode");
+    assert(block_inode[TFS_BLOCK_EVERY_POS_MAGIC] == TFS_BLOCK_MAGIC, "block magic is not correct");
+
+    uint16_t links = tfs_read_links(block_inode);
+    if (links > 1) {
+        tfs_write_links(block_inode, links - 1);
+        fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode));
+        return TFS_OK;
+    }
+
+    fail_if(tfs_free_data(block_inode));
+    tfs_zcache_drop(inode_index);
+    fail_if(tfs_block_free(inode_index));
+    return TFS_OK;
+}
+
+/* frees an (already unlinked) directory inode and its entry blocks */
+int tfs_dir_free(addr_t dir_index) {
+    char block_dir[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, dir_index, block_dir));
+    addr_t dent_index;
+    memcpy(&dent_index, &block_dir[TFS_BLOCK___DIR_POS__NEXT], sizeof(addr_t));
+    while (dent_index != 0) {
+        char block_dent[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, dent_index, block_dent));
+        addr_t next_dent_index = tfs_read_addr(block_dent);
+        fail_if(tfs_block_free(dent_index));
+        dent_index = next_dent_index;
+    }
+    fail_if(tfs_block_free(dir_index));
+
+    struct tfs_dir* dir_info = tfs_meta.dirs[dir_index];
+    if (dir_info != NULL) {
+        free(dir_info->free);
+        free(dir_info);
+        tfs_meta.dirs[dir_index] = NULL;
+    }
+    return TFS_OK;
+}
+
+/******************************************************/
+/******************* Stats functions ******************/
+/******************************************************/
+
+/* Every timed tfs_* call is a wrapper around its tfs_op_* body, so calls
+ * the library makes to itself aren't counted twice, and runs under tfs_mutex */
+int tfs_mkfs(char *filename, int nBytes) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_mkfs(filename, nBytes);
+    uint64_t ns = tfs_stats_op(TFS_OP_MKFS, start, ret);
+    tfs_trace_call(TFS_OP_MKFS, start, ns, ret, nBytes, 0, 0, filename, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_mount(char *diskname) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_mount(diskname);
+    uint64_t ns = tfs_stats_op(TFS_OP_MOUNT, start, ret);
+    tfs_trace_call(TFS_OP_MOUNT, start, ns, ret, 0, 0, 0, diskname, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_unmount(void) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_unmount();
+    uint64_t ns = tfs_stats_op(TFS_OP_UNMOUNT, start, ret);
+    tfs_trace_call(TFS_OP_UNMOUNT, start, ns, ret, 0, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+fileDescriptor tfs_openFile(char *name) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    fileDescriptor ret = tfs_op_openFile(name);
+    uint64_t ns = tfs_stats_op(TFS_OP_OPEN_FILE, start, ret);
+    tfs_trace_call(TFS_OP_OPEN_FILE, start, ns, ret, 0, 0, 0, name, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_closeFile(fileDescriptor FD) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_closeFile(FD);
+    uint64_t ns = tfs_stats_op(TFS_OP_CLOSE_FILE, start, ret);
+    tfs_trace_call(TFS_OP_CLOSE_FILE, start, ns, ret, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_writeFile(fileDescriptor FD, char *buffer, int size) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_writeFile(FD, buffer, size);
+    uint64_t ns = tfs_stats_op(TFS_OP_WRITE_FILE, start, ret);
+    tfs_trace_call(TFS_OP_WRITE_FILE, start, ns, ret, FD, size, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_deleteFile(fileDescriptor FD) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_deleteFile(FD);
+    uint64_t ns = tfs_stats_op(TFS_OP_DELETE_FILE, start, ret);
+    tfs_trace_call(TFS_OP_DELETE_FILE, start, ns, ret, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_readByte(fileDescriptor FD, char *buffer) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_readByte(FD, buffer);
+    uint64_t ns = tfs_stats_op(TFS_OP_READ_BYTE, start, ret);
+    tfs_trace_call(TFS_OP_READ_BYTE, start, ns, ret, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_seek(fileDescriptor FD, int offset) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_seek(FD, offset);
+    uint64_t ns = tfs_stats_op(TFS_OP_SEEK, start, ret);
+    tfs_trace_call(TFS_OP_SEEK, start, ns, ret, FD, offset, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+struct tfs_stat tfs_readFileInfo(fileDescriptor FD) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    struct tfs_stat stat = tfs_op_readFileInfo(FD);
+    uint64_t ns = tfs_stats_op(TFS_OP_READ_FILE_INFO, start, stat.err);
+    tfs_trace_call(TFS_OP_READ_FILE_INFO, start, ns, stat.err, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return stat;
+}
+
+int tfs_sendfile(fileDescriptor FD, int out_fd, int offset, int len) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_sendfile(FD, out_fd, offset, len);
+    uint64_t ns = tfs_stats_op(TFS_OP_SENDFILE, start, ret);
+    tfs_trace_call(TFS_OP_SENDFILE, start, ns, ret, FD, offset, len, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_setFlags(fileDescriptor FD, int flags) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_setFlags(FD, flags);
+    uint64_t ns = tfs_stats_op(TFS_OP_SET_FLAGS, start, ret);
+    tfs_trace_call(TFS_OP_SET_FLAGS, start, ns, ret, FD, flags, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_fallocate(fileDescriptor FD, int bytes) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_fallocate(FD, bytes);
+    uint64_t ns = tfs_stats_op(TFS_OP_FALLOCATE, start, ret);
+    tfs_trace_call(TFS_OP_FALLOCATE, start, ns, ret, FD, bytes, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_checkConsistency(void) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_checkConsistency();
+    uint64_t ns = tfs_stats_op(TFS_OP_CHECK_CONSISTENCY, start, ret);
+    tfs_trace_call(TFS_OP_CHECK_CONSISTENCY, start, ns, ret, 0, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_mkdir(char *path) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_mkdir(path);
+    uint64_t ns = tfs_stats_op(TFS_OP_MKDIR, start, ret);
+    tfs_trace_call(TFS_OP_MKDIR, start, ns, ret, 0, 0, 0, path, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_rmdir(char *path) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_rmdir(path);
+    uint64_t ns = tfs_stats_op(TFS_OP_RMDIR, start, ret);
+    tfs_trace_call(TFS_OP_RMDIR, start, ns, ret, 0, 0, 0, path, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_rename(char *old_path, char *new_path) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_rename(old_path, new_path);
+    uint64_t ns = tfs_stats_op(TFS_OP_RENAME, start, ret);
+    tfs_trace_call(TFS_OP_RENAME, start, ns, ret, 0, 0, 0, old_path, new_path);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_link(char *old_path, char *new_path) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_link(old_path, new_path);
+    uint64_t ns = tfs_stats_op(TFS_OP_LINK, start, ret);
+    tfs_trace_call(TFS_OP_LINK, start, ns, ret, 0, 0, 0, old_path, new_path);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_clone(char *src_path, char *dst_path) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_clone(src_path, dst_path);
+    uint64_t ns = tfs_stats_op(TFS_OP_CLONE, start, ret);
+    tfs_trace_call(TFS_OP_CLONE, start, ns, ret, 0, 0, 0, src_path, dst_path);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_snapshot(char *path) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_snapshot(path);
+    uint64_t ns = tfs_stats_op(TFS_OP_SNAPSHOT, start, ret);
+    tfs_trace_call(TFS_OP_SNAPSHOT, start, ns, ret, 0, 0, 0, path, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_resize(int newBytes) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_resize(newBytes);
+    uint64_t ns = tfs_stats_op(TFS_OP_RESIZE, start, ret);
+    tfs_trace_call(TFS_OP_RESIZE, start, ns, ret, newBytes, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_writeBegin(fileDescriptor FD) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_writeBegin(FD);
+    uint64_t ns = tfs_stats_op(TFS_OP_WRITE_BEGIN, start, ret);
+    tfs_trace_call(TFS_OP_WRITE_BEGIN, start, ns, ret, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_writeChunk(fileDescriptor FD, char *buffer, int size) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_writeChunk(FD, buffer, size);
+    uint64_t ns = tfs_stats_op(TFS_OP_WRITE_CHUNK, start, ret);
+    tfs_trace_call(TFS_OP_WRITE_CHUNK, start, ns, ret, FD, size, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_writeCommit(fileDescriptor FD) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_writeCommit(FD);
+    uint64_t ns = tfs_stats_op(TFS_OP_WRITE_COMMIT, start, ret);
+    tfs_trace_call(TFS_OP_WRITE_COMMIT, start, ns, ret, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_writeAbort(fileDescriptor FD) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_writeAbort(FD);
+    uint64_t ns = tfs_stats_op(TFS_OP_WRITE_ABORT, start, ret);
+    tfs_trace_call(TFS_OP_WRITE_ABORT, start, ns, ret, FD, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_batch(struct tfs_batch_op* ops, int count) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_batch(ops, count);
+    uint64_t ns = tfs_stats_op(TFS_OP_BATCH, start, ret);
+    tfs_trace_batch(start, ns, ret, ops, count);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_defrag(int budgetMs) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_defrag(budgetMs);
+    uint64_t ns = tfs_stats_op(TFS_OP_DEFRAG, start, ret);
+    tfs_trace_call(TFS_OP_DEFRAG, start, ns, ret, budgetMs, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_clean(int budgetMs) {
+    tfs_lock();
+    uint64_t start = tfs_stats_now();
+    int ret = tfs_op_clean(budgetMs);
+    uint64_t ns = tfs_stats_op(TFS_OP_CLEAN, start, ret);
+    tfs_trace_call(TFS_OP_CLEAN, start, ns, ret, budgetMs, 0, 0, NULL, NULL);
+    tfs_unlock();
+    return ret;
+}
+
+static const char* tfs_op_names[TFS_OP_COUNT] = {
+    "tfs_mkfs",
+    "tfs_mount",
+    "tfs_unmount",
+    "tfs_openFile",
+    "tfs_closeFile",
+    "tfs_writeFile",
+    "tfs_deleteFile",
+    "tfs_readByte",
+    "tfs_seek",
+    "tfs_readFileInfo",
+    "tfs_sendfile",
+    "tfs_setFlags",
+    "tfs_fallocate",
+    "tfs_checkConsistency",
+    "tfs_mkdir",
+    "tfs_rmdir",
+    "tfs_rename",
+    "tfs_link",
+    "tfs_clone",
+    "tfs_snapshot",
+    "tfs_resize",
+    "tfs_writeBegin",
+    "tfs_writeChunk",
+    "tfs_writeCommit",
+    "tfs_writeAbort",
+    "tfs_batch",
+    "tfs_defrag",
+    "tfs_clean",
+    "tfs_read_async"
+};
+
+int tfs_getStats(struct tfs_stats *stats) {
+    if (stats == NULL)
+        return TFS_ERR_INVALID;
+    struct disk_stats disk;
+    tfs_lock();
+    diskStats(&disk);
+    *stats = tfs_stats;
+    tfs_unlock();
+    stats->block_reads = disk.reads - tfs_stats_disk.reads;
+    stats->block_writes = disk.writes - tfs_stats_disk.writes;
+    stats->bytes_read = (uint64_t)(disk.blocks_read - tfs_stats_disk.blocks_read) * BLOCKSIZE;
+    stats->bytes_written = (uint64_t)(disk.blocks_written - tfs_stats_disk.blocks_written) * BLOCKSIZE;
+    stats->syscalls = disk.syscalls - tfs_stats_disk.syscalls;
+    return TFS_OK;
+}
+
+void tfs_resetStats(void) {
+    tfs_lock();
+    memset(&tfs_stats, 0, sizeof(tfs_stats));
+    // libDisk's counters only go up, later reads are relative to now
+    diskStats(&tfs_stats_disk);
+    tfs_unlock();
+}
+
+void tfs_lock(void) {
+    pthread_mutex_lock(&tfs_mutex);
+}
+
+void tfs_unlock(void) {
+    pthread_mutex_unlock(&tfs_mutex);
+}
+
+const char *tfs_opName(int op) {
+    if (op < 0 || op >= TFS_OP_COUNT)
+        return NULL;
+    return tfs_op_names[op];
+}
+
+uint64_t tfs_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* counts a call to `op` that started at `start` and returned `ret`, returns how long it took */
+uint64_t tfs_stats_op(int op, uint64_t start, int ret) {
+    uint64_t ns = tfs_stats_now() - start;
+    struct tfs_op_stats* op_stats = &tfs_stats.ops[op];
+    op_stats->calls++;
+    if (ret < 0)
+        op_stats->errors++;
+    op_stats->total_ns += ns;
+    int bucket = 0;
+    while (bucket + 1 < TFS_LATENCY_BUCKETS && ns >> (bucket + 1) != 0)
+        bucket++;
+    op_stats->latency[bucket]++;
+    return ns;
+}
+
+/******************************************************/
+/******************* Trace functions ******************/
+/******************************************************/
+
+int tfs_traceStart(char *path) {
+    tfs_lock();
+    int ret = tfs_trace_start(path);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_traceStop(void) {
+    tfs_lock();
+    int ret = tfs_trace_stop();
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_trace_start(char *path) {
+    if (tfs_trace.file != NULL)
+        return TFS_ERR_BUSY;
+    struct tfs_trace_header header = { TFS_TRACE_MAGIC, TFS_TRACE_VERSION, 0, 0 };
+    if (tfs_meta.mounted) {
+        char block_super[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        // images from before the block count was kept leave it 0, unknown
+        header.image_bytes = tfs_read_count(block_super) * BLOCKSIZE;
+    }
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return -(errno);
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return TFS_ERR_IO;
+    }
+    tfs_trace.file = file;
+    tfs_trace.start = tfs_stats_now();
+    setDiskTrace(tfs_trace_io);
+    return TFS_OK;
+}
+
+int tfs_trace_stop(void) {
+    if (tfs_trace.file == NULL)
+        return TFS_ERR_INVALID;
+    setDiskTrace(NULL);
+    bool failed = ferror(tfs_trace.file) != 0;
+    failed = fclose(tfs_trace.file) != 0 || failed;
+    tfs_trace.file = NULL;
+    // a record that didn't make it to the file leaves the trace cut short
+    return failed ? TFS_ERR_IO : TFS_OK;
+}
+
+/* Appends a record for a call to `op` with its integer arguments and up to
+ * two paths. Block I/O the call did was recorded as it happened, so it
+ * comes before the call in the trace */
+void tfs_trace_call(int op, uint64_t start, uint64_t ns, int ret, int arg0, int arg1, int arg2, const char* str0, const char* str1) {
+    if (tfs_trace.file == NULL)
+        return;
+    struct tfs_trace_record record = {0};
+    record.type = TFS_TRACE_CALL;
+    record.op = op;
+    record.ret = ret;
+    record.args[0] = arg0;
+    record.args[1] = arg1;
+    record.args[2] = arg2;
+    record.start_ns = start - tfs_trace.start;
+    record.ns = ns;
+    if (str0 != NULL)
+        record.len += strlen(str0) + 1;
+    if (str1 != NULL)
+        record.len += strlen(str1) + 1;
+    fwrite(&record, sizeof(record), 1, tfs_trace.file);
+    if (str0 != NULL)
+        fwrite(str0, strlen(str0) + 1, 1, tfs_trace.file);
+    if (str1 != NULL)
+        fwrite(str1, strlen(str1) + 1, 1, tfs_trace.file);
+}
+
+/* a tfs_batch record lists each op as its TFS_BATCH_* byte, its size and its path */
+void tfs_trace_batch(uint64_t start, uint64_t ns, int ret, struct tfs_batch_op* ops, int count) {
+    if (tfs_trace.file == NULL)
+        return;
+    struct tfs_trace_record record = {0};
+    record.type = TFS_TRACE_CALL;
+    record.op = TFS_OP_BATCH;
+    record.ret = ret;
+    record.args[0] = count;
+    record.start_ns = start - tfs_trace.start;
+    record.ns = ns;
+    int i;
+    for (i = 0; ops != NULL && i < count; i++)
+        record.len += 1 + sizeof(int32_t) + (ops[i].path != NULL ? strlen(ops[i].path) : 0) + 1;
+    fwrite(&record, sizeof(record), 1, tfs_trace.file);
+    for (i = 0; ops != NULL && i < count; i++) {
+        uint8_t op = ops[i].op;
+        int32_t size = ops[i].size;
+        const char* path = ops[i].path != NULL ? ops[i].path : "";
+        fwrite(&op, sizeof(op), 1, tfs_trace.file);
+        fwrite(&size, sizeof(size), 1, tfs_trace.file);
+        fwrite(path, strlen(path) + 1, 1, tfs_trace.file);
+    }
+}
+
+/* libDisk's trace callback */
+void tfs_trace_io(int disk, int kind, int bNum, int count) {
+    if (tfs_trace.file == NULL)
+        return;
+    struct tfs_trace_record record = {0};
+    record.type = TFS_TRACE_IO;
+    record.op = kind;
+    record.args[0] = bNum;
+    record.args[1] = count;
+    record.start_ns = tfs_stats_now() - tfs_trace.start;
+    fwrite(&record, sizeof(record), 1, tfs_trace.file);
+}
+
+/******************************************************/
+/***************** Readahead functions ****************/
+/******************************************************/
+
+/* counts the data block `file` just moved on to and, if the file is being
+ * read in order and the block isn't read ahead already, reads it and the
+ * blocks after it on disk in one I/O. That bets on the rest of the chain
+ * being contiguous; when it isn't, the next block of the chain misses and
+ * starts a new window from there */
+int tfs_readahead(struct tfs_openfile* file) {
+    addr_t block_index = file->ptr.block_num;
+    tfs_meta.readahead_stats.reads++;
+    if (isReadAhead(tfs_meta.disk, block_index)) {
+        tfs_meta.readahead_stats.hits++;
+        return TFS_OK;
+    }
+    int block_start = file->offset - (file->ptr.byte_index - TFS_BLOCK__FILE_POS__DATA);
+    if (tfs_meta.readahead == 0 || (!file->ra_sequential && block_start != 0))
+        return TFS_OK;
+    int count = (file->size - block_start + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    if (count > tfs_meta.readahead)
+        count = tfs_meta.readahead;
+    // a lone block is read just as well by readBlock
+    if (count < 2)
+        return TFS_OK;
+    // the blocks are only a guess, a failed read is left to readBlock to report
+    int read = readaheadBlocks(tfs_meta.disk, block_index, count);
+    if (read > 0) {
+        tfs_meta.readahead_stats.ios++;
+        tfs_meta.readahead_stats.blocks += read;
+    }
+    return TFS_OK;
+}
+
+int tfs_setReadahead(int blocks) {
+    tfs_lock();
+    int ret = TFS_OK;
+    if (!tfs_meta.mounted)
+        ret = TFS_ERR_NOT_MOUNTED;
+    else if (blocks < 0 || blocks > READAHEAD_BLOCKS_MAX)
+        ret = TFS_ERR_INVALID;
+    else
+        tfs_meta.readahead = blocks;
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_readaheadStats(struct tfs_readahead_stats *stats) {
+    tfs_lock();
+    int ret = TFS_OK;
+    if (!tfs_meta.mounted)
+        ret = TFS_ERR_NOT_MOUNTED;
+    else if (stats == NULL)
+        ret = TFS_ERR_INVALID;
+    else
+        *stats = tfs_meta.readahead_stats;
+    tfs_unlock();
+    return ret;
+}
+
+/******************************************************/
+/***************** Write-back functions ***************/
+/******************************************************/
+
+int tfs_setWriteBack(int blocks, int dirtyPct, int ageMs) {
+    tfs_lock();
+    int ret = tfs_meta.mounted ? diskWriteBack(tfs_meta.disk, blocks, dirtyPct, ageMs) : TFS_ERR_NOT_MOUNTED;
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_sync(void) {
+    tfs_lock();
+    int ret = tfs_meta.mounted ? flushDisk(tfs_meta.disk) : TFS_ERR_NOT_MOUNTED;
+    tfs_unlock();
+    return ret;
+}
+
+/******************************************************/
+/******************** Async functions *****************/
+/******************************************************/
+
+/* runs a queued call through the timed tfs_* calls, so it's counted and
+ * traced like the caller had made it. A read is one call of its own rather
+ * than a tfs_readByte per byte */
+int tfs_async_run(struct tfs_async_call *call) {
+    switch (call->op) {
+    case TFS_ASYNC_OPEN:
+        return tfs_openFile(call->name);
+    case TFS_ASYNC_WRITE:
+        return tfs_writeFile(call->fd, call->buffer, call->size);
+    case TFS_ASYNC_READ: {
+        tfs_lock();
+        uint64_t start = tfs_stats_now();
+        int ret = tfs_op_read(call->fd, call->buffer, call->size);
+        uint64_t ns = tfs_stats_op(TFS_OP_READ_ASYNC, start, ret);
+        tfs_trace_call(TFS_OP_READ_ASYNC, start, ns, ret, call->fd, call->size, 0, NULL, NULL);
+        tfs_unlock();
+        return ret;
+    }
+    }
+    return TFS_ERR_INVALID;
+}
+
+void *tfs_async_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&tfs_async.lock);
+    while (!tfs_async.stop || tfs_async.run != tfs_async.tail) {
+        if (tfs_async.run == tfs_async.tail) {
+            pthread_cond_wait(&tfs_async.work, &tfs_async.lock);
+            continue;
+        }
+        struct tfs_async_call *call = &tfs_async.calls[tfs_async.run % TFS_ASYNC_QUEUE_MAX];
+        pthread_mutex_unlock(&tfs_async.lock);
+        int ret = tfs_async_run(call);
+        pthread_mutex_lock(&tfs_async.lock);
+        call->ret = ret;
+        tfs_async.run++;
+        uint64_t one = 1;
+        // can't fail, the counter is nowhere near its limit
+        write(tfs_async.efd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&tfs_async.lock);
+    return NULL;
+}
+
+int tfs_async_start(void) {
+    if (tfs_async.running)
+        return tfs_async.efd;
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0)
+        return -(errno);
+    tfs_async.efd = efd;
+    tfs_async.stop = false;
+    tfs_async.head = tfs_async.run = tfs_async.tail = 0;
+    if (pthread_create(&tfs_async.thread, NULL, tfs_async_worker, NULL) != 0) {
+        close(efd);
+        return TFS_ERR_NO_MEMORY;
+    }
+    tfs_async.running = true;
+    return efd;
+}
+
+int tfs_async_stop(void) {
+    if (!tfs_async.running)
+        return TFS_ERR_INVALID;
+    pthread_mutex_lock(&tfs_async.lock);
+    tfs_async.stop = true;
+    pthread_cond_signal(&tfs_async.work);
+    pthread_mutex_unlock(&tfs_async.lock);
+    pthread_join(tfs_async.thread, NULL);
+    // completions nobody polled
+    for (; tfs_async.head != tfs_async.tail; tfs_async.head++)
+        free(tfs_async.calls[tfs_async.head % TFS_ASYNC_QUEUE_MAX].name);
+    close(tfs_async.efd);
+    tfs_async.running = false;
+    return TFS_OK;
+}
+
+/* queues a call, `name` is copied */
+int tfs_async_submit(int op, fileDescriptor FD, char *name, char *buffer, int size, void *tag) {
+    if (!tfs_async.running)
+        return TFS_ERR_INVALID;
+    char *copy = NULL;
+    if (name != NULL && (copy = strdup(name)) == NULL)
+        return TFS_ERR_NO_MEMORY;
+    pthread_mutex_lock(&tfs_async.lock);
+    if (tfs_async.tail - tfs_async.head == TFS_ASYNC_QUEUE_MAX) {
+        pthread_mutex_unlock(&tfs_async.lock);
+        free(copy);
+        return TFS_ERR_BUSY;
+    }
+    struct tfs_async_call *call = &tfs_async.calls[tfs_async.tail % TFS_ASYNC_QUEUE_MAX];
+    call->op = op;
+    call->fd = FD;
+    call->name = copy;
+    call->buffer = buffer;
+    call->size = size;
+    call->tag = tag;
+    tfs_async.tail++;
+    pthread_cond_signal(&tfs_async.work);
+    pthread_mutex_unlock(&tfs_async.lock);
+    return TFS_OK;
+}
+
+int tfs_open_async(char *name, void *tag) {
+    if (name == NULL)
+        return TFS_ERR_INVALID;
+    return tfs_async_submit(TFS_ASYNC_OPEN, 0, name, NULL, 0, tag);
+}
+
+int tfs_read_async(fileDescriptor FD, char *buffer, int size, void *tag) {
+    if (FD < 0 || FD >= TFS_OPEN_FILES_MAX)
+        return TFS_ERR_BAD_FD;
+    if (buffer == NULL || size < 0)
+        return TFS_ERR_INVALID;
+    return tfs_async_submit(TFS_ASYNC_READ, FD, NULL, buffer, size, tag);
+}
+
+int tfs_write_async(fileDescriptor FD, char *buffer, int size, void *tag) {
+    if (FD < 0 || FD >= TFS_OPEN_FILES_MAX)
+        return TFS_ERR_BAD_FD;
+    if ((buffer == NULL && size > 0) || size < 0)
+        return TFS_ERR_INVALID;
+    return tfs_async_submit(TFS_ASYNC_WRITE, FD, NULL, buffer, size, tag);
+}
+
+int tfs_async_poll(struct tfs_completion *done, int max) {
+    if (!tfs_async.running)
+        return TFS_ERR_INVALID;
+    if (done == NULL || max < 0)
+        return TFS_ERR_INVALID;
+    uint64_t count;
+    // cleared first, a call finishing from here on sets it again
+    read(tfs_async.efd, &count, sizeof(count));
+    pthread_mutex_lock(&tfs_async.lock);
+    int n;
+    for (n = 0; n < max && tfs_async.head != tfs_async.run; n++, tfs_async.head++) {
+        struct tfs_async_call *call = &tfs_async.calls[tfs_async.head % TFS_ASYNC_QUEUE_MAX];
+        done[n].op = call->op;
+        done[n].ret = call->ret;
+        done[n].tag = call->tag;
+        free(call->name);
+        call->name = NULL;
+    }
+    // what didn't fit keeps the eventfd readable
+    if (tfs_async.head != tfs_async.run) {
+        uint64_t one = 1;
+        write(tfs_async.efd, &one, sizeof(one));
+    }
+    pthread_mutex_unlock(&tfs_async.lock);
+    return n;
+}
+
+/******************************************************/
+/************* Streaming write functions **************/
+/******************************************************/
+
+int tfs_op_writeBegin(fileDescriptor FD) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live || file_meta->inode_index == 0)
+        return TFS_ERR_BAD_FD;
+    if (file_meta->stream != NULL)
+        return TFS_ERR_BUSY;
+
+    // compressing and indexing need the whole file
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & (TFS_FLAG_COMPRESS | TFS_FLAG_DEDUP | TFS_FLAG_SPARSE))
+        return TFS_ERR_INVALID;
+
+    file_meta->stream = calloc(1, sizeof(struct tfs_stream));
+    if (file_meta->stream == NULL)
+        fail(TFS_ERR_NO_MEMORY);
+    file_meta->stream->goal = file_meta->inode_index + 1;
+    tfs_meta.streams++;
+    return TFS_OK;
+}
+
+int tfs_op_writeChunk(fileDescriptor FD, char *buffer, int size) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live)
+        return TFS_ERR_BAD_FD;
+    struct tfs_stream* stream = file_meta->stream;
+    if (stream == NULL || size < 0)
+        return TFS_ERR_INVALID;
+    if (stream->size + size > TFS_FILE_SIZE_MAX)
+        return TFS_ERR_INSUFFICIENT_SPACE;
+
+    while (size > 0) {
+        if (stream->block_index == 0 || stream->fill == TFS_BLOCK__FILE_SIZE_DATA)
+            fail_if(tfs_stream_next(stream));
+        int n = TFS_BLOCK__FILE_SIZE_DATA - stream->fill;
+        if (n > size)
+            n = size;
+        memcpy(&stream->block[TFS_BLOCK__FILE_POS__DATA + stream->fill], buffer, n);
+        stream->fill += n;
+        stream->size += n;
+        buffer += n;
+        size -= n;
+    }
+    return TFS_OK;
+}
+
+int tfs_op_writeCommit(fileDescriptor FD) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live)
+        return TFS_ERR_BAD_FD;
+    struct tfs_stream* stream = file_meta->stream;
+    if (stream == NULL)
+        return TFS_ERR_INVALID;
+
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    // the chain is kept as long as a tfs_fallocate asked for
+    uint16_t reserved;
+    memcpy(&reserved, &block_inode[TFS_BLOCK_INODE_POS_RESRV], sizeof(uint16_t));
+    int blocks = (stream->size + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    while (blocks < reserved) {
+        fail_if(tfs_stream_next(stream));
+        stream->fill = TFS_BLOCK__FILE_SIZE_DATA;
+        blocks++;
+    }
+    if (stream->block_index != 0) {
+        tfs_write_addr(stream->block, 0);
+        fail_if(writeBlock(tfs_meta.disk, stream->block_index, stream->block));
+    }
+    while (stream->claimed_next < stream->claimed_count)
+        fail_if(tfs_block_free(stream->claimed[stream->claimed_next++]));
+
+    /* the new chain replaces the old one in a single inode write */
+    char block_inode_old[BLOCKSIZE];
+    memcpy(block_inode_old, block_inode, BLOCKSIZE);
+    uint64_t ctime = tfs_read_tstamp(block_inode, TSTAMP_CREATE);
+    tfs_write_addr(block_inode, stream->first);
+    tfs_write_size(block_inode, stream->size);
+    block_inode[TFS_BLOCK_INODE_POS_FLAGS] &= ~TFS_INODE_FLAGS_LAYOUT;
+    uint16_t physical_size = stream->size;
+    memcpy(&block_inode[TFS_BLOCK_INODE_POS_PSIZE], &physical_size, sizeof(uint16_t));
+    tfs_write_times(block_inode, ctime);
+    fail_if(writeBlock(tfs_meta.disk, file_meta->inode_index, block_inode));
+    fail_if(tfs_free_data(block_inode_old));
+    tfs_zcache_drop(file_meta->inode_index);
+    tfs_block_map_drop(file_meta->inode_index);
+
+    file_meta->size = stream->size;
+    file_meta->compressed = false;
+    file_meta->indexed = false;
+    file_meta->offset = 0;
+    file_meta->ptr.block_num = stream->size > 0 ? stream->first : file_meta->inode_index;
+    file_meta->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
+    free(stream);
+    file_meta->stream = NULL;
+    tfs_meta.streams--;
+    return TFS_OK;
+}
+
+int tfs_op_writeAbort(fileDescriptor FD) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    struct tfs_openfile* file_meta = &tfs_openfile_table[FD];
+    if (!file_meta->live)
+        return TFS_ERR_BAD_FD;
+    if (file_meta->stream == NULL)
+        return TFS_ERR_INVALID;
+    return tfs_stream_abort(file_meta);
+}
+
+/* hands out the next block of the stream, claiming another batch near the
+ * last one when the batch runs out */
+int tfs_stream_claim(struct tfs_stream* stream, addr_t* out) {
+    if (stream->claimed_next == stream->claimed_count) {
+        char block_super[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        int count = TFS_STREAM_BATCH;
+        int err = tfs_space_take(stream->goal, count, stream->claimed, block_super);
+        if (err == TFS_ERR_INSUFFICIENT_SPACE) {
+            // not a whole batch left, one block will do
+            count = 1;
+            err = tfs_space_take(stream->goal, count, stream->claimed, block_super);
+        }
+        fail_if(err);
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        stream->goal = stream->claimed[count - 1] + 1;
+        stream->claimed_count = count;
+        stream->claimed_next = 0;
+    }
+    *out = stream->claimed[stream->claimed_next++];
+    return TFS_OK;
+}
+
+/* writes out the block being filled, linked to a newly claimed one, and
+ * starts filling that */
+int tfs_stream_next(struct tfs_stream* stream) {
+    addr_t next;
+    fail_if(tfs_stream_claim(stream, &next));
+    if (stream->block_index != 0) {
+        tfs_write_addr(stream->block, next);
+        fail_if(writeBlock(tfs_meta.disk, stream->block_index, stream->block));
+    } else {
+        stream->first = next;
+    }
+    memset(stream->block, 0, BLOCKSIZE);
+    stream->block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__DATA;
+    stream->block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+    stream->block_index = next;
+    stream->fill = 0;
+    return TFS_OK;
+}
+
+/* frees everything a streaming write on `file` claimed, if it has one */
+int tfs_stream_abort(struct tfs_openfile* file) {
+    struct tfs_stream* stream = file->stream;
+    if (stream == NULL)
+        return TFS_OK;
+    file->stream = NULL;
+    tfs_meta.streams--;
+    int err = TFS_OK;
+    if (stream->block_index != 0) {
+        // end the written part of the chain so it can be freed whole
+        tfs_write_addr(stream->block, 0);
+        if ((err = writeBlock(tfs_meta.disk, stream->block_index, stream->block)) >= 0)
+            err = tfs_free_chain(stream->first);
+    }
+    while (err >= 0 && stream->claimed_next < stream->claimed_count)
+        err = tfs_block_free(stream->claimed[stream->claimed_next++]);
+    free(stream);
+    fail_if(err);
+    return TFS_OK;
+}
+
+/******************************************************/
+/******************* Batch functions ******************/
+/******************************************************/
+
+/* a name a batch touches, and what it holds at the op being checked */
+struct tfs_batch_name {
+    addr_t dir;
+    char base[TFS_FILE_NAME_LEN_MAX + 1];
+    /* block type of what is there, 0 for nothing */
+    uint8_t type;
+    /* created by an earlier op of the batch */
+    bool created;
+};
+
+/* a directory a batch creates or deletes names in, and its free slots at the op being checked */
+struct tfs_batch_dir {
+    addr_t dir;
+    int free;
+};
+
+int tfs_op_batch(struct tfs_batch_op* ops, int count) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (ops == NULL || count < 0)
+        return TFS_ERR_INVALID;
+    if (count == 0)
+        return TFS_OK;
+
+    struct tfs_batch_name* names = calloc(count, sizeof(struct tfs_batch_name));
+    struct tfs_batch_dir* dirs = calloc(count, sizeof(struct tfs_batch_dir));
+    int* op_name = calloc(count, sizeof(int));
+    int* op_blocks = calloc(count, sizeof(int));
+    int err = TFS_ERR_NO_MEMORY;
+    if (names != NULL && dirs != NULL && op_name != NULL && op_blocks != NULL) {
+        err = tfs_batch_check(ops, count, names, dirs, op_name, op_blocks);
+        if (err >= 0)
+            err = tfs_batch_apply(ops, count, names, op_name, op_blocks);
+    }
+    free(names);
+    free(dirs);
+    free(op_name);
+    free(op_blocks);
+    fail_if(err);
+    return TFS_OK;
+}
+
+/* Plays the batch through on the names alone, so a batch that can't be
+ * applied whole is refused before anything is written. Each distinct name
+ * is looked up in the dentry cache once. Fills in which name every op works
+ * on and how many blocks it needs, counting a _DENT block for a create that
+ * finds its directory full */
+int tfs_batch_check(struct tfs_batch_op* ops, int count, struct tfs_batch_name* names, struct tfs_batch_dir* dirs, int* op_name, int* op_blocks) {
+    int name_count = 0;
+    int dir_count = 0;
+    int i;
+    for (i = 0; i < count; i++)
+        ops[i].err = TFS_OK;
+    for (i = 0; i < count; i++) {
+        struct tfs_batch_op* op = &ops[i];
+        int err = TFS_OK;
+        addr_t dir;
+        char base[TFS_FILE_NAME_LEN_MAX + 1];
+        if (op->path == NULL || (op->op != TFS_BATCH_DELETE
+                && (op->size < 0 || op->size > TFS_FILE_SIZE_MAX || (op->size > 0 && op->buffer == NULL))))
+            err = TFS_ERR_INVALID;
+        if (err >= 0)
+            err = tfs_path_walk(op->path, &dir, base);
+        if (err >= 0 && base[0] == '\0')
+            err = TFS_ERR_INVALID;
+
+        int n = 0;
+        if (err >= 0) {
+            // names repeat within a batch rarely, a linear search is plenty
+            for (n = 0; n < name_count; n++)
+                if (names[n].dir == dir && strcmp(names[n].base, base) == 0)
+                    break;
+            if (n == name_count) {
+                struct tfs_dir* dir_info;
+                err = tfs_dir_load(dir, &dir_info);
+                if (err >= 0) {
+                    struct tfs_dentry* dentry = tfs_dcache_find(dir, base);
+                    names[n].dir = dir;
+                    memcpy(names[n].base, base, TFS_FILE_NAME_LEN_MAX + 1);
+                    names[n].type = dentry != NULL ? dentry->type : 0;
+                    names[n].created = false;
+                    name_count++;
+                }
+            }
+        }
+        struct tfs_batch_name* name = &names[n];
+        if (err >= 0 && op->op == TFS_BATCH_CREATE) {
+            if (name->type != 0)
+                err = TFS_ERR_EXISTS;
+        } else if (err >= 0 && (op->op == TFS_BATCH_WRITE || op->op == TFS_BATCH_DELETE)) {
+            if (name->type == 0)
+                err = TFS_ERR_NO_ENTRY;
+            else if (name->type == TFS_BLOCK_TYPE___DIR)
+                err = TFS_ERR_IS_DIR;
+        } else if (err >= 0) {
+            err = TFS_ERR_INVALID;
+        }
+
+        int blocks = 0;
+        if (err >= 0 && op->op != TFS_BATCH_DELETE)
+            blocks = (op->size + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+        if (err >= 0 && op->op == TFS_BATCH_WRITE && !name->created) {
+            // the policies that need their own write path, and a reservation to keep
+            char block_inode[BLOCKSIZE];
+            err = readBlock(tfs_meta.disk, tfs_dcache_find(name->dir, name->base)->inode, block_inode);
+            if (err >= 0 && (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_FLAG_ALL))
+                err = TFS_ERR_INVALID;
+            uint16_t reserved;
+            memcpy(&reserved, &block_inode[TFS_BLOCK_INODE_POS_RESRV], sizeof(uint16_t));
+            if (blocks < reserved)
+                blocks = reserved;
+        }
+        if (err < 0) {
+            op->err = err;
+            return err;
+        }
+
+        // slots are taken and given back the way tfs_dir_add and tfs_dir_remove will
+        int d = 0;
+        if (op->op != TFS_BATCH_WRITE) {
+            for (d = 0; d < dir_count; d++)
+                if (dirs[d].dir == name->dir)
+                    break;
+            if (d == dir_count) {
+                struct tfs_dir* dir_info;
+                fail_if(tfs_dir_load(name->dir, &dir_info));
+                dirs[d].dir = name->dir;
+                dirs[d].free = dir_info->free_count;
+                dir_count++;
+            }
+        }
+        if (op->op == TFS_BATCH_CREATE) {
+            name->type = TFS_BLOCK_TYPE_INODE;
+            name->created = true;
+            blocks++;
+            if (dirs[d].free == 0) {
+                dirs[d].free = TFS_BLOCK__DENT_SLOTS;
+                blocks++;
+            }
+            dirs[d].free--;
+        } else if (op->op == TFS_BATCH_DELETE) {
+            name->type = 0;
+            name->created = false;
+            dirs[d].free++;
+        }
+        op_name[i] = n;
+        op_blocks[i] = blocks;
+    }
+    return TFS_OK;
+}
+
+/* Writes a checked batch: every block it needs is claimed up front in one
+ * allocator call, and everything it frees goes onto the free list in one
+ * go at the end. An I/O error part way leaves the ops before it applied,
+ * but the claimed blocks nothing points at yet are given back */
+int tfs_batch_apply(struct tfs_batch_op* ops, int count, struct tfs_batch_name* names, int* op_name, int* op_blocks) {
+    static addr_t blocks[TFS_BLOCK_COUNT_MAX];
+    static addr_t freeing[TFS_BLOCK_COUNT_MAX];
+    static addr_t index_freeing[TFS_BLOCK_COUNT_MAX];
+    /* inodes whose open descriptors have to catch up, TFS_BATCH_WRITE or TFS_BATCH_DELETE */
+    static uint8_t touched[TFS_BLOCK_COUNT_MAX];
+    int total = 0;
+    int i;
+    for (i = 0; i < count; i++)
+        total += op_blocks[i];
+    if (total > TFS_BLOCK_COUNT_MAX)
+        return TFS_ERR_NO_FREE_BLOCKS;
+
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    if (total > 0) {
+        int err = tfs_space_take(TFS_BLOCK_SUPER_INDEX + 1, total, blocks, block_super);
+        fail_if(err);
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    }
+
+    memset(touched, 0, sizeof(touched));
+    int taken = 0;
+    /* blocks[0..committed) are reachable from the ops applied so far */
+    int committed = 0;
+    int freeing_count = 0;
+    int index_freeing_count = 0;
+    bool refs_changed = false;
+    int err = TFS_OK;
+    for (i = 0; i < count; i++) {
+        struct tfs_batch_op* op = &ops[i];
+        struct tfs_batch_name* name = &names[op_name[i]];
+        char block_inode[BLOCKSIZE] = {0};
+        addr_t inode_index;
+        int op_first = taken;
+        committed = taken;
+        if (op->op == TFS_BATCH_CREATE) {
+            struct tfs_dir* dir_info;
+            if ((err = tfs_dir_load(name->dir, &dir_info)) < 0)
+                break;
+            if (dir_info->free_count == 0) {
+                // the check counted this _DENT block, it is linked in before the inode is written
+                if ((err = tfs_dir_grow_at(name->dir, dir_info, blocks[taken])) < 0)
+                    break;
+                committed = ++taken;
+            }
+            inode_index = blocks[taken++];
+            block_inode[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE_INODE;
+            block_inode[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+            tfs_write_links(block_inode, 1);
+            tfs_write_times(block_inode, 0);
+        } else {
+            struct tfs_dentry* dentry = tfs_dcache_find(name->dir, name->base);
+            inode_index = dentry->inode;
+            if ((err = readBlock(tfs_meta.disk, inode_index, block_inode)) < 0)
+                break;
+            tfs_zcache_drop(inode_index);
+            tfs_block_map_drop(inode_index);
+            if (op->op == TFS_BATCH_DELETE) {
+                if ((err = tfs_dir_remove(name->dir, dentry)) < 0)
+                    break;
+                uint16_t links = tfs_read_links(block_inode);
+                if (links > 1) {
+                    tfs_write_links(block_inode, links - 1);
+                    if ((err = writeBlock(tfs_meta.disk, inode_index, block_inode)) < 0)
+                        break;
+                    continue;
+                }
+                touched[inode_index] = TFS_BATCH_DELETE;
+            } else {
+                touched[inode_index] = TFS_BATCH_WRITE;
+            }
+            // the old content goes at the end with everything else freed
+            if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_INDEXED)
+                index_freeing[index_freeing_count++] = tfs_read_addr(block_inode);
+            else if ((err = tfs_chain_collect(tfs_read_addr(block_inode), freeing, &freeing_count, &refs_changed)) < 0)
+                break;
+            if (op->op == TFS_BATCH_DELETE) {
+                freeing[freeing_count++] = inode_index;
+                continue;
+            }
+            tfs_write_times(block_inode, tfs_read_tstamp(block_inode, TSTAMP_CREATE));
+        }
+
+        int data_blocks = op_blocks[i] - (taken - op_first);
+        if ((err = tfs_chain_fill(op->buffer, op->size, &blocks[taken], data_blocks)) < 0)
+            break;
+        tfs_write_addr(block_inode, data_blocks > 0 ? blocks[taken] : 0);
+        taken += data_blocks;
+        tfs_write_size(block_inode, op->size);
+        block_inode[TFS_BLOCK_INODE_POS_FLAGS] &= ~TFS_INODE_FLAGS_LAYOUT;
+        uint16_t physical_size = op->size;
+        memcpy(&block_inode[TFS_BLOCK_INODE_POS_PSIZE], &physical_size, sizeof(uint16_t));
+        if ((err = writeBlock(tfs_meta.disk, inode_index, block_inode)) < 0)
+            break;
+        if (op->op == TFS_BATCH_CREATE && (err = tfs_dir_add(name->dir, name->base, inode_index, TFS_BLOCK_TYPE_INODE)) < 0)
+            break;
+    }
+    if (err < 0) {
+        // the rest of the claim, and an inode with its data that no entry names
+        fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        fail_if(tfs_blocks_free(&blocks[committed], total - committed, block_super));
+        if (total > committed && !tfs_punching())
+            fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        fail(err);
+    }
+
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    fail_if(tfs_blocks_free(freeing, freeing_count, block_super));
+    if (freeing_count > 0 && !tfs_punching())
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    for (i = 0; i < index_freeing_count; i++)
+        fail_if(tfs_index_free(index_freeing[i]));
+    if (refs_changed)
+        fail_if(tfs_refs_sync());
+
+    /* open descriptors see rewritten files from the start and deleted ones as deleted */
+    int fd;
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX; fd++) {
+        struct tfs_openfile* file = &tfs_openfile_table[fd];
+        if (!file->live || touched[file->inode_index] == 0)
+            continue;
+        if (touched[file->inode_index] == TFS_BATCH_DELETE) {
+            fail_if(tfs_stream_abort(file));
+            struct tfs_openfile new_file_meta = {0};
+            new_file_meta.live = true;
+            new_file_meta.parent = file->parent;
+            memcpy(new_file_meta.name, file->name, TFS_FILE_NAME_LEN_MAX + 1);
+            memcpy(file, &new_file_meta, sizeof(struct tfs_openfile));
+            continue;
+        }
+        char block_inode[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, file->inode_index, block_inode));
+        file->size = tfs_read_size(block_inode);
+        file->compressed = false;
+        file->indexed = false;
+        file->offset = 0;
+        file->ptr.block_num = file->size > 0 ? tfs_read_addr(block_inode) : file->inode_index;
+        file->ptr.byte_index = TFS_BLOCK__FILE_POS__DATA;
+    }
+    return TFS_OK;
+}
+
+/******************************************************/
+/**************** Compression functions ***************/
+/******************************************************/
+
+/* Builds the compressed stream for `size` bytes of `buffer`. Returns the
+ * stream length, or -1 if it would not fit in `stream_cap` */
+int tfs_compress_stream(char* buffer, int size, char* stream, int stream_cap) {
+    int frame_count = (size + TFS_COMPRESS_FRAME - 1) / TFS_COMPRESS_FRAME;
+    int pos = frame_count * sizeof(uint16_t);
+    if (pos >= stream_cap)
+        return -1;
+    int frame;
+    for (frame = 0; frame < frame_count; frame++) {
+        char* raw = &buffer[frame * TFS_COMPRESS_FRAME];
+        int raw_len = size - frame * TFS_COMPRESS_FRAME;
+        if (raw_len > TFS_COMPRESS_FRAME)
+            raw_len = TFS_COMPRESS_FRAME;
+        int cap = stream_cap - pos;
+        if (cap > raw_len - 1)
+            cap = raw_len - 1;
+        int len = cap > 0 ? lzCompress(raw, raw_len, &stream[pos], cap) : -1;
+        if (len < 0) {
+            if (pos + raw_len > stream_cap)
+                return -1;
+            memcpy(&stream[pos], raw, raw_len);
+            len = raw_len;
+        }
+        pos += len;
+        uint16_t end = pos;
+        memcpy(&stream[frame * sizeof(uint16_t)], &end, sizeof(uint16_t));
+    }
+    return pos;
+}
+
+/* copies the first `len` payload bytes of the chain at `first` into `out` */
+int tfs_read_chain(addr_t first, int len, char* out) {
+    addr_t block_index = first;
+    int pos = 0;
+    while (pos < len) {
+        if (block_index == 0)
+            return TFS_ERR_INVALID;
+        char block[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, block_index, block));
+        int n = len - pos;
+        if (n > TFS_BLOCK__FILE_SIZE_DATA)
+            n = TFS_BLOCK__FILE_SIZE_DATA;
+        memcpy(&out[pos], &block[TFS_BLOCK__FILE_POS__DATA], n);
+        pos += n;
+        block_index = tfs_read_addr(block);
+    }
+    return TFS_OK;
+}
+
+/* copies the first `len` bytes stored for an inode into `out`, whichever way
+ * its blocks are laid out */
+int tfs_read_data(char* block_inode, int len, char* out) {
+    if (!(block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_INDEXED))
+        return tfs_read_chain(tfs_read_addr(block_inode), len, out);
+
+    addr_t index_index = tfs_read_addr(block_inode);
+    char block_index[BLOCKSIZE];
+    int pos = 0;
+    int slot = TFS_BLOCK__INDX_SLOTS;
+    while (pos < len) {
+        if (slot == TFS_BLOCK__INDX_SLOTS) {
+            if (index_index == 0)
+                return TFS_ERR_INVALID;
+            fail_if(readBlock(tfs_meta.disk, index_index, block_index));
+            index_index = tfs_read_addr(block_index);
+            slot = 0;
+        }
+        addr_t block_num;
+        memcpy(&block_num, &block_index[TFS_BLOCK__INDX_POS__ENTS + slot * sizeof(addr_t)], sizeof(addr_t));
+        char block[BLOCKSIZE] = {0};
+        // a 0 entry is a hole in a sparse file
+        if (block_num != 0)
+            fail_if(readBlock(tfs_meta.disk, block_num, block));
+        int n = len - pos;
+        if (n > TFS_BLOCK__FILE_SIZE_DATA)
+            n = TFS_BLOCK__FILE_SIZE_DATA;
+        memcpy(&out[pos], &block[TFS_BLOCK__FILE_POS__DATA], n);
+        pos += n;
+        slot++;
+    }
+    return TFS_OK;
+}
+
+/* returns frame `frame` of a compressed file, decompressing it on a miss */
+int tfs_zcache_get(addr_t inode_index, int frame, struct tfs_zframe** out) {
+    struct tfs_zframe* victim = &tfs_zcache[0];
+    int i;
+    for (i = 0; i < TFS_ZCACHE_ENTRIES; i++) {
+        struct tfs_zframe* entry = &tfs_zcache[i];
+        if (entry->live && entry->inode == inode_index && entry->frame == frame) {
+            entry->used = ++tfs_zcache_tick;
+            *out = entry;
+            tfs_stats.zcache_hits++;
+            return TFS_OK;
+        }
+        if (!entry->live || (victim->live && entry->used < victim->used))
+            victim = entry;
+    }
+    tfs_stats.zcache_misses++;
+
+    char block_inode[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, inode_index, block_inode));
+    int size = tfs_read_size(block_inode);
+    int frame_count = (size + TFS_COMPRESS_FRAME - 1) / TFS_COMPRESS_FRAME;
+    if (frame >= frame_count)
+        return TFS_ERR_OUT_OF_BOUNDS;
+
+    static char stream[TFS_FILE_SIZE_MAX];
+    int header_len = frame_count * sizeof(uint16_t);
+    fail_if(tfs_read_data(block_inode, header_len, stream));
+    uint16_t start = header_len;
+    uint16_t end;
+    if (frame > 0)
+        memcpy(&start, &stream[(frame - 1) * sizeof(uint16_t)], sizeof(uint16_t));
+    memcpy(&end, &stream[frame * sizeof(uint16_t)], sizeof(uint16_t));
+    if (end < start)
+        return TFS_ERR_INVALID;
+    fail_if(tfs_read_data(block_inode, end, stream));
+
+    int raw_len = size - frame * TFS_COMPRESS_FRAME;
+    if (raw_len > TFS_COMPRESS_FRAME)
+        raw_len = TFS_COMPRESS_FRAME;
+    victim->live = false;
+    if (end - start == raw_len) {
+        memcpy(victim->data, &stream[start], raw_len);
+    } else if (lzDecompress(&stream[start], end - start, victim->data, raw_len) != raw_len) {
+        return TFS_ERR_INVALID;
+    }
+    victim->live = true;
+    victim->inode = inode_index;
+    victim->frame = frame;
+    victim->len = raw_len;
+    victim->used = ++tfs_zcache_tick;
+    *out = victim;
+    return TFS_OK;
+}
+
+/* forgets every cached frame of `inode_index` */
+void tfs_zcache_drop(addr_t inode_index) {
+    int i;
+    for (i = 0; i < TFS_ZCACHE_ENTRIES; i++) {
+        if (tfs_zcache[i].inode == inode_index)
+            tfs_zcache[i].live = false;
+    }
+}
+
+/******************************************************/
+/*************** Deduplication functions **************/
+/******************************************************/
+
+/* 64 bit hash of a data block's payload, 8 bytes at a time */
+uint64_t tfs_block_hash(const char* data) {
+    uint64_t hash = 0x9e3779b97f4a7c15ull;
+    int pos;
+    for (pos = 0; pos + 8 <= TFS_BLOCK__FILE_SIZE_DATA; pos += 8) {
+        uint64_t word;
+        memcpy(&word, &data[pos], sizeof(uint64_t));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    uint32_t tail = 0;
+    memcpy(&tail, &data[pos], TFS_BLOCK__FILE_SIZE_DATA - pos);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 29;
+    return hash;
+}
+
+/* finds a block in the content index whose payload is `data`, 0 if none */
+int tfs_dedup_find(const char* data, uint64_t hash, addr_t* out) {
+    addr_t block_index = tfs_meta.dedup_buckets[hash % TFS_DEDUP_BUCKETS];
+    for (; block_index != 0; block_index = tfs_meta.dedup_next[block_index]) {
+        if (tfs_meta.dedup_hash[block_index] != hash)
+            continue;
+        char block[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, block_index, block));
+        if (memcmp(&block[TFS_BLOCK__FILE_POS__DATA], data, TFS_BLOCK__FILE_SIZE_DATA) == 0)
+            break;
+    }
+    *out = block_index;
+    return TFS_OK;
+}
+
+void tfs_dedup_insert(addr_t block_index, uint64_t hash) {
+    addr_t* bucket = &tfs_meta.dedup_buckets[hash % TFS_DEDUP_BUCKETS];
+    tfs_meta.dedup_hash[block_index] = hash;
+    tfs_meta.dedup_next[block_index] = *bucket;
+    *bucket = block_index;
+}
+
+/* drops `block_index` from the content index if it is in it */
+void tfs_dedup_forget(addr_t block_index) {
+    addr_t* link = &tfs_meta.dedup_buckets[tfs_meta.dedup_hash[block_index] % TFS_DEDUP_BUCKETS];
+    while (*link != 0 && *link != block_index)
+        link = &tfs_meta.dedup_next[*link];
+    if (*link == block_index)
+        *link = tfs_meta.dedup_next[block_index];
+    tfs_meta.dedup_next[block_index] = 0;
+}
+
+/* Takes a reference to a data block holding the 252 bytes at `data`. With
+ * `share` an existing one is used when the index has a match, otherwise a
+ * fresh block is written (and indexed). The caller syncs the refs */
+int tfs_dedup_get(const char* data, bool share, addr_t* out) {
+    uint64_t hash = tfs_block_hash(data);
+    addr_t block_index = 0;
+    int err;
+    if (share) {
+        err = tfs_dedup_find(data, hash, &block_index);
+        fail_if(err);
+        tfs_meta.dedup_stats.lookups++;
+    }
+    if (block_index != 0) {
+        if (tfs_meta.refs[block_index] < UINT16_MAX) {
+            tfs_meta.refs[block_index]++;
+            tfs_meta.dedup_stats.hits++;
+            tfs_meta.dedup_stats.logical_blocks++;
+            *out = block_index;
+            return TFS_OK;
+        }
+        // out of references - later writes share the fresh copy instead
+        tfs_dedup_forget(block_index);
+    }
+
+    char block[BLOCKSIZE];
+    fail_if(tfs_block_alloc(&block_index, block));
+    block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__DATA;
+    tfs_write_addr(block, 0);
+    memcpy(&block[TFS_BLOCK__FILE_POS__DATA], data, TFS_BLOCK__FILE_SIZE_DATA);
+    if ((err = writeBlock(tfs_meta.disk, block_index, block)) < 0) {
+        tfs_block_free(block_index);
+        fail(err);
+    }
+    tfs_dedup_insert(block_index, hash);
+    tfs_meta.dedup_stats.logical_blocks++;
+    tfs_meta.dedup_stats.physical_blocks++;
+    *out = block_index;
+    return TFS_OK;
+}
+
+/* drops a reference taken by tfs_dedup_get, freeing the block with the last
+ * one. The caller syncs the refs */
+int tfs_dedup_put(addr_t block_index) {
+    tfs_meta.dedup_stats.logical_blocks--;
+    if (tfs_meta.refs[block_index] > 0) {
+        tfs_meta.refs[block_index]--;
+        return TFS_OK;
+    }
+    tfs_dedup_forget(block_index);
+    tfs_meta.dedup_stats.physical_blocks--;
+    return tfs_block_free(block_index);
+}
+
+/* Stores `size` bytes of `buffer` as standalone data blocks and writes the
+ * index listing them. `flags` are the inode's policy bits: TFS_FLAG_DEDUP
+ * shares blocks found in the content index, TFS_FLAG_SPARSE leaves blocks of
+ * zeros out as 0 entries. `stored` is set to the number of blocks listed. On
+ * failure every reference taken is dropped again */
+int tfs_index_write(char* buffer, int size, int flags, addr_t* first_index, int* stored) {
+    static addr_t blocks[TFS_FILE_BLOCKS_MAX];
+    addr_t index_blocks[TFS_FILE_BLOCKS_MAX / TFS_BLOCK__INDX_SLOTS + 1];
+    int block_count = (size + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    int index_count = (block_count + TFS_BLOCK__INDX_SLOTS - 1) / TFS_BLOCK__INDX_SLOTS;
+    uint32_t hits = tfs_meta.dedup_stats.hits;
+    static const char zeros[TFS_BLOCK__FILE_SIZE_DATA];
+    int taken = 0;
+    int allocated = 0;
+    int err = TFS_OK;
+
+    *stored = 0;
+    for (taken = 0; taken < block_count; taken++) {
+        char data[TFS_BLOCK__FILE_SIZE_DATA] = {0};
+        int n = size - taken * TFS_BLOCK__FILE_SIZE_DATA;
+        if (n > TFS_BLOCK__FILE_SIZE_DATA)
+            n = TFS_BLOCK__FILE_SIZE_DATA;
+        memcpy(data, &buffer[taken * TFS_BLOCK__FILE_SIZE_DATA], n);
+        if ((flags & TFS_FLAG_SPARSE) && memcmp(data, zeros, TFS_BLOCK__FILE_SIZE_DATA) == 0) {
+            blocks[taken] = 0;
+            continue;
+        }
+        if ((err = tfs_dedup_get(data, (flags & TFS_FLAG_DEDUP) != 0, &blocks[taken])) < 0)
+            goto undo;
+        (*stored)++;
+    }
+    // references to shared blocks hit the disk before any index points at them
+    if (tfs_meta.dedup_stats.hits != hits && (err = tfs_refs_sync()) < 0)
+        goto undo;
+
+    char block[BLOCKSIZE];
+    for (allocated = 0; allocated < index_count; allocated++) {
+        if ((err = tfs_block_alloc(&index_blocks[allocated], block)) < 0)
+            goto undo;
+    }
+    int i;
+    for (i = 0; i < index_count; i++) {
+        memset(block, 0, BLOCKSIZE);
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__INDX;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        tfs_write_addr(block, i + 1 < index_count ? index_blocks[i + 1] : 0);
+        int slots = block_count - i * TFS_BLOCK__INDX_SLOTS;
+        if (slots > TFS_BLOCK__INDX_SLOTS)
+            slots = TFS_BLOCK__INDX_SLOTS;
+        memcpy(&block[TFS_BLOCK__INDX_POS__ENTS], &blocks[i * TFS_BLOCK__INDX_SLOTS], slots * sizeof(addr_t));
+        if ((err = writeBlock(tfs_meta.disk, index_blocks[i], block)) < 0)
+            goto undo;
+    }
+    *first_index = index_blocks[0];
+    return TFS_OK;
+
+undo:
+    while (allocated > 0)
+        tfs_block_free(index_blocks[--allocated]);
+    while (taken > 0) {
+        if (blocks[--taken] != 0)
+            tfs_dedup_put(blocks[taken]);
+    }
+    if (tfs_meta.dedup_stats.hits != hits)
+        tfs_refs_sync();
+    fail(err);
+}
+
+/* finds the data block `block` (counting from 0) of an indexed file */
+int tfs_index_get(addr_t first_index, int block, addr_t* out) {
+    addr_t index_index = first_index;
+    char block_index[BLOCKSIZE];
+    int skip;
+    for (skip = block / TFS_BLOCK__INDX_SLOTS; skip > 0; skip--) {
+        fail_if(readBlock(tfs_meta.disk, index_index, block_index));
+        index_index = tfs_read_addr(block_index);
+        if (index_index == 0)
+            return TFS_ERR_INVALID;
+    }
+    fail_if(readBlock(tfs_meta.disk, index_index, block_index));
+    int slot = block % TFS_BLOCK__INDX_SLOTS;
+    memcpy(out, &block_index[TFS_BLOCK__INDX_POS__ENTS + slot * sizeof(addr_t)], sizeof(addr_t));
+    return TFS_OK;
+}
+
+/* Frees the index chain at `first_index` and drops its data block references.
+ * A shared index (clones, snapshots) only loses a reference */
+int tfs_index_free(addr_t first_index) {
+    if (first_index == 0)
+        return TFS_OK;
+    if (tfs_meta.refs[first_index] > 0) {
+        tfs_meta.refs[first_index]--;
+        return tfs_refs_sync();
+    }
+
+    bool refs_changed = false;
+    addr_t index_index = first_index;
+    while (index_index != 0) {
+        char block_index[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, index_index, block_index));
+        assert(block_index[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__INDX, "block type is not index");
+        int slot;
+        for (slot = 0; slot < TFS_BLOCK__INDX_SLOTS; slot++) {
+            addr_t block_num;
+            memcpy(&block_num, &block_index[TFS_BLOCK__INDX_POS__ENTS + slot * sizeof(addr_t)], sizeof(addr_t));
+            if (block_num == 0)
+                continue;
+            if (tfs_meta.refs[block_num] > 0)
+                refs_changed = true;
+            fail_if(tfs_dedup_put(block_num));
+        }
+        addr_t next_index = tfs_read_addr(block_index);
+        fail_if(tfs_block_free(index_index));
+        index_index = next_index;
+    }
+    if (refs_changed)
+        fail_if(tfs_refs_sync());
+    return TFS_OK;
+}
+
+/* Rebuilds the content index from the data blocks of every indexed inode.
+ * Needs the refs table loaded */
+int tfs_dedup_load(void) {
+    memset(tfs_meta.dedup_buckets, 0, TFS_DEDUP_BUCKETS * sizeof(addr_t));
+    memset(tfs_meta.dedup_next, 0, TFS_BLOCK_COUNT_MAX * sizeof(addr_t));
+    tfs_meta.dedup_stats = (struct tfs_dedup_stats){0};
+    uint8_t* seen = calloc(TFS_BLOCK_COUNT_MAX / 8, 1);
+    if (seen == NULL)
+        return TFS_ERR_NO_MEMORY;
+
+    char block_inode[BLOCKSIZE];
+    int inode_index;
+    int limit = tfs_formatted_limit();
+    int err = TFS_OK;
+    for (inode_index = 0; inode_index < limit && readBlock(tfs_meta.disk, inode_index, block_inode) >= 0; inode_index++) {
+        if (block_inode[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE_INODE
+                || !(block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_INDEXED))
+            continue;
+        addr_t index_index = tfs_read_addr(block_inode);
+        while (index_index != 0) {
+            char block_index[BLOCKSIZE];
+            if ((err = readBlock(tfs_meta.disk, index_index, block_index)) < 0)
+                goto out;
+            int slot;
+            for (slot = 0; slot < TFS_BLOCK__INDX_SLOTS; slot++) {
+                addr_t block_num;
+                memcpy(&block_num, &block_index[TFS_BLOCK__INDX_POS__ENTS + slot * sizeof(addr_t)], sizeof(addr_t));
+                if (block_num == 0)
+                    continue;
+                // clones share whole indexes and files share blocks, count each once
+                if (seen[block_num / 8] & (1 << (block_num % 8)))
+                    continue;
+                seen[block_num / 8] |= 1 << (block_num % 8);
+                char block[BLOCKSIZE];
+                if ((err = readBlock(tfs_meta.disk, block_num, block)) < 0)
+                    goto out;
+                uint64_t hash = tfs_block_hash(&block[TFS_BLOCK__FILE_POS__DATA]);
+                addr_t match;
+                if ((err = tfs_dedup_find(&block[TFS_BLOCK__FILE_POS__DATA], hash, &match)) < 0)
+                    goto out;
+                if (match == 0)
+                    tfs_dedup_insert(block_num, hash);
+                tfs_meta.dedup_stats.physical_blocks++;
+                tfs_meta.dedup_stats.logical_blocks += 1 + tfs_meta.refs[block_num];
+            }
+            index_index = tfs_read_addr(block_index);
+        }
+    }
+out:
+    free(seen);
+    fail_if(err);
+    return TFS_OK;
+}
+
+int tfs_dedupStats(struct tfs_dedup_stats *stats) {
+    tfs_lock();
+    int ret = TFS_OK;
+    if (!tfs_meta.mounted)
+        ret = TFS_ERR_NOT_MOUNTED;
+    else if (stats == NULL)
+        ret = TFS_ERR_INVALID;
+    else
+        *stats = tfs_meta.dedup_stats;
+    tfs_unlock();
+    return ret;
+}
+
+/******************************************************/
+/***************** Allocator functions ****************/
+/******************************************************/
+
+/* builds tfs_meta.space and the free list links from disk */
+int tfs_space_load(void) {
+    uint8_t* space = tfs_meta.space;
+    int end;
+    fail_if(tfs_space_map(space, &end, tfs_meta.free_next));
+
+    // only blocks reachable from the head are free, others were leaked
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    addr_t prev = 0;
+    addr_t free_index = tfs_read_addr(block_super);
+    tfs_stats.free_list_walks++;
+    while (free_index != 0 && free_index < end && space[free_index] == TFS_SPACE_FREE) {
+        tfs_stats.free_list_length++;
+        space[free_index] = TFS_SPACE_LISTED;
+        tfs_meta.free_prev[free_index] = prev;
+        prev = free_index;
+        free_index = tfs_meta.free_next[free_index];
+    }
+    if (prev != 0)
+        tfs_meta.free_next[prev] = 0;
+    int i;
+    for (i = 0; i < end; i++) {
+        if (space[i] == TFS_SPACE_FREE)
+            space[i] = TFS_SPACE_USED;
+        else if (space[i] == TFS_SPACE_LISTED)
+            space[i] = TFS_SPACE_FREE;
+    }
+    tfs_meta.space_end = end;
+    tfs_meta.space_valid = true;
+    return TFS_OK;
+}
+
+void tfs_space_used(addr_t index) {
+    if (tfs_meta.space_valid)
+        tfs_meta.space[index] = TFS_SPACE_USED;
+}
+
+/* records `index` as linked into the free list between `prev` and `next` */
+void tfs_space_freed(addr_t index, addr_t prev, addr_t next) {
+    if (!tfs_meta.space_valid)
+        return;
+    tfs_meta.space[index] = TFS_SPACE_FREE;
+    tfs_meta.free_prev[index] = prev;
+    tfs_meta.free_next[index] = next;
+    if (next != 0)
+        tfs_meta.free_prev[next] = index;
+}
+
+/* Finds `count` free blocks for one file, preferring a single run at or
+ * after `goal`, then any run, then the free blocks closest after `goal`.
+ * They are unlinked from the free list, the holes or the never written
+ * tail, and `block_super` is updated to match for the caller to write */
+int tfs_space_take(addr_t goal, int count, addr_t* out, char* block_super) {
+    if (!tfs_meta.space_valid)
+        fail_if(tfs_space_load());
+    uint8_t* space = tfs_meta.space;
+    int end = tfs_meta.space_end;
+    if (tfs_meta.log_mode) {
+        // everything goes at the log head, which starts at the never written tail
+        goal = tfs_meta.log_head;
+        if (goal == 0 && tfs_read_count(block_super) != 0)
+            goal = tfs_read_hwm(block_super);
+    }
+    if (goal <= TFS_BLOCK_SUPER_INDEX || goal >= end)
+        goal = TFS_BLOCK_SUPER_INDEX + 1;
+
+    int n = 0;
+    int i;
+    int scanned;
+    int start = tfs_space_find(space, goal, end, count);
+    scanned = (start != 0 ? start + count : end) - goal;
+    if (start == 0) {
+        start = tfs_space_find(space, TFS_BLOCK_SUPER_INDEX + 1, end, count);
+        scanned += (start != 0 ? start + count : end) - (TFS_BLOCK_SUPER_INDEX + 1);
+    }
+    if (start != 0) {
+        for (i = 0; i < count; i++)
+            out[n++] = start + i;
+    } else {
+        for (i = goal; i < end && n < count; i++)
+            if (space[i] != TFS_SPACE_USED)
+                out[n++] = i;
+        scanned += i - goal;
+        for (i = TFS_BLOCK_SUPER_INDEX + 1; i < goal && n < count; i++)
+            if (space[i] != TFS_SPACE_USED)
+                out[n++] = i;
+        scanned += i - (TFS_BLOCK_SUPER_INDEX + 1);
+    }
+    tfs_stats.alloc_calls++;
+    tfs_stats.alloc_scanned += scanned;
+    if (scanned > tfs_stats.alloc_scanned_max)
+        tfs_stats.alloc_scanned_max = scanned;
+    if (n == 0)
+        return TFS_ERR_NO_FREE_BLOCKS;
+    if (n < count)
+        return TFS_ERR_INSUFFICIENT_SPACE;
+
+    // claimed in address order, so the high-water mark only moves up
+    static addr_t sorted[TFS_BLOCK_COUNT_MAX];
+    memcpy(sorted, out, count * sizeof(addr_t));
+    qsort(sorted, count, sizeof(addr_t), tfs_addr_cmp);
+    static addr_t relinked[TFS_BLOCK_COUNT_MAX];
+    int relinked_count = 0;
+    addr_t head = tfs_read_addr(block_super);
+    uint32_t hwm = tfs_read_hwm(block_super);
+    for (i = 0; i < count; i++) {
+        addr_t index = sorted[i];
+        int k;
+        switch (space[index]) {
+        case TFS_SPACE_LAZY:
+            // never written blocks skipped over read as zeros, which makes them holes
+            for (k = hwm; k < index; k++) {
+                if (space[k] != TFS_SPACE_LAZY)
+                    continue;
+                space[k] = TFS_SPACE_HOLE;
+                tfs_hole_push(k);
+            }
+            if (index + 1 > hwm)
+                hwm = index + 1;
+            break;
+        case TFS_SPACE_HOLE:
+            tfs_hole_remove(index);
+            break;
+        case TFS_SPACE_FREE: {
+            addr_t prev = tfs_meta.free_prev[index];
+            addr_t next = tfs_meta.free_next[index];
+            if (prev != 0) {
+                tfs_meta.free_next[prev] = next;
+                relinked[relinked_count++] = prev;
+            } else {
+                head = next;
+            }
+            if (next != 0)
+                tfs_meta.free_prev[next] = prev;
+            break;
+        }
+        }
+        space[index] = TFS_SPACE_USED;
+    }
+
+    /* free blocks whose successor was taken point past it */
+    for (i = 0; i < relinked_count; i++) {
+        addr_t index = relinked[i];
+        if (space[index] != TFS_SPACE_FREE)
+            continue;
+        char block[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, index, block));
+        if (tfs_read_addr(block) == tfs_meta.free_next[index])
+            continue;
+        tfs_write_addr(block, tfs_meta.free_next[index]);
+        fail_if(writeBlock(tfs_meta.disk, index, block));
+    }
+    tfs_write_addr(block_super, head);
+    if (tfs_read_count(block_super) != 0)
+        tfs_write_hwm(block_super, hwm);
+    tfs_stats.alloc_blocks += count;
+    if (tfs_meta.log_mode)
+        tfs_meta.log_head = out[count - 1] + 1;
+    return TFS_OK;
+}
+
+/* Writes `size` bytes of `buffer` into a new chain of `count` data blocks
+ * placed near `goal`. Blocks past the data are left zeroed */
+int tfs_chain_write(char* buffer, int size, int count, addr_t goal, addr_t* first) {
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    static addr_t blocks[TFS_BLOCK_COUNT_MAX];
+    int err = tfs_space_take(goal, count, blocks, block_super);
+    fail_if(err);
+    fail_if(tfs_chain_fill(buffer, size, blocks, count));
+    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    *first = blocks[0];
+    return TFS_OK;
+}
+
+/* writes `size` bytes from `buffer` as a chain through the already claimed
+ * `blocks`, zeros past the size. In log mode runs of adjacent blocks go out
+ * in one write of up to a segment */
+int tfs_chain_fill(char* buffer, int size, addr_t* blocks, int count) {
+    static char run[TFS_LOG_SEGMENT_BLOCKS][BLOCKSIZE];
+    int run_count = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        char* block = run[run_count++];
+        memset(block, 0, BLOCKSIZE);
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__DATA;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        tfs_write_addr(block, i + 1 < count ? blocks[i + 1] : 0);
+        int block_size = size - i * TFS_BLOCK__FILE_SIZE_DATA;
+        if (block_size > TFS_BLOCK__FILE_SIZE_DATA)
+            block_size = TFS_BLOCK__FILE_SIZE_DATA;
+        if (block_size > 0)
+            memcpy(&block[TFS_BLOCK__FILE_POS__DATA], &buffer[i * TFS_BLOCK__FILE_SIZE_DATA], block_size);
+        if (tfs_meta.log_mode && i + 1 < count && blocks[i + 1] == blocks[i] + 1
+                && run_count < TFS_LOG_SEGMENT_BLOCKS)
+            continue;
+        fail_if(writeBlocks(tfs_meta.disk, blocks[i] - (run_count - 1), run_count, run));
+        run_count = 0;
+    }
+    return TFS_OK;
+}
+
+/******************************************************/
+/************** Defragmentation functions *************/
+/******************************************************/
+
+/* Records in `map` whether each block is used, free, punched or past the
+ * high-water mark, and sets `end` to the number of blocks. When `next` is
+ * given it receives the free list link of every free block */
+int tfs_space_map(uint8_t* map, int* end, addr_t* next) {
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    int count = tfs_read_count(block_super);
+    int limit = count == 0 ? TFS_BLOCK_COUNT_MAX : (int)tfs_read_hwm(block_super);
+
+    char block[BLOCKSIZE];
+    int i;
+    map[TFS_BLOCK_SUPER_INDEX] = TFS_SPACE_USED;
+    for (i = TFS_BLOCK_SUPER_INDEX + 1; i < limit && readBlock(tfs_meta.disk, i, block) >= 0; i++) {
+        if (block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__FREE) {
+            map[i] = TFS_SPACE_FREE;
+            if (next != NULL)
+                next[i] = tfs_read_addr(block);
+        } else if (block[TFS_BLOCK_EVERY_POS__TYPE] == 0 && block[TFS_BLOCK_EVERY_POS_MAGIC] == 0)
+            map[i] = TFS_SPACE_HOLE;
+        else
+            map[i] = TFS_SPACE_USED;
+    }
+    for (; i < count; i++)
+        map[i] = TFS_SPACE_LAZY;
+    *end = i;
+    return TFS_OK;
+}
+
+/* Collects the data blocks of the file in `block_inode` in file order,
+ * skipping sparse holes. `shared` is set if any of them may have other
+ * owners, which is always the case for indexed files */
+int tfs_file_blocks(char* block_inode, addr_t* blocks, int* count, bool* shared) {
+    *count = 0;
+    *shared = false;
+    addr_t block_index = tfs_read_addr(block_inode);
+    char block[BLOCKSIZE];
+    if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_INDEXED) {
+        *shared = block_index != 0;
+        while (block_index != 0) {
+            fail_if(readBlock(tfs_meta.disk, block_index, block));
+            int slot;
+            for (slot = 0; slot < TFS_BLOCK__INDX_SLOTS; slot++) {
+                addr_t block_num;
+                memcpy(&block_num, &block[TFS_BLOCK__INDX_POS__ENTS + slot * sizeof(addr_t)], sizeof(addr_t));
+                if (block_num != 0)
+                    blocks[(*count)++] = block_num;
+            }
+            block_index = tfs_read_addr(block);
+        }
+        return TFS_OK;
+    }
+    while (block_index != 0 && *count < TFS_BLOCK_COUNT_MAX) {
+        if (tfs_meta.refs[block_index] > 0)
+            *shared = true;
+        blocks[(*count)++] = block_index;
+        fail_if(readBlock(tfs_meta.disk, block_index, block));
+        block_index = tfs_read_addr(block);
+    }
+    return TFS_OK;
+}
+
+/* number of runs of adjacent blocks in `blocks` */
+int tfs_extent_count(addr_t* blocks, int count) {
+    int extents = count > 0;
+    int i;
+    for (i = 1; i < count; i++)
+        if (blocks[i] != blocks[i - 1] + 1)
+            extents++;
+    return extents;
+}
+
+int tfs_fragStats(struct tfs_frag_stats *stats) {
+    tfs_lock();
+    int ret = tfs_frag_scan(stats);
+    tfs_unlock();
+    return ret;
+}
+
+int tfs_frag_scan(struct tfs_frag_stats *stats) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (stats == NULL)
+        return TFS_ERR_INVALID;
+
+    static uint8_t map[TFS_BLOCK_COUNT_MAX];
+    static addr_t blocks[TFS_BLOCK_COUNT_MAX];
+    int end;
+    fail_if(tfs_space_map(map, &end, NULL));
+    *stats = (struct tfs_frag_stats){0};
+
+    int i;
+    for (i = 0; i < end; i++) {
+        if (map[i] == TFS_SPACE_USED) {
+            char block_inode[BLOCKSIZE];
+            fail_if(readBlock(tfs_meta.disk, i, block_inode));
+            if (block_inode[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE_INODE)
+                continue;
+            int count;
+            bool shared;
+            fail_if(tfs_file_blocks(block_inode, blocks, &count, &shared));
+            if (count == 0)
+                continue;
+            stats->files++;
+            stats->blocks += count;
+            stats->extents += tfs_extent_count(blocks, count);
+            continue;
+        }
+        stats->free_blocks++;
+        int run = 1;
+        while (i + 1 < end && map[i + 1] != TFS_SPACE_USED) {
+            stats->free_blocks++;
+            run++;
+            i++;
+        }
+        stats->free_runs++;
+        if (run > (int)stats->largest_free_run)
+            stats->largest_free_run = run;
+    }
+    if (stats->blocks > stats->files)
+        stats->fragmentation = 100 * (stats->extents - stats->files) / (stats->blocks - stats->files);
+    return TFS_OK;
+}
+
+/* first run of `count` free blocks in `map` from `from` up to `end`, or 0 if there is none */
+int tfs_space_find(uint8_t* map, int from, int end, int count) {
+    int start = from;
+    int i;
+    for (i = start; i < end; i++) {
+        if (map[i] == TFS_SPACE_USED) {
+            start = i + 1;
+            continue;
+        }
+        if (i + 1 - start == count)
+            return start;
+    }
+    return 0;
+}
+
+/* Copies the data chain `blocks` of the inode at `inode_index` to the free
+ * run at `target` and repoints the inode at it. The old blocks are freed
+ * (in `map` only, the free list is rebuilt by the caller) */
+int tfs_chain_move(addr_t inode_index, char* block_inode, addr_t* blocks, int count, int target, uint8_t* map) {
+    char block[BLOCKSIZE];
+    int i;
+    for (i = 0; i < count; i++) {
+        fail_if(readBlock(tfs_meta.disk, blocks[i], block));
+        tfs_write_addr(block, i + 1 < count ? target + i + 1 : 0);
+        fail_if(writeBlock(tfs_meta.disk, target + i, block));
+        map[target + i] = TFS_SPACE_USED;
+    }
+    tfs_write_addr(block_inode, target);
+    fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode));
+    tfs_block_map_drop(inode_index);
+
+    int fd;
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX; fd++) {
+        struct tfs_openfile* file_meta = &tfs_openfile_table[fd];
+        if (!file_meta->live || file_meta->inode_index != inode_index)
+            continue;
+        for (i = 0; i < count; i++) {
+            if (file_meta->ptr.block_num == blocks[i]) {
+                file_meta->ptr.block_num = target + i;
+                break;
+            }
+        }
+    }
+
+    if (tfs_punching()) {
+        for (i = 0; i < count; i++)
+            map[blocks[i]] = TFS_SPACE_HOLE;
+        return tfs_blocks_release(blocks, count);
+    }
+    char block_free[BLOCKSIZE] = {0};
+    block_free[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+    block_free[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+    for (i = 0; i < count; i++) {
+        fail_if(writeBlock(tfs_meta.disk, blocks[i], block_free));
+        map[blocks[i]] = TFS_SPACE_FREE;
+    }
+    return TFS_OK;
+}
+
+/* Slides every used block down over the free ones below it, keeping their
+ * order, so free space ends up as one run at the end. Blocks left behind
+ * past the last used one go past the high-water mark (punched) or, on
+ * images without one, are written free */
+int tfs_space_compact(uint8_t* map, int end) {
+    static addr_t from[TFS_BLOCK_COUNT_MAX];
+    static addr_t to[TFS_BLOCK_COUNT_MAX];
+    int count = 0;
+    int used = TFS_BLOCK_SUPER_INDEX + 1;
+    int i;
+    for (i = TFS_BLOCK_SUPER_INDEX + 1; i < end; i++) {
+        if (map[i] != TFS_SPACE_USED)
+            continue;
+        if (i != used) {
+            from[count] = i;
+            to[count++] = used;
+        }
+        used++;
+    }
+    if (count == 0)
+        return TFS_OK;
+    fail_if(tfs_blocks_relocate(from, to, count, end));
+
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    bool lazy = tfs_read_count(block_super) != 0;
+    char block_free[BLOCKSIZE] = {0};
+    block_free[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+    block_free[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+    for (i = TFS_BLOCK_SUPER_INDEX + 1; i < end; i++) {
+        if (i < used) {
+            map[i] = TFS_SPACE_USED;
+        } else if (lazy) {
+            map[i] = TFS_SPACE_LAZY;
+        } else if (map[i] == TFS_SPACE_USED) {
+            fail_if(writeBlock(tfs_meta.disk, i, block_free));
+            map[i] = TFS_SPACE_FREE;
+        }
+    }
+    // blocks past the high-water mark have to read as zeros
+    if (lazy && punchBlocks(tfs_meta.disk, used, end - used) < 0) {
+        char zeros[BLOCKSIZE] = {0};
+        for (i = used; i < end; i++)
+            fail_if(writeBlock(tfs_meta.disk, i, zeros));
+    }
+    return TFS_OK;
+}
+
+/* Links the free blocks in `map` into the free list in address order, so
+ * allocation hands out runs of adjacent blocks, and raises the high-water
+ * mark past any never written block that was used */
+int tfs_space_relink(uint8_t* map, int end) {
+    char block_super[BLOCKSIZE];
+    char block[BLOCKSIZE];
+    addr_t next = 0;
+    int hwm = 0;
+    tfs_meta.hole_count = 0;
+    tfs_meta.space_valid = false;
+    int i;
+    for (i = end - 1; i > TFS_BLOCK_SUPER_INDEX; i--) {
+        if (map[i] != TFS_SPACE_LAZY && hwm == 0)
+            hwm = i + 1;
+        // pushed from the top down so the lowest hole is handed out first
+        if (map[i] == TFS_SPACE_HOLE)
+            tfs_hole_push(i);
+        if (map[i] != TFS_SPACE_FREE)
+            continue;
+        fail_if(readBlock(tfs_meta.disk, i, block));
+        if (tfs_read_addr(block) != next) {
+            tfs_write_addr(block, next);
+            fail_if(writeBlock(tfs_meta.disk, i, block));
+        }
+        next = i;
+    }
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    tfs_write_addr(block_super, next);
+    if (tfs_read_count(block_super) != 0)
+        tfs_write_hwm(block_super, hwm > 0 ? hwm : TFS_BLOCK_SUPER_INDEX + 1);
+    return writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super);
+}
+
+int tfs_op_defrag(int budgetMs) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (tfs_meta.streams > 0)
+        return TFS_ERR_BUSY;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    static uint8_t map[TFS_BLOCK_COUNT_MAX];
+    static addr_t blocks[TFS_BLOCK_COUNT_MAX];
+    int end;
+    fail_if(tfs_space_map(map, &end, NULL));
+
+    // detach the free list while blocks move, a crash can then only leak free blocks
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    tfs_write_addr(block_super, 0);
+    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+
+    int err = TFS_OK;
+    bool more = false;
+    if (tfs_meta.defrag_cursor == 0)
+        tfs_meta.defrag_stuck = 0;
+    int inode_index;
+    for (inode_index = tfs_meta.defrag_cursor; inode_index < end; inode_index++) {
+        if (budgetMs > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed >= budgetMs) {
+                more = true;
+                break;
+            }
+        }
+        if (map[inode_index] != TFS_SPACE_USED)
+            continue;
+        char block_inode[BLOCKSIZE];
+        if ((err = readBlock(tfs_meta.disk, inode_index, block_inode)) < 0)
+            break;
+        if (block_inode[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE_INODE)
+            continue;
+        int count;
+        bool shared;
+        if ((err = tfs_file_blocks(block_inode, blocks, &count, &shared)) < 0)
+            break;
+        // blocks with other owners would need every owner repointed
+        if (shared || tfs_extent_count(blocks, count) <= 1)
+            continue;
+        int target = tfs_space_find(map, TFS_BLOCK_SUPER_INDEX + 1, end, count);
+        if (target == 0) {
+            // may fit once the free space is compacted
+            if (tfs_meta.defrag_stuck == 0 || count < tfs_meta.defrag_stuck)
+                tfs_meta.defrag_stuck = count;
+            continue;
+        }
+        if ((err = tfs_chain_move(inode_index, block_inode, blocks, count, target, map)) < 0)
+            break;
+    }
+    if (err >= 0 && !more && budgetMs > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        // compact on the next call, with a budget of its own
+        more = elapsed >= budgetMs;
+    }
+    bool compact = err >= 0 && !more;
+    if (compact) {
+        err = tfs_space_compact(map, end);
+        // go through the files again if one that had no room now has
+        if (tfs_meta.defrag_stuck > 0 && tfs_space_find(map, TFS_BLOCK_SUPER_INDEX + 1, end, tfs_meta.defrag_stuck) != 0)
+            more = true;
+        inode_index = 0;
+    }
+    tfs_meta.defrag_cursor = more ? inode_index : 0;
+
+    int relink_err = tfs_space_relink(map, end);
+    fail_if(err);
+    fail_if(relink_err);
+    if (compact) {
+        fail_if(tfs_refs_sync());
+        fail_if(tfs_dedup_load());
+    }
+    return more;
+}
+
+/* Cleans mostly dead segments, in rounds of the emptiest first: their live
+ * blocks are moved to the log head together, with every pointer to them
+ * rewritten, and the rest of the segment is punched. The segment the log
+ * head is in is left alone, as is an image's only segment, and each segment
+ * is cleaned at most once per call. A segment is only picked when its live
+ * blocks fit in the free space outside the segments picked, which is where
+ * they go, so running short of space ends the call instead of failing it */
+int tfs_op_clean(int budgetMs) {
+    if (!tfs_meta.mounted)
+        return TFS_ERR_NOT_MOUNTED;
+    if (tfs_meta.streams > 0)
+        return TFS_ERR_BUSY;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    enum { segments_max = TFS_BLOCK_COUNT_MAX / TFS_LOG_SEGMENT_BLOCKS + 1 };
+    static bool cleaned[segments_max];
+    static bool picked[segments_max];
+    static int live[segments_max];
+    static int dead[segments_max];
+    static int lazy[segments_max];
+    static addr_t moving[TFS_LOG_SEGMENT_BLOCKS];
+    static addr_t targets[TFS_LOG_SEGMENT_BLOCKS];
+    static uint8_t masked[TFS_BLOCK_COUNT_MAX];
+    memset(cleaned, 0, sizeof(cleaned));
+    while (true) {
+        if (!tfs_meta.space_valid)
+            fail_if(tfs_space_load());
+        uint8_t* space = tfs_meta.space;
+        int end = tfs_meta.space_end;
+        int segments = (end + TFS_LOG_SEGMENT_BLOCKS - 1) / TFS_LOG_SEGMENT_BLOCKS;
+        int head = tfs_meta.log_head != 0 ? (int)tfs_meta.log_head / TFS_LOG_SEGMENT_BLOCKS : -1;
+        int seg;
+        int i;
+        if (segments <= 1)
+            return 0;
+        memset(live, 0, segments * sizeof(int));
+        memset(dead, 0, segments * sizeof(int));
+        memset(lazy, 0, segments * sizeof(int));
+        memset(picked, 0, segments * sizeof(bool));
+        for (i = TFS_BLOCK_SUPER_INDEX + 1; i < end; i++) {
+            live[i / TFS_LOG_SEGMENT_BLOCKS] += space[i] == TFS_SPACE_USED;
+            dead[i / TFS_LOG_SEGMENT_BLOCKS] += space[i] == TFS_SPACE_FREE || space[i] == TFS_SPACE_HOLE;
+            lazy[i / TFS_LOG_SEGMENT_BLOCKS] += space[i] == TFS_SPACE_LAZY;
+        }
+        // never written blocks are handed out too, they just aren't worth cleaning for
+        int free_outside = 0;
+        for (seg = 0; seg < segments; seg++)
+            free_outside += dead[seg] + lazy[seg];
+
+        // what fits in one segment at the head, emptiest segments first
+        int moving_count = 0;
+        int live_max;
+        for (live_max = 1; live_max * 100 <= TFS_LOG_SEGMENT_BLOCKS * TFS_LOG_CLEAN_LIVE_PCT; live_max++) {
+            for (seg = 0; seg < segments; seg++) {
+                if (cleaned[seg] || seg == head || live[seg] != live_max || dead[seg] == 0
+                        || moving_count + live_max > TFS_LOG_SEGMENT_BLOCKS
+                        || moving_count + live_max > free_outside - dead[seg] - lazy[seg])
+                    continue;
+                int first = seg * TFS_LOG_SEGMENT_BLOCKS;
+                for (i = first; i < first + TFS_LOG_SEGMENT_BLOCKS && i < end; i++)
+                    if (space[i] == TFS_SPACE_USED && i != TFS_BLOCK_SUPER_INDEX)
+                        moving[moving_count++] = i;
+                free_outside -= dead[seg] + lazy[seg];
+                cleaned[seg] = true;
+                picked[seg] = true;
+            }
+        }
+        if (moving_count == 0)
+            return 0;
+
+        // the targets come from outside the picked segments, which read as full while they are taken
+        for (seg = 0; seg < segments; seg++) {
+            if (!picked[seg])
+                continue;
+            for (i = seg * TFS_LOG_SEGMENT_BLOCKS; i < (seg + 1) * TFS_LOG_SEGMENT_BLOCKS && i < end; i++) {
+                masked[i] = space[i];
+                space[i] = TFS_SPACE_USED;
+            }
+        }
+        char block_super[BLOCKSIZE];
+        int err = readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super);
+        if (err >= 0)
+            err = tfs_space_take(tfs_meta.log_head, moving_count, targets, block_super);
+        for (seg = 0; seg < segments; seg++) {
+            if (!picked[seg])
+                continue;
+            for (i = seg * TFS_LOG_SEGMENT_BLOCKS; i < (seg + 1) * TFS_LOG_SEGMENT_BLOCKS && i < end; i++) {
+                space[i] = masked[i];
+                // passed over by a target past the high-water mark, as tfs_space_take does
+                if (err >= 0 && space[i] == TFS_SPACE_LAZY && i < (int)tfs_read_hwm(block_super)) {
+                    space[i] = TFS_SPACE_HOLE;
+                    tfs_hole_push(i);
+                }
+            }
+        }
+        fail_if(err);
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        // the moved copies may be past the old high-water mark
+        int limit = tfs_read_count(block_super) != 0 ? (int)tfs_read_hwm(block_super) : end;
+        fail_if(tfs_blocks_relocate(moving, targets, moving_count, limit));
+        fail_if(tfs_blocks_release(moving, moving_count));
+        fail_if(tfs_refs_sync());
+        fail_if(tfs_dedup_load());
+
+        if (budgetMs > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed >= budgetMs)
+                return 1;
+        }
+    }
+}
+
+/******************************************************/
+/****************** Resize functions ******************/
+/******************************************************/
+
+/* points the addr at `pos` of `block` at its moved copy, if it was moved */
+bool tfs_remap_at(char* block, int pos, addr_t* remap) {
+    addr_t addr;
+    memcpy(&addr, &block[pos], sizeof(addr_t));
+    if (addr == 0 || remap[addr] == 0)
+        return false;
+    memcpy(&block[pos], &remap[addr], sizeof(addr_t));
+    return true;
+}
+
+/* rewrites every block address stored in `block`. Returns whether any changed */
+bool tfs_block_remap(char* block, addr_t* remap) {
+    bool changed = false;
+    int pos = 0;
+    int slots = 0;
+    int stride = 0;
+    switch (block[TFS_BLOCK_EVERY_POS__TYPE]) {
+    case TFS_BLOCK_TYPE_SUPER:
+        changed |= tfs_remap_at(block, TFS_BLOCK_SUPER_POS__REFS, remap);
+        // fall through - the superblock is also the root directory
+    case TFS_BLOCK_TYPE___DIR:
+        if (block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE___DIR)
+            changed |= tfs_remap_at(block, TFS_BLOCK___DIR_POS_PARENT, remap);
+        changed |= tfs_remap_at(block, TFS_BLOCK___DIR_POS__NEXT, remap);
+        pos = TFS_BLOCK___DIR_POS__ENTS;
+        slots = TFS_BLOCK___DIR_SLOTS;
+        stride = TFS_DIRENT_SIZE;
+        break;
+    case TFS_BLOCK_TYPE__DENT:
+        changed |= tfs_remap_at(block, TFS_BLOCK_EVERY_POS__ADDR, remap);
+        pos = TFS_BLOCK__DENT_POS__ENTS;
+        slots = TFS_BLOCK__DENT_SLOTS;
+        stride = TFS_DIRENT_SIZE;
+        break;
+    case TFS_BLOCK_TYPE__INDX:
+        changed |= tfs_remap_at(block, TFS_BLOCK_EVERY_POS__ADDR, remap);
+        pos = TFS_BLOCK__INDX_POS__ENTS;
+        slots = TFS_BLOCK__INDX_SLOTS;
+        stride = sizeof(addr_t);
+        break;
+    case TFS_BLOCK_TYPE__REFS:
+        // the entries are rewritten from tfs_meta.refs by tfs_refs_sync
+    case TFS_BLOCK_TYPE_INODE:
+    case TFS_BLOCK_TYPE__DATA:
+        changed |= tfs_remap_at(block, TFS_BLOCK_EVERY_POS__ADDR, remap);
+        break;
+    }
+    int slot;
+    for (slot = 0; slot < slots; slot++)
+        changed |= tfs_remap_at(block, pos + slot * stride, remap);
+    return changed;
+}
+
+/* Copies block `from[i]` to `to[i]`, in order, then rewrites every pointer
+ * to a moved block - in blocks below `limit`, the refs table and open
+ * files - and drops the caches that hold block addresses. A target may be
+ * a block moved earlier in the list */
+int tfs_blocks_relocate(addr_t* from, addr_t* to, int count, int limit) {
+    static addr_t remap[TFS_BLOCK_COUNT_MAX];
+    char block[BLOCKSIZE];
+    memset(remap, 0, sizeof(remap));
+    int j;
+    for (j = 0; j < count; j++) {
+        fail_if(readBlock(tfs_meta.disk, from[j], block));
+        fail_if(writeBlock(tfs_meta.disk, to[j], block));
+        remap[from[j]] = to[j];
+        tfs_meta.refs[to[j]] = tfs_meta.refs[from[j]];
+        tfs_meta.refs[from[j]] = 0;
+    }
+    int i;
+    for (i = 0; i < limit; i++) {
+        fail_if(readBlock(tfs_meta.disk, i, block));
+        if (tfs_block_remap(block, remap))
+            fail_if(writeBlock(tfs_meta.disk, i, block));
+    }
+
+    int fd;
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX; fd++) {
+        struct tfs_openfile* file_meta = &tfs_openfile_table[fd];
+        if (!file_meta->live)
+            continue;
+        if (remap[file_meta->inode_index] != 0)
+            file_meta->inode_index = remap[file_meta->inode_index];
+        if (remap[file_meta->parent] != 0)
+            file_meta->parent = remap[file_meta->parent];
+        if (remap[file_meta->ptr.block_num] != 0)
+            file_meta->ptr.block_num = remap[file_meta->ptr.block_num];
+        for (j = 0; file_meta->block_map != NULL && j < file_meta->block_map_count; j++) {
+            if (remap[file_meta->block_map[j]] != 0)
+                file_meta->block_map[j] = remap[file_meta->block_map[j]];
+        }
+    }
+    tfs_dcache_clear();
+    for (j = 0; j < TFS_ZCACHE_ENTRIES; j++)
+        tfs_zcache[j].live = false;
+    tfs_meta.space_valid = false;
+    return TFS_OK;
+}
+
+/* Shrinks the image to `new_count` blocks. Live blocks past the end are
+ * copied into free ones below it, then every pointer to them (on disk, in
+ * the refs table and in open files) is rewritten before the tail is cut
+ * off. Nothing is changed if the live blocks don't fit */
+int tfs_shrink(uint32_t new_count, uint32_t hwm) {
+    static addr_t moving[TFS_BLOCK_COUNT_MAX];
+    static addr_t targets[TFS_BLOCK_COUNT_MAX];
+    static bool used[TFS_BLOCK_COUNT_MAX];
+    char block[BLOCKSIZE];
+    int moving_count = 0;
+    int target_count = 0;
+    uint32_t i;
+
+    /* live blocks past the new end */
+    for (i = new_count; i < hwm; i++) {
+        fail_if(readBlock(tfs_meta.disk, i, block));
+        bool hole = block[TFS_BLOCK_EVERY_POS__TYPE] == 0 && block[TFS_BLOCK_EVERY_POS_MAGIC] == 0;
+        if (block[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE__FREE && !hole)
+            moving[moving_count++] = i;
+    }
+    /* free blocks to move them into, then never written ones */
+    uint32_t new_hwm = hwm < new_count ? hwm : new_count;
+    for (i = TFS_BLOCK_SUPER_INDEX + 1; i < new_hwm && target_count < moving_count; i++) {
+        fail_if(readBlock(tfs_meta.disk, i, block));
+        bool hole = block[TFS_BLOCK_EVERY_POS__TYPE] == 0 && block[TFS_BLOCK_EVERY_POS_MAGIC] == 0;
+        if (block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__FREE || hole)
+            targets[target_count++] = i;
+    }
+    while (target_count < moving_count && new_hwm < new_count)
+        targets[target_count++] = new_hwm++;
+    if (target_count < moving_count)
+        return TFS_ERR_INSUFFICIENT_SPACE;
+
+    memset(used, 0, sizeof(used));
+    int j;
+    for (j = 0; j < target_count; j++)
+        used[targets[j]] = true;
+
+    /* the free blocks that stay free, read before any of them is filled */
+    static addr_t keep[TFS_BLOCK_COUNT_MAX];
+    static addr_t keep_next[TFS_BLOCK_COUNT_MAX];
+    int keep_count = 0;
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    addr_t free_index = tfs_read_addr(block_super);
+    while (free_index != 0) {
+        fail_if(readBlock(tfs_meta.disk, free_index, block));
+        addr_t next = tfs_read_addr(block);
+        if (free_index < new_count && !used[free_index]) {
+            keep[keep_count] = free_index;
+            keep_next[keep_count++] = next;
+        }
+        free_index = next;
+    }
+
+    fail_if(tfs_blocks_relocate(moving, targets, moving_count, new_hwm));
+
+    /* relink the free list past the blocks that were filled or cut off */
+    for (j = 0; j < keep_count; j++) {
+        addr_t next = j + 1 < keep_count ? keep[j + 1] : 0;
+        if (next == keep_next[j])
+            continue;
+        fail_if(readBlock(tfs_meta.disk, keep[j], block));
+        tfs_write_addr(block, next);
+        fail_if(writeBlock(tfs_meta.disk, keep[j], block));
+    }
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    tfs_write_addr(block_super, keep_count > 0 ? keep[0] : 0);
+    tfs_write_hwm(block_super, new_hwm);
+    tfs_write_count(block_super, new_count);
+    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+
+    fail_if(tfs_refs_sync());
+    fail_if(tfs_holes_load());
+    fail_if(tfs_dedup_load());
+    fail_if(resizeDisk(tfs_meta.disk, new_count * BLOCKSIZE));
+    return TFS_OK;
+}
+
+/******************************************************/
+/***************** Directory functions ****************/
+/******************************************************/
+
+/* creates the empty directory `name` in `parent` */
+int tfs_dir_make(addr_t parent, const char* name, addr_t* out) {
+    struct tfs_dir* parent_info;
+    fail_if(tfs_dir_load(parent, &parent_info));
+    if (tfs_dcache_find(parent, name) != NULL)
+        return TFS_ERR_EXISTS;
+
+    char block_dir[BLOCKSIZE];
+    addr_t dir_index;
+    fail_if(tfs_block_alloc(&dir_index, block_dir));
+    int err;
+
+    block_dir[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE___DIR;
+    tfs_write_addr(block_dir, 0);
+    tfs_write_size(block_dir, 0);
+    {
+        time_t t = time(NULL);
+        tfs_write_tstamp(block_dir, TSTAMP_CREATE, t);
+        tfs_write_tstamp(block_dir, TSTAMP_ACCESS, t);
+        tfs_write_tstamp(block_dir, TSTAMP_MODIFY, t);
+    }
+    tfs_write_links(block_dir, 1);
+    memcpy(&block_dir[TFS_BLOCK___DIR_POS_PARENT], &parent, sizeof(addr_t));
+    fail_if(writeBlock(tfs_meta.disk, dir_index, block_dir));
+
+    if ((err = tfs_dir_add(parent, name, dir_index, TFS_BLOCK_TYPE___DIR)) < 0) {
+        tfs_block_free(dir_index);
+        fail(err);
+    }
+    *out = dir_index;
+    return TFS_OK;
+}
+
+
+/* copies every entry of `dir` off disk into a malloc'd array */
+int tfs_dir_list(addr_t dir, struct tfs_dirent_copy** out, int* count) {
+    int cap = 16;
+    int n = 0;
+    struct tfs_dirent_copy* entries = malloc(cap * sizeof(struct tfs_dirent_copy));
+    if (entries == NULL)
+        return TFS_ERR_NO_MEMORY;
+
+    char block[BLOCKSIZE];
+    addr_t block_index = dir;
+    int err;
+    // the root directory is block 0, so the loop ends on a zero next pointer
+    for (;;) {
+        if ((err = readBlock(tfs_meta.disk, block_index, block)) < 0) {
+            free(entries);
+            fail(err);
+        }
+        int slots = block_index == dir ? TFS_BLOCK___DIR_SLOTS : TFS_BLOCK__DENT_SLOTS;
+        int slot;
+        for (slot = 0; slot < slots; slot++) {
+            char* dirent = &block[tfs_dirent_pos(block_index, dir, slot)];
+            addr_t inode;
+            memcpy(&inode, &dirent[TFS_DIRENT_POS_INODE], sizeof(addr_t));
+            if (inode == 0)
+                continue;
+            if (n == cap) {
+                cap *= 2;
+                struct tfs_dirent_copy* grown = realloc(entries, cap * sizeof(struct tfs_dirent_copy));
+                if (grown == NULL) {
+                    free(entries);
+                    return TFS_ERR_NO_MEMORY;
+                }
+                entries = grown;
+            }
+            entries[n].inode = inode;
+            entries[n].type = dirent[TFS_DIRENT_POS__TYPE];
+            memset(entries[n].name, 0, sizeof(entries[n].name));
+            memcpy(entries[n].name, &dirent[TFS_DIRENT_POS__NAME], TFS_FILE_NAME_LEN_MAX);
+            n++;
+        }
+        if (block_index == dir)
+            memcpy(&block_index, &block[TFS_BLOCK___DIR_POS__NEXT], sizeof(addr_t));
+        else
+            block_index = tfs_read_addr(block);
+        if (block_index == 0)
+            break;
+    }
+    *out = entries;
+    *count = n;
+    return TFS_OK;
+}
+
+/* Names a copy of inode `src` as `name` in `dir`, sharing its data chain.
+ * With `share` the chain's reference is taken (and synced) here, otherwise
+ * the caller already took it */
+int tfs_inode_clone(addr_t src, addr_t dir, const char* name, bool share) {
+    char block_src[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, src, block_src));
+    assert(block_src[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE_INODE, "clone source is not an inode");
+
+    addr_t first = tfs_read_addr(block_src);
+    if (share && first != 0) {
+        tfs_meta.refs[first]++;
+        fail_if(tfs_refs_sync());
+    }
+
+    char block_inode[BLOCKSIZE];
+    addr_t inode_index;
+    int err;
+    if ((err = tfs_block_alloc(&inode_index, block_inode)) < 0) {
+        if (share && first != 0) {
+            tfs_meta.refs[first]--;
+            tfs_refs_sync();
+        }
+        fail(err);
+    }
+    memcpy(block_inode, block_src, BLOCKSIZE);
+    tfs_write_links(block_inode, 1);
+    tfs_write_tstamp_now(block_inode, TSTAMP_CREATE);
+    fail_if(writeBlock(tfs_meta.disk, inode_index, block_inode));
+    if ((err = tfs_dir_add(dir, name, inode_index, TFS_BLOCK_TYPE_INODE)) < 0) {
+        tfs_block_free(inode_index);
+        fail(err);
+    }
+    return TFS_OK;
+}
+
+/* reads the _REFS chain into tfs_meta.refs */
+int tfs_refs_load(void) {
+    memset(tfs_meta.refs, 0, TFS_BLOCK_COUNT_MAX * sizeof(uint16_t));
+    char block[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block));
+    addr_t refs_index;
+    memcpy(&refs_index, &block[TFS_BLOCK_SUPER_POS__REFS], sizeof(addr_t));
+    while (refs_index != 0) {
+        fail_if(readBlock(tfs_meta.disk, refs_index, block));
+        if (block[TFS_BLOCK_EVERY_POS__TYPE] != TFS_BLOCK_TYPE__REFS)
+            return TFS_ERR_INVALID;
+        int slot;
+        for (slot = 0; slot < TFS_BLOCK__REFS_SLOTS; slot++) {
+            char* ent = &block[TFS_BLOCK__REFS_POS__ENTS + slot * TFS_BLOCK__REFS_SIZE__ENT];
+            addr_t shared;
+            uint16_t extra;
+            memcpy(&shared, ent, sizeof(addr_t));
+            memcpy(&extra, ent + sizeof(addr_t), sizeof(uint16_t));
+            if (shared != 0)
+                tfs_meta.refs[shared] = extra;
+        }
+        refs_index = tfs_read_addr(block);
+    }
+    return TFS_OK;
+}
+
+/* Rewrites the _REFS chain from tfs_meta.refs, reusing its blocks and
+ * growing or shrinking it as needed */
+int tfs_refs_sync(void) {
+    static addr_t chain[TFS_BLOCK_COUNT_MAX / TFS_BLOCK__REFS_SLOTS + 1];
+    int shared_count = 0;
+    int i;
+    for (i = 0; i < TFS_BLOCK_COUNT_MAX; i++) {
+        if (tfs_meta.refs[i] > 0)
+            shared_count++;
+    }
+    int needed = (shared_count + TFS_BLOCK__REFS_SLOTS - 1) / TFS_BLOCK__REFS_SLOTS;
+
+    char block[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block));
+    addr_t refs_index;
+    memcpy(&refs_index, &block[TFS_BLOCK_SUPER_POS__REFS], sizeof(addr_t));
+    int have = 0;
+    while (refs_index != 0) {
+        chain[have++] = refs_index;
+        fail_if(readBlock(tfs_meta.disk, refs_index, block));
+        refs_index = tfs_read_addr(block);
+    }
+    while (have < needed)
+        fail_if(tfs_block_alloc(&chain[have++], block));
+    while (have > needed)
+        fail_if(tfs_block_free(chain[--have]));
+
+    int ref_index = 0;
+    for (i = 0; i < needed; i++) {
+        memset(block, 0, BLOCKSIZE);
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__REFS;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        tfs_write_addr(block, i + 1 < needed ? chain[i + 1] : 0);
+        int slot = 0;
+        for (; ref_index < TFS_BLOCK_COUNT_MAX && slot < TFS_BLOCK__REFS_SLOTS; ref_index++) {
+            if (tfs_meta.refs[ref_index] == 0)
+                continue;
+            char* ent = &block[TFS_BLOCK__REFS_POS__ENTS + slot * TFS_BLOCK__REFS_SIZE__ENT];
+            addr_t shared = ref_index;
+            memcpy(ent, &shared, sizeof(addr_t));
+            memcpy(ent + sizeof(addr_t), &tfs_meta.refs[ref_index], sizeof(uint16_t));
+            slot++;
+        }
+        fail_if(writeBlock(tfs_meta.disk, chain[i], block));
+    }
+
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block));
+    refs_index = needed > 0 ? chain[0] : 0;
+    memcpy(&block[TFS_BLOCK_SUPER_POS__REFS], &refs_index, sizeof(addr_t));
+    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block));
+    return TFS_OK;
+}
+
+/* FNV-1a over the parent inode and name */
+uint32_t tfs_dentry_hash(addr_t parent, const char* name) {
+    uint32_t hash = 2166136261u;
+    hash = (hash ^ (parent & 0xff)) * 16777619u;
+    hash = (hash ^ (parent >> 8)) * 16777619u;
+    for (; *name != '\0'; name++)
+        hash = (hash ^ (uint8_t)*name) * 16777619u;
+    return hash;
+}
+
+struct tfs_dentry* tfs_dcache_find(addr_t parent, const char* name) {
+    uint32_t hash = tfs_dentry_hash(parent, name);
+    struct tfs_dentry* dentry = tfs_meta.dcache[hash % tfs_meta.dcache_buckets];
+    uint64_t scanned = 0;
+    for (; dentry != NULL; dentry = dentry->next) {
+        scanned++;
+        if (dentry->hash == hash && dentry->parent == parent && strcmp(dentry->name, name) == 0)
+            break;
+    }
+    tfs_stats.name_lookups++;
+    tfs_stats.name_scanned += scanned;
+    if (scanned > tfs_stats.name_scanned_max)
+        tfs_stats.name_scanned_max = scanned;
+    return dentry;
+}
+
+/* doubles the bucket count once the cache averages two dentries per bucket */
+void tfs_dcache_grow(void) {
+    int buckets = tfs_meta.dcache_buckets * 2;
+    struct tfs_dentry** dcache = calloc(buckets, sizeof(struct tfs_dentry*));
+    if (dcache == NULL)
+        return; // longer chains are still correct
+    int i;
+    for (i = 0; i < tfs_meta.dcache_buckets; i++) {
+        struct tfs_dentry* dentry = tfs_meta.dcache[i];
+        while (dentry != NULL) {
+            struct tfs_dentry* next = dentry->next;
+            dentry->next = dcache[dentry->hash % buckets];
+            dcache[dentry->hash % buckets] = dentry;
+            dentry = next;
+        }
+    }
+    free(tfs_meta.dcache);
+    tfs_meta.dcache = dcache;
+    tfs_meta.dcache_buckets = buckets;
+}
+
+int tfs_dcache_insert(addr_t parent, const char* name, addr_t inode, uint8_t type, struct tfs_dirent_loc loc) {
+    struct tfs_dentry* dentry = calloc(1, sizeof(struct tfs_dentry));
+    if (dentry == NULL)
+        return TFS_ERR_NO_MEMORY;
+    dentry->hash = tfs_dentry_hash(parent, name);
+    dentry->parent = parent;
+    dentry->inode = inode;
+    dentry->type = type;
+    dentry->block = loc.block;
+    dentry->slot = loc.slot;
+    strncpy(dentry->name, name, TFS_FILE_NAME_LEN_MAX);
+
+    if (tfs_meta.dcache_count >= tfs_meta.dcache_buckets * 2)
+        tfs_dcache_grow();
+    struct tfs_dentry** bucket = &tfs_meta.dcache[dentry->hash % tfs_meta.dcache_buckets];
+    dentry->next = *bucket;
+    *bucket = dentry;
+    tfs_meta.dcache_count++;
+    return TFS_OK;
+}
+
+void tfs_dcache_remove(struct tfs_dentry* dentry) {
+    struct tfs_dentry** link = &tfs_meta.dcache[dentry->hash % tfs_meta.dcache_buckets];
+    while (*link != dentry) {
+        assert(*link != NULL, "dentry %s not in dcache", dentry->name);
+        link = &(*link)->next;
+    }
+    *link = dentry->next;
+    tfs_meta.dcache_count--;
+    free(dentry);
+}
+
+/* forgets every dentry and loaded directory, they are read again on demand */
+void tfs_dcache_clear(void) {
+    int i;
+    if (tfs_meta.dcache != NULL) {
+        for (i = 0; i < tfs_meta.dcache_buckets; i++) {
+            struct tfs_dentry* dentry = tfs_meta.dcache[i];
+            while (dentry != NULL) {
+                struct tfs_dentry* next = dentry->next;
+                free(dentry);
+                dentry = next;
+            }
+            tfs_meta.dcache[i] = NULL;
+        }
+    }
+    if (tfs_meta.dirs != NULL) {
+        for (i = 0; i < TFS_BLOCK_COUNT_MAX; i++) {
+            if (tfs_meta.dirs[i] == NULL)
+                continue;
+            free(tfs_meta.dirs[i]->free);
+            free(tfs_meta.dirs[i]);
+            tfs_meta.dirs[i] = NULL;
+        }
+    }
+    tfs_meta.dcache_count = 0;
+}
+
+void tfs_dcache_drop(void) {
+    tfs_dcache_clear();
+    free(tfs_meta.dcache);
+    free(tfs_meta.dirs);
+    tfs_meta.dcache = NULL;
+    tfs_meta.dirs = NULL;
+    tfs_meta.dcache_buckets = 0;
+    tfs_meta.dcache_count = 0;
+}
+
+int tfs_dir_push_free(struct tfs_dir* dir_info, struct tfs_dirent_loc loc) {
+    if (dir_info->free_count == dir_info->free_cap) {
+        int cap = dir_info->free_cap == 0 ? 8 : dir_info->free_cap * 2;
+        struct tfs_dirent_loc* free_locs = realloc(dir_info->free, cap * sizeof(struct tfs_dirent_loc));
+        if (free_locs == NULL)
+            return TFS_ERR_NO_MEMORY;
+        dir_info->free = free_locs;
+        dir_info->free_cap = cap;
+    }
+    dir_info->free[dir_info->free_count++] = loc;
+    return TFS_OK;
+}
+
+/* offset of `slot` within a directory head block or _DENT block */
+int tfs_dirent_pos(addr_t block_index, addr_t dir, uint8_t slot) {
+    if (block_index == dir)
+        return TFS_BLOCK___DIR_POS__ENTS + slot * TFS_DIRENT_SIZE;
+    return TFS_BLOCK__DENT_POS__ENTS + slot * TFS_DIRENT_SIZE;
+}
+
+/* reads the entries of one directory block into the dentry cache */
+int tfs_dir_load_block(addr_t dir, struct tfs_dir* dir_info, addr_t block_index, char* block, int slots) {
+    int slot;
+    for (slot = 0; slot < slots; slot++) {
+        char* dirent = &block[tfs_dirent_pos(block_index, dir, slot)];
+        struct tfs_dirent_loc loc = {.block = block_index, .slot = slot};
+        addr_t inode;
+        memcpy(&inode, &dirent[TFS_DIRENT_POS_INODE], sizeof(addr_t));
+        if (inode == 0) {
+            fail_if(tfs_dir_push_free(dir_info, loc));
+            continue;
+        }
+        char name[TFS_FILE_NAME_LEN_MAX + 1] = {0};
+        memcpy(name, &dirent[TFS_DIRENT_POS__NAME], TFS_FILE_NAME_LEN_MAX);
+        fail_if(tfs_dcache_insert(dir, name, inode, dirent[TFS_DIRENT_POS__TYPE], loc));
+        dir_info->entry_count++;
+    }
+    return TFS_OK;
+}
+
+/* Reads every entry of `dir` into the dentry cache the first time it is used.
+ * After that lookups, creates and removes in `dir` never scan it on disk */
+int tfs_dir_load(addr_t dir, struct tfs_dir** out) {
+    if (tfs_meta.dirs[dir] != NULL) {
+        *out = tfs_meta.dirs[dir];
+        return TFS_OK;
+    }
+    tfs_stats.dir_loads++;
+    char block[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, dir, block));
+    int type = block[TFS_BLOCK_EVERY_POS__TYPE];
+    if (type != TFS_BLOCK_TYPE___DIR && type != TFS_BLOCK_TYPE_SUPER)
+        return TFS_ERR_NOT_DIR;
+
+    struct tfs_dir* dir_info = calloc(1, sizeof(struct tfs_dir));
+    if (dir_info == NULL)
+        return TFS_ERR_NO_MEMORY;
+    tfs_meta.dirs[dir] = dir_info;
+
+    fail_if(tfs_dir_load_block(dir, dir_info, dir, block, TFS_BLOCK___DIR_SLOTS));
+    addr_t dent_index;
+    memcpy(&dent_index, &block[TFS_BLOCK___DIR_POS__NEXT], sizeof(addr_t));
+    while (dent_index != 0) {
+        fail_if(readBlock(tfs_meta.disk, dent_index, block));
+        assert(block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__DENT, "block %d is not a dirent block", dent_index);
+        fail_if(tfs_dir_load_block(dir, dir_info, dent_index, block, TFS_BLOCK__DENT_SLOTS));
+        dent_index = tfs_read_addr(block);
+    }
+    *out = dir_info;
+    return TFS_OK;
+}
+
+/* links a fresh _DENT block into `dir` and makes its slots available */
+int tfs_dir_grow(addr_t dir, struct tfs_dir* dir_info) {
+    char block_dent[BLOCKSIZE];
+    addr_t dent_index;
+    fail_if(tfs_block_alloc(&dent_index, block_dent));
+    return tfs_dir_grow_at(dir, dir_info, dent_index);
+}
+
+/* tfs_dir_grow with the already claimed block `dent_index` */
+int tfs_dir_grow_at(addr_t dir, struct tfs_dir* dir_info, addr_t dent_index) {
+    char block_dir[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, dir, block_dir));
+
+    char block_dent[BLOCKSIZE] = {0};
+    block_dent[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__DENT;
+    block_dent[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+    memcpy(&block_dent[TFS_BLOCK_EVERY_POS__ADDR], &block_dir[TFS_BLOCK___DIR_POS__NEXT], sizeof(addr_t));
+    fail_if(writeBlock(tfs_meta.disk, dent_index, block_dent));
+
+    memcpy(&block_dir[TFS_BLOCK___DIR_POS__NEXT], &dent_index, sizeof(addr_t));
+    fail_if(writeBlock(tfs_meta.disk, dir, block_dir));
+
+    int slot;
+    for (slot = TFS_BLOCK__DENT_SLOTS - 1; slot >= 0; slot--)
+        fail_if(tfs_dir_push_free(dir_info, (struct tfs_dirent_loc){.block = dent_index, .slot = slot}));
+    return TFS_OK;
+}
+
+int tfs_dirent_write(addr_t dir, struct tfs_dirent_loc loc, addr_t inode, uint8_t type, const char* name) {
+    char block[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, loc.block, block));
+    char* dirent = &block[tfs_dirent_pos(loc.block, dir, loc.slot)];
+    memset(dirent, 0, TFS_DIRENT_SIZE);
+    memcpy(&dirent[TFS_DIRENT_POS_INODE], &inode, sizeof(addr_t));
+    dirent[TFS_DIRENT_POS__TYPE] = type;
+    if (name != NULL)
+        strncpy(&dirent[TFS_DIRENT_POS__NAME], name, TFS_FILE_NAME_LEN_MAX);
+    fail_if(writeBlock(tfs_meta.disk, loc.block, block));
+    return TFS_OK;
+}
+
+/* names `inode` as `name` in `dir`. The name must not already exist */
+int tfs_dir_add(addr_t dir, const char* name, addr_t inode, uint8_t type) {
+    struct tfs_dir* dir_info;
+    fail_if(tfs_dir_load(dir, &dir_info));
+    assert(tfs_dcache_find(dir, name) == NULL, "%s already exists", name);
+
+    if (dir_info->free_count == 0)
+        fail_if(tfs_dir_grow(dir, dir_info));
+
+    struct tfs_dirent_loc loc = dir_info->free[dir_info->free_count - 1];
+    fail_if(tfs_dirent_write(dir, loc, inode, type, name));
+    dir_info->free_count--;
+    fail_if(tfs_dcache_insert(dir, name, inode, type, loc));
+    dir_info->entry_count++;
+    return TFS_OK;
+}
+
+/* clears `dentry`'s on-disk entry and drops it from the cache */
+int tfs_dir_remove(addr_t dir, struct tfs_dentry* dentry) {
+    struct tfs_dir* dir_info;
+    fail_if(tfs_dir_load(dir, &dir_info));
+    struct tfs_dirent_loc loc = {.block = dentry->block, .slot = dentry->slot};
+    fail_if(tfs_dirent_write(dir, loc, 0, 0, NULL));
+    fail_if(tfs_dir_push_free(dir_info, loc));
+    tfs_dcache_remove(dentry);
+    dir_info->entry_count--;
+    return TFS_OK;
+}
+
+/* Resolves every component of `path` but the last, which is copied into `base`
+ * (empty for the root). `dir` is set to the directory that should hold `base` */
+int tfs_path_walk(const char* path, addr_t* dir, char* base) {
+    addr_t cur = TFS_BLOCK__ROOT_INDEX;
+    base[0] = '\0';
+    const char* p = path;
+    while (*p == '/')
+        p++;
+    while (*p != '\0') {
+        const char* end = strchr(p, '/');
+        int len = end == NULL ? (int)strlen(p) : (int)(end - p);
+        if (len > TFS_FILE_NAME_LEN_MAX)
+            return TFS_ERR_FILE_NAME_TOO_LONG;
+        const char* next = p + len;
+        while (*next == '/')
+            next++;
+        if (*next == '\0') {
+            memcpy(base, p, len);
+            base[len] = '\0';
+            break;
+        }
+
+        char name[TFS_FILE_NAME_LEN_MAX + 1];
+        memcpy(name, p, len);
+        name[len] = '\0';
+        struct tfs_dir* dir_info;
+        fail_if(tfs_dir_load(cur, &dir_info));
+        struct tfs_dentry* dentry = tfs_dcache_find(cur, name);
+        if (dentry == NULL)
+            return TFS_ERR_NO_ENTRY;
+        if (dentry->type != TFS_BLOCK_TYPE___DIR)
+            return TFS_ERR_NOT_DIR;
+        cur = dentry->inode;
+        p = next;
+    }
+    *dir = cur;
+    return TFS_OK;
+}
+
+/******************************************************/
+/****************** Helper functions ******************/
+/******************************************************/
+
+/* walks the data chain of `file` once and keeps the address of every block
+ * holding its bytes, the reserved tail isn't needed */
+int tfs_block_map_load(struct tfs_openfile* file) {
+    char block[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, file->inode_index, block));
+    int count = (file->size + TFS_BLOCK__FILE_SIZE_DATA - 1) / TFS_BLOCK__FILE_SIZE_DATA;
+    // never NULL, that means not loaded
+    addr_t* map = malloc((count + 1) * sizeof(addr_t));
+    if (map == NULL)
+        fail(TFS_ERR_NO_MEMORY);
+    int mapped = 0;
+    addr_t block_index = tfs_read_addr(block);
+    while (block_index != 0 && mapped < count) {
+        map[mapped++] = block_index;
+        // the last block's link isn't needed
+        if (mapped == count)
+            break;
+        int err = readBlock(tfs_meta.disk, block_index, block);
+        if (err < 0) {
+            free(map);
+            fail(err);
+        }
+        block_index = tfs_read_addr(block);
+    }
+    file->block_map = map;
+    file->block_map_count = mapped;
+    tfs_meta.block_maps++;
+    return TFS_OK;
+}
+
+void tfs_block_map_free(struct tfs_openfile* file) {
+    if (file->block_map == NULL)
+        return;
+    free(file->block_map);
+    file->block_map = NULL;
+    tfs_meta.block_maps--;
+}
+
+/* forgets the block maps of every descriptor open on `inode_index`, for when its chain changes */
+void tfs_block_map_drop(addr_t inode_index) {
+    int fd;
+    for (fd = 0; fd < TFS_OPEN_FILES_MAX && tfs_meta.block_maps > 0; fd++) {
+        struct tfs_openfile* file = &tfs_openfile_table[fd];
+        if (file->live && file->inode_index == inode_index)
+            tfs_block_map_free(file);
+    }
+}
+
+/* writes all of `data` to a host fd, however many calls that takes */
+int tfs_send_bytes(int out_fd, const char* data, int count) {
+    while (count > 0) {
+        ssize_t written = write(out_fd, data, count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            fail(-errno);
+        data += written;
+        count -= written;
+    }
+    return TFS_OK;
+}
+
+/* pops the head of the free list, or once it is empty a punched block or the
+ * block at the high-water mark. `block` is left holding its contents */
+int tfs_block_alloc(addr_t* index, char* block) {
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    if (tfs_meta.log_mode) {
+        // inodes and directory blocks go to the log head like data
+        fail_if(tfs_space_take(0, 1, index, block_super));
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        memset(block, 0, BLOCKSIZE);
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        return TFS_OK;
+    }
+    // always the first free block, nothing is searched
+    tfs_stats.alloc_calls++;
+
+    addr_t free_index = tfs_read_addr(block_super);
+    if (free_index == 0 && tfs_meta.hole_count > 0) {
+        // free list is empty - reuse a punched block
+        memset(block, 0, BLOCKSIZE);
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        *index = tfs_meta.holes[--tfs_meta.hole_count];
+        tfs_space_used(*index);
+        tfs_stats.alloc_blocks++;
+        return TFS_OK;
+    }
+    if (free_index == 0) {
+        // nothing was freed - format the next never written block
+        uint32_t hwm = tfs_read_hwm(block_super);
+        if (hwm >= tfs_read_count(block_super))
+            return TFS_ERR_NO_FREE_BLOCKS;
+        memset(block, 0, BLOCKSIZE);
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        tfs_write_hwm(block_super, hwm + 1);
+        fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        *index = hwm;
+        tfs_space_used(*index);
+        tfs_stats.alloc_blocks++;
+        return TFS_OK;
+    }
+
+    fail_if(readBlock(tfs_meta.disk, free_index, block));
+    assert(block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__FREE, "block type is not free");
+
+    // update super next free block index
+    addr_t next = tfs_read_addr(block);
+    tfs_write_addr(block_super, next);
+    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    *index = free_index;
+    tfs_space_used(free_index);
+    tfs_stats.alloc_blocks++;
+    if (tfs_meta.space_valid && next != 0)
+        tfs_meta.free_prev[next] = 0;
+    return TFS_OK;
+}
+
+/* Frees the data chain starting at `first`. The chain is spliced onto the
+ * head of the free list whole, so only its blocks and the superblock are
+ * written. With punch_holes or log mode set the blocks are punched instead */
+int tfs_free_chain(addr_t first) {
+    static addr_t blocks[TFS_BLOCK_COUNT_MAX];
+    int count = 0;
+    bool refs_changed = false;
+    fail_if(tfs_chain_collect(first, blocks, &count, &refs_changed));
+    if (count > 0) {
+        char block_super[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+        assert(block_super[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE_SUPER, "block type is not super");
+        fail_if(tfs_blocks_free(blocks, count, block_super));
+        if (!tfs_punching())
+            fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    }
+    if (refs_changed)
+        fail_if(tfs_refs_sync());
+    return TFS_OK;
+}
+
+/* appends to `out` the blocks of the chain at `first` that only it owns. A
+ * shared rest of the chain is left to its other owners, minus the reference
+ * this chain held on it */
+int tfs_chain_collect(addr_t first, addr_t* out, int* count, bool* refs_changed) {
+    if (first != 0 && tfs_meta.refs[first] > 0) {
+        // still shared - the other owners keep the whole chain
+        tfs_meta.refs[first]--;
+        *refs_changed = true;
+        return TFS_OK;
+    }
+    addr_t block_index = first;
+    while (block_index != 0) {
+        char block[BLOCKSIZE];
+        fail_if(readBlock(tfs_meta.disk, block_index, block));
+        assert(block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__DATA, "block type is not data");
+        assert(block[TFS_BLOCK_EVERY_POS_MAGIC] == TFS_BLOCK_MAGIC, "block magic is not correct");
+        out[(*count)++] = block_index;
+        addr_t next_block_index = tfs_read_addr(block);
+        if (next_block_index != 0 && tfs_meta.refs[next_block_index] > 0) {
+            // the rest of the chain is shared with another file
+            tfs_meta.refs[next_block_index]--;
+            *refs_changed = true;
+            next_block_index = 0;
+        }
+        block_index = next_block_index;
+    }
+    return TFS_OK;
+}
+
+/* Frees `count` blocks with one write each, linked in the given order onto
+ * the head of the free list in `block_super`, which the caller writes. With
+ * punch_holes or log mode set they are punched instead and `block_super` is untouched */
+int tfs_blocks_free(addr_t* blocks, int count, char* block_super) {
+    if (count == 0)
+        return TFS_OK;
+    if (tfs_punching())
+        return tfs_blocks_release(blocks, count);
+
+    addr_t head = tfs_read_addr(block_super);
+    int i;
+    for (i = 0; i < count; i++) {
+        char block[BLOCKSIZE] = {0};
+        block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+        block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+        tfs_write_addr(block, i + 1 < count ? blocks[i + 1] : head);
+        fail_if(writeBlock(tfs_meta.disk, blocks[i], block));
+        tfs_space_freed(blocks[i], i > 0 ? blocks[i - 1] : 0, tfs_read_addr(block));
+    }
+    tfs_write_addr(block_super, blocks[0]);
+    return TFS_OK;
+}
+
+int tfs_free_data(char* block_inode) {
+    if (block_inode[TFS_BLOCK_INODE_POS_FLAGS] & TFS_INODE_FLAG_INDEXED)
+        return tfs_index_free(tfs_read_addr(block_inode));
+    return tfs_free_chain(tfs_read_addr(block_inode));
+}
+
+/* zeroes `index` and pushes it onto the head of the free list */
+int tfs_block_free(addr_t index) {
+    if (tfs_punching())
+        return tfs_blocks_release(&index, 1);
+
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+
+    char block[BLOCKSIZE] = {0};
+    block[TFS_BLOCK_EVERY_POS__TYPE] = TFS_BLOCK_TYPE__FREE;
+    block[TFS_BLOCK_EVERY_POS_MAGIC] = TFS_BLOCK_MAGIC;
+    tfs_write_addr(block, tfs_read_addr(block_super));
+    fail_if(writeBlock(tfs_meta.disk, index, block));
+
+    tfs_write_addr(block_super, index);
+    fail_if(writeBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    tfs_space_freed(index, 0, tfs_read_addr(block));
+    return TFS_OK;
+}
+
+int tfs_addr_cmp(const void* a, const void* b) {
+    return *(const addr_t*)a - *(const addr_t*)b;
+}
+
+/* Punches `blocks` out of the image, one call per run of adjacent blocks,
+ * and records them as free. Where the host can't punch the run is zeroed
+ * with plain writes, which leaves the same all zero blocks behind */
+int tfs_blocks_release(addr_t* blocks, int count) {
+    qsort(blocks, count, sizeof(addr_t), tfs_addr_cmp);
+    int start = 0;
+    while (start < count) {
+        int end = start + 1;
+        while (end < count && blocks[end] == blocks[end - 1] + 1)
+            end++;
+        if (punchBlocks(tfs_meta.disk, blocks[start], end - start) < 0) {
+            char zeros[BLOCKSIZE] = {0};
+            int i;
+            for (i = start; i < end; i++)
+                fail_if(writeBlock(tfs_meta.disk, blocks[i], zeros));
+        }
+        start = end;
+    }
+    int i;
+    for (i = 0; i < count; i++)
+        tfs_hole_push(blocks[i]);
+    if (tfs_meta.space_valid) {
+        for (i = 0; i < count; i++)
+            tfs_meta.space[blocks[i]] = TFS_SPACE_HOLE;
+    }
+    return TFS_OK;
+}
+
+void tfs_hole_push(addr_t index) {
+    tfs_meta.hole_slot[index] = tfs_meta.hole_count;
+    tfs_meta.holes[tfs_meta.hole_count++] = index;
+}
+
+/* takes `index` out of the holes, moving the last one into its place */
+void tfs_hole_remove(addr_t index) {
+    int slot = tfs_meta.hole_slot[index];
+    if (slot >= tfs_meta.hole_count || tfs_meta.holes[slot] != index)
+        return;
+    addr_t last = tfs_meta.holes[--tfs_meta.hole_count];
+    tfs_meta.holes[slot] = last;
+    tfs_meta.hole_slot[last] = slot;
+}
+
+/* finds the punched blocks, which read as all zeros below the high-water mark */
+int tfs_holes_load(void) {
+    int limit = tfs_formatted_limit();
+    fail_if(limit);
+    tfs_meta.hole_count = 0;
+    tfs_meta.space_valid = false;
+    char block[BLOCKSIZE];
+    int block_index;
+    for (block_index = TFS_BLOCK_SUPER_INDEX + 1; block_index < limit; block_index++) {
+        if (readBlock(tfs_meta.disk, block_index, block) < 0)
+            break;
+        if (block[TFS_BLOCK_EVERY_POS__TYPE] == 0 && block[TFS_BLOCK_EVERY_POS_MAGIC] == 0)
+            tfs_hole_push(block_index);
+    }
+    return TFS_OK;
+}
+
+int tfs_setPunchHoles(int enable) {
+    tfs_lock();
+    tfs_meta.punch_holes = enable != 0;
+    tfs_unlock();
+    return TFS_OK;
+}
+
+/* whether freed blocks are punched rather than put on the free list */
+bool tfs_punching(void) {
+    return tfs_meta.punch_holes || tfs_meta.log_mode;
+}
+
+int tfs_setLogStructured(int enable) {
+    tfs_lock();
+    tfs_meta.log_mode = enable != 0;
+    tfs_meta.log_head = 0;
+    tfs_unlock();
+    return TFS_OK;
+}
+
+void tfs_write_addr(char* block, uint16_t addr) {
+    union {
+        uint16_t addr;
+        char addr_bytes[2];
+    } addr_union;
     addr_union.addr = addr;
     block[TFS_BLOCK_EVERY_POS__ADDR] = addr_union.addr_bytes[0];
     block[TFS_BLOCK_EVERY_POS__ADDR + 1] = addr_union.addr_bytes[1];
@@ -710,6 +5050,48 @@ uint16_t tfs_read_size(char* block) {
     return addr_union.addr;
 }
 
+void tfs_write_hwm(char* block_super, uint32_t hwm) {
+    memcpy(&block_super[TFS_BLOCK_SUPER_POS___HWM], &hwm, sizeof(uint32_t));
+}
+
+uint32_t tfs_read_hwm(char* block_super) {
+    uint32_t hwm;
+    memcpy(&hwm, &block_super[TFS_BLOCK_SUPER_POS___HWM], sizeof(uint32_t));
+    return hwm;
+}
+
+void tfs_write_count(char* block_super, uint32_t count) {
+    memcpy(&block_super[TFS_BLOCK_SUPER_POS_COUNT], &count, sizeof(uint32_t));
+}
+
+uint32_t tfs_read_count(char* block_super) {
+    uint32_t count;
+    memcpy(&count, &block_super[TFS_BLOCK_SUPER_POS_COUNT], sizeof(uint32_t));
+    return count;
+}
+
+/* number of blocks that may hold anything but zeros, scans can stop there */
+int tfs_formatted_limit(void) {
+    char block_super[BLOCKSIZE];
+    fail_if(readBlock(tfs_meta.disk, TFS_BLOCK_SUPER_INDEX, block_super));
+    if (tfs_read_count(block_super) == 0)
+        return TFS_BLOCK_COUNT_MAX;
+    return tfs_read_hwm(block_super);
+}
+
+/* inodes written before link counts existed read as having one link */
+void tfs_write_links(char* block, uint16_t links) {
+    memcpy(&block[TFS_BLOCK_INODE_POS_LINKS], &links, sizeof(uint16_t));
+}
+
+uint16_t tfs_read_links(char* block) {
+    uint16_t links;
+    memcpy(&links, &block[TFS_BLOCK_INODE_POS_LINKS], sizeof(uint16_t));
+    if (links == 0)
+        links = 1;
+    return links;
+}
+
 void hexdump_block(char* block) {
     int i;
     for (i = 0; i < BLOCKSIZE; i++) {
@@ -755,6 +5137,10 @@ int tfs_free_block_count() {
         assert(block[TFS_BLOCK_EVERY_POS__TYPE] == TFS_BLOCK_TYPE__FREE, "block type is not free is %d", block[TFS_BLOCK_EVERY_POS__TYPE]);
         next_free_block_index = tfs_read_addr(block);
     }
+    // plus punched blocks and every block that was never written
+    free_block_count += tfs_meta.hole_count;
+    if (tfs_read_count(block_super) > tfs_read_hwm(block_super))
+        free_block_count += tfs_read_count(block_super) - tfs_read_hwm(block_super);
     return free_block_count;
 }
 
@@ -774,6 +5160,14 @@ void tfs_write_tstamp(char* block, enum tstamp tstamp, time_t t) {
     memcpy(&block[index], &t64, sizeof(uint64_t));
 }
 
+/* stamps a freshly written inode, keeping `ctime` unless it is 0 */
+void tfs_write_times(char* block_inode, uint64_t ctime) {
+    time_t t = time(NULL);
+    tfs_write_tstamp(block_inode, TSTAMP_CREATE, ctime != 0 ? (time_t)ctime : t);
+    tfs_write_tstamp(block_inode, TSTAMP_ACCESS, t);
+    tfs_write_tstamp(block_inode, TSTAMP_MODIFY, t);
+}
+
 void tfs_write_tstamp_now(char* block, enum tstamp tstamp) {
     time_t t = time(NULL);
     tfs_write_tstamp(block, tstamp, t);
@@ -3,6 +3,9 @@
 
 #include "tinyFS.h"
 
+/* longest single path component (file or directory name) */
+#define TFS_FILE_NAME_LEN_MAX 28
+
 int tfs_mkfs(char *filename, int nBytes); 
 /* Makes a blank TinyFS file system of size nBytes on the unix file 
 specified by ‘filename’. This function should use the emulated disk 
@@ -24,7 +27,40 @@ fileDescriptor tfs_openFile(char *name);
 /* Creates or Opens a file for reading and writing on the currently 
 mounted file system. Creates a dynamic resource table entry for the file, 
 and returns a file descriptor (integer) that can be used to reference 
-this entry while the filesystem is mounted. */
+this entry while the filesystem is mounted. `name` may be a '/' separated
+path, every directory along it must already exist. */
+
+int tfs_mkdir(char *path);
+/* Creates an empty directory at `path`. The parent directory must exist
+and nothing may already be named `path`. */
+
+int tfs_rmdir(char *path);
+/* Removes the empty directory at `path`. The root cannot be removed. */
+
+int tfs_rename(char *old_path, char *new_path);
+/* Atomically renames `old_path` to `new_path`, replacing whatever
+`new_path` named. Only directory entries are rewritten, file data is never
+copied. Open file descriptors follow the file to its new name. */
+
+int tfs_link(char *old_path, char *new_path);
+/* Gives the file at `old_path` the additional name `new_path`. The file's
+blocks are freed once tfs_deleteFile has removed every name. */
+
+int tfs_clone(char *src_path, char *dst_path);
+/* Creates `dst_path` as a copy of the file at `src_path` without copying
+any data. The two files share blocks (tracked with per-block reference
+counts) until either is rewritten, which then writes fresh blocks. */
+
+int tfs_snapshot(char *path);
+/* Freezes the current state of the image into a new directory at `path`.
+Every file gets a clone, so only metadata is written. */
+
+int tfs_resize(int newBytes);
+/* Grows or shrinks the mounted image to `newBytes`. Growing adds the new
+blocks to the free space. Shrinking moves every block in use out of the
+part being cut off first, and fails with TFS_ERR_INSUFFICIENT_SPACE
+(changing nothing) if they don't fit in the free blocks that remain. Open
+file descriptors stay valid. */
 
 
 int tfs_closeFile(fileDescriptor FD); 
@@ -54,13 +90,367 @@ success/error codes.*/
 #include <time.h>
 #include <stdint.h>
 
+/* storage policies for tfs_setFlags */
+#define TFS_FLAG_COMPRESS 0x01
+#define TFS_FLAG_DEDUP 0x02
+#define TFS_FLAG_SPARSE 0x04
+#define TFS_FLAG_ALL (TFS_FLAG_COMPRESS | TFS_FLAG_DEDUP | TFS_FLAG_SPARSE)
+
+/* operations for tfs_batch */
+#define TFS_BATCH_CREATE 1
+#define TFS_BATCH_WRITE 2
+#define TFS_BATCH_DELETE 3
+
+struct tfs_batch_op {
+    /* TFS_BATCH_CREATE a new file at `path` holding `buffer`, TFS_BATCH_WRITE
+     * an existing one's whole content, or TFS_BATCH_DELETE the name */
+    int op;
+    char *path;
+    char *buffer;
+    int size;
+    /* set on the op that made tfs_batch refuse the batch */
+    int err;
+};
+
+int tfs_batch(struct tfs_batch_op *ops, int count);
+/* Applies `count` operations in order as one batch: the data blocks and
+inodes of all of them are claimed in a single allocator pass and everything
+they free is returned to the free list together, so the superblock is
+written twice per batch instead of a few times per file. Names are resolved
+through the dentry cache once each. The whole batch is checked first (names
+existing or not, directories in the way, sizes, space) and nothing is
+written unless every op can be applied. Files with storage policies
+(tfs_setFlags) can't be rewritten in a batch. */
+
+int tfs_sendfile(fileDescriptor FD, int out_fd, int offset, int len);
+/* Copies `len` bytes of the file from `offset` to the host file descriptor
+`out_fd` (a file, pipe or socket) and returns how many were copied, fewer
+when the file ends first. Data blocks go straight from the disk image with
+sendfile, one call per block since every block starts with a header. Only
+compressed files and holes pass through memory. The file pointer doesn't
+move. */
+
+int tfs_setFlags(fileDescriptor FD, int flags);
+/* Sets the TFS_FLAG_* storage policy of a file. Policies take effect at
+the next tfs_writeFile. With TFS_FLAG_COMPRESS the file is stored as LZ
+compressed frames whenever that saves space, and decompressed transparently
+by tfs_readByte. With TFS_FLAG_DEDUP every data block whose content is
+already stored by another TFS_FLAG_DEDUP file is shared with it instead of
+written again. With TFS_FLAG_SPARSE blocks of zeros are not stored at all
+and read back as zeros. */
+
+struct tfs_dedup_stats {
+    /* data block references held by TFS_FLAG_DEDUP and TFS_FLAG_SPARSE files */
+    uint32_t logical_blocks;
+    /* distinct data blocks actually stored for them */
+    uint32_t physical_blocks;
+    /* content index lookups by tfs_writeFile since mount, and how many matched */
+    uint32_t lookups;
+    uint32_t hits;
+};
+
+int tfs_dedupStats(struct tfs_dedup_stats *stats);
+/* Reports how well deduplication is doing. logical_blocks / physical_blocks
+is the dedup ratio. */
+
+struct tfs_readahead_stats {
+    /* data blocks of chained files tfs_readByte moved on to, and how many
+     * of them had already been read ahead */
+    uint32_t reads;
+    uint32_t hits;
+    /* readahead I/Os issued and the blocks they read */
+    uint32_t ios;
+    uint32_t blocks;
+};
+
+int tfs_setReadahead(int blocks);
+/* Sets how many blocks are read ahead, in a single I/O, once a file's chain
+is being read in order (8 by default, at most 64, 0 turns
+readahead off). Resets to the default on mount. */
+
+int tfs_readaheadStats(struct tfs_readahead_stats *stats);
+/* Reports readahead since mount. hits / reads is the hit rate. */
+
+int tfs_setWriteBack(int blocks, int dirtyPct, int ageMs);
+/* Caches up to `blocks` written blocks in memory so tfs_* calls return
+without waiting on the image. A background thread writes them out in block
+order, adjacent blocks in one write, once `dirtyPct` percent of the cache
+is dirty or the oldest has waited `ageMs` ms. Blocks reach the image in
+a different order than they were written, so after a crash it can hold
+any mix of them; tfs_sync when that matters. 0 blocks writes everything
+out and turns the cache off. Off by default, unmount writes everything
+out. */
+
+int tfs_sync(void);
+/* Waits until everything tfs_setWriteBack cached is in the image. Returns
+the error of a background write that failed since the last tfs_sync. */
+
+/* calls tfs_async_poll reports on */
+#define TFS_ASYNC_OPEN 1
+#define TFS_ASYNC_READ 2
+#define TFS_ASYNC_WRITE 3
+/* most async calls submitted and not yet reported by tfs_async_poll */
+#define TFS_ASYNC_QUEUE_MAX 256
+
+struct tfs_completion {
+    /* TFS_ASYNC_* of the call */
+    int op;
+    /* what the call came to: the file descriptor for TFS_ASYNC_OPEN, the
+     * bytes read for TFS_ASYNC_READ, 0 for TFS_ASYNC_WRITE, or an error */
+    int ret;
+    /* as passed to the call */
+    void *tag;
+};
+
+int tfs_async_start(void);
+/* Starts the worker thread that runs async calls and returns an eventfd
+that is readable while there are completions to collect, to wait on with
+poll/epoll next to an event loop's other descriptors (the same one if it
+is already running). */
+
+int tfs_async_stop(void);
+/* Waits for the submitted calls to finish, drops completions nobody
+collected and stops the worker, closing the eventfd. */
+
+int tfs_open_async(char *name, void *tag);
+int tfs_read_async(fileDescriptor FD, char *buffer, int size, void *tag);
+int tfs_write_async(fileDescriptor FD, char *buffer, int size, void *tag);
+/* Queue tfs_openFile(name), a read of up to `size` bytes into `buffer`
+(fewer at the end of the file) and tfs_writeFile(FD, buffer, size) and
+return at once, 0 or TFS_ERR_BUSY with TFS_ASYNC_QUEUE_MAX calls
+outstanding. `name` is copied, `buffer` must stay put until the call's
+completion is collected. The worker runs calls one at a time in the order
+they were submitted, so a read queued after a write on the same descriptor
+sees it; they are counted and traced like the calls they stand for, a read
+as one TFS_OP_READ_ASYNC that touches atime once rather than a tfs_readByte
+per byte. Every
+other tfs_* call, the tfs_set* calls and *Stats reports included, may still
+be made meanwhile and takes turns with the worker. */
+
+int tfs_async_poll(struct tfs_completion *done, int max);
+/* Copies up to `max` completions into `done`, in the order the calls were
+submitted, and returns how many. Never blocks, 0 when none are ready. */
+
+int tfs_writeBegin(fileDescriptor FD);
+int tfs_writeChunk(fileDescriptor FD, char *buffer, int size);
+int tfs_writeCommit(fileDescriptor FD);
+int tfs_writeAbort(fileDescriptor FD);
+/* Streaming alternative to tfs_writeFile for files too big to build in one
+buffer. tfs_writeBegin starts replacing the file's content, each
+tfs_writeChunk appends `size` bytes to it and tfs_writeCommit swaps the new
+content in (with the file pointer at 0, like tfs_writeFile). Until then
+reads see the old content. Blocks are allocated and written as chunks
+arrive, so no more than one block is held in memory. tfs_writeAbort, closing
+or deleting the file drops the new content. Plain files only, files with
+TFS_FLAG_COMPRESS, TFS_FLAG_DEDUP or TFS_FLAG_SPARSE get TFS_ERR_INVALID.
+While a stream is open tfs_writeFile on the descriptor, tfs_resize and
+tfs_defrag return TFS_ERR_BUSY. */
+
+int tfs_fallocate(fileDescriptor FD, int bytes);
+/* Reserves room for the file to grow to `bytes` as one run of blocks, as
+close after its inode as free space allows, moving what it holds now to
+the start of the run. Later writes keep the file's chain at least that
+long, so it stays in place while it grows. `bytes` 0 drops the
+reservation. Not available for dedup and sparse files (TFS_ERR_INVALID). */
+
+struct tfs_frag_stats {
+    /* files with data, their data blocks and the runs of adjacent blocks they are stored in */
+    uint32_t files;
+    uint32_t blocks;
+    uint32_t extents;
+    /* free blocks and the runs of adjacent blocks they form */
+    uint32_t free_blocks;
+    uint32_t free_runs;
+    uint32_t largest_free_run;
+    /* percentage of steps from one data block of a file to the next that
+     * are not to the adjacent block - 0 when every file is contiguous */
+    uint32_t fragmentation;
+};
+
+int tfs_fragStats(struct tfs_frag_stats *stats);
+/* Reports how fragmented files and free space are. */
+
+int tfs_defrag(int budgetMs);
+/* Moves the data chain of every fragmented file into a run of adjacent
+blocks, then slides all used blocks down so the free space is one run at
+the end, and relinks the free list in address order so later writes get
+adjacent blocks too. Works on the mounted image with files open. With
+`budgetMs` > 0 it stops once that much time has passed. Returns 1 while
+there is more to do (a later call carries on where it stopped, or goes
+over files that only fit after compaction) and 0 once it is done. Chains
+shared with clones and indexed (dedup and sparse) files are not made
+contiguous, but still take part in the compaction. */
+
+int tfs_setPunchHoles(int enable);
+/* With `enable` set, blocks freed from then on are zeroed by punching holes
+in the image (fallocate PUNCH_HOLE, adjacent blocks in one call) instead of
+being rewritten, which hands their space back to the host. Falls back to
+writing zeros where the host can't punch. Off by default. */
+
+int tfs_setLogStructured(int enable);
+/* With `enable` set, every block taken from then on - data, inodes and
+directory blocks - is placed at a log head that only moves forward through
+the image, so writes land next to each other instead of wherever a block
+was freed and a file's new chain goes out as one run, in writes of up to
+64 blocks. Freed blocks are punched as with
+tfs_setPunchHoles. Once the head reaches the end it carries on from the
+first free run, which tfs_clean keeps long. Inodes and the superblock are
+still updated where they are. Off by default. */
+
+int tfs_clean(int budgetMs);
+/* Reclaims segments (64 block stretches of the image) that are at most half
+live for the log head: their live blocks are moved together to the head,
+with every pointer to them rewritten, and the rest are punched. Emptiest
+segments go first, and only while their live blocks fit in the free space
+left outside them; an image of one segment is never cleaned. Works on the
+mounted image with files open, but not
+while a tfs_writeBegin stream is (TFS_ERR_BUSY). With `budgetMs` > 0 it
+stops once that much time has passed and returns 1, otherwise it returns 0
+once no segment is left to clean. Meant to run when the caller is idle,
+in log-structured mode or not. */
+
+/* the tfs_* calls tfs_getStats keeps latencies for */
+enum tfs_op {
+    TFS_OP_MKFS,
+    TFS_OP_MOUNT,
+    TFS_OP_UNMOUNT,
+    TFS_OP_OPEN_FILE,
+    TFS_OP_CLOSE_FILE,
+    TFS_OP_WRITE_FILE,
+    TFS_OP_DELETE_FILE,
+    TFS_OP_READ_BYTE,
+    TFS_OP_SEEK,
+    TFS_OP_READ_FILE_INFO,
+    TFS_OP_SENDFILE,
+    TFS_OP_SET_FLAGS,
+    TFS_OP_FALLOCATE,
+    TFS_OP_CHECK_CONSISTENCY,
+    TFS_OP_MKDIR,
+    TFS_OP_RMDIR,
+    TFS_OP_RENAME,
+    TFS_OP_LINK,
+    TFS_OP_CLONE,
+    TFS_OP_SNAPSHOT,
+    TFS_OP_RESIZE,
+    TFS_OP_WRITE_BEGIN,
+    TFS_OP_WRITE_CHUNK,
+    TFS_OP_WRITE_COMMIT,
+    TFS_OP_WRITE_ABORT,
+    TFS_OP_BATCH,
+    TFS_OP_DEFRAG,
+    TFS_OP_CLEAN,
+    TFS_OP_READ_ASYNC,
+    TFS_OP_COUNT
+};
+
+#define TFS_LATENCY_BUCKETS 32
+
+struct tfs_op_stats {
+    uint64_t calls;
+    /* calls that returned an error */
+    uint64_t errors;
+    uint64_t total_ns;
+    /* calls by how long they took: bucket i counts [2^i, 2^(i+1)) ns, the
+     * last bucket everything slower */
+    uint64_t latency[TFS_LATENCY_BUCKETS];
+};
+
+struct tfs_stats {
+    /* host I/O issued by libDisk, readahead runs count as one read and
+     * runs written at once in log-structured mode as one write */
+    uint64_t block_reads;
+    uint64_t block_writes;
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+    uint64_t syscalls;
+    /* allocator requests, the blocks they got, and the entries of the block
+     * map searched for them (in total and the most for one request) */
+    uint64_t alloc_calls;
+    uint64_t alloc_blocks;
+    uint64_t alloc_scanned;
+    uint64_t alloc_scanned_max;
+    /* times the on-disk free list was walked to rebuild the block map, and
+     * the free blocks followed */
+    uint64_t free_list_walks;
+    uint64_t free_list_length;
+    /* name lookups (tfs_openFile and every path component), the dentries
+     * compared for them, and the longest bucket chain scanned */
+    uint64_t name_lookups;
+    uint64_t name_scanned;
+    uint64_t name_scanned_max;
+    /* directories read into the dentry cache, each one a cache miss */
+    uint64_t dir_loads;
+    /* decompressed frame cache of compressed files */
+    uint64_t zcache_hits;
+    uint64_t zcache_misses;
+    struct tfs_op_stats ops[TFS_OP_COUNT];
+};
+
+int tfs_getStats(struct tfs_stats *stats);
+/* Copies the counters kept since the program started (or the last
+tfs_resetStats) into `stats`. They are kept across mounts and cost a couple
+of clock reads per call, cheap enough to leave running. */
+
+void tfs_resetStats(void);
+/* Zeros every counter tfs_getStats reports. */
+
+const char *tfs_opName(int op);
+/* Name of the tfs_* call a TFS_OP_* stands for, NULL past TFS_OP_COUNT. */
+
+/* Trace files start with a struct tfs_trace_header followed by records,
+each a struct tfs_trace_record and `len` bytes of strings. Little endian,
+as written by the host. */
+#define TFS_TRACE_MAGIC 0x43525446 /* "TFRC" */
+#define TFS_TRACE_VERSION 1
+/* record types: a tfs_* call (op is a TFS_OP_*) or block I/O (op is a DISK_TRACE_*) */
+#define TFS_TRACE_CALL 1
+#define TFS_TRACE_IO 2
+
+struct tfs_trace_header {
+    uint32_t magic;
+    uint32_t version;
+    /* size of the image mounted when tracing started, 0 if none was */
+    uint32_t image_bytes;
+    uint32_t reserved;
+};
+
+struct tfs_trace_record {
+    uint8_t type;
+    uint8_t op;
+    uint16_t reserved;
+    /* bytes of NUL terminated strings after the record: the paths of the
+     * call, or for tfs_batch an op byte, a 4 byte size and a path per op */
+    uint32_t len;
+    /* what the call returned (err for tfs_readFileInfo) */
+    int32_t ret;
+    /* the integer arguments in order, file data isn't kept (only its size).
+     * For block I/O the first block and the block count */
+    int32_t args[3];
+    /* start since tfs_traceStart and how long it took, in nanoseconds */
+    uint64_t start_ns;
+    uint64_t ns;
+};
+
+int tfs_traceStart(char *path);
+/* Starts writing every tfs_* call (arguments, result and timing) and every
+block I/O it causes to the trace file at `path`, replacing it. Replay it
+with bench/tfs_replay. Records are buffered, so the file is only complete
+after tfs_traceStop. */
+
+int tfs_traceStop(void);
+/* Stops tracing and closes the trace file. */
+
 struct tfs_stat {
     int err;
+    /* logical size, physical_size is the number of bytes actually stored */
     uint16_t size;
-    char name[9];
+    uint16_t physical_size;
+    int flags;
+    char name[TFS_FILE_NAME_LEN_MAX + 1];
     time_t ctime;
     time_t atime;
     time_t mtime;
+    uint16_t links;
 };
 
 struct tfs_stat tfs_readFileInfo(fileDescriptor FD);
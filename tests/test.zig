@@ -2,7 +2,10 @@ const std = @import("std");
 
 const tinyFS = @cImport({
     @cInclude("libDisk.c");
+    @cInclude("libLZ.c");
     @cInclude("libTinyFS.c");
+    @cInclude("signal.h");
+    @cInclude("sys/resource.h");
 });
 
 const DATASIZE = tinyFS.TFS_BLOCK__FILE_SIZE_DATA;
@@ -88,21 +91,18 @@ test "mkfs" {
     const blocks_count: isize = 4;
 
     assert(block_byte(&contents, 0, 0) == 1, "Superblock not set\n", .{});
+    assert(block_byte(&contents, 0, 1) == 0x44, "Superblock magic not set to 0x44\n", .{});
 
-    for (0..blocks_count) |block_index| {
-        assert(
-            block_byte(&contents, block_index, 1) == 0x44,
-            "Block {d} magic not set to 0x44\n",
-            .{block_index},
-        );
+    // only the superblock is written, the rest stays a hole that reads as zeros
+    for (1..blocks_count) |block_index| {
         assert(
             std.mem.eql(
                 u8,
-                contents[block_index * 256 ..][4..256],
-                std.mem.zeroes([256]u8)[4..256],
+                contents[block_index * 256 ..][0..256],
+                std.mem.zeroes([256]u8)[0..256],
             ),
-            "Block not zeroed\n",
-            .{},
+            "Block {d} not zeroed\n",
+            .{block_index},
         );
     }
 }
@@ -124,21 +124,18 @@ test "mkfs-non-256-len" {
     const blocks_count: isize = 4;
 
     assert(block_byte(&contents, 0, 0) == 1, "Superblock not set\n", .{});
+    assert(block_byte(&contents, 0, 1) == 0x44, "Superblock magic not set to 0x44\n", .{});
 
-    for (0..blocks_count) |block_index| {
-        assert(
-            block_byte(&contents, block_index, 1) == 0x44,
-            "Block {d} magic not set to 0x44\n",
-            .{block_index},
-        );
+    // only the superblock is written, the rest stays a hole that reads as zeros
+    for (1..blocks_count) |block_index| {
         assert(
             std.mem.eql(
                 u8,
-                contents[block_index * 256 ..][4..256],
-                std.mem.zeroes([256]u8)[4..256],
+                contents[block_index * 256 ..][0..256],
+                std.mem.zeroes([256]u8)[0..256],
             ),
-            "Block not zeroed\n",
-            .{},
+            "Block {d} not zeroed\n",
+            .{block_index},
         );
     }
 }
@@ -171,6 +168,27 @@ test "mkfs-neg-nBytes" {
     assert(tinyFS.tfs_mkfs(@constCast(test_fs_file), @as(i32, @intCast(-1))) < 0, "tfs_mkfs failed\n", .{});
 }
 
+test "mkfs-lazy" {
+    var test_fs_file: [*c]const u8 = "/tmp/mkfs_lazy.tfs";
+    std.fs.deleteFileAbsoluteZ(test_fs_file) catch {};
+
+    // formatting writes one block no matter the size
+    assert(tinyFS.tfs_mkfs(@constCast(test_fs_file), 65536 * BLOCKSIZE) == 0, "tfs_mkfs failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(@constCast(test_fs_file))), .SUCCESS, "tfs_mount failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 65535, "tfs_free_block_count failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 4]u8 = undefined;
+    @memset(&data, 0x42);
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 65530, "tfs_free_block_count failed\n", .{});
+    var read_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
 fn mkfs(comptime name: []const u8, comptime nBytes: u64) ![5 + name.len:0]u8 {
     const test_file_name: *const [5 + name.len:0]u8 = "/tmp/" ++ name;
     var test_fs_file: [*c]const u8 = test_file_name.ptr;
@@ -191,21 +209,18 @@ fn mkfs(comptime name: []const u8, comptime nBytes: u64) ![5 + name.len:0]u8 {
     const blocks_count: isize = @divFloor(nBytes, 256);
 
     assert(block_byte(&contents, 0, 0) == 1, "Superblock not set\n", .{});
+    assert(block_byte(&contents, 0, 1) == 0x44, "Superblock magic not set to 0x44\n", .{});
 
-    for (0..blocks_count) |block_index| {
-        assert(
-            block_byte(&contents, block_index, 1) == 0x44,
-            "Block {d} magic not set to 0x44\n",
-            .{block_index},
-        );
+    // only the superblock is written, the rest stays a hole that reads as zeros
+    for (1..blocks_count) |block_index| {
         assert(
             std.mem.eql(
                 u8,
-                contents[block_index * 256 ..][4..256],
-                std.mem.zeroes([256]u8)[4..256],
+                contents[block_index * 256 ..][0..256],
+                std.mem.zeroes([256]u8)[0..256],
             ),
-            "Block not zeroed\n",
-            .{},
+            "Block {d} not zeroed\n",
+            .{block_index},
         );
     }
 
@@ -436,3 +451,1148 @@ test "stat" {
 
     assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
 }
+
+test "directories" {
+    var fs_file = try mkfs("dirs.tfs", tinyFS.BLOCKSIZE * 64);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var dir_name: [*c]u8 = @constCast("tenant");
+    var sub_dir_name: [*c]u8 = @constCast("/tenant/shard-0001");
+    var file_name: [*c]u8 = @constCast("/tenant/shard-0001/config.json");
+    var missing_name: [*c]u8 = @constCast("missing/config.json");
+
+    assert_eq(errno_from(tinyFS.tfs_mkdir(dir_name)), .SUCCESS, "tfs_mkdir failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mkdir(dir_name)), .EXIST, "tfs_mkdir made a directory twice\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mkdir(sub_dir_name)), .SUCCESS, "tfs_mkdir failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_openFile(missing_name)), .NOENT, "tfs_openFile created a missing directory\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_openFile(dir_name)), .ISDIR, "tfs_openFile opened a directory\n", .{});
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(fd), .SUCCESS, "tfs_openFile failed\n", .{});
+    var data: [DATASIZE * 2]u8 = undefined;
+    @memset(&data, 0x42);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    const fd_2 = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(fd_2), .SUCCESS, "tfs_openFile failed\n", .{});
+    var read_data = try read_file(fd_2, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_rmdir(sub_dir_name)), .NOTEMPTY, "tfs_rmdir removed a non-empty directory\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fd)), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_closeFile(fd)), .SUCCESS, "tfs_closeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_closeFile(fd_2)), .SUCCESS, "tfs_closeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_rmdir(sub_dir_name)), .SUCCESS, "tfs_rmdir failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_rmdir(dir_name)), .SUCCESS, "tfs_rmdir failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 63, "tfs_free_block_count failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "rename+link" {
+    var fs_file = try mkfs("rename.tfs", tinyFS.BLOCKSIZE * 16);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("config");
+    var tmp_name: [*c]u8 = @constCast("config.tmp");
+    var link_name: [*c]u8 = @constCast("config.bak");
+
+    var old_data: [DATASIZE]u8 = undefined;
+    @memset(&old_data, 0x41);
+    var new_data: [DATASIZE * 2]u8 = undefined;
+    @memset(&new_data, 0x42);
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &old_data, @intCast(old_data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    const fd_tmp = tinyFS.tfs_openFile(tmp_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_tmp, &new_data, @intCast(new_data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 10, "tfs_free_block_count failed\n", .{});
+
+    // replacing config frees its inode and single data block
+    assert_eq(errno_from(tinyFS.tfs_rename(tmp_name, file_name)), .SUCCESS, "tfs_rename failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 12, "tfs_free_block_count failed\n", .{});
+
+    const fd_2 = tinyFS.tfs_openFile(file_name);
+    var read_data = try read_file(fd_2, new_data.len);
+    assert(std.mem.eql(u8, &new_data, &read_data), "read_data == new_data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_link(file_name, link_name)), .SUCCESS, "tfs_link failed\n", .{});
+    assert_eq(tinyFS.tfs_readFileInfo(fd_2).links, 2, "links not 2\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fd_2)), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 12, "tfs_free_block_count failed\n", .{});
+
+    const fd_link = tinyFS.tfs_openFile(link_name);
+    var link_data = try read_file(fd_link, new_data.len);
+    assert(std.mem.eql(u8, &new_data, &link_data), "link_data == new_data\n", .{});
+    assert_eq(tinyFS.tfs_readFileInfo(fd_link).links, 1, "links not 1\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "clone+snapshot" {
+    var fs_file = try mkfs("clone.tfs", tinyFS.BLOCKSIZE * 16);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var src_name: [*c]u8 = @constCast("src");
+    var dst_name: [*c]u8 = @constCast("dst");
+    var snap_name: [*c]u8 = @constCast("snap");
+    var snap_src_name: [*c]u8 = @constCast("snap/src");
+
+    var data: [DATASIZE * 3]u8 = undefined;
+    @memset(&data, 0x41);
+    var new_data: [DATASIZE]u8 = undefined;
+    @memset(&new_data, 0x42);
+
+    const fd = tinyFS.tfs_openFile(src_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 11, "tfs_free_block_count failed\n", .{});
+
+    // the clone costs an inode and the block listing shared blocks, no data
+    assert_eq(errno_from(tinyFS.tfs_clone(src_name, dst_name)), .SUCCESS, "tfs_clone failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 9, "tfs_free_block_count failed\n", .{});
+
+    const fd_dst = tinyFS.tfs_openFile(dst_name);
+    var dst_data = try read_file(fd_dst, data.len);
+    assert(std.mem.eql(u8, &data, &dst_data), "dst_data == data\n", .{});
+
+    // rewriting the clone leaves the source alone
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_dst, &new_data, @intCast(new_data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 9, "tfs_free_block_count failed\n", .{});
+    const fd_src = tinyFS.tfs_openFile(src_name);
+    var src_data = try read_file(fd_src, data.len);
+    assert(std.mem.eql(u8, &data, &src_data), "src_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_snapshot(snap_name)), .SUCCESS, "tfs_snapshot failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_src, &new_data, @intCast(new_data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    const fd_snap = tinyFS.tfs_openFile(snap_src_name);
+    var snap_data = try read_file(fd_snap, data.len);
+    assert(std.mem.eql(u8, &data, &snap_data), "snap_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "compression" {
+    var fs_file = try mkfs("compress.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("text");
+    var data: [DATASIZE * 20]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = "hello world from (a) file "[i % 26];
+    }
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_setFlags(fd, tinyFS.TFS_FLAG_COMPRESS)), .SUCCESS, "tfs_setFlags failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    // 20 blocks of text fit in one compressed block
+    assert_eq(tinyFS.tfs_free_block_count(), 37, "tfs_free_block_count failed\n", .{});
+    const stat_info = tinyFS.tfs_readFileInfo(fd);
+    assert_eq(stat_info.size, data.len, "size not equal got {d}\n", .{stat_info.size});
+    assert(stat_info.physical_size < DATASIZE, "physical size {d} not compressed\n", .{stat_info.physical_size});
+
+    var read_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    var byte: u8 = 0;
+    assert_eq(errno_from(tinyFS.tfs_seek(fd, DATASIZE * 17 + 3)), .SUCCESS, "tfs_seek failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+    assert_eq(byte, data[DATASIZE * 17 + 3], "seeked byte wrong\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "dedup" {
+    var fs_file = try mkfs("dedup.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var a_name: [*c]u8 = @constCast("a");
+    var b_name: [*c]u8 = @constCast("b");
+    var data: [DATASIZE * 3]u8 = undefined;
+    @memset(&data, 0x41);
+
+    // three identical blocks are stored once, plus the index and refs blocks
+    const fd_a = tinyFS.tfs_openFile(a_name);
+    assert_eq(errno_from(tinyFS.tfs_setFlags(fd_a, tinyFS.TFS_FLAG_DEDUP)), .SUCCESS, "tfs_setFlags failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_a, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 35, "tfs_free_block_count failed\n", .{});
+
+    // a second copy only costs its inode and index
+    const fd_b = tinyFS.tfs_openFile(b_name);
+    assert_eq(errno_from(tinyFS.tfs_setFlags(fd_b, tinyFS.TFS_FLAG_DEDUP)), .SUCCESS, "tfs_setFlags failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_b, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 33, "tfs_free_block_count failed\n", .{});
+
+    var stats: tinyFS.tfs_dedup_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_dedupStats(&stats)), .SUCCESS, "tfs_dedupStats failed\n", .{});
+    assert_eq(stats.logical_blocks, 6, "logical_blocks wrong\n", .{});
+    assert_eq(stats.physical_blocks, 1, "physical_blocks wrong\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fd_a)), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 35, "tfs_free_block_count failed\n", .{});
+    var read_data = try read_file(fd_b, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fd_b)), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 39, "tfs_free_block_count failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "punch holes+sparse" {
+    var fs_file = try mkfs("punch.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    defer _ = tinyFS.tfs_setPunchHoles(0);
+
+    var file_name: [*c]u8 = @constCast("file");
+    var sparse_name: [*c]u8 = @constCast("sparse");
+    var data: [DATASIZE * 4]u8 = undefined;
+    @memset(&data, 0x42);
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 34, "tfs_free_block_count failed\n", .{});
+
+    // punched blocks are zeros on disk but still count as free
+    assert_eq(errno_from(tinyFS.tfs_setPunchHoles(1)), .SUCCESS, "tfs_setPunchHoles failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fd)), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 39, "tfs_free_block_count failed\n", .{});
+    var block: [BLOCKSIZE]u8 = undefined;
+    assert_eq(tinyFS.readBlock(tinyFS.tfs_meta.disk, 2, &block), 0, "readBlock failed\n", .{});
+    assert(std.mem.eql(u8, &block, &std.mem.zeroes([BLOCKSIZE]u8)), "block not punched\n", .{});
+
+    // only the two blocks with data (and the index) are stored
+    var sparse_data = std.mem.zeroes([DATASIZE * 10]u8);
+    sparse_data[3] = 1;
+    sparse_data[DATASIZE * 7] = 2;
+    const fd_sparse = tinyFS.tfs_openFile(sparse_name);
+    assert_eq(errno_from(tinyFS.tfs_setFlags(fd_sparse, tinyFS.TFS_FLAG_SPARSE)), .SUCCESS, "tfs_setFlags failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_sparse, &sparse_data, @intCast(sparse_data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 35, "tfs_free_block_count failed\n", .{});
+    const stat_info = tinyFS.tfs_readFileInfo(fd_sparse);
+    assert_eq(stat_info.physical_size, DATASIZE * 2, "physical_size wrong\n", .{});
+    var read_data = try read_file(fd_sparse, sparse_data.len);
+    assert(std.mem.eql(u8, &sparse_data, &read_data), "read_data == sparse_data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "resize" {
+    var fs_file = try mkfs("resize.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var first_name: [*c]u8 = @constCast("first");
+    var second_name: [*c]u8 = @constCast("second");
+    var data: [DATASIZE * 4]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+
+    const fd_first = tinyFS.tfs_openFile(first_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_first, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    const fd_second = tinyFS.tfs_openFile(second_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_second, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fd_first)), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 34, "tfs_free_block_count failed\n", .{});
+
+    // the superblock and the second file take 6 blocks
+    assert_eq(errno_from(tinyFS.tfs_resize(tinyFS.BLOCKSIZE * 5)), .OVERFLOW, "tfs_resize should fail\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_resize(tinyFS.BLOCKSIZE * 8)), .SUCCESS, "tfs_resize failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 2, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    var read_data = try read_file(fd_second, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_resize(tinyFS.BLOCKSIZE * 16)), .SUCCESS, "tfs_resize failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 10, "tfs_free_block_count failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "defrag" {
+    var fs_file = try mkfs("defrag.tfs", tinyFS.BLOCKSIZE * 43);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    const names = [_][*c]u8{ @constCast("f0"), @constCast("f1"), @constCast("f2"), @constCast("f3"), @constCast("f4"), @constCast("f5") };
+    var big_name: [*c]u8 = @constCast("big");
+    var data: [DATASIZE * 8]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+
+    // six files fill the image, deleting every other one leaves gaps of 7
+    // blocks, too short for the 8 data blocks of the next file
+    var fds: [names.len]c_int = undefined;
+    for (names, 0..) |name, i| {
+        fds[i] = tinyFS.tfs_openFile(name);
+        assert_eq(errno_from(tinyFS.tfs_writeFile(fds[i], &data, DATASIZE * 6)), .SUCCESS, "tfs_writeFile failed\n", .{});
+    }
+    assert_eq(tinyFS.tfs_free_block_count(), 0, "tfs_free_block_count failed\n", .{});
+    for (0..3) |i| {
+        assert_eq(errno_from(tinyFS.tfs_deleteFile(fds[i * 2 + 1])), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    }
+    const fd_big = tinyFS.tfs_openFile(big_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd_big, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    var before: tinyFS.tfs_frag_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_fragStats(&before)), .SUCCESS, "tfs_fragStats failed\n", .{});
+    assert(before.fragmentation > 0, "files should be fragmented\n", .{});
+    const free_count = tinyFS.tfs_free_block_count();
+
+    // the big file only fits in one run once the free space is compacted
+    assert_eq(tinyFS.tfs_defrag(0), 1, "tfs_defrag should ask for another pass\n", .{});
+    assert_eq(tinyFS.tfs_defrag(0), 0, "tfs_defrag failed\n", .{});
+    var after: tinyFS.tfs_frag_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_fragStats(&after)), .SUCCESS, "tfs_fragStats failed\n", .{});
+    assert_eq(after.fragmentation, 0, "files still fragmented\n", .{});
+    assert_eq(after.extents, 4, "extents wrong\n", .{});
+    assert_eq(after.free_runs, 1, "free space not compacted\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), free_count, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+
+    const read_data = try read_file(fd_big, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "fallocate" {
+    var fs_file = try mkfs("fallocate.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var log_name: [*c]u8 = @constCast("log");
+    var data: [DATASIZE * 3]u8 = undefined;
+    @memset(&data, 0x42);
+
+    const fd = tinyFS.tfs_openFile(log_name);
+    assert_eq(tinyFS.tfs_free_block_count(), 38, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_fallocate(fd, DATASIZE * 10)), .SUCCESS, "tfs_fallocate failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 28, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+
+    // writes land in the reserved run, right after the inode, and reads stop at the size
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 28, "tfs_free_block_count failed\n", .{});
+    var block: [BLOCKSIZE]u8 = undefined;
+    assert_eq(tinyFS.readBlock(tinyFS.tfs_meta.disk, 1, &block), 0, "readBlock failed\n", .{});
+    assert_eq(block[0], 2, "inode not at block 1\n", .{});
+    assert_eq(block[2], 2, "data not right after the inode\n", .{});
+    const read_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+    var byte: u8 = 0;
+    assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .RANGE, "tfs_readByte read past the size\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_fallocate(fd, 0)), .SUCCESS, "tfs_fallocate failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 35, "tfs_free_block_count failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "fallocate without space" {
+    var fs_file = try mkfs("fallocate_nospace.tfs", tinyFS.BLOCKSIZE * 20);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 3]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+
+    const fd = tinyFS.tfs_openFile(name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    var before: tinyFS.tfs_frag_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_fragStats(&before)), .SUCCESS, "tfs_fragStats failed\n", .{});
+
+    // the new run can't be allocated, so the old chain must still be in place
+    assert_eq(errno_from(tinyFS.tfs_fallocate(fd, DATASIZE * 30)), .OVERFLOW, "tfs_fallocate should fail\n", .{});
+    var after: tinyFS.tfs_frag_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_fragStats(&after)), .SUCCESS, "tfs_fragStats failed\n", .{});
+    assert_eq(after.free_blocks, before.free_blocks, "free blocks changed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    const read_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+
+    // and the blocks it would have freed are not handed out twice
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, DATASIZE * 2)), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "readahead" {
+    var fs_file = try mkfs("readahead.tfs", tinyFS.BLOCKSIZE * 100);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 20]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 29 + 'a');
+    }
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    // 8 block windows: the first block of each is read, the other 7 are hits
+    const read_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+    var stats: tinyFS.tfs_readahead_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_readaheadStats(&stats)), .SUCCESS, "tfs_readaheadStats failed\n", .{});
+    assert_eq(stats.reads, 20, "wrong block reads\n", .{});
+    assert_eq(stats.hits, 17, "wrong readahead hits\n", .{});
+    assert_eq(stats.ios, 3, "wrong readahead I/Os\n", .{});
+
+    // seeking around reads no more ahead
+    var byte: u8 = 0;
+    assert_eq(errno_from(tinyFS.tfs_seek(fd, DATASIZE * 7 + 3)), .SUCCESS, "tfs_seek failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+    assert_eq(byte, data[DATASIZE * 7 + 3], "wrong byte after seek\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_readaheadStats(&stats)), .SUCCESS, "tfs_readaheadStats failed\n", .{});
+    assert_eq(stats.ios, 3, "read ahead on a seek\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_setReadahead(65)), .INVAL, "tfs_setReadahead took too big a window\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_setReadahead(0)), .SUCCESS, "tfs_setReadahead failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_seek(fd, 0)), .SUCCESS, "tfs_seek failed\n", .{});
+    const reread_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &reread_data), "reread_data == data\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_readaheadStats(&stats)), .SUCCESS, "tfs_readaheadStats failed\n", .{});
+    assert_eq(stats.ios, 3, "read ahead while off\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "seek block map" {
+    var fs_file = try mkfs("seek.tfs", tinyFS.BLOCKSIZE * 100);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 60]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 29 + 'a');
+    }
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    // the chain is walked on the first seek only
+    var byte: u8 = 0;
+    for (0..200) |i| {
+        const offset = (i * 7919) % data.len;
+        assert_eq(errno_from(tinyFS.tfs_seek(fd, @intCast(offset))), .SUCCESS, "tfs_seek failed\n", .{});
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, data[offset], "wrong byte at {d}\n", .{offset});
+    }
+    assert_eq(tinyFS.tfs_openfile_table[@intCast(fd)].block_map_count, 60, "block map not loaded\n", .{});
+
+    // a rewrite through another descriptor drops the map
+    const fd2 = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd2, &data, DATASIZE * 10)), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert(tinyFS.tfs_openfile_table[@intCast(fd)].block_map == null, "block map kept after a write\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_seek(fd, DATASIZE * 9 + 1)), .SUCCESS, "tfs_seek failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+    assert_eq(byte, data[DATASIZE * 9 + 1], "wrong byte after rewrite\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "streaming write" {
+    var fs_file = try mkfs("stream.tfs", tinyFS.BLOCKSIZE * 100);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var old_data: [DATASIZE * 2]u8 = undefined;
+    @memset(&old_data, 'o');
+    var data: [DATASIZE * 30 + 17]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 29 + 'a');
+    }
+
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &old_data, @intCast(old_data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 96, "tfs_free_block_count failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_writeBegin(fd)), .SUCCESS, "tfs_writeBegin failed\n", .{});
+    var offset: usize = 0;
+    while (offset < data.len) : (offset += 100) {
+        const len = @min(100, data.len - offset);
+        assert_eq(errno_from(tinyFS.tfs_writeChunk(fd, data[offset..].ptr, @intCast(len))), .SUCCESS, "tfs_writeChunk failed\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &old_data, 1)), .BUSY, "tfs_writeFile during a stream\n", .{});
+
+    // the old content stays readable until commit
+    const fd2 = tinyFS.tfs_openFile(file_name);
+    const old_read = try read_file(fd2, old_data.len);
+    assert(std.mem.eql(u8, &old_data, &old_read), "old_read == old_data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_writeCommit(fd)), .SUCCESS, "tfs_writeCommit failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 100 - 2 - 31, "tfs_free_block_count failed\n", .{});
+    const read_data = try read_file(fd, data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+
+    // aborting hands the blocks back
+    assert_eq(errno_from(tinyFS.tfs_writeBegin(fd)), .SUCCESS, "tfs_writeBegin failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeChunk(fd, &old_data, @intCast(old_data.len))), .SUCCESS, "tfs_writeChunk failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_writeAbort(fd)), .SUCCESS, "tfs_writeAbort failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 100 - 2 - 31, "tfs_free_block_count failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "sendfile" {
+    var fs_file = try mkfs("sendfile.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 6 + 11]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 29 + 'a');
+    }
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    const out = try std.fs.createFileAbsolute("/tmp/sendfile.out", .{ .read = true, .truncate = true });
+    defer out.close();
+
+    // from the middle of a block to past the end, clipped to the size
+    assert_eq(tinyFS.tfs_sendfile(fd, out.handle, 100, 10000), @as(c_int, @intCast(data.len - 100)), "tfs_sendfile failed\n", .{});
+    var sent: [data.len - 100]u8 = undefined;
+    assert_eq(try out.preadAll(&sent, 0), sent.len, "short host file\n", .{});
+    assert(std.mem.eql(u8, data[100..], &sent), "sent == data\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_sendfile(fd, out.handle, data.len + 1, 1)), .RANGE, "tfs_sendfile past the end\n", .{});
+
+    // the file pointer doesn't move
+    var byte: u8 = 0;
+    assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+    assert_eq(byte, data[0], "file pointer moved\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "batch" {
+    var fs_file = try mkfs("batch.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var data: [DATASIZE * 2 + 10]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 31 + 'a');
+    }
+    var names = [_][*c]u8{ @constCast("a"), @constCast("b"), @constCast("c") };
+    var ops: [3]tinyFS.tfs_batch_op = undefined;
+    for (&ops, 0..) |*op, i| {
+        op.* = .{ .op = tinyFS.TFS_BATCH_CREATE, .path = names[i], .buffer = &data, .size = @intCast(DATASIZE * i + 10), .err = 0 };
+    }
+    // 3 inodes and 1 + 2 + 3 data blocks
+    const free = tinyFS.tfs_free_block_count();
+    assert_eq(errno_from(tinyFS.tfs_batch(&ops, ops.len)), .SUCCESS, "tfs_batch failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), free - 9, "tfs_free_block_count failed\n", .{});
+
+    const fd = tinyFS.tfs_openFile(names[2]);
+    var byte: u8 = 0;
+    for (0..DATASIZE * 2 + 10) |i| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, data[i], "read back\n", .{});
+    }
+
+    // nothing is applied when one op can't be
+    ops[0].op = tinyFS.TFS_BATCH_DELETE;
+    ops[1].op = tinyFS.TFS_BATCH_DELETE;
+    ops[2].op = tinyFS.TFS_BATCH_CREATE;
+    assert_eq(errno_from(tinyFS.tfs_batch(&ops, ops.len)), .EXIST, "tfs_batch over an existing name\n", .{});
+    assert_eq(errno_from(ops[2].err), .EXIST, "failing op\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), free - 9, "tfs_free_block_count failed\n", .{});
+
+    ops[2].op = tinyFS.TFS_BATCH_DELETE;
+    assert_eq(errno_from(tinyFS.tfs_batch(&ops, ops.len)), .SUCCESS, "tfs_batch failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), free, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "batch growing a directory" {
+    var fs_file = try mkfs("batchdir.tfs", tinyFS.BLOCKSIZE * 12);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var data: [DATASIZE * 3]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+    var text = "0123456789".*;
+
+    // fill the root's slots, a create now needs a _DENT block as well
+    for (0..6) |i| {
+        var name = [_:0]u8{ 'f', '1' + @as(u8, @intCast(i)) };
+        assert(tinyFS.tfs_openFile(&name) >= 0, "tfs_openFile failed\n", .{});
+    }
+    assert_eq(tinyFS.tfs_free_block_count(), 5, "tfs_free_block_count failed\n", .{});
+    var ops = [_]tinyFS.tfs_batch_op{
+        .{ .op = tinyFS.TFS_BATCH_WRITE, .path = @constCast("f1"), .buffer = &text, .size = text.len, .err = 0 },
+        .{ .op = tinyFS.TFS_BATCH_CREATE, .path = @constCast("g"), .buffer = &data, .size = DATASIZE * 3, .err = 0 },
+    };
+    assert_eq(errno_from(tinyFS.tfs_batch(&ops, ops.len)), .OVERFLOW, "tfs_batch should not fit\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 5, "tfs_free_block_count failed\n", .{});
+    const fd = tinyFS.tfs_openFile(@constCast("f1"));
+    var byte: u8 = 0;
+    assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .RANGE, "f1 was written\n", .{});
+
+    // 1 data block, then the _DENT block, an inode and 2 data blocks
+    ops[1].size = DATASIZE * 2;
+    assert_eq(errno_from(tinyFS.tfs_batch(&ops, ops.len)), .SUCCESS, "tfs_batch failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), 0, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    const fd_g = tinyFS.tfs_openFile(@constCast("g"));
+    const read_data = try read_file(fd_g, DATASIZE * 2);
+    assert(std.mem.eql(u8, data[0 .. DATASIZE * 2], &read_data), "read_data == data\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "disk stats" {
+    var fs_file = try mkfs("diskstats.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var before: tinyFS.struct_disk_stats = undefined;
+    var after: tinyFS.struct_disk_stats = undefined;
+    var block: [BLOCKSIZE]u8 = undefined;
+    tinyFS.diskStats(&before);
+    assert_eq(tinyFS.readBlock(tinyFS.tfs_meta.disk, 0, &block), 0, "readBlock failed\n", .{});
+    assert_eq(tinyFS.writeBlock(tinyFS.tfs_meta.disk, 0, &block), 0, "writeBlock failed\n", .{});
+    // a readahead run is one read
+    assert_eq(tinyFS.readaheadBlocks(tinyFS.tfs_meta.disk, 0, 8), 8, "readaheadBlocks failed\n", .{});
+    assert_eq(tinyFS.readBlock(tinyFS.tfs_meta.disk, 3, &block), 0, "readBlock failed\n", .{});
+    tinyFS.diskStats(&after);
+    assert_eq(after.reads - before.reads, 2, "reads\n", .{});
+    assert_eq(after.blocks_read - before.blocks_read, 9, "blocks read\n", .{});
+    assert_eq(after.writes - before.writes, 1, "writes\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "stats" {
+    var fs_file = try mkfs("stats.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+
+    tinyFS.tfs_resetStats();
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 2]u8 = undefined;
+    @memset(&data, 'a');
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    var byte: u8 = 0;
+    for (0..5) |_| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_closeFile(fd + 1)), .BADF, "tfs_closeFile of a closed fd\n", .{});
+
+    var stats: tinyFS.struct_tfs_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_getStats(&stats)), .SUCCESS, "tfs_getStats failed\n", .{});
+    const read_byte = stats.ops[@intCast(tinyFS.TFS_OP_READ_BYTE)];
+    assert_eq(read_byte.calls, 5, "tfs_readByte calls\n", .{});
+    var histogram_calls: u64 = 0;
+    for (read_byte.latency) |calls| {
+        histogram_calls += calls;
+    }
+    assert_eq(histogram_calls, 5, "latency histogram\n", .{});
+    assert_eq(stats.ops[@intCast(tinyFS.TFS_OP_CLOSE_FILE)].errors, 1, "tfs_closeFile errors\n", .{});
+    // tfs_mount checks consistency itself, that isn't a call of its own
+    assert_eq(stats.ops[@intCast(tinyFS.TFS_OP_CHECK_CONSISTENCY)].calls, 0, "tfs_checkConsistency calls\n", .{});
+    assert(stats.block_writes > 0, "block writes\n", .{});
+    assert_eq(stats.bytes_written, stats.block_writes * BLOCKSIZE, "bytes written\n", .{});
+    assert(stats.alloc_blocks >= 3, "allocated blocks\n", .{});
+
+    tinyFS.tfs_resetStats();
+    assert_eq(errno_from(tinyFS.tfs_getStats(&stats)), .SUCCESS, "tfs_getStats failed\n", .{});
+    assert_eq(stats.block_writes, 0, "block writes after reset\n", .{});
+    assert_eq(stats.ops[@intCast(tinyFS.TFS_OP_READ_BYTE)].calls, 0, "calls after reset\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "trace" {
+    var fs_file = try mkfs("trace.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    var trace_path: [*c]u8 = @constCast("/tmp/tinyfs.trace");
+
+    assert_eq(errno_from(tinyFS.tfs_traceStart(trace_path)), .SUCCESS, "tfs_traceStart failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [100]u8 = undefined;
+    @memset(&data, 'a');
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_traceStop()), .SUCCESS, "tfs_traceStop failed\n", .{});
+
+    const trace = try std.fs.openFileAbsolute("/tmp/tinyfs.trace", .{});
+    defer trace.close();
+    var header: tinyFS.struct_tfs_trace_header = undefined;
+    assert_eq(try trace.readAll(std.mem.asBytes(&header)), @sizeOf(tinyFS.struct_tfs_trace_header), "short trace\n", .{});
+    assert_eq(header.magic, tinyFS.TFS_TRACE_MAGIC, "trace magic\n", .{});
+
+    // mount, open, write and unmount in order, each after the block I/O it did
+    const calls = [_]c_int{ tinyFS.TFS_OP_MOUNT, tinyFS.TFS_OP_OPEN_FILE, tinyFS.TFS_OP_WRITE_FILE, tinyFS.TFS_OP_UNMOUNT };
+    var next: usize = 0;
+    var ios: usize = 0;
+    var record: tinyFS.struct_tfs_trace_record = undefined;
+    var strings: [64]u8 = undefined;
+    while (try trace.readAll(std.mem.asBytes(&record)) == @sizeOf(tinyFS.struct_tfs_trace_record)) {
+        assert_eq(try trace.readAll(strings[0..record.len]), record.len, "short strings\n", .{});
+        if (record.type == tinyFS.TFS_TRACE_IO) {
+            ios += 1;
+            continue;
+        }
+        assert_eq(@as(c_int, record.op), calls[next], "call order\n", .{});
+        if (record.op == tinyFS.TFS_OP_OPEN_FILE) {
+            assert(std.mem.eql(u8, strings[0..record.len], "file\x00"), "traced name\n", .{});
+        }
+        if (record.op == tinyFS.TFS_OP_WRITE_FILE) {
+            assert_eq(record.args[1], @as(i32, @intCast(data.len)), "traced size\n", .{});
+        }
+        next += 1;
+    }
+    assert_eq(next, calls.len, "traced calls\n", .{});
+    assert(ios > 0, "traced block I/O\n", .{});
+}
+
+test "ram disk" {
+    var ram_name: [*c]u8 = @constCast("ram:scratch");
+    var snapshot_path: [*c]u8 = @constCast("/tmp/ramdisk.tfs");
+    std.fs.deleteFileAbsoluteZ(snapshot_path) catch {};
+
+    assert_eq(errno_from(tinyFS.tfs_mount(ram_name)), .NOENT, "mounted a RAM disk that doesn't exist\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mkfs(ram_name, tinyFS.BLOCKSIZE * 40)), .SUCCESS, "tfs_mkfs failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(ram_name)), .SUCCESS, "tfs_mount failed\n", .{});
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [300]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 251);
+    }
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.ramDiskDrop(ram_name)), .BUSY, "dropped a mounted RAM disk\n", .{});
+
+    // nothing reaches the host
+    var before: tinyFS.struct_disk_stats = undefined;
+    var after: tinyFS.struct_disk_stats = undefined;
+    tinyFS.diskStats(&before);
+    var byte: u8 = undefined;
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back\n", .{});
+    }
+    tinyFS.diskStats(&after);
+    assert_eq(after.syscalls, before.syscalls, "syscalls\n", .{});
+
+    assert_eq(errno_from(tinyFS.ramDiskSnapshot(ram_name, snapshot_path)), .SUCCESS, "ramDiskSnapshot failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+    assert_eq(errno_from(tinyFS.ramDiskDrop(ram_name)), .SUCCESS, "ramDiskDrop failed\n", .{});
+
+    // the snapshot mounts as a regular disk
+    assert_eq(errno_from(tinyFS.tfs_mount(snapshot_path)), .SUCCESS, "mounting the snapshot failed\n", .{});
+    const snapshot_fd = tinyFS.tfs_openFile(file_name);
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(snapshot_fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "snapshot read back\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "striped disk" {
+    var disk_name: [*c]u8 = @constCast("stripe:2:/tmp/stripe0.img,/tmp/stripe1.img,/tmp/stripe2.img");
+    const disk = tinyFS.openDisk(disk_name, tinyFS.BLOCKSIZE * 40);
+    assert(disk >= 0, "openDisk failed\n", .{});
+
+    var block: [BLOCKSIZE]u8 = undefined;
+    for (0..40) |i| {
+        @memset(&block, @intCast(i));
+        assert_eq(tinyFS.writeBlock(disk, @intCast(i), &block), 0, "writeBlock failed\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.writeBlock(disk, 40, &block)), .RANGE, "wrote past the end\n", .{});
+    // every member holds its share of the blocks, two at a time in turn
+    const shares = [_]u64{ 14, 14, 12 };
+    for (shares, 0..) |share, i| {
+        var buf: ["/tmp/stripeX.img".len]u8 = undefined;
+        const member = std.fmt.bufPrint(&buf, "/tmp/stripe{d}.img", .{i}) catch unreachable;
+        const stat = try std.fs.cwd().statFile(member);
+        assert_eq(stat.size, share * BLOCKSIZE, "member {d} size\n", .{i});
+    }
+
+    // a readahead run spans all of them
+    assert_eq(tinyFS.readaheadBlocks(disk, 3, 30), 30, "readaheadBlocks failed\n", .{});
+    for (3..33) |i| {
+        assert(tinyFS.isReadAhead(disk, @intCast(i)) != 0, "block {d} not read ahead\n", .{i});
+        assert_eq(tinyFS.readBlock(disk, @intCast(i), &block), 0, "readBlock failed\n", .{});
+        assert_eq(block[BLOCKSIZE - 1], @as(u8, @intCast(i)), "block {d}\n", .{i});
+    }
+    assert_eq(tinyFS.closeDisk(disk), 0, "closeDisk failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_mkfs(disk_name, tinyFS.BLOCKSIZE * 40)), .SUCCESS, "tfs_mkfs failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(disk_name)), .SUCCESS, "tfs_mount failed\n", .{});
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 6]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 253);
+    }
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    var byte: u8 = undefined;
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "mirrored disk" {
+    var disk_name: [*c]u8 = @constCast("mirror:/tmp/mirror0.img,/tmp/mirror1.img");
+    var replica: [*c]u8 = @constCast("/tmp/mirror1.img");
+    assert_eq(errno_from(tinyFS.tfs_mkfs(disk_name, tinyFS.BLOCKSIZE * 40)), .SUCCESS, "tfs_mkfs failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(disk_name)), .SUCCESS, "tfs_mount failed\n", .{});
+    assert_eq(tinyFS.mirrorLive(tinyFS.tfs_meta.disk), 2, "live replicas\n", .{});
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 3]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 251);
+    }
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+
+    // each replica is a whole disk on its own
+    assert_eq(errno_from(tinyFS.tfs_mount(replica)), .SUCCESS, "mounting a replica failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+
+    // a lost replica is copied back at mount
+    try std.fs.deleteFileAbsoluteZ(replica);
+    assert_eq(errno_from(tinyFS.tfs_mount(disk_name)), .SUCCESS, "tfs_mount failed\n", .{});
+    assert_eq(tinyFS.mirrorLive(tinyFS.tfs_meta.disk), 2, "live replicas after resync\n", .{});
+    const mirror_fd = tinyFS.tfs_openFile(file_name);
+    var byte: u8 = undefined;
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(mirror_fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+    const stat = try std.fs.cwd().statFile("/tmp/mirror1.img");
+    assert_eq(stat.size, 40 * BLOCKSIZE, "resynced replica size\n", .{});
+}
+
+test "log-structured writes" {
+    var fs_file = try mkfs("log.tfs", tinyFS.BLOCKSIZE * 150);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    assert_eq(errno_from(tinyFS.tfs_setLogStructured(1)), .SUCCESS, "tfs_setLogStructured failed\n", .{});
+    defer _ = tinyFS.tfs_setLogStructured(0);
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var data: [DATASIZE * 7]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+
+    // 16 files of an inode and 7 data blocks each go down one after the
+    // other, deleting the first 7 leaves the first segment mostly dead
+    var fds: [16]c_int = undefined;
+    for (&fds, 0..) |*fd, i| {
+        var name = [_:0]u8{ 'f', 'a' + @as(u8, @intCast(i)) };
+        fd.* = tinyFS.tfs_openFile(&name);
+        assert_eq(errno_from(tinyFS.tfs_writeFile(fd.*, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    }
+    for (0..7) |i| {
+        assert_eq(errno_from(tinyFS.tfs_deleteFile(fds[i])), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    }
+
+    var before: tinyFS.tfs_frag_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_fragStats(&before)), .SUCCESS, "tfs_fragStats failed\n", .{});
+    assert_eq(tinyFS.tfs_clean(0), 0, "tfs_clean failed\n", .{});
+    var after: tinyFS.tfs_frag_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_fragStats(&after)), .SUCCESS, "tfs_fragStats failed\n", .{});
+    assert(after.largest_free_run > before.largest_free_run, "segment not cleaned\n", .{});
+    assert_eq(after.free_blocks, before.free_blocks, "free blocks changed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+
+    // the moved file reads back through its open descriptor
+    var byte: u8 = undefined;
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fds[7], &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "clean without space" {
+    var fs_file = try mkfs("clean.tfs", tinyFS.BLOCKSIZE * 50);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var data: [DATASIZE * 9]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+
+    // the image is a single segment, 30 blocks live and 19 free, with nowhere to move it
+    var fds: [4]c_int = undefined;
+    for (&fds, 0..) |*fd, i| {
+        var name = [_:0]u8{ 'f', 'a' + @as(u8, @intCast(i)) };
+        fd.* = tinyFS.tfs_openFile(&name);
+        assert_eq(errno_from(tinyFS.tfs_writeFile(fd.*, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(fds[0])), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    const free_count = tinyFS.tfs_free_block_count();
+    assert_eq(tinyFS.tfs_clean(0), 0, "tfs_clean failed\n", .{});
+    assert_eq(tinyFS.tfs_free_block_count(), free_count, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    const read_data = try read_file(fds[1], data.len);
+    assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+
+    // two segments: the second is under half live after a delete, but its
+    // live blocks don't fit in the free space of the full first one
+    var fs_file2 = try mkfs("clean2.tfs", tinyFS.BLOCKSIZE * 100);
+    var fs_file2_ptr: [*:0]u8 = &fs_file2;
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file2_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    var more: [10]c_int = undefined;
+    for (&more, 0..) |*fd, i| {
+        var name = [_:0]u8{ 'g', 'a' + @as(u8, @intCast(i)) };
+        fd.* = tinyFS.tfs_openFile(&name);
+        // the last one shares the room left with a new directory block
+        const size: c_int = if (i < 9) @intCast(data.len) else DATASIZE * 7;
+        assert_eq(errno_from(tinyFS.tfs_writeFile(fd.*, &data, size)), .SUCCESS, "tfs_writeFile failed\n", .{});
+    }
+    assert_eq(tinyFS.tfs_free_block_count(), 0, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_deleteFile(more[7])), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    assert_eq(tinyFS.tfs_clean(0), 0, "tfs_clean failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    const more_data = try read_file(more[8], data.len);
+    assert(std.mem.eql(u8, &data, &more_data), "more_data == data\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "clean in place" {
+    var fs_file = try mkfs("cleanlazy.tfs", tinyFS.BLOCKSIZE * 320);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var data: [DATASIZE * 6]u8 = undefined;
+    for (&data, 0..) |*byte, i| byte.* = @intCast(i % 251);
+
+    // the first segment ends up 14 blocks live, the rest of the image was never written
+    var fds: [9]c_int = undefined;
+    for (&fds, 0..) |*fd, i| {
+        var name = [_:0]u8{ 'f', 'a' + @as(u8, @intCast(i)) };
+        fd.* = tinyFS.tfs_openFile(&name);
+        assert_eq(errno_from(tinyFS.tfs_writeFile(fd.*, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    }
+    for (0..7) |i| {
+        assert_eq(errno_from(tinyFS.tfs_deleteFile(fds[i])), .SUCCESS, "tfs_deleteFile failed\n", .{});
+    }
+    const free_count = tinyFS.tfs_free_block_count();
+
+    // with no log head the live blocks must still leave the segment, not move within it
+    assert_eq(tinyFS.tfs_clean(0), 0, "tfs_clean failed\n", .{});
+    assert(tinyFS.tfs_meta.space_valid, "space map not loaded\n", .{});
+    for (1..tinyFS.TFS_LOG_SEGMENT_BLOCKS) |i| {
+        assert(tinyFS.tfs_meta.space[i] != tinyFS.TFS_SPACE_USED, "block {d} still live\n", .{i});
+    }
+    assert_eq(tinyFS.tfs_free_block_count(), free_count, "tfs_free_block_count failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    for (fds[7..]) |fd| {
+        const read_data = try read_file(fd, data.len);
+        assert(std.mem.eql(u8, &data, &read_data), "read_data == data\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "direct I/O" {
+    var disk_name: [*c]u8 = @constCast("direct:/tmp/direct.tfs");
+    var plain_name: [*c]u8 = @constCast("/tmp/direct.tfs");
+    // 41 blocks don't end on a sector boundary
+    assert_eq(errno_from(tinyFS.tfs_mkfs(disk_name, tinyFS.BLOCKSIZE * 41)), .SUCCESS, "tfs_mkfs failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(disk_name)), .SUCCESS, "tfs_mount failed\n", .{});
+    // 0 where /tmp can't do O_DIRECT and the disk was opened buffered instead
+    const direct = tinyFS.isDirect(tinyFS.tfs_meta.disk);
+    assert(direct >= 0, "isDirect failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 5 + 17]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 251);
+    }
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    var byte: u8 = undefined;
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+    if (direct == 1) {
+        const stat = try std.fs.cwd().statFile("/tmp/direct.tfs");
+        assert_eq(stat.size % 512, 0, "host file not padded to a sector\n", .{});
+    }
+
+    // the image opens buffered as well
+    assert_eq(errno_from(tinyFS.tfs_mount(plain_name)), .SUCCESS, "tfs_mount failed\n", .{});
+    const plain_fd = tinyFS.tfs_openFile(file_name);
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(plain_fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back buffered\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "write-back" {
+    var fs_file = try mkfs("writeback.tfs", tinyFS.BLOCKSIZE * 100);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    assert_eq(errno_from(tinyFS.tfs_setWriteBack(64, 50, 10)), .NODEV, "tfs_setWriteBack before mount\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    // big and old enough that nothing goes out before tfs_sync
+    assert_eq(errno_from(tinyFS.tfs_setWriteBack(64, 100, 1000000)), .SUCCESS, "tfs_setWriteBack failed\n", .{});
+
+    var file_name: [*c]u8 = @constCast("file");
+    var data: [DATASIZE * 5 + 17]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 251);
+    }
+    var before: tinyFS.struct_disk_stats = undefined;
+    var after: tinyFS.struct_disk_stats = undefined;
+    tinyFS.diskStats(&before);
+    const fd = tinyFS.tfs_openFile(file_name);
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+    tinyFS.diskStats(&after);
+    assert_eq(after.writes, before.writes, "written before tfs_sync\n", .{});
+
+    // reads see the cached blocks
+    var byte: u8 = undefined;
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(fd, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back cached\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_sync()), .SUCCESS, "tfs_sync failed\n", .{});
+    tinyFS.diskStats(&after);
+    // the inode and its data blocks are adjacent, so go out together
+    assert(after.blocks_written - before.blocks_written > after.writes - before.writes, "adjacent blocks not merged\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    const again = tinyFS.tfs_openFile(file_name);
+    for (data) |expected| {
+        assert_eq(errno_from(tinyFS.tfs_readByte(again, &byte)), .SUCCESS, "tfs_readByte failed\n", .{});
+        assert_eq(byte, expected, "read back\n", .{});
+    }
+    assert_eq(errno_from(tinyFS.tfs_checkConsistency()), .SUCCESS, "tfs_checkConsistency failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "write-back flush error at unmount" {
+    var fs_file = try mkfs("writeback_err.tfs", tinyFS.BLOCKSIZE * 40);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_setWriteBack(16, 100, 1000000)), .SUCCESS, "tfs_setWriteBack failed\n", .{});
+
+    var data: [DATASIZE * 8]u8 = undefined;
+    @memset(&data, 0x42);
+    const fd = tinyFS.tfs_openFile(@constCast("file"));
+    assert_eq(errno_from(tinyFS.tfs_writeFile(fd, &data, @intCast(data.len))), .SUCCESS, "tfs_writeFile failed\n", .{});
+
+    // a file size limit below the cached blocks makes their flush fail
+    _ = tinyFS.signal(tinyFS.SIGXFSZ, tinyFS.SIG_IGN);
+    var limit: tinyFS.struct_rlimit = undefined;
+    assert_eq(tinyFS.getrlimit(tinyFS.RLIMIT_FSIZE, &limit), 0, "getrlimit failed\n", .{});
+    var low = limit;
+    low.rlim_cur = tinyFS.BLOCKSIZE * 2;
+    assert_eq(tinyFS.setrlimit(tinyFS.RLIMIT_FSIZE, &low), 0, "setrlimit failed\n", .{});
+    const ret = tinyFS.tfs_unmount();
+    assert_eq(tinyFS.setrlimit(tinyFS.RLIMIT_FSIZE, &limit), 0, "setrlimit failed\n", .{});
+    assert(ret < 0, "tfs_unmount should report the failed flush\n", .{});
+
+    // the mount is gone all the same
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .NODEV, "tfs_unmount after a failed flush\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}
+
+test "async calls" {
+    var fs_file = try mkfs("async.tfs", tinyFS.BLOCKSIZE * 100);
+    var fs_file_ptr: [*:0]u8 = &fs_file;
+    assert_eq(errno_from(tinyFS.tfs_open_async(@constCast("file"), null)), .INVAL, "tfs_open_async before tfs_async_start\n", .{});
+    const efd = tinyFS.tfs_async_start();
+    assert(efd >= 0, "tfs_async_start failed\n", .{});
+    defer _ = tinyFS.tfs_async_stop();
+    assert_eq(errno_from(tinyFS.tfs_mount(fs_file_ptr)), .SUCCESS, "tfs_mount failed\n", .{});
+
+    var data: [DATASIZE * 3 + 5]u8 = undefined;
+    for (&data, 0..) |*byte, i| {
+        byte.* = @intCast(i % 251);
+    }
+    var back: [data.len + 10]u8 = undefined;
+    var done: [4]tinyFS.struct_tfs_completion = undefined;
+
+    assert_eq(errno_from(tinyFS.tfs_open_async(@constCast("file"), null)), .SUCCESS, "tfs_open_async failed\n", .{});
+    var got: c_int = 0;
+    while (got == 0) : (std.time.sleep(std.time.ns_per_ms)) {
+        got = tinyFS.tfs_async_poll(&done, done.len);
+    }
+    assert_eq(got, 1, "tfs_async_poll\n", .{});
+    assert_eq(done[0].op, tinyFS.TFS_ASYNC_OPEN, "completion op\n", .{});
+    const fd = done[0].ret;
+    assert(fd >= 0, "async open failed\n", .{});
+
+    // the read is queued behind the write and sees it
+    assert_eq(errno_from(tinyFS.tfs_write_async(fd, &data, @intCast(data.len), null)), .SUCCESS, "tfs_write_async failed\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_read_async(fd, &back, @intCast(back.len), null)), .SUCCESS, "tfs_read_async failed\n", .{});
+    got = 0;
+    while (got < 2) : (std.time.sleep(std.time.ns_per_ms)) {
+        got += tinyFS.tfs_async_poll(&done[@intCast(got)], 2 - got);
+    }
+    assert_eq(done[0].op, tinyFS.TFS_ASYNC_WRITE, "completion op\n", .{});
+    assert_eq(errno_from(done[0].ret), .SUCCESS, "async write failed\n", .{});
+    assert_eq(done[1].op, tinyFS.TFS_ASYNC_READ, "completion op\n", .{});
+    assert_eq(done[1].ret, data.len, "async read stops at the end of the file\n", .{});
+    assert(std.mem.eql(u8, back[0..data.len], &data), "read back\n", .{});
+
+    // a queued read is one call with one atime update, not a tfs_readByte per byte
+    assert_eq(errno_from(tinyFS.tfs_seek(fd, 0)), .SUCCESS, "tfs_seek failed\n", .{});
+    var before: tinyFS.struct_disk_stats = undefined;
+    var after: tinyFS.struct_disk_stats = undefined;
+    tinyFS.tfs_resetStats();
+    tinyFS.diskStats(&before);
+    assert_eq(errno_from(tinyFS.tfs_read_async(fd, &back, @intCast(back.len), null)), .SUCCESS, "tfs_read_async failed\n", .{});
+    got = 0;
+    while (got == 0) : (std.time.sleep(std.time.ns_per_ms)) {
+        got = tinyFS.tfs_async_poll(&done, done.len);
+    }
+    tinyFS.diskStats(&after);
+    assert_eq(done[0].ret, data.len, "async read\n", .{});
+    assert(std.mem.eql(u8, back[0..data.len], &data), "read back\n", .{});
+    assert_eq(after.writes - before.writes, 1, "atime writes\n", .{});
+    var stats: tinyFS.struct_tfs_stats = undefined;
+    assert_eq(errno_from(tinyFS.tfs_getStats(&stats)), .SUCCESS, "tfs_getStats failed\n", .{});
+    assert_eq(stats.ops[@intCast(tinyFS.TFS_OP_READ_BYTE)].calls, 0, "tfs_readByte calls\n", .{});
+    assert_eq(stats.ops[@intCast(tinyFS.TFS_OP_READ_ASYNC)].calls, 1, "tfs_read_async calls\n", .{});
+    assert_eq(errno_from(tinyFS.tfs_unmount()), .SUCCESS, "tfs_unmount failed\n", .{});
+}